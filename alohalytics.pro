@@ -7,12 +7,17 @@ SOURCES += examples/cpp/example.cc \
 
 HEADERS += src/alohalytics.h \
            src/event_base.h \
+           src/event_encoder.h \
+           src/event_field.h \
+           src/event_rules.h \
            src/file_manager.h \
            src/gzip_wrapper.h \
            src/http_client.h \
+           src/latency_histogram.h \
            src/location.h \
            src/logger.h \
            src/messages_queue.h \
+           src/shared_ring.h \
 
 QMAKE_LFLAGS *= -lz
 
@@ -0,0 +1,315 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Measures client-side statistics engine costs and prints results as JSON (or as a text table).
+// Run it with --help to see available options.
+
+#include "benchmarks/bench.h"
+#include "benchmarks/loopback_http_server.h"
+#include "examples/cpp/dflags.h"
+#include "src/alohalytics.h"
+#include "src/event_base.h"
+#include "src/event_encoder.h"
+#include "src/file_manager.h"
+#include "src/gzip_wrapper.h"
+#include "src/latency_histogram.h"
+#include "src/messages_queue.h"
+
+#include <unistd.h>  // rmdir
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+DEFINE_uint64(iterations, 50000, "Number of events logged or serialized by every benchmark.");
+DEFINE_uint32(max_threads, 64, "LogEvent throughput is measured for 1, 2, 4, ... max_threads producer threads.");
+DEFINE_uint64(queue_samples, 2000, "Number of messages to measure MessagesQueue push to disk latency.");
+DEFINE_uint64(gzip_rounds, 5, "How many times the test data is gzipped or gunzipped for every level.");
+DEFINE_uint64(upload_rounds, 10, "Number of Upload() calls to the loopback server.");
+DEFINE_uint64(upload_events, 2000, "Number of events logged before every Upload() call.");
+DEFINE_string(format, "json", "Output format, json or text.");
+DEFINE_string(storage, "", "Temporary directory for the queue files, a new one in /tmp is created by default.");
+
+using namespace alohalytics;
+using namespace alohalytics::bench;
+
+namespace {
+
+const std::string kEventName = "route_built";
+const std::string kMode = "car";
+const Location kLocation = Location::FromLatLon(55.75, 37.62).SetAltitude(150, 5).SetSpeed(15).SetBearing(90);
+
+std::vector<Result> gResults;
+// Removed at exit, after Stats has flushed everything.
+std::string gTemporaryStorage;
+
+void Report(const Result & result) {
+  gResults.push_back(result);
+  if (FLAGS_format == "text") {
+    PrintText(result);
+  }
+}
+
+std::string Serialize(AlohalyticsBaseEvent const & event) {
+  std::ostringstream sstream;
+  { cereal::BinaryOutputArchive(sstream) << std::unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event); }
+  return sstream.str();
+}
+
+void RemoveDirectory(const std::string & directory) {
+  FileManager::ForEachFileInDir(directory, [](const std::string & file) {
+    std::remove(file.c_str());
+    return true;
+  });
+  ::rmdir(directory.c_str());
+}
+
+void RemoveTemporaryStorage() {
+  RemoveDirectory(gTemporaryStorage + "queue/");
+  RemoveDirectory(gTemporaryStorage + "stats/");
+  ::rmdir(gTemporaryStorage.c_str());
+}
+
+// The same event logged with both APIs to compare them.
+void BenchmarkTypedFieldsVsStringMap() {
+  // Serialization only, without the queue.
+  Report(Measure("Serialize TStringMap with cereal", FLAGS_iterations, [](uint64_t i) {
+    AlohalyticsKeyPairsEvent event;
+    event.key = kEventName;
+    event.pairs = TStringMap{{"dist_m", std::to_string(i)}, {"mode", kMode}};
+    DoNotOptimize(Serialize(event));
+  }));
+  std::string buffer;
+  Report(Measure("Serialize Field... with EventEncoder", FLAGS_iterations, [&buffer](uint64_t i) {
+    const Field dist("dist_m", i), mode("mode", kMode);
+    Field const * fields[] = {&dist, &mode};
+    std::sort(std::begin(fields), std::end(fields), &Field::NameLess);
+    buffer.resize(EventEncoder::KeyPairsEventSize(kEventName, fields, 2));
+    EventEncoder(&buffer[0]).KeyPairsEvent(AlohalyticsBaseEvent::CurrentTimestamp(), kEventName, fields, 2);
+    DoNotOptimize(buffer);
+  }));
+}
+
+// Serialization cost of every event type which is created on the client.
+void BenchmarkCerealPerEventType() {
+  AlohalyticsIdEvent id;
+  id.id = "A:c5a3a9b4-9a4b-4e0b-bc5b-5e3f8f8d2b11";
+  AlohalyticsKeyEvent key;
+  key.key = kEventName;
+  AlohalyticsKeyValueEvent value;
+  value.key = kEventName;
+  value.value = kMode;
+  AlohalyticsKeyPairsEvent pairs;
+  pairs.key = kEventName;
+  pairs.pairs = TStringMap{{"dist_m", "12345"}, {"mode", kMode}, {"time_s", "678"}};
+  AlohalyticsKeyLocationEvent key_location;
+  key_location.key = kEventName;
+  key_location.location = kLocation;
+  AlohalyticsKeyValueLocationEvent value_location;
+  value_location.key = kEventName;
+  value_location.value = kMode;
+  value_location.location = kLocation;
+  AlohalyticsKeyPairsLocationEvent pairs_location;
+  pairs_location.key = kEventName;
+  pairs_location.pairs = pairs.pairs;
+  pairs_location.location = kLocation;
+  const std::pair<const char *, AlohalyticsBaseEvent const *> events[] = {
+      {"i", &id}, {"k", &key}, {"v", &value}, {"p", &pairs},
+      {"kl", &key_location}, {"vl", &value_location}, {"pl", &pairs_location}};
+  for (const auto & event : events) {
+    Result result = Measure(std::string("cereal serialize ") + event.first, FLAGS_iterations,
+                            [&event](uint64_t) { DoNotOptimize(Serialize(*event.second)); });
+    result.extra.emplace_back("event_bytes", Serialize(*event.second).size());
+    Report(result);
+  }
+}
+
+// Latency between MessagesQueue::PushMessage and the message appearing in the file.
+void BenchmarkQueuePushToDisk(const std::string & directory) {
+  const std::string current_file = directory + kCurrentFileName;
+  LatencyHistogram histogram;
+  Result result;
+  {
+    THundredKilobytesFileQueue queue;
+    queue.SetStorageDirectory(directory);
+    AlohalyticsKeyPairsEvent event;
+    event.key = kEventName;
+    event.pairs = TStringMap{{"dist_m", "12345"}, {"mode", kMode}};
+    const std::string message = Serialize(event);
+    const auto file_size = [&current_file]() -> int64_t {
+      try {
+        return static_cast<int64_t>(FileManager::GetFileSize(current_file));
+      } catch (const std::exception &) {
+        // File does not exist yet or is being archived.
+        return -1;
+      }
+    };
+    result = Measure("MessagesQueue push to disk", FLAGS_queue_samples, [&](uint64_t) {
+      const int64_t size_before = file_size();
+      const auto start = std::chrono::steady_clock::now();
+      queue.PushMessage(message);
+      int64_t size_after;
+      while ((size_after = file_size()) == size_before || size_after < 0) {
+        std::this_thread::yield();
+      }
+      histogram.Record(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    });
+    result.bytes = message.size() * FLAGS_queue_samples;
+  }
+  const LatencyHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  result.extra.emplace_back("p50_us", snapshot.Percentile(50.) / 1000.);
+  result.extra.emplace_back("p99_us", snapshot.Percentile(99.) / 1000.);
+  result.extra.emplace_back("max_us", snapshot.Max() / 1000.);
+  Report(result);
+  RemoveDirectory(directory);
+}
+
+void BenchmarkGzip() {
+  // Typical archive content.
+  std::string data;
+  for (uint64_t i = 0; data.size() < 1024 * 1024; ++i) {
+    AlohalyticsKeyPairsLocationEvent event;
+    event.key = kEventName;
+    event.pairs = TStringMap{{"dist_m", std::to_string(i * 37 % 100000)}, {"mode", kMode}};
+    event.location = kLocation;
+    data += Serialize(event);
+  }
+  for (int level = Z_BEST_SPEED; level <= Z_BEST_COMPRESSION; ++level) {
+    std::string gzipped;
+    Result gzip = Measure("Gzip level " + std::to_string(level), FLAGS_gzip_rounds,
+                          [&](uint64_t) { gzipped = Gzip(data, level); });
+    gzip.bytes = data.size() * FLAGS_gzip_rounds;
+    gzip.extra.emplace_back("ratio", double(data.size()) / gzipped.size());
+    Report(gzip);
+    Result gunzip = Measure("Gunzip level " + std::to_string(level), FLAGS_gzip_rounds,
+                            [&](uint64_t) { DoNotOptimize(Gunzip(gzipped)); });
+    gunzip.bytes = data.size() * FLAGS_gzip_rounds;
+    Report(gunzip);
+  }
+}
+
+ProcessingResult UploadAndWait(Stats & stats) {
+  std::promise<ProcessingResult> promise;
+  std::future<ProcessingResult> future = promise.get_future();
+  stats.Upload([&promise](ProcessingResult result) { promise.set_value(result); });
+  return future.get();
+}
+
+// Archiving and uploading of the default channel to a local server (via the platform HTTP client).
+void BenchmarkUpload(Stats & stats) {
+  LoopbackHTTPServer server;
+  stats.SetServerUrl(server.Url()).SetClientId("A:alohalytics_bench");
+  const EngineMetrics before = stats.GetMetrics();
+  Result result = Measure("Upload to loopback server", FLAGS_upload_rounds, [&](uint64_t round) {
+    for (uint64_t i = 0; i < FLAGS_upload_events; ++i) {
+      stats.LogEvent(kEventName, Field("dist_m", round * FLAGS_upload_events + i), Field("mode", kMode));
+    }
+    if (UploadAndWait(stats) != ProcessingResult::EProcessedSuccessfully) {
+      std::cerr << "Upload to the loopback server has failed." << std::endl;
+    }
+  });
+  const EngineMetrics after = stats.GetMetrics();
+  result.bytes = server.ReceivedBodyBytes();
+  const double rounds = static_cast<double>(std::max<uint64_t>(FLAGS_upload_rounds, 1));
+  result.extra.emplace_back("gzip_us_per_upload", (after.gzip_time_us - before.gzip_time_us) / rounds);
+  result.extra.emplace_back("http_us_per_upload", (after.upload_time_us - before.upload_time_us) / rounds);
+  result.extra.emplace_back("upload_failures", after.upload_failures - before.upload_failures);
+  Report(result);
+  // Do not upload anything produced by next benchmarks.
+  stats.SetServerUrl("");
+}
+
+// Throughput of every LogEvent overload with different number of producer threads.
+void BenchmarkLogEventThreads(Stats & stats) {
+  const TStringMap pairs = {{"dist_m", "12345"}, {"mode", kMode}};
+  const std::pair<const char *, std::function<void(uint64_t)>> overloads[] = {
+      {"LogEvent(name)", [&stats](uint64_t) { stats.LogEvent(kEventName); }},
+      {"LogEvent(name, location)", [&stats](uint64_t) { stats.LogEvent(kEventName, kLocation); }},
+      {"LogEvent(name, value)", [&stats](uint64_t) { stats.LogEvent(kEventName, kMode); }},
+      {"LogEvent(name, value, location)", [&stats](uint64_t) { stats.LogEvent(kEventName, kMode, kLocation); }},
+      {"LogEvent(name, TStringMap)", [&](uint64_t) { stats.LogEvent(kEventName, pairs); }},
+      {"LogEvent(name, TStringMap, location)", [&](uint64_t) { stats.LogEvent(kEventName, pairs, kLocation); }},
+      {"LogEvent(name, Field...)",
+       [&stats](uint64_t i) { stats.LogEvent(kEventName, Field("dist_m", i), Field("mode", kMode)); }}};
+  for (const auto & overload : overloads) {
+    for (uint32_t threads = 1; threads <= FLAGS_max_threads; threads *= 2) {
+      const std::function<void(uint64_t)> & function = overload.second;
+      Report(MeasureThreads(overload.first, threads, std::max<uint64_t>(FLAGS_iterations / threads, 1),
+                            [&function](uint32_t, uint64_t i) { function(i); }));
+    }
+  }
+  // Batch API, operations are counted per event.
+  const size_t kBatchSize = 100;
+  const std::vector<alohalytics::Event> batch(kBatchSize, alohalytics::Event(kEventName, pairs));
+  Result result = Measure("LogEvents(100 x TStringMap)", std::max<uint64_t>(FLAGS_iterations / kBatchSize, 1),
+                          [&stats, &batch](uint64_t) { stats.LogEvents(batch); });
+  result.operations *= kBatchSize;
+  Report(result);
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+  ParseDFlags(&argc, &argv);
+  std::string storage = FLAGS_storage;
+  if (storage.empty()) {
+    char path[] = "/tmp/alohalytics_bench-XXXXXX";
+    if (!::mkdtemp(path)) {
+      std::cerr << "Can't create temporary directory." << std::endl;
+      return -1;
+    }
+    storage = path;
+    gTemporaryStorage = storage + "/";
+    // Registered before Stats::Instance() is created, so it is called after Stats' destructor.
+    std::atexit(&RemoveTemporaryStorage);
+  }
+  FileManager::AppendDirectorySlash(storage);
+  const std::string queue_directory = storage + "queue/";
+  const std::string stats_directory = storage + "stats/";
+  if (!FileManager::MakeDirectory(queue_directory) || !FileManager::MakeDirectory(stats_directory)) {
+    std::cerr << "Can't create directories in " << storage << std::endl;
+    return -1;
+  }
+
+  BenchmarkTypedFieldsVsStringMap();
+  BenchmarkCerealPerEventType();
+  BenchmarkQueuePushToDisk(queue_directory);
+  BenchmarkGzip();
+  Stats & stats = Stats::Instance();
+  stats.SetStoragePath(stats_directory);
+  BenchmarkUpload(stats);
+  BenchmarkLogEventThreads(stats);
+
+  if (FLAGS_format != "text") {
+    PrintJson(gResults);
+  }
+  return 0;
+}
@@ -0,0 +1,163 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Tiny helpers to measure performance of the library's hot paths.
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace alohalytics {
+namespace bench {
+
+// Prevents compiler from optimizing away benchmarked computations.
+template <typename T>
+inline void DoNotOptimize(const T & value) {
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct Result {
+  std::string name;
+  uint64_t operations = 0;
+  double seconds = 0;
+  uint32_t threads = 1;
+  // Processed bytes, if it makes sense for the benchmark.
+  uint64_t bytes = 0;
+  // Additional benchmark-specific values, e.g. latency percentiles.
+  std::vector<std::pair<std::string, double>> extra;
+
+  double NanosecondsPerOperation() const { return operations ? seconds * 1e9 / operations : 0; }
+  double OperationsPerSecond() const { return seconds > 0 ? operations / seconds : 0; }
+  double MegabytesPerSecond() const { return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0; }
+};
+
+// Calls function(i) for i in [0, operations) and measures total time.
+template <typename TFunction>
+Result Measure(const std::string & name, uint64_t operations, TFunction && function) {
+  Result result;
+  result.name = name;
+  result.operations = operations;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint64_t i = 0; i < operations; ++i) {
+    function(i);
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+// Calls function(thread, i) for i in [0, operations_per_thread) from every thread at the same time,
+// measures time from the start until all threads have finished.
+template <typename TFunction>
+Result MeasureThreads(const std::string & name, uint32_t threads, uint64_t operations_per_thread,
+                      TFunction && function) {
+  Result result;
+  result.name = name;
+  result.threads = threads;
+  result.operations = operations_per_thread * threads;
+  std::atomic<uint32_t> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      ++ready;
+      while (!go) {
+        std::this_thread::yield();
+      }
+      for (uint64_t i = 0; i < operations_per_thread; ++i) {
+        function(t, i);
+      }
+    });
+  }
+  while (ready != threads) {
+    std::this_thread::yield();
+  }
+  const auto start = std::chrono::steady_clock::now();
+  go = true;
+  for (auto & worker : workers) {
+    worker.join();
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+inline void PrintText(const Result & result, std::ostream & out = std::cout) {
+  out << std::left << std::setw(48) << result.name << std::right << std::setw(4) << result.threads << "t"
+      << std::fixed << std::setprecision(1) << std::setw(12) << result.NanosecondsPerOperation() << " ns/op"
+      << std::setw(14) << result.OperationsPerSecond() << " op/s";
+  if (result.bytes) {
+    out << std::setw(10) << result.MegabytesPerSecond() << " MB/s";
+  }
+  for (const auto & extra : result.extra) {
+    out << ' ' << extra.first << '=' << extra.second;
+  }
+  out << std::endl;
+}
+
+inline std::string JsonString(const std::string & str) {
+  std::string escaped = "\"";
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+    }
+    escaped += c;
+  }
+  return escaped + '"';
+}
+
+// One JSON object with all results, easy to diff between library versions.
+inline void PrintJson(const std::vector<Result> & results, std::ostream & out = std::cout) {
+  out << "{\"results\": [";
+  const char * separator = "\n";
+  out.unsetf(std::ios_base::floatfield);
+  out << std::setprecision(6);
+  for (const Result & result : results) {
+    out << separator << "  {\"name\": " << JsonString(result.name) << ", \"threads\": " << result.threads
+        << ", \"operations\": " << result.operations << ", \"seconds\": " << result.seconds
+        << ", \"ns_per_op\": " << result.NanosecondsPerOperation()
+        << ", \"ops_per_second\": " << result.OperationsPerSecond();
+    if (result.bytes) {
+      out << ", \"bytes\": " << result.bytes << ", \"mb_per_second\": " << result.MegabytesPerSecond();
+    }
+    for (const auto & extra : result.extra) {
+      out << ", " << JsonString(extra.first) << ": " << extra.second;
+    }
+    out << '}';
+    separator = ",\n";
+  }
+  out << "\n]}" << std::endl;
+}
+
+}  // namespace bench
+}  // namespace alohalytics
+
+#endif  // BENCH_H
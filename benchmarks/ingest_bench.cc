@@ -0,0 +1,294 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Measures server-side ingest costs per core: gunzip, events rewriting with cereal (the original
+// implementation) and with the pass-through EventsScanner. Prints results as JSON (or as a text table).
+// With --durable_dir, also measures latency and throughput of concurrent durable writes for every sync
+// batch window, the directory should be on the real storage device (not tmpfs) for meaningful results.
+// Junk bodies (valid up to the middle) measure the cost of rejecting them with cereal's exceptions, and with
+// the streaming receiver which stops at the first invalid event.
+
+#include "benchmarks/bench.h"
+#include "examples/cpp/dflags.h"
+#include "server/statistics_receiver.h"
+#include "src/latency_histogram.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+DEFINE_uint64(bodies, 2000, "Number of processed bodies for every benchmark.");
+DEFINE_uint64(events_per_body, 200, "Number of events in every body, the first one is an ID event.");
+DEFINE_string(format, "json", "Output format, json or text.");
+DEFINE_string(durable_dir, "", "Directory for durable writes benchmark, it is skipped if empty.");
+DEFINE_uint32(durable_threads, 32, "Number of concurrent requests in durable writes benchmark.");
+DEFINE_uint64(durable_requests, 20, "Number of requests per thread in durable writes benchmark.");
+DEFINE_string(sync_windows_us, "0,250,1000,4000", "Comma-separated sync batch windows in microseconds.");
+
+using namespace alohalytics;
+using namespace alohalytics::bench;
+
+namespace {
+
+const uint64_t kServerTimestamp = 1450000000000ULL;
+const std::string kIP = "192.168.0.1";
+const std::string kUA = "Dalvik/2.1.0 (Linux; U; Android 6.0; Nexus 5 Build/MRA58N)";
+const std::string kURI = "/android/maps/154";
+
+std::vector<Result> gResults;
+
+void Report(const Result & result) {
+  gResults.push_back(result);
+  if (FLAGS_format == "text") {
+    PrintText(result);
+  }
+}
+
+template <typename TEvent>
+void Append(std::string & body, const TEvent & event) {
+  std::ostringstream stream;
+  cereal::BinaryOutputArchive(stream) << std::unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event);
+  body += stream.str();
+}
+
+// Typical client's body: ID event and a mix of other events.
+std::string GenerateBody(uint64_t seed) {
+  std::mt19937_64 random(seed);
+  std::string body;
+  AlohalyticsIdEvent id;
+  id.timestamp = kServerTimestamp - 100000;
+  id.id = "A:" + std::to_string(random());
+  Append(body, id);
+  const Location location = Location::FromLatLon(55.75, 37.62).SetAltitude(150, 5).SetSpeed(15).SetBearing(90);
+  for (uint64_t i = 1; i < FLAGS_events_per_body; ++i) {
+    const uint64_t timestamp = id.timestamp + i * 100;
+    switch (random() % 4) {
+      case 0: {
+        AlohalyticsKeyEvent event;
+        event.timestamp = timestamp;
+        event.key = "$onResume";
+        Append(body, event);
+      } break;
+      case 1: {
+        AlohalyticsKeyValueEvent event;
+        event.timestamp = timestamp;
+        event.key = "searchEmitResults";
+        event.value = std::to_string(random() % 1000);
+        Append(body, event);
+      } break;
+      case 2: {
+        AlohalyticsKeyPairsEvent event;
+        event.timestamp = timestamp;
+        event.key = "route_built";
+        event.pairs = {{"dist_m", std::to_string(random() % 100000)}, {"mode", "car"}, {"version", "154"}};
+        Append(body, event);
+      } break;
+      case 3: {
+        AlohalyticsKeyPairsLocationEvent event;
+        event.timestamp = timestamp;
+        event.key = "$GPS_tracking";
+        event.pairs = {{"accuracy", std::to_string(random() % 100)}};
+        event.location = location;
+        Append(body, event);
+      } break;
+    }
+  }
+  return body;
+}
+
+// Rewrites every body with the given function and reports uncompressed body throughput.
+template <typename TFunction>
+void BenchmarkBodies(const std::string & name, const std::vector<std::string> & bodies, uint64_t bytes,
+                     TFunction && function) {
+  uint64_t output_bytes = 0;
+  Result result = Measure(name, FLAGS_bodies,
+                          [&](uint64_t i) { output_bytes += function(bodies[i % bodies.size()]).size(); });
+  result.bytes = bytes * FLAGS_bodies / bodies.size();
+  result.extra.emplace_back("output_bytes", static_cast<double>(output_bytes));
+  Report(result);
+}
+
+std::string RewriteWithScanner(const std::string & body) {
+  std::string out, client_id;
+  EventsScanner scanner(body.data(), body.size());
+  if (!StatisticsReceiver::RewriteEvents(scanner, kServerTimestamp, kIP, kUA, kURI, out, client_id)) {
+    std::cerr << "Corrupted body." << std::endl;
+    std::exit(-1);
+  }
+  return out;
+}
+
+std::string RewriteWithCereal(const std::string & body) {
+  std::string client_id;
+  return StatisticsReceiver::RewriteEventsWithCereal(body, kServerTimestamp, kIP, kUA, kURI, client_id);
+}
+
+// Inserts an event with an unknown polymorphic type id in the middle of the body.
+std::string CorruptBody(const std::string & body) {
+  EventsScanner scanner(body.data(), body.size());
+  EventsScanner::Event event;
+  while (scanner.Next(event) && event.begin < body.size() / 2) {
+  }
+  return body.substr(0, event.begin) + std::string("\x05\0\0\0", 4) + body.substr(event.begin);
+}
+
+// Rejected bodies are never stored, so the receiver's directory stays empty.
+void BenchmarkRejectedStream(const std::vector<std::string> & gzipped_junk, uint64_t bytes) {
+  char directory[] = "/tmp/ingest_bench-XXXXXX";
+  if (!::mkdtemp(directory)) {
+    std::cerr << "Can't create temporary directory." << std::endl;
+    std::exit(-1);
+  }
+  {
+    StatisticsReceiver receiver(directory);
+    BenchmarkBodies("Reject junk by stream with EventsScanner", gzipped_junk, bytes, [&](const std::string & gzipped) {
+      size_t offset = 0;
+      const auto read = [&gzipped, &offset](char * buffer, size_t size) {
+        size = std::min(size, gzipped.size() - offset);
+        std::memcpy(buffer, gzipped.data() + offset, size);
+        offset += size;
+        return size;
+      };
+      IngestFailure failure;
+      if (receiver.ProcessReceivedHTTPStream(read, gzipped.size(), kServerTimestamp, kIP, kUA, kURI, &failure) !=
+          IngestResult::CorruptedEvents) {
+        std::cerr << "Junk body was not rejected." << std::endl;
+        std::exit(-1);
+      }
+      return std::string(static_cast<size_t>(failure.inflated_bytes), '\0');
+    });
+  }
+  FileManager::ForEachFileInDir(directory, [](const std::string & file) {
+    std::remove(file.c_str());
+    return true;
+  });
+  ::rmdir(directory);
+}
+
+// Every thread stores bodies through the same receiver, as fcgi_server threads do.
+void BenchmarkStore(const std::string & name, const std::vector<std::string> & gzipped_bodies, uint64_t bytes,
+                    bool durable, std::chrono::microseconds sync_window) {
+  std::string directory = FLAGS_durable_dir;
+  FileManager::AppendDirectorySlash(directory);
+  directory += "ingest_bench/";
+  if (!FileManager::MakeDirectory(directory)) {
+    std::cerr << "Can't create " << directory << std::endl;
+    std::exit(-1);
+  }
+  LatencyHistogram histogram;
+  Result result;
+  QueueMetrics metrics;
+  {
+    StatisticsReceiver receiver(directory);
+    if (durable) {
+      receiver.EnableDurableWrites(sync_window);
+    }
+    result = MeasureThreads(name, FLAGS_durable_threads, FLAGS_durable_requests, [&](uint32_t thread, uint64_t i) {
+      const auto start = std::chrono::steady_clock::now();
+      receiver.ProcessReceivedHTTPBody(gzipped_bodies[(thread + i) % gzipped_bodies.size()], kServerTimestamp, kIP,
+                                       kUA, kURI);
+      histogram.Record(static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    });
+    metrics = receiver.Metrics();
+  }
+  result.bytes = bytes * result.operations / gzipped_bodies.size();
+  const LatencyHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  result.extra.emplace_back("p50_us", snapshot.Percentile(50.) / 1000.);
+  result.extra.emplace_back("p99_us", snapshot.Percentile(99.) / 1000.);
+  result.extra.emplace_back("syncs", static_cast<double>(metrics.syncs));
+  if (metrics.syncs) {
+    result.extra.emplace_back("requests_per_sync", static_cast<double>(metrics.sync_requests) / metrics.syncs);
+  }
+  Report(result);
+  FileManager::ForEachFileInDir(directory, [](const std::string & file) {
+    std::remove(file.c_str());
+    return true;
+  });
+  ::rmdir(directory.c_str());
+}
+
+void BenchmarkDurableWrites(const std::vector<std::string> & gzipped_bodies, uint64_t bytes) {
+  BenchmarkStore("Store without sync", gzipped_bodies, bytes, false, std::chrono::microseconds(0));
+  std::istringstream windows(FLAGS_sync_windows_us);
+  std::string window;
+  while (std::getline(windows, window, ',')) {
+    BenchmarkStore("Store with sync, " + window + " us window", gzipped_bodies, bytes, true,
+                   std::chrono::microseconds(std::stoul(window)));
+  }
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+  ParseDFlags(&argc, &argv);
+  std::vector<std::string> bodies, gzipped_bodies;
+  uint64_t bytes = 0;
+  for (uint64_t i = 0; i < 16; ++i) {
+    bodies.push_back(GenerateBody(i));
+    gzipped_bodies.push_back(Gzip(bodies.back()));
+    bytes += bodies.back().size();
+    if (RewriteWithCereal(bodies.back()) != RewriteWithScanner(bodies.back())) {
+      std::cerr << "Pass-through output differs from cereal's one." << std::endl;
+      return -1;
+    }
+  }
+
+  BenchmarkBodies("Gunzip", gzipped_bodies, bytes, [](const std::string & gzipped) { return Gunzip(gzipped); });
+  BenchmarkBodies("Rewrite with cereal", bodies, bytes, &RewriteWithCereal);
+  BenchmarkBodies("Rewrite with EventsScanner", bodies, bytes, &RewriteWithScanner);
+  BenchmarkBodies("Gunzip + rewrite with cereal", gzipped_bodies, bytes,
+                  [](const std::string & gzipped) { return RewriteWithCereal(Gunzip(gzipped)); });
+  BenchmarkBodies("Gunzip + rewrite with EventsScanner", gzipped_bodies, bytes,
+                  [](const std::string & gzipped) { return RewriteWithScanner(Gunzip(gzipped)); });
+
+  std::vector<std::string> gzipped_junk;
+  for (const std::string & body : bodies) {
+    gzipped_junk.push_back(Gzip(CorruptBody(body)));
+  }
+  BenchmarkBodies("Reject junk with cereal exceptions", gzipped_junk, bytes, [](const std::string & gzipped) {
+    try {
+      return RewriteWithCereal(Gunzip(gzipped));
+    } catch (const std::exception &) {
+      return std::string();
+    }
+  });
+  BenchmarkRejectedStream(gzipped_junk, bytes);
+
+  if (!FLAGS_durable_dir.empty()) {
+    BenchmarkDurableWrites(gzipped_bodies, bytes);
+  }
+
+  if (FLAGS_format != "text") {
+    PrintJson(gResults);
+  }
+  return 0;
+}
@@ -0,0 +1,238 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Load generator for a running alohalytics_httpd (or nginx with fcgi_server): every thread POSTs gzipped bodies
+// over it's own keep-alive connection and counts replies by status, e.g. to check admission control locally:
+// $ echo 'ip_rate = 100' > /tmp/admission.conf
+// $ alohalytics_httpd --port 8080 --admission-config /tmp/admission.conf /tmp/aloha /monitoring &
+// $ ingest_load --port 8080 --threads 8 --source_ips 4 --clients 100 --format text
+// Connections are bound to different 127.0.0.x source addresses to simulate several clients' IPs.
+
+#include "benchmarks/bench.h"
+#include "examples/cpp/dflags.h"
+#include "src/event_base.h"
+#include "src/gzip_wrapper.h"
+#include "src/latency_histogram.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+DEFINE_string(host, "127.0.0.1", "Server's IPv4 address.");
+DEFINE_uint32(port, 8080, "Server's port.");
+DEFINE_string(uri, "/android/load/1", "Request URI.");
+DEFINE_uint32(threads, 8, "Number of concurrent connections.");
+DEFINE_uint64(requests, 1000, "Number of requests per thread.");
+DEFINE_uint32(clients, 16, "Number of different client IDs in bodies.");
+DEFINE_uint32(source_ips, 1, "Number of different source IPs (127.0.0.2 and so on), 0 uses the default one.");
+DEFINE_uint64(events_per_body, 20, "Number of events in every body, the first one is an ID event.");
+DEFINE_string(format, "json", "Output format, json or text.");
+
+using namespace alohalytics;
+using namespace alohalytics::bench;
+
+namespace {
+
+template <typename TEvent>
+void Append(std::string & body, const TEvent & event) {
+  std::ostringstream stream;
+  cereal::BinaryOutputArchive(stream) << std::unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event);
+  body += stream.str();
+}
+
+std::string GzippedBody(uint32_t client) {
+  std::string body;
+  AlohalyticsIdEvent id;
+  id.id = "A:load-" + std::to_string(client);
+  Append(body, id);
+  AlohalyticsKeyValueEvent event;
+  event.key = "load";
+  for (uint64_t i = 1; i < FLAGS_events_per_body; ++i) {
+    event.value = std::to_string(i);
+    Append(body, event);
+  }
+  return Gzip(body);
+}
+
+// Blocking keep-alive HTTP/1.1 connection, reconnects when the server closes it.
+class Connection {
+  const uint32_t source_ip_;
+  int fd_ = -1;
+  std::string buffer_;
+
+  bool Connect() {
+    fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (fd_ < 0) {
+      return false;
+    }
+    const int one = 1;
+    ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    if (source_ip_) {
+      address.sin_addr.s_addr = htonl(source_ip_);
+      if (::bind(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address))) {
+        Close();
+        return false;
+      }
+    }
+    address.sin_port = htons(static_cast<uint16_t>(FLAGS_port));
+    if (::inet_pton(AF_INET, FLAGS_host.c_str(), &address.sin_addr) != 1 ||
+        ::connect(fd_, reinterpret_cast<sockaddr *>(&address), sizeof(address))) {
+      Close();
+      return false;
+    }
+    return true;
+  }
+
+  void Close() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+    buffer_.clear();
+  }
+
+  bool ReadMore() {
+    char chunk[16 * 1024];
+    const ssize_t size = ::recv(fd_, chunk, sizeof(chunk), 0);
+    if (size <= 0) {
+      return false;
+    }
+    buffer_.append(chunk, static_cast<size_t>(size));
+    return true;
+  }
+
+ public:
+  // Zero source_ip uses the default one.
+  explicit Connection(uint32_t source_ip) : source_ip_(source_ip) {}
+  ~Connection() { Close(); }
+
+  // Returns HTTP status, or 0 on network error.
+  int Post(const std::string & request, std::string & body) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+      if (fd_ < 0 && !Connect()) {
+        return 0;
+      }
+      if (::send(fd_, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+        Close();
+        continue;
+      }
+      size_t head_end;
+      while ((head_end = buffer_.find("\r\n\r\n")) == std::string::npos) {
+        if (!ReadMore()) {
+          break;
+        }
+      }
+      if (head_end == std::string::npos) {
+        // Keep-alive connection could have been closed by the server, retry with a new one.
+        Close();
+        continue;
+      }
+      const std::string head = buffer_.substr(0, head_end);
+      const int status = std::atoi(head.c_str() + head.find(' ') + 1);
+      size_t content_length = 0;
+      const size_t length_header = head.find("Content-Length: ");
+      if (length_header != std::string::npos) {
+        content_length = std::strtoul(head.c_str() + length_header + 16, nullptr, 10);
+      }
+      while (buffer_.size() < head_end + 4 + content_length) {
+        if (!ReadMore()) {
+          Close();
+          return 0;
+        }
+      }
+      body = buffer_.substr(head_end + 4, content_length);
+      buffer_.erase(0, head_end + 4 + content_length);
+      if (head.find("Connection: close") != std::string::npos) {
+        Close();
+      }
+      return status;
+    }
+    return 0;
+  }
+};
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+  ParseDFlags(&argc, &argv);
+  if (FLAGS_threads == 0 || FLAGS_clients == 0) {
+    std::cerr << "--threads and --clients should be positive." << std::endl;
+    return -1;
+  }
+  std::vector<std::string> requests;
+  for (uint32_t client = 0; client < FLAGS_clients; ++client) {
+    const std::string body = GzippedBody(client);
+    requests.push_back("POST " + FLAGS_uri + " HTTP/1.1\r\nHost: " + FLAGS_host +
+                       "\r\nContent-Type: application/alohalytics-binary-blob\r\nContent-Encoding: gzip\r\n"
+                       "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+  }
+  std::vector<std::unique_ptr<Connection>> connections;
+  // Replies as "<status> <first line of the body>", e.g. "200 Mahalo" or "429 Hohono", per thread.
+  std::vector<std::map<std::string, uint64_t>> replies(FLAGS_threads);
+  for (uint32_t thread = 0; thread < FLAGS_threads; ++thread) {
+    connections.emplace_back(new Connection(FLAGS_source_ips ? 0x7f000002 + thread % FLAGS_source_ips : 0));
+  }
+  LatencyHistogram histogram;
+  Result result = MeasureThreads("POST " + FLAGS_uri, FLAGS_threads, FLAGS_requests, [&](uint32_t thread,
+                                                                                         uint64_t i) {
+    std::string body;
+    const auto start = std::chrono::steady_clock::now();
+    const int status =
+        connections[thread]->Post(requests[(thread + i * FLAGS_threads) % requests.size()], body);
+    histogram.Record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    ++replies[thread][std::to_string(status) + ' ' + body.substr(0, body.find('\n'))];
+  });
+  std::map<std::string, uint64_t> total;
+  for (const auto & thread_replies : replies) {
+    for (const auto & reply : thread_replies) {
+      total[reply.first] += reply.second;
+    }
+  }
+  const LatencyHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  result.extra.emplace_back("p50_us", snapshot.Percentile(50.) / 1000.);
+  result.extra.emplace_back("p99_us", snapshot.Percentile(99.) / 1000.);
+  for (const auto & reply : total) {
+    result.extra.emplace_back(reply.first, static_cast<double>(reply.second));
+  }
+  if (FLAGS_format == "text") {
+    PrintText(result);
+  } else {
+    PrintJson({result});
+  }
+  return 0;
+}
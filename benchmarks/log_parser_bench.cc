@@ -0,0 +1,215 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Measures how many nginx log lines per second logs_processor can parse: the single-pass NginxLogParser and
+// the original parser (find_first_of, substring copies, strptime + mktime and istringstream for the status).
+// Synthetic log has realistic lines with one new second every few lines, and is parsed again and again until
+// --log_mb are processed. With --log_file, a real log is parsed instead. Prints results as JSON (or as a text table).
+
+#include "benchmarks/bench.h"
+#include "examples/cpp/dflags.h"
+#include "server/nginx_log_parser.h"
+
+#include <time.h>  // strptime
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+DEFINE_uint64(log_mb, 4096, "Size of the synthetic log parsed by NginxLogParser, in megabytes.");
+DEFINE_uint64(legacy_log_mb, 256, "Size of the synthetic log parsed by the original parser, in megabytes.");
+DEFINE_uint64(lines_per_second, 20, "Log lines with the same timestamp in the synthetic log.");
+DEFINE_string(log_file, "", "Real log to parse instead of the synthetic one, it is parsed once.");
+DEFINE_string(format, "json", "Output format, json or text.");
+
+using namespace alohalytics;
+using namespace alohalytics::bench;
+
+namespace {
+
+// Lines are parsed from this chunk again and again.
+constexpr uint64_t kChunkBytes = 64 * 1024 * 1024;
+
+std::string GenerateLog(uint64_t bytes) {
+  static const char * const kUserAgents[] = {
+      "Dalvik/2.1.0 (Linux; U; Android 6.0; Nexus 5 Build/MRA58N)",
+      "Dalvik/1.6.0 (Linux; U; Android 4.4.4; m1 note Build/KTU84P)",
+      "MAPS.ME/5.6 CFNetwork/758.2.8 Darwin/15.0.0",
+  };
+  std::mt19937_64 random(42);
+  std::string log;
+  log.reserve(bytes + 1024);
+  time_t timestamp = 1434588181;
+  for (uint64_t line = 0; log.size() < bytes; ++line) {
+    if (line % FLAGS_lines_per_second == 0) {
+      ++timestamp;
+    }
+    char time_local[32];
+    struct tm tm;
+    ::gmtime_r(&timestamp, &tm);
+    ::strftime(time_local, sizeof(time_local), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    const uint64_t file = random() % 10000000000ULL;
+    log += "10." + std::to_string(random() % 256) + '.' + std::to_string(random() % 256) + '.' +
+           std::to_string(random() % 256) + " [" + time_local + "] \"POST /android/maps/" +
+           std::to_string(random() % 200) + " HTTP/1.1\" " + (random() % 50 ? "200 " : "499 ") +
+           std::to_string(random() % 100000) + " /var/nginx/bodies/" + std::to_string(file % 1000) + '/' +
+           std::to_string(file) + " \"" + kUserAgents[random() % 3] + "\" application/alohalytics-binary-blob gzip\n";
+  }
+  return log;
+}
+
+// The original logs_processor's parser, only fields are extracted.
+struct LegacyEntry {
+  std::string ip;
+  uint64_t timestamp_ms = 0;
+  std::string uri;
+  int http_code = 0;
+  std::string file_path;
+  std::string user_agent;
+};
+
+bool LegacyParse(const std::string & log_entry, LegacyEntry & entry) {
+  std::string::size_type start_pos = 0;
+  std::string::size_type end_pos = log_entry.find_first_of(' ');
+  if (end_pos == std::string::npos) {
+    return false;
+  }
+  entry.ip.assign(log_entry, start_pos, end_pos - start_pos);
+  start_pos = end_pos + 1;
+  end_pos = log_entry.find_first_of(' ', start_pos);
+  if (end_pos == std::string::npos) {
+    return false;
+  }
+  struct tm stm;
+  ::memset(&stm, 0, sizeof(stm));
+  if (NULL == ::strptime(&log_entry[start_pos], "[%d/%b/%Y:%H:%M:%S", &stm)) {
+    return false;
+  }
+  entry.timestamp_ms = mktime(&stm) * 1000;
+  start_pos = log_entry.find_first_of('/', end_pos);
+  if (start_pos == std::string::npos) {
+    return false;
+  }
+  end_pos = log_entry.find_first_of(' ', start_pos);
+  if (end_pos == std::string::npos) {
+    return false;
+  }
+  entry.uri.assign(log_entry, start_pos, end_pos - start_pos);
+  start_pos = log_entry.find_first_of(' ', end_pos + 1);
+  if ((std::istringstream(log_entry.substr(start_pos + 1, 3)) >> entry.http_code).fail()) {
+    return false;
+  }
+  start_pos = log_entry.find_first_of('/', start_pos);
+  if (start_pos == std::string::npos) {
+    return false;
+  }
+  end_pos = log_entry.find_first_of(' ', start_pos);
+  if (end_pos == std::string::npos) {
+    return false;
+  }
+  entry.file_path.assign(log_entry, start_pos, end_pos - start_pos);
+  start_pos = log_entry.find_first_of('"', end_pos);
+  if (start_pos == std::string::npos) {
+    return false;
+  }
+  end_pos = log_entry.find("\" ", start_pos + 1);
+  if (end_pos == std::string::npos) {
+    return false;
+  }
+  entry.user_agent.assign(log_entry, start_pos + 1, end_pos - start_pos - 1);
+  return std::string::npos != log_entry.find(" application/alohalytics-binary-blob gzip", end_pos + 1);
+}
+
+std::vector<Result> gResults;
+
+void Report(const Result & result) {
+  gResults.push_back(result);
+  if (FLAGS_format == "text") {
+    PrintText(result);
+  }
+}
+
+// Calls parse(line) for every line of the log, repeating the log until total_bytes are parsed.
+// Lines are copied into a reused string, as getline does in logs_processor.
+template <typename TParse>
+void BenchmarkLines(const std::string & name, const std::string & log, uint64_t total_bytes, TParse && parse) {
+  std::vector<std::pair<size_t, size_t>> lines;
+  for (size_t begin = 0; begin < log.size();) {
+    const char * found = static_cast<const char *>(std::memchr(log.data() + begin, '\n', log.size() - begin));
+    const size_t end = found ? found - log.data() : log.size();
+    lines.emplace_back(begin, end - begin);
+    begin = end + 1;
+  }
+  const uint64_t passes = std::max<uint64_t>(1, total_bytes / std::max<size_t>(log.size(), 1));
+  std::string line;
+  uint64_t failed = 0;
+  Result result = Measure(name, passes * lines.size(), [&](uint64_t i) {
+    const auto & position = lines[i % lines.size()];
+    line.assign(log, position.first, position.second);
+    if (!parse(line)) {
+      ++failed;
+    }
+  });
+  result.bytes = passes * log.size();
+  result.extra.emplace_back("failed_lines", static_cast<double>(failed));
+  Report(result);
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+  ParseDFlags(&argc, &argv);
+  std::string log;
+  if (FLAGS_log_file.empty()) {
+    log = GenerateLog(std::min(kChunkBytes, FLAGS_log_mb * 1024 * 1024));
+  } else {
+    std::ifstream file(FLAGS_log_file, std::ios::binary);
+    log.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    FLAGS_log_mb = FLAGS_legacy_log_mb = 0;
+  }
+
+  NginxLogParser parser;
+  NginxLogParser::Entry entry;
+  BenchmarkLines("NginxLogParser", log, FLAGS_log_mb * 1024 * 1024, [&](const std::string & line) {
+    const bool parsed = parser.Parse(line.data(), line.size(), entry) == NginxLogParser::Error::None;
+    DoNotOptimize(entry);
+    return parsed;
+  });
+  LegacyEntry legacy_entry;
+  BenchmarkLines("Original parser", log, FLAGS_legacy_log_mb * 1024 * 1024, [&](const std::string & line) {
+    const bool parsed = LegacyParse(line, legacy_entry);
+    DoNotOptimize(legacy_entry);
+    return parsed;
+  });
+
+  if (FLAGS_format != "text") {
+    PrintJson(gResults);
+  }
+  return 0;
+}
@@ -0,0 +1,138 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Minimal HTTP server on 127.0.0.1 which accepts any request and replies with 200 OK.
+// Used to benchmark the upload path without network noise. POSIX only.
+
+#ifndef LOOPBACK_HTTP_SERVER_H
+#define LOOPBACK_HTTP_SERVER_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace alohalytics {
+namespace bench {
+
+class LoopbackHTTPServer {
+ public:
+  LoopbackHTTPServer() {
+    socket_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_ < 0) {
+      throw std::runtime_error("socket() has failed.");
+    }
+    sockaddr_in address;
+    std::memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;  // Any free port.
+    socklen_t address_size = sizeof(address);
+    if (::bind(socket_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || ::listen(socket_, 16) != 0 ||
+        ::getsockname(socket_, reinterpret_cast<sockaddr *>(&address), &address_size) != 0) {
+      ::close(socket_);
+      throw std::runtime_error("Can't listen on the loopback interface.");
+    }
+    port_ = ntohs(address.sin_port);
+    thread_ = std::thread(&LoopbackHTTPServer::Serve, this);
+  }
+
+  ~LoopbackHTTPServer() {
+    should_exit_ = true;
+    // Wake up accept().
+    ::shutdown(socket_, SHUT_RDWR);
+    thread_.join();
+    ::close(socket_);
+  }
+
+  std::string Url() const { return "http://127.0.0.1:" + std::to_string(port_) + "/"; }
+  uint64_t ReceivedBodyBytes() const { return received_body_bytes_; }
+
+ private:
+  void Serve() {
+    while (!should_exit_) {
+      const int connection = ::accept(socket_, nullptr, nullptr);
+      if (connection < 0) {
+        continue;
+      }
+      HandleConnection(connection);
+      ::close(connection);
+    }
+  }
+
+  static bool Send(int connection, const std::string & data) {
+    return ::send(connection, data.data(), data.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(data.size());
+  }
+
+  void HandleConnection(int connection) {
+    std::string request;
+    char buffer[64 * 1024];
+    size_t headers_end;
+    while ((headers_end = request.find("\r\n\r\n")) == std::string::npos) {
+      const ssize_t received = ::recv(connection, buffer, sizeof(buffer), 0);
+      if (received <= 0) {
+        return;
+      }
+      request.append(buffer, static_cast<size_t>(received));
+    }
+    // Header names are case-insensitive, curl sends them capitalized.
+    const std::string headers = request.substr(0, headers_end);
+    size_t content_length = 0;
+    const size_t length_header = headers.find("Content-Length:");
+    if (length_header != std::string::npos) {
+      content_length = std::strtoul(headers.c_str() + length_header + 15, nullptr, 10);
+    }
+    if (headers.find("100-continue") != std::string::npos && !Send(connection, "HTTP/1.1 100 Continue\r\n\r\n")) {
+      return;
+    }
+    size_t body_received = request.size() - headers_end - 4;
+    while (body_received < content_length) {
+      const ssize_t received = ::recv(connection, buffer, sizeof(buffer), 0);
+      if (received <= 0) {
+        return;
+      }
+      body_received += static_cast<size_t>(received);
+    }
+    received_body_bytes_ += body_received;
+    Send(connection, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+  }
+
+  int socket_ = -1;
+  uint16_t port_ = 0;
+  std::atomic<bool> should_exit_{false};
+  std::atomic<uint64_t> received_body_bytes_{0};
+  std::thread thread_;
+};
+
+}  // namespace bench
+}  // namespace alohalytics
+
+#endif  // LOOPBACK_HTTP_SERVER_H
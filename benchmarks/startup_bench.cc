@@ -0,0 +1,86 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Measures process start (and exit) time of startup_app built with and without the library,
+// to keep library's impact on app's cold start visible. POSIX only.
+
+#include "benchmarks/bench.h"
+#include "examples/cpp/dflags.h"
+
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <string>
+
+extern char ** environ;
+
+DEFINE_uint64(runs, 200, "Number of process starts for every executable.");
+DEFINE_string(without_library, "", "Path to startup_app_empty, by default it is searched near this binary.");
+DEFINE_string(with_library, "", "Path to startup_app_alohalytics, by default it is searched near this binary.");
+DEFINE_string(format, "json", "Output format, json or text.");
+
+using namespace alohalytics::bench;
+
+namespace {
+
+bool RunProcess(const std::string & path) {
+  char * argv[] = {const_cast<char *>(path.c_str()), nullptr};
+  pid_t pid;
+  if (::posix_spawn(&pid, path.c_str(), nullptr, nullptr, argv, environ) != 0) {
+    return false;
+  }
+  int status;
+  return ::waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char ** argv) {
+  ParseDFlags(&argc, &argv);
+  const std::string self = argv[0];
+  const std::string directory = self.substr(0, self.find_last_of('/') + 1);
+  const std::pair<std::string, std::string> apps[] = {
+      {"Process start without library",
+       FLAGS_without_library.empty() ? directory + "startup_app_empty" : FLAGS_without_library},
+      {"Process start with library",
+       FLAGS_with_library.empty() ? directory + "startup_app_alohalytics" : FLAGS_with_library}};
+  std::vector<Result> results;
+  for (const auto & app : apps) {
+    // Warm up file system caches.
+    if (!RunProcess(app.second)) {
+      std::cerr << "Can't run " << app.second << std::endl;
+      return -1;
+    }
+    results.push_back(Measure(app.first, FLAGS_runs, [&app](uint64_t) { RunProcess(app.second); }));
+  }
+  if (FLAGS_format == "text") {
+    for (const Result & result : results) {
+      PrintText(result);
+    }
+  } else {
+    PrintJson(results);
+  }
+  return 0;
+}
@@ -0,0 +1,350 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Per-IP and per-client token buckets, which reject floods of requests before their bodies are inflated.
+// Buckets are stored in fixed-size tables, so memory usage does not depend on the number of clients.
+
+#ifndef ADMISSION_CONTROL_H
+#define ADMISSION_CONTROL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace alohalytics {
+
+// End of hash chains and LRU lists in TokenBucketTable.
+constexpr uint32_t kNoTokenBucket = 0xffffffff;
+
+// Token bucket for every key, in a table which is split into stripes with their own locks. Every stripe has
+// a fixed number of buckets and evicts the least recently used one when a new key does not fit. So a flood of
+// new keys can only make the table forget old (usually idle) buckets, and they start again with a full burst.
+class TokenBucketTable {
+  struct Bucket {
+    uint64_t key;
+    double tokens;
+    int64_t updated_us;
+    // Hash chain and LRU list of the stripe.
+    uint32_t next_in_chain;
+    uint32_t lru_prev;
+    uint32_t lru_next;
+  };
+
+  struct Stripe {
+    std::mutex mutex;
+    std::vector<Bucket> buckets;
+    // Heads of hash chains, size is a power of 2.
+    std::vector<uint32_t> chains;
+    uint32_t used = 0;
+    // Most and least recently used buckets.
+    uint32_t lru_head = kNoTokenBucket;
+    uint32_t lru_tail = kNoTokenBucket;
+  };
+
+  const double rate_;
+  const double burst_;
+  std::vector<std::unique_ptr<Stripe>> stripes_;
+  std::atomic<uint64_t> evictions_{0};
+
+  // 64-bit FNV-1a, finalized with splitmix64, as both stripe and chain are selected by it's bits.
+  static uint64_t Hash(const std::string & key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : key) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+  }
+
+  static void Unlink(Stripe & stripe, uint32_t index) {
+    const Bucket & bucket = stripe.buckets[index];
+    if (bucket.lru_prev == kNoTokenBucket) {
+      stripe.lru_head = bucket.lru_next;
+    } else {
+      stripe.buckets[bucket.lru_prev].lru_next = bucket.lru_next;
+    }
+    if (bucket.lru_next == kNoTokenBucket) {
+      stripe.lru_tail = bucket.lru_prev;
+    } else {
+      stripe.buckets[bucket.lru_next].lru_prev = bucket.lru_prev;
+    }
+  }
+
+  static void PushFront(Stripe & stripe, uint32_t index) {
+    Bucket & bucket = stripe.buckets[index];
+    bucket.lru_prev = kNoTokenBucket;
+    bucket.lru_next = stripe.lru_head;
+    if (stripe.lru_head == kNoTokenBucket) {
+      stripe.lru_tail = index;
+    } else {
+      stripe.buckets[stripe.lru_head].lru_prev = index;
+    }
+    stripe.lru_head = index;
+  }
+
+  static uint32_t & ChainHead(Stripe & stripe, uint64_t hash) {
+    return stripe.chains[(hash >> 32) & (stripe.chains.size() - 1)];
+  }
+
+  // Returns index of the key's bucket, a new bucket has a full burst.
+  uint32_t FindOrInsert(Stripe & stripe, uint64_t hash, int64_t now_us) {
+    uint32_t & head = ChainHead(stripe, hash);
+    for (uint32_t index = head; index != kNoTokenBucket; index = stripe.buckets[index].next_in_chain) {
+      if (stripe.buckets[index].key == hash) {
+        Unlink(stripe, index);
+        PushFront(stripe, index);
+        return index;
+      }
+    }
+    uint32_t index;
+    if (stripe.used < stripe.buckets.size()) {
+      index = stripe.used++;
+    } else {
+      index = stripe.lru_tail;
+      Unlink(stripe, index);
+      uint32_t * link = &ChainHead(stripe, stripe.buckets[index].key);
+      while (*link != index) {
+        link = &stripe.buckets[*link].next_in_chain;
+      }
+      *link = stripe.buckets[index].next_in_chain;
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+    Bucket & bucket = stripe.buckets[index];
+    bucket.key = hash;
+    bucket.tokens = burst_;
+    bucket.updated_us = now_us;
+    bucket.next_in_chain = head;
+    head = index;
+    PushFront(stripe, index);
+    return index;
+  }
+
+ public:
+  // Every key gets rate tokens per second, up to burst tokens. Memory is allocated once for capacity buckets.
+  TokenBucketTable(double rate, double burst, size_t capacity, size_t stripes_count)
+      : rate_(rate), burst_(std::max(burst, 1.)) {
+    stripes_count = std::max<size_t>(stripes_count, 1);
+    const size_t stripe_capacity = std::max<size_t>(capacity / stripes_count, 1);
+    if (stripe_capacity >= kNoTokenBucket) {
+      throw std::invalid_argument("Too large token buckets table.");
+    }
+    size_t chains = 1;
+    while (chains < stripe_capacity) {
+      chains *= 2;
+    }
+    for (size_t i = 0; i < stripes_count; ++i) {
+      stripes_.emplace_back(new Stripe());
+      stripes_.back()->buckets.resize(stripe_capacity);
+      stripes_.back()->chains.assign(chains, kNoTokenBucket);
+    }
+  }
+
+  // Takes one token from the key's bucket, returns false if there are no tokens left.
+  bool Take(const std::string & key, int64_t now_us) {
+    const uint64_t hash = Hash(key);
+    Stripe & stripe = *stripes_[hash % stripes_.size()];
+    std::lock_guard<std::mutex> lock(stripe.mutex);
+    Bucket & bucket = stripe.buckets[FindOrInsert(stripe, hash, now_us)];
+    if (now_us > bucket.updated_us) {
+      bucket.tokens = std::min(burst_, bucket.tokens + (now_us - bucket.updated_us) * rate_ / 1e6);
+      bucket.updated_us = now_us;
+    }
+    if (bucket.tokens < 1.) {
+      return false;
+    }
+    bucket.tokens -= 1.;
+    return true;
+  }
+
+  uint64_t Evictions() const { return evictions_.load(std::memory_order_relaxed); }
+};
+
+struct AdmissionConfig {
+  // Requests per second (on average) and burst for every client's IP and for every client ID.
+  // Zero rate disables the limit.
+  double ip_rate = 0.;
+  double ip_burst = 10.;
+  double client_rate = 0.;
+  double client_burst = 10.;
+  // Number of buckets for IPs and for client IDs (every table has it's own buckets).
+  size_t table_capacity = 64 * 1024;
+  size_t table_stripes = 64;
+
+  // Reads "key = value" lines, empty lines and lines starting with # are ignored. Keys are the field names.
+  // Throws std::runtime_error on any error.
+  static AdmissionConfig FromFile(const std::string & path) {
+    std::ifstream file(path);
+    if (!file) {
+      throw std::runtime_error("Can't open admission config " + path);
+    }
+    AdmissionConfig config;
+    std::string line;
+    for (size_t line_number = 1; std::getline(file, line); ++line_number) {
+      const size_t begin = line.find_first_not_of(" \t\r");
+      if (begin == std::string::npos || line[begin] == '#') {
+        continue;
+      }
+      const size_t equals = line.find('=', begin);
+      if (equals == std::string::npos) {
+        throw std::runtime_error(path + ':' + std::to_string(line_number) + ": missing '='.");
+      }
+      const std::string key = Trim(line.substr(begin, equals - begin));
+      const std::string value = Trim(line.substr(equals + 1));
+      char * end = nullptr;
+      const double number = std::strtod(value.c_str(), &end);
+      if (value.empty() || *end != '\0' || !(number >= 0.)) {
+        throw std::runtime_error(path + ':' + std::to_string(line_number) + ": invalid value for " + key + '.');
+      }
+      if (key == "ip_rate") {
+        config.ip_rate = number;
+      } else if (key == "ip_burst") {
+        config.ip_burst = number;
+      } else if (key == "client_rate") {
+        config.client_rate = number;
+      } else if (key == "client_burst") {
+        config.client_burst = number;
+      } else if (key == "table_capacity" && number >= 1.) {
+        config.table_capacity = static_cast<size_t>(number);
+      } else if (key == "table_stripes" && number >= 1.) {
+        config.table_stripes = static_cast<size_t>(number);
+      } else {
+        throw std::runtime_error(path + ':' + std::to_string(line_number) + ": unknown key or invalid value " +
+                                 key + '.');
+      }
+    }
+    return config;
+  }
+
+ private:
+  static std::string Trim(const std::string & str) {
+    const size_t begin = str.find_first_not_of(" \t\r");
+    if (begin == std::string::npos) {
+      return std::string();
+    }
+    return str.substr(begin, str.find_last_not_of(" \t\r") - begin + 1);
+  }
+};
+
+struct AdmissionCounters {
+  uint64_t ip_admitted = 0;
+  uint64_t ip_rejected = 0;
+  uint64_t client_admitted = 0;
+  uint64_t client_rejected = 0;
+  // Buckets which were forgotten because the table was full.
+  uint64_t evictions = 0;
+};
+
+// Thread-safe. Disabled limits cost nothing.
+class AdmissionControl {
+  const AdmissionConfig config_;
+  std::unique_ptr<TokenBucketTable> ips_;
+  std::unique_ptr<TokenBucketTable> clients_;
+  std::atomic<uint64_t> ip_admitted_{0};
+  std::atomic<uint64_t> ip_rejected_{0};
+  std::atomic<uint64_t> client_admitted_{0};
+  std::atomic<uint64_t> client_rejected_{0};
+
+  static int64_t NowInMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static bool Admit(TokenBucketTable * table,
+                    const std::string & key,
+                    int64_t now_us,
+                    std::atomic<uint64_t> & admitted,
+                    std::atomic<uint64_t> & rejected) {
+    if (!table) {
+      return true;
+    }
+    if (table->Take(key, now_us)) {
+      admitted.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+ public:
+  explicit AdmissionControl(const AdmissionConfig & config) : config_(config) {
+    if (config.ip_rate > 0.) {
+      ips_.reset(new TokenBucketTable(config.ip_rate, config.ip_burst, config.table_capacity, config.table_stripes));
+    }
+    if (config.client_rate > 0.) {
+      clients_.reset(
+          new TokenBucketTable(config.client_rate, config.client_burst, config.table_capacity, config.table_stripes));
+    }
+  }
+
+  bool Enabled() const { return ips_ || clients_; }
+
+  // Should be called before reading the body.
+  bool AdmitIP(const std::string & ip) { return AdmitIP(ip, NowInMicroseconds()); }
+  // Client ID is known only when the beginning of the body is inflated.
+  bool AdmitClient(const std::string & client_id) { return AdmitClient(client_id, NowInMicroseconds()); }
+
+  // For unit tests, to control time.
+  bool AdmitIP(const std::string & ip, int64_t now_us) {
+    return Admit(ips_.get(), ip, now_us, ip_admitted_, ip_rejected_);
+  }
+  bool AdmitClient(const std::string & client_id, int64_t now_us) {
+    return Admit(clients_.get(), client_id, now_us, client_admitted_, client_rejected_);
+  }
+
+  // Time to get a new token for the slowest enabled limit, to be sent in Retry-After header.
+  uint32_t RetryAfterSeconds() const {
+    double seconds = 1.;
+    if (ips_) {
+      seconds = std::max(seconds, 1. / config_.ip_rate);
+    }
+    if (clients_) {
+      seconds = std::max(seconds, 1. / config_.client_rate);
+    }
+    return static_cast<uint32_t>(std::min(std::ceil(seconds), 86400.));
+  }
+
+  AdmissionCounters Counters() const {
+    AdmissionCounters counters;
+    counters.ip_admitted = ip_admitted_.load(std::memory_order_relaxed);
+    counters.ip_rejected = ip_rejected_.load(std::memory_order_relaxed);
+    counters.client_admitted = client_admitted_.load(std::memory_order_relaxed);
+    counters.client_rejected = client_rejected_.load(std::memory_order_relaxed);
+    counters.evictions = (ips_ ? ips_->Evictions() : 0) + (clients_ ? clients_->Evictions() : 0);
+    return counters;
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // ADMISSION_CONTROL_H
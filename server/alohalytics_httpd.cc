@@ -0,0 +1,549 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// clang-format off
+// Standalone HTTP server which stores statistics received from remote clients, without nginx and FastCGI.
+// Data is stored exactly like fcgi_server does, by default in <specified folder>/alohalytics_messages file.
+// If you have tons of data, it is better to use logrotate utility to archive it (see logrotate.conf).
+
+// The same validity checks are done as in nginx.conf for fcgi_server:
+// Request method should be POST only (405 otherwise).
+// Content-Length should be set (411 otherwise) and not larger than --max-body-bytes (413 otherwise).
+// Content-Type should be application/alohalytics-binary-blob (415 otherwise, except of monitoring uri).
+// Content-Encoding should be gzip (400 otherwise, except of monitoring uri).
+
+// Overloaded server (see --soft-pending-bytes etc.) asks clients to retry later and to sample their events, in an
+// additional line of the reply body (see src/upload_hint.h), or rejects requests with 503 before reading their bodies.
+// With --admission-config, requests over the per-IP (before reading the body) or per-client (before inflating the
+// body) rate limit get 429 status.
+// With --dedup-window-seconds, bodies which clients resend after a lost reply are acknowledged but not stored again.
+// Warnings about rejected bodies are rate-limited (--rejected-logs-per-second), and with --quarantine-dir a sample of
+// them is saved for investigation.
+// Log lines are written by a background thread (see server/async_logger.h), and every log call site is limited to
+// --log-lines-per-second lines.
+
+// Monitoring URI is a simple is-server-alive check. POST any content-type there and get it back without any modifications.
+// With --metrics-uri, GET requests to it get requests, stage timings, queue and rejection counters in the Prometheus
+// text format (see server/ingest_metrics.h).
+
+// Usage example:
+// $ alohalytics_httpd [--address 127.0.0.1] [--port 8080] [--workers N] /dir/to/store/received/data /monitoring/uri [/optional/path/to/log.file]
+// $ curl -X POST -H 'Content-Type: text/plain' --data-binary 'hello' http://127.0.0.1:8080/monitoring/uri
+// Every worker has its own SO_REUSEPORT listening socket and epoll loop.
+// Several instances can also listen on the same port.
+// clang-format on
+
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "src/logger.h"
+
+#include "server/async_logger.h"
+#include "server/epoll_http_server.h"
+#include "server/statistics_receiver.h"
+
+using namespace std;
+
+// Can be used as a basic check on the client-side if it has connected to the right server.
+static const string kBodyTextForGoodServerReply = "Mahalo";
+static const string kBodyTextForBadServerReply = "Hohono";
+static const string kAlohalyticsContentType = "application/alohalytics-binary-blob";
+static const unsigned long kMaxWorkers = 1024;
+
+// Global variables to correctly reopen data and log files after signals from logrotate utility.
+volatile sig_atomic_t gReceivedSIGHUP = 0;
+volatile sig_atomic_t gReceivedSIGUSR1 = 0;
+alohalytics::EpollHTTPServer * gServer = nullptr;
+
+// Any worker can notice the signal, the mutex guarantees that every file is reopened only once.
+void ReopenFilesOnSignals(alohalytics::StatisticsReceiver & receiver, alohalytics::AsyncLogger & logger) {
+  if (gReceivedSIGHUP != SIGHUP && gReceivedSIGUSR1 != SIGUSR1) {
+    return;
+  }
+  static mutex signals_mutex;
+  lock_guard<mutex> lock(signals_mutex);
+  // Correctly reopen data file in the queue.
+  if (gReceivedSIGHUP == SIGHUP) {
+    receiver.ReopenDataFile();
+    gReceivedSIGHUP = 0;
+  }
+  // Correctly reopen debug log file.
+  if (gReceivedSIGUSR1 == SIGUSR1) {
+    logger.ReopenLogFile();
+    gReceivedSIGUSR1 = 0;
+  }
+}
+
+// Returns backpressure limit for the command line flag, or nullptr if it is not a backpressure flag.
+uint64_t * BackpressureFlag(const string & flag, alohalytics::BackpressureLimits & limits) {
+  if (flag == "--soft-pending-bytes") {
+    return &limits.soft_pending_bytes;
+  } else if (flag == "--hard-pending-bytes") {
+    return &limits.hard_pending_bytes;
+  } else if (flag == "--soft-latency-us") {
+    return &limits.soft_store_latency_us;
+  } else if (flag == "--hard-latency-us") {
+    return &limits.hard_store_latency_us;
+  } else if (flag == "--retry-after") {
+    return &limits.min_retry_after_seconds;
+  } else if (flag == "--max-retry-after") {
+    return &limits.max_retry_after_seconds;
+  } else if (flag == "--min-sampling-percent") {
+    return &limits.min_sampling_percent;
+  }
+  return nullptr;
+}
+
+// Old clients check only the status code, new ones follow the hint in the second line (see src/upload_hint.h).
+string BodyWithHint(const string & body, const alohalytics::UploadHint & hint) {
+  return hint.Empty() ? body : body + '\n' + hint.ToString();
+}
+
+// Workers finish their current requests and exit.
+void StopServerOnSignal(int) {
+  if (gServer) {
+    gServer->Stop();
+  }
+}
+
+// Client treats any non-200 reply as an error and keeps its data for the next upload.
+void SetTooManyRequests(uint32_t retry_after_seconds, alohalytics::HTTPResponse & response) {
+  alohalytics::UploadHint hint;
+  hint.retry_after_seconds = retry_after_seconds;
+  response.status = 429;
+  response.headers.emplace_back("Retry-After", to_string(retry_after_seconds));
+  response.body = BodyWithHint(kBodyTextForBadServerReply, hint);
+}
+
+// Rejects invalid requests before their bodies are read.
+bool CheckRequestHead(const alohalytics::HTTPRequest & request,
+                      alohalytics::StatisticsReceiver & receiver,
+                      const string & kMonitoringURI,
+                      const string & kMetricsURI,
+                      alohalytics::HTTPResponse & response) {
+  if (!kMetricsURI.empty() && request.uri == kMetricsURI && request.method == "GET") {
+    response.content_type = alohalytics::kPrometheusContentType;
+    response.body = receiver.MetricsText();
+    return false;
+  }
+  if (request.method != "POST") {
+    response.status = 405;
+    response.headers.emplace_back("Allow", "POST");
+  } else if (!request.has_content_length) {
+    response.status = 411;
+  } else if (request.uri == kMonitoringURI) {
+    return true;
+  } else if (!request.Header("content-type") || *request.Header("content-type") != kAlohalyticsContentType) {
+    response.status = 415;
+  } else if (!request.Header("content-encoding") || *request.Header("content-encoding") != "gzip") {
+    response.status = 400;
+  } else if (!receiver.AdmitRequest(request.remote_addr)) {
+    // Rate limited requests are not logged, as there can be a flood of them, see counters at shutdown.
+    SetTooManyRequests(receiver.RateLimitRetryAfterSeconds(), response);
+    return false;
+  } else {
+    alohalytics::UploadHint hint;
+    if (!receiver.CheckBackpressure(hint)) {
+      return true;
+    }
+    // Hard limit is hit, the body is not even read.
+    response.status = 503;
+    if (hint.retry_after_seconds) {
+      response.headers.emplace_back("Retry-After", to_string(hint.retry_after_seconds));
+    }
+    response.body = BodyWithHint(kBodyTextForBadServerReply, hint);
+    return false;
+  }
+  response.body = alohalytics::HTTPStatusText(response.status);
+  return false;
+}
+
+// We always reply to our clients that we have received everything they sent, even if it was a complete junk.
+// The difference is only in the body of the reply.
+void HandleRequest(alohalytics::HTTPRequest & request,
+                   alohalytics::StatisticsReceiver & receiver,
+                   const string & kMonitoringURI,
+                   alohalytics::LogRateLimiter & rejected_log,
+                   alohalytics::HTTPResponse & response) {
+  const string * user_agent = request.Header("user-agent");
+  if (request.body.empty()) {
+    ALOG("WARNING: Request is ignored due to empty body", request.remote_addr, request.uri,
+         user_agent ? *user_agent : "");
+    response.body = kBodyTextForBadServerReply;
+    return;
+  }
+  // Handle special URI for server monitoring: reply with the same content and content-type.
+  if (request.uri == kMonitoringURI) {
+    const string * content_type = request.Header("content-type");
+    if (content_type) {
+      response.content_type = *content_type;
+    }
+    response.body.swap(request.body);
+    return;
+  }
+  size_t offset = 0;
+  const auto read = [&request, &offset](char * buffer, size_t size) {
+    size = min(size, request.body.size() - offset);
+    memcpy(buffer, request.body.data() + offset, size);
+    offset += size;
+    return size;
+  };
+  alohalytics::UploadHint hint;
+  receiver.CheckBackpressure(hint);
+  alohalytics::IngestFailure failure;
+  const alohalytics::IngestResult result = receiver.ProcessReceivedHTTPStream(
+      read, request.body.size(), AlohalyticsBaseEvent::CurrentTimestamp(), request.remote_addr,
+      user_agent ? *user_agent : "", request.uri, &failure);
+  if (result == alohalytics::IngestResult::SyncError) {
+    ALOG("ERROR: Request could not be stored durably", request.remote_addr, request.uri,
+         user_agent ? *user_agent : "");
+    response.status = 503;
+    response.body = BodyWithHint(kBodyTextForBadServerReply, hint);
+    return;
+  }
+  if (result == alohalytics::IngestResult::RateLimited) {
+    SetTooManyRequests(max(hint.retry_after_seconds, receiver.RateLimitRetryAfterSeconds()), response);
+    return;
+  }
+  // Duplicate was already stored, so client should delete it's copy.
+  if (result != alohalytics::IngestResult::Ok && result != alohalytics::IngestResult::Duplicate) {
+    // Junk traffic can be heavy, so only some bodies are logged, and a sample is saved with --quarantine-dir.
+    uint64_t suppressed = 0;
+    if (rejected_log.Allow(suppressed)) {
+      ALOG("WARNING: Request is rejected:", alohalytics::IngestResultToString(result), failure.ToString(),
+           request.body.size(), request.remote_addr, request.uri, user_agent ? *user_agent : "",
+           "Not logged before:", suppressed);
+    }
+    response.body = BodyWithHint(kBodyTextForBadServerReply, hint);
+    return;
+  }
+  response.body = BodyWithHint(kBodyTextForGoodServerReply, hint);
+}
+
+int main(int argc, char * argv[]) {
+  // Positional arguments without options.
+  vector<char *> args;
+  alohalytics::HTTPServerConfig config;
+  unsigned long workers_count = 1;
+  unsigned long shards_count = 1;
+  auto shard_by = alohalytics::StatisticsReceiver::ShardBy::Thread;
+  alohalytics::IngestLimits limits;
+  bool durable = false;
+  unsigned long sync_window_us = 0;
+  alohalytics::BackpressureLimits backpressure;
+  alohalytics::AdmissionConfig admission;
+  unsigned long dedup_window_seconds = 0;
+  unsigned long dedup_capacity = 1024 * 1024;
+  string metrics_uri;
+  alohalytics::QuarantineConfig quarantine;
+  uint64_t rejected_logs_per_second = 10;
+  uint64_t log_lines_per_second = 100;
+  for (int i = 0; i < argc; ++i) {
+    const string arg = argv[i];
+    if (arg == "--quarantine-dir") {
+      quarantine.directory = (i + 1 < argc) ? argv[++i] : "";
+    } else if (arg == "--quarantine-one-of" || arg == "--quarantine-max-files" ||
+               arg == "--rejected-logs-per-second") {
+      uint64_t & value = arg == "--quarantine-one-of"
+                             ? quarantine.sample_one_of
+                             : (arg == "--quarantine-max-files" ? quarantine.max_files : rejected_logs_per_second);
+      char * end = nullptr;
+      value = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--quarantine-one-of" && value == 0)) {
+        ALOG("ERROR:", arg, "should be followed by a non-negative number (positive for --quarantine-one-of).");
+        return -1;
+      }
+    } else if (arg == "--log-lines-per-second") {
+      char * end = nullptr;
+      log_lines_per_second = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0') {
+        ALOG("ERROR: --log-lines-per-second should be followed by a non-negative number.");
+        return -1;
+      }
+    } else if (arg == "--metrics-uri") {
+      metrics_uri = (i + 1 < argc) ? argv[++i] : "";
+      if (metrics_uri.empty() || metrics_uri.front() != '/') {
+        ALOG("ERROR: --metrics-uri should be followed by an URI which starts with a slash.");
+        return -1;
+      }
+    } else if (arg == "--dedup-window-seconds" || arg == "--dedup-capacity") {
+      unsigned long & value = arg == "--dedup-window-seconds" ? dedup_window_seconds : dedup_capacity;
+      char * end = nullptr;
+      value = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--dedup-capacity" && value == 0)) {
+        ALOG("ERROR:", arg, "should be followed by a number of seconds or a positive number of hashes.");
+        return -1;
+      }
+    } else if (arg == "--admission-config") {
+      try {
+        admission = alohalytics::AdmissionConfig::FromFile(i + 1 < argc ? argv[++i] : "");
+      } catch (const exception & ex) {
+        ALOG("ERROR:", ex.what());
+        return -1;
+      }
+    } else if (uint64_t * value = BackpressureFlag(arg, backpressure)) {
+      char * end = nullptr;
+      *value = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--min-sampling-percent" && (*value == 0 || *value > 100))) {
+        ALOG("ERROR:", arg, "should be followed by a non-negative number (percent from 1 to 100 for sampling).");
+        return -1;
+      }
+    } else if (arg == "--durable") {
+      durable = true;
+    } else if (arg == "--sync-window-us") {
+      char * end = nullptr;
+      sync_window_us = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || sync_window_us > 1000000) {
+        ALOG("ERROR: --sync-window-us should be followed by a number of microseconds from 0 to 1000000.");
+        return -1;
+      }
+    } else if (arg == "--address") {
+      config.address = (i + 1 < argc) ? argv[++i] : "";
+    } else if (arg == "--port" || arg == "--keep-alive-timeout") {
+      char * end = nullptr;
+      const unsigned long value = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || value == 0 || value > 65535) {
+        ALOG("ERROR:", arg, "should be followed by a number from 1 to 65535.");
+        return -1;
+      }
+      if (arg == "--port") {
+        config.port = static_cast<uint16_t>(value);
+      } else {
+        config.keep_alive_timeout_seconds = static_cast<int>(value);
+      }
+    } else if (arg == "--max-body-bytes" || arg == "--max-inflated-bytes") {
+      uint64_t & bytes = arg == "--max-body-bytes" ? limits.max_compressed_bytes : limits.max_inflated_bytes;
+      char * end = nullptr;
+      bytes = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || bytes == 0) {
+        ALOG("ERROR:", arg, "should be followed by a positive number of bytes.");
+        return -1;
+      }
+    } else if (arg == "--max-inflate-ratio") {
+      char * end = nullptr;
+      limits.max_inflate_ratio = (i + 1 < argc) ? strtod(argv[++i], &end) : 0;
+      if (!end || *end != '\0' || !(limits.max_inflate_ratio >= 1.)) {
+        ALOG("ERROR: --max-inflate-ratio should be followed by a number not less than 1.");
+        return -1;
+      }
+    } else if (arg == "--workers" || arg == "--shards") {
+      unsigned long & count = arg == "--workers" ? workers_count : shards_count;
+      char * end = nullptr;
+      count = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || count == 0 || count > kMaxWorkers) {
+        ALOG("ERROR:", arg, "should be followed by a number from 1 to", kMaxWorkers);
+        return -1;
+      }
+    } else if (arg == "--shard-by") {
+      const string value = (i + 1 < argc) ? argv[++i] : "";
+      if (value == "client_id") {
+        shard_by = alohalytics::StatisticsReceiver::ShardBy::ClientId;
+      } else if (value != "thread") {
+        ALOG("ERROR: --shard-by should be followed by thread or client_id.");
+        return -1;
+      }
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+
+  if (args.size() < 3) {
+    ALOG("Usage:", argv[0], "[--address A] [--port N] [--workers N] [--keep-alive-timeout S] "
+                            "[--shards N] [--shard-by thread|client_id] "
+                            "[--max-body-bytes N] [--max-inflated-bytes N] [--max-inflate-ratio R] "
+                            "[--durable [--sync-window-us N]] "
+                            "[--soft-pending-bytes N] [--hard-pending-bytes N] [--soft-latency-us N] "
+                            "[--hard-latency-us N] [--retry-after S] [--max-retry-after S] [--min-sampling-percent P] "
+                            "[--admission-config path] [--dedup-window-seconds S [--dedup-capacity N]] "
+                            "[--metrics-uri /uri] [--rejected-logs-per-second N] [--log-lines-per-second N] "
+                            "[--quarantine-dir path [--quarantine-one-of N] [--quarantine-max-files N]] "
+                            "<directory to store received data> "
+                            "</special/uri/for/monitoring> "
+                            "[optional path to error log file]");
+    ALOG("  - Listens on --address (default", config.address, ") and --port (default", config.port, ").");
+    ALOG("  - --workers runs N epoll loops with their own SO_REUSEPORT sockets (1 by default).");
+    ALOG("  - Idle keep-alive connections are closed after --keep-alive-timeout seconds (default",
+         config.keep_alive_timeout_seconds, ").");
+    ALOG("  - --shards stores data into N files with separate writers, in shard-<i> subdirectories (1 by default).");
+    ALOG("    Shard is selected by the processing thread (default) or by the client id. Data files of all");
+    ALOG("    shards are listed in", alohalytics::kShardsManifestFileName, "file in the storage directory.");
+    ALOG("  - Bodies are rejected if gzipped size is larger than --max-body-bytes (default",
+         limits.max_compressed_bytes, "), if inflated size is larger than --max-inflated-bytes (default",
+         limits.max_inflated_bytes, ") or if inflated/gzipped ratio exceeds --max-inflate-ratio (default",
+         limits.max_inflate_ratio, ").");
+    ALOG("  - With --durable, clients get a reply only when their data is flushed to the storage device, or");
+    ALOG("    503 status if it has failed. Requests which arrive during a flush share the next one, and flushes");
+    ALOG("    can be delayed by --sync-window-us to group more requests (0 by default).");
+    ALOG("  - When received data waiting for writers exceeds --soft-pending-bytes, or average time to store a body");
+    ALOG("    exceeds --soft-latency-us, clients are asked to upload after --retry-after seconds (default",
+         backpressure.min_retry_after_seconds, ") and to log less events, proportionally to the load, but not later");
+    ALOG("    than --max-retry-after (default", backpressure.max_retry_after_seconds,
+         ") and not less than --min-sampling-percent (default", backpressure.min_sampling_percent, ").");
+    ALOG("    Above --hard-pending-bytes or --hard-latency-us requests are rejected with 503 status. All disabled by "
+         "default.");
+    ALOG("  - --admission-config file limits requests rate for every IP and client ID with token buckets, e.g.");
+    ALOG("    ip_rate = 1, ip_burst = 20, client_rate = 0.1, client_burst = 5 (one \"key = value\" per line, see");
+    ALOG("    AdmissionConfig). Over-limit requests get 429 status before their bodies are read or inflated.");
+    ALOG("  - With --dedup-window-seconds, exact copies of bodies from the same client, received during the window");
+    ALOG("    after the original one, are acknowledged but not stored again. Up to --dedup-capacity (default",
+         dedup_capacity, ") body hashes are kept, 16 bytes each.");
+    ALOG("  - Monitoring URI always replies with the same body and content-type which has been received.");
+    ALOG("  - GET request to --metrics-uri gets ingest metrics in the Prometheus text format (disabled by default).");
+    ALOG("  - Up to --rejected-logs-per-second (default", rejected_logs_per_second,
+         ") rejected bodies are logged per second.");
+    ALOG("  - With --quarantine-dir, every --quarantine-one-of received body (default", quarantine.sample_one_of,
+         ") is saved there if it is rejected,");
+    ALOG("    with it's description, up to --quarantine-max-files (default", quarantine.max_files, ").");
+    ALOG("  - Errors are logged to stdout if error log file has not been specified, by a background thread.");
+    ALOG("    Every log call site writes up to --log-lines-per-second lines (default", log_lines_per_second,
+         ", 0 is unlimited),");
+    ALOG("    numbers of suppressed lines are logged once per second.");
+    ALOG("  - SIGHUP reopens main data file and SIGUSR1 reopens debug log file for logrotate utility.");
+    ALOG("  - SIGTERM gracefully shutdowns server daemon.");
+    return -1;
+  }
+
+  const string kStorageDirectory = args[1];
+  if (!alohalytics::FileManager::IsDirectoryWritable(kStorageDirectory)) {
+    ALOG("ERROR: Directory", kStorageDirectory, "is not writable.");
+    return -1;
+  }
+
+  const string kMonitoringURI = args[2];
+  if (kMonitoringURI.empty() || kMonitoringURI.front() != '/') {
+    ALOG("ERROR: Given monitoring URI", kMonitoringURI, "shoud start with a slash.");
+    return -1;
+  }
+
+  // Log into a file if it was given in the command line, from now on ALOG does not block on writes.
+  alohalytics::AsyncLogger logger(args.size() > 3 ? args[3] : nullptr, log_lines_per_second);
+
+  unique_ptr<alohalytics::StatisticsReceiver> receiver_ptr;
+  try {
+    receiver_ptr.reset(new alohalytics::StatisticsReceiver(kStorageDirectory, shards_count, shard_by));
+  } catch (const exception & ex) {
+    ALOG("ERROR:", ex.what());
+    return -1;
+  }
+  alohalytics::StatisticsReceiver & receiver = *receiver_ptr;
+  receiver.SetIngestLimits(limits);
+  if (durable) {
+    receiver.EnableDurableWrites(chrono::microseconds(sync_window_us));
+  }
+  receiver.SetBackpressureLimits(backpressure);
+  receiver.SetAdmissionConfig(admission);
+  if (dedup_window_seconds) {
+    receiver.EnableDuplicateDetection(dedup_capacity, chrono::seconds(dedup_window_seconds));
+  }
+  try {
+    receiver.SetQuarantineConfig(quarantine);
+  } catch (const exception & ex) {
+    ALOG("ERROR:", ex.what());
+    return -1;
+  }
+  alohalytics::LogRateLimiter rejected_log(rejected_logs_per_second);
+  if (!metrics_uri.empty()) {
+    receiver.EnableMetrics();
+  }
+  // Every reply is recorded once: either for rejected request head, or for the whole request.
+  alohalytics::IngestMetrics * metrics = receiver.GetIngestMetrics();
+  config.workers = workers_count;
+  config.max_body_bytes = limits.max_compressed_bytes;
+
+  alohalytics::HTTPHandlers handlers;
+  handlers.on_head = [&receiver, &kMonitoringURI, &metrics_uri, metrics](const alohalytics::HTTPRequest & request,
+                                                                          alohalytics::HTTPResponse & response) {
+    const bool accepted = CheckRequestHead(request, receiver, kMonitoringURI, metrics_uri, response);
+    if (!accepted && metrics) {
+      metrics->RecordReply(response.status, response.body.size());
+    }
+    return accepted;
+  };
+  handlers.on_request = [&receiver, &kMonitoringURI, &rejected_log, metrics](alohalytics::HTTPRequest & request,
+                                                                             alohalytics::HTTPResponse & response) {
+    HandleRequest(request, receiver, kMonitoringURI, rejected_log, response);
+    if (metrics) {
+      metrics->RecordReply(response.status, response.body.size());
+    }
+  };
+  handlers.on_tick = [&receiver, &logger]() { ReopenFilesOnSignals(receiver, logger); };
+
+  unique_ptr<alohalytics::EpollHTTPServer> server;
+  try {
+    server.reset(new alohalytics::EpollHTTPServer(config, handlers));
+  } catch (const exception & ex) {
+    ALOG("ERROR:", ex.what());
+    return -1;
+  }
+  gServer = server.get();
+
+  // Correctly reopen data file on SIGHUP for logrotate.
+  if (SIG_ERR == ::signal(SIGHUP, [](int) { gReceivedSIGHUP = SIGHUP; })) {
+    ALOG("WARNING: Could not set SIGHUP handler. Logrotate will not work correctly.");
+  }
+  // Correctly reopen debug log file on SIGUSR1 for logrotate.
+  if (SIG_ERR == ::signal(SIGUSR1, [](int) { gReceivedSIGUSR1 = SIGUSR1; })) {
+    ALOG("WARNING: Could not set SIGUSR1 handler. Logrotate will not work correctly.");
+  }
+  for (auto signo : {SIGTERM, SIGINT}) {
+    if (SIG_ERR == ::signal(signo, StopServerOnSignal)) {
+      ALOG("WARNING: Could not set", signo, "signal handler");
+    }
+  }
+
+  ALOG("HTTP Server instance is ready to serve clients' requests on", config.address + ':' +
+       to_string(server->Port()), "with", config.workers, "worker(s) and", shards_count, "shard(s).");
+  server->Run();
+  gServer = nullptr;
+  for (size_t i = 0; i < static_cast<size_t>(alohalytics::IngestResult::Count); ++i) {
+    const auto ingest_result = static_cast<alohalytics::IngestResult>(i);
+    ALOG("Requests with", alohalytics::IngestResultToString(ingest_result), "result:",
+         receiver.IngestCounter(ingest_result));
+  }
+  const alohalytics::AdmissionCounters admission_counters = receiver.GetAdmissionCounters();
+  ALOG("Admitted/rejected requests by IP:", admission_counters.ip_admitted, admission_counters.ip_rejected,
+       "by client ID:", admission_counters.client_admitted, admission_counters.client_rejected,
+       "evicted buckets:", admission_counters.evictions);
+  if (dedup_window_seconds) {
+    const alohalytics::DuplicateCacheCounters dedup_counters = receiver.GetDuplicateCacheCounters();
+    ALOG("Duplicate bodies:", dedup_counters.hits, "of", dedup_counters.lookups, "hit rate:",
+         dedup_counters.HitRate(), "evicted hashes:", dedup_counters.evictions);
+  }
+  if (!quarantine.directory.empty()) {
+    ALOG("Rejected bodies saved into", quarantine.directory, "directory:", receiver.QuarantinedBodiesCount());
+  }
+  if (durable) {
+    const alohalytics::QueueMetrics metrics = receiver.Metrics();
+    ALOG("Flushes to the storage device:", metrics.syncs, "for", metrics.sync_requests, "requests.");
+  }
+  ALOG("Shutting down HTTP server instance.");
+  return 0;
+}
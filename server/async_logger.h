@@ -0,0 +1,309 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// ALOG backend for server binaries: logging threads only copy formatted lines into a lock-free ring, and
+// a background thread writes them into the log file (or stdout). Noisy call sites are rate-limited, and the
+// number of suppressed messages is logged once per second instead of them.
+
+#ifndef ASYNC_LOGGER_H
+#define ASYNC_LOGGER_H
+
+#include "src/logger.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace alohalytics {
+
+// Longer lines are truncated, so records have a fixed size and the ring never allocates.
+constexpr size_t kLogRecordSize = 1024;
+
+// Bounded multi-producer single-consumer queue of lines, each slot has a sequence number which tells
+// if it is free for the producer or ready for the consumer.
+class LogRing {
+ public:
+  // Capacity is rounded up to a power of two.
+  explicit LogRing(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_.reset(new Slot[size]);
+    mask_ = size - 1;
+    for (size_t i = 0; i < size; ++i) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Returns false if the ring is full. Never blocks.
+  bool Push(const char * data, size_t size) {
+    uint64_t position = head_.load(std::memory_order_relaxed);
+    Slot * slot;
+    while (true) {
+      slot = &slots_[position & mask_];
+      const int64_t diff = static_cast<int64_t>(slot->sequence.load(std::memory_order_acquire) - position);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        position = head_.load(std::memory_order_relaxed);
+      }
+    }
+    if (size > kLogRecordSize) {
+      static const char kTruncated[] = "...\n";
+      const size_t kept = kLogRecordSize - sizeof(kTruncated) + 1;
+      std::memcpy(slot->data, data, kept);
+      std::memcpy(slot->data + kept, kTruncated, sizeof(kTruncated) - 1);
+      size = kLogRecordSize;
+    } else {
+      std::memcpy(slot->data, data, size);
+    }
+    slot->size = size;
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Should be called by one consumer thread only. Returns false if the ring is empty.
+  template <typename TConsumer>
+  bool Pop(TConsumer && consumer) {
+    Slot & slot = slots_[tail_ & mask_];
+    if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+      return false;
+    }
+    consumer(slot.data, slot.size);
+    slot.sequence.store(tail_ + mask_ + 1, std::memory_order_release);
+    ++tail_;
+    return true;
+  }
+
+  // Number of pushed lines, for the Flush() of the logger.
+  uint64_t Pushed() const { return head_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    size_t size;
+    char data[kLogRecordSize];
+  };
+  std::unique_ptr<Slot[]> slots_;
+  uint64_t mask_;
+  std::atomic<uint64_t> head_{0};
+  // Only the consumer accesses it.
+  uint64_t tail_ = 0;
+};
+
+// Installs itself as the ALOG backend for its lifetime, and writes all lines before destruction. Should outlive
+// all logging threads.
+class AsyncLogger : public LogBackend {
+ public:
+  // Writes to stdout if path is nullptr. Zero lines_per_second disables rate limiting.
+  AsyncLogger(const char * path, uint64_t lines_per_second, size_t ring_capacity = 4096)
+      : path_(path), lines_per_second_(lines_per_second), ring_(ring_capacity) {
+    Open();
+    writer_ = std::thread(&AsyncLogger::WriterThread, this);
+    Installed().store(this, std::memory_order_release);
+  }
+  AsyncLogger(const AsyncLogger &) = delete;
+  AsyncLogger & operator=(const AsyncLogger &) = delete;
+
+  ~AsyncLogger() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    wakeup_.notify_one();
+    written_condition_.notify_all();
+    writer_.join();
+    Installed().store(nullptr, std::memory_order_release);
+    // Sites outlive the logger, so another one can limit them again.
+    for (LogSite * site = suppressed_sites_.load(); site; site = site->next) {
+      site->suppressed = 0;
+      site->listed = false;
+    }
+    if (file_ && file_ != stdout) {
+      std::fclose(file_);
+    }
+  }
+
+  // Per-site token window: up to lines_per_second_ messages in every second.
+  bool Allow(LogSite & site) override {
+    if (lines_per_second_ == 0) {
+      return true;
+    }
+    const uint64_t now = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count());
+    uint64_t second = site.second.load(std::memory_order_relaxed);
+    if (second != now && site.second.compare_exchange_strong(second, now)) {
+      site.count.store(0, std::memory_order_relaxed);
+    }
+    if (site.count.fetch_add(1, std::memory_order_relaxed) < lines_per_second_) {
+      return true;
+    }
+    site.suppressed.fetch_add(1, std::memory_order_relaxed);
+    // Sites are listed only once and never removed, so the list can be read without locks.
+    if (!site.listed.exchange(true)) {
+      site.next = suppressed_sites_.load(std::memory_order_relaxed);
+      while (!suppressed_sites_.compare_exchange_weak(site.next, &site, std::memory_order_release,
+                                                      std::memory_order_relaxed)) {
+      }
+    }
+    return false;
+  }
+
+  // Line is dropped (and counted) if the writer can't keep up, logging threads never wait for it.
+  void Write(const std::string & line) override {
+    if (!ring_.Push(line.data(), line.size())) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  // Can be called from a signal handler, the log file is reopened by the writer thread (e.g. for logrotate).
+  void ReopenLogFile() { reopen_.store(true, std::memory_order_relaxed); }
+
+  // Blocks until all lines pushed before this call are written, or until the logger is stopped.
+  void Flush() {
+    if (std::this_thread::get_id() == writer_.get_id()) {
+      WriteLines();
+      return;
+    }
+    const uint64_t pushed = ring_.Pushed();
+    std::unique_lock<std::mutex> lock(mutex_);
+    wakeup_.notify_one();
+    written_condition_.wait(lock,
+                            [this, pushed] { return stop_ || written_.load(std::memory_order_acquire) >= pushed; });
+  }
+
+  uint64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+ private:
+  void Open() {
+    if (!path_) {
+      file_ = stdout;
+      return;
+    }
+    std::FILE * file = std::fopen(path_, "a");
+    if (!file) {
+      // Previous file (if any) is still used.
+      const std::string error = "Alohalytics: ERROR: Could not open log file " + std::string(path_) + '\n';
+      std::fwrite(error.data(), 1, error.size(), file_ ? file_ : stderr);
+      return;
+    }
+    if (file_) {
+      std::fclose(file_);
+    }
+    file_ = file;
+  }
+
+  // Lines about suppressed and dropped messages go through the ring as usual.
+  void LogSuppressed() {
+    for (LogSite * site = suppressed_sites_.load(std::memory_order_acquire); site; site = site->next) {
+      const uint64_t suppressed = site->suppressed.exchange(0, std::memory_order_relaxed);
+      if (suppressed) {
+        ALOG("WARNING:", suppressed, "messages were suppressed at", std::string(site->file) + ':' +
+                                                                      std::to_string(site->line));
+      }
+    }
+    const uint64_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+      ALOG("WARNING:", dropped, "messages were dropped because the log writer could not keep up.");
+    }
+  }
+
+  void WriterThread() {
+    auto next_summary = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (true) {
+      if (reopen_.exchange(false, std::memory_order_relaxed)) {
+        Open();
+      }
+      if (WriteLines()) {
+        continue;
+      }
+      const auto now = std::chrono::steady_clock::now();
+      if (now >= next_summary) {
+        next_summary = now + std::chrono::seconds(1);
+        LogSuppressed();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stop_) {
+        break;
+      }
+      // Producers do not wake the writer up, so logging never takes a lock.
+      wakeup_.wait_for(lock, std::chrono::milliseconds(10));
+    }
+    // Suppressed messages of the last second, e.g. from the shutdown.
+    LogSuppressed();
+    WriteLines();
+  }
+
+  // Returns number of written lines.
+  uint64_t WriteLines() {
+    uint64_t lines = 0;
+    while (ring_.Pop([this](const char * data, size_t size) { std::fwrite(data, 1, size, file_); })) {
+      ++lines;
+    }
+    if (lines) {
+      std::fflush(file_);
+      {
+        // Flush() can't miss the notification between it's check and wait.
+        std::lock_guard<std::mutex> lock(mutex_);
+        written_.fetch_add(lines, std::memory_order_release);
+      }
+      written_condition_.notify_all();
+    }
+    return lines;
+  }
+
+  const char * const path_;
+  const uint64_t lines_per_second_;
+  LogRing ring_;
+  std::FILE * file_ = nullptr;
+  std::atomic<bool> reopen_{false};
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<LogSite *> suppressed_sites_{nullptr};
+  std::mutex mutex_;
+  std::condition_variable wakeup_;
+  // Notified when lines are written or the logger is stopped, for Flush().
+  std::condition_variable written_condition_;
+  // Guarded by mutex_.
+  bool stop_ = false;
+  std::thread writer_;
+};
+
+}  // namespace alohalytics
+
+#endif  // ASYNC_LOGGER_H
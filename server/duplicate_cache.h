@@ -0,0 +1,185 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Remembers hashes of recently received bodies, so bodies which clients resend after a lost reply
+// (e.g. on timeout when the data was already stored) are acknowledged without storing them again.
+
+#ifndef DUPLICATE_CACHE_H
+#define DUPLICATE_CACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace alohalytics {
+
+struct DuplicateCacheCounters {
+  uint64_t lookups = 0;
+  uint64_t hits = 0;
+  // Hashes which were forgotten before their window has passed, as the cache was full.
+  uint64_t evictions = 0;
+
+  double HitRate() const { return lookups ? static_cast<double>(hits) / lookups : 0.; }
+};
+
+// Fixed-size set-associative cache: every hash can be stored only in one set of kWays slots, so lookups and
+// inserts are O(1). When all slots of the set are used, the oldest one is replaced. Sets are guarded by
+// a fixed number of mutexes.
+class DuplicateCache {
+  static constexpr size_t kWays = 4;
+  static constexpr size_t kMutexes = 64;
+
+  struct Slot {
+    // Zero is an empty slot.
+    uint64_t hash = 0;
+    int64_t inserted_us = 0;
+  };
+
+  const int64_t window_us_;
+  size_t sets_mask_;
+  std::vector<Slot> slots_;
+  std::mutex mutexes_[kMutexes];
+  std::atomic<uint64_t> lookups_{0};
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> evictions_{0};
+
+  static int64_t NowInMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static uint64_t NonZero(uint64_t hash) { return hash ? hash : 1; }
+
+  size_t SetIndex(uint64_t hash) const { return hash & sets_mask_; }
+
+  // Should be called with locked set's mutex. Returns true if the hash was inserted during the window, otherwise
+  // sets victim to the slot for it: expired slot of the same hash, an empty slot or the oldest one.
+  bool FindLocked(size_t set, uint64_t hash, int64_t now_us, Slot *& victim) {
+    Slot * const first = &slots_[set * kWays];
+    victim = first;
+    for (Slot * slot = first; slot != first + kWays; ++slot) {
+      if (slot->hash == hash) {
+        if (now_us - slot->inserted_us < window_us_) {
+          return true;
+        }
+        victim = slot;
+        break;
+      }
+      if (victim->hash != 0 && (slot->hash == 0 || slot->inserted_us < victim->inserted_us)) {
+        victim = slot;
+      }
+    }
+    return false;
+  }
+
+  void ReplaceLocked(Slot * victim, uint64_t hash, int64_t now_us) {
+    if (victim->hash != 0 && victim->hash != hash && now_us - victim->inserted_us < window_us_) {
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+    victim->hash = hash;
+    victim->inserted_us = now_us;
+  }
+
+ public:
+  // Memory is allocated once for at least capacity hashes (16 bytes each).
+  DuplicateCache(size_t capacity, std::chrono::seconds window)
+      : window_us_(std::chrono::duration_cast<std::chrono::microseconds>(window).count()) {
+    size_t sets = 1;
+    while (sets * kWays < capacity) {
+      sets *= 2;
+    }
+    sets_mask_ = sets - 1;
+    slots_.resize(sets * kWays);
+  }
+
+  // Returns true if the same hash was inserted during the window. Otherwise inserts it and returns false.
+  bool CheckAndInsert(uint64_t hash) { return CheckAndInsert(hash, NowInMicroseconds()); }
+  // Returns true if the same hash was inserted during the window, without inserting it.
+  bool Contains(uint64_t hash) { return Contains(hash, NowInMicroseconds()); }
+  // Inserts the hash unless it was inserted during the window. Does not count a lookup.
+  void Insert(uint64_t hash) { Insert(hash, NowInMicroseconds()); }
+
+  // For unit tests, to control time.
+  bool CheckAndInsert(uint64_t hash, int64_t now_us) {
+    hash = NonZero(hash);
+    const size_t set = SetIndex(hash);
+    lookups_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutexes_[set % kMutexes]);
+    Slot * victim;
+    if (FindLocked(set, hash, now_us, victim)) {
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    ReplaceLocked(victim, hash, now_us);
+    return false;
+  }
+  bool Contains(uint64_t hash, int64_t now_us) {
+    hash = NonZero(hash);
+    const size_t set = SetIndex(hash);
+    lookups_.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutexes_[set % kMutexes]);
+    Slot * victim;
+    if (FindLocked(set, hash, now_us, victim)) {
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+  void Insert(uint64_t hash, int64_t now_us) {
+    hash = NonZero(hash);
+    const size_t set = SetIndex(hash);
+    std::lock_guard<std::mutex> lock(mutexes_[set % kMutexes]);
+    Slot * victim;
+    if (!FindLocked(set, hash, now_us, victim)) {
+      ReplaceLocked(victim, hash, now_us);
+    }
+  }
+
+  // Forgets the hash, e.g. if the body could not be stored after CheckAndInsert.
+  void Erase(uint64_t hash) {
+    hash = NonZero(hash);
+    const size_t set = SetIndex(hash);
+    std::lock_guard<std::mutex> lock(mutexes_[set % kMutexes]);
+    Slot * const first = &slots_[set * kWays];
+    for (Slot * slot = first; slot != first + kWays; ++slot) {
+      if (slot->hash == hash) {
+        *slot = Slot();
+      }
+    }
+  }
+
+  DuplicateCacheCounters Counters() const {
+    DuplicateCacheCounters counters;
+    counters.lookups = lookups_.load(std::memory_order_relaxed);
+    counters.hits = hits_.load(std::memory_order_relaxed);
+    counters.evictions = evictions_.load(std::memory_order_relaxed);
+    return counters;
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // DUPLICATE_CACHE_H
@@ -0,0 +1,475 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#ifndef EPOLL_HTTP_SERVER_H
+#define EPOLL_HTTP_SERVER_H
+
+// Linux-only event-driven HTTP/1.1 server: every worker thread has its own SO_REUSEPORT listening socket
+// and its own epoll loop, so the kernel balances connections between workers and no locks are needed.
+// Keep-alive and pipelined requests are supported. Handlers are called synchronously on the worker's thread.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/logger.h"
+
+#include "server/http_request_parser.h"
+
+namespace alohalytics {
+
+constexpr int kHTTPServerMaxEvents = 256;
+constexpr size_t kHTTPServerReadBufferSize = 64 * 1024;
+// How long to wait for the client to close the connection after an error response.
+constexpr int kHTTPServerLingerTimeoutSeconds = 5;
+
+struct HTTPServerConfig {
+  // Numeric IPv4 or IPv6 address to listen on.
+  std::string address = "0.0.0.0";
+  // 0 means any free port, see EpollHTTPServer::Port().
+  uint16_t port = 8080;
+  size_t workers = 1;
+  size_t max_head_bytes = HTTPRequestParser::kDefaultMaxHeadBytes;
+  uint64_t max_body_bytes = 16 * 1024 * 1024;
+  // Idle connections are closed after this timeout.
+  int keep_alive_timeout_seconds = 60;
+  size_t max_connections_per_worker = 10000;
+};
+
+struct HTTPHandlers {
+  // Is called when request head is received. Returns false if the response is ready, the body is not read
+  // and the connection is closed then. Can be empty.
+  std::function<bool(const HTTPRequest &, HTTPResponse &)> on_head;
+  // Is called for every complete request.
+  std::function<void(HTTPRequest &, HTTPResponse &)> on_request;
+  // Is called by every worker at least once per second, e.g. to check signal flags. Can be empty.
+  std::function<void()> on_tick;
+};
+
+class EpollHTTPServer {
+ public:
+  // Throws std::runtime_error if listening sockets can't be created.
+  EpollHTTPServer(const HTTPServerConfig & config, const HTTPHandlers & handlers)
+      : config_(config), handlers_(handlers) {
+    if (config_.workers == 0) {
+      throw std::runtime_error("At least one worker is needed.");
+    }
+    stop_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stop_fd_ < 0) {
+      throw std::runtime_error(std::string("eventfd has failed: ") + std::strerror(errno));
+    }
+    port_ = config_.port;
+    for (size_t i = 0; i < config_.workers; ++i) {
+      const int fd = Listen();
+      if (fd < 0) {
+        Close();
+        throw std::runtime_error("Can't listen on " + config_.address + ':' + std::to_string(port_) + ": " +
+                                 std::strerror(errno));
+      }
+      listen_fds_.push_back(fd);
+    }
+  }
+
+  EpollHTTPServer(const EpollHTTPServer &) = delete;
+  EpollHTTPServer & operator=(const EpollHTTPServer &) = delete;
+
+  ~EpollHTTPServer() { Close(); }
+
+  // Actual listening port.
+  uint16_t Port() const { return port_; }
+
+  // Serves requests until Stop() is called. The first worker runs on the calling thread.
+  void Run() {
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < listen_fds_.size(); ++i) {
+      threads.emplace_back(&EpollHTTPServer::Worker, this, listen_fds_[i]);
+    }
+    Worker(listen_fds_.front());
+    for (std::thread & t : threads) {
+      t.join();
+    }
+  }
+
+  // Async-signal-safe, can be called from a signal handler.
+  void Stop() {
+    stop_.store(true);
+    const uint64_t one = 1;
+    // Stop fd is never read, so all workers wake up.
+    const ssize_t written = ::write(stop_fd_, &one, sizeof(one));
+    static_cast<void>(written);
+  }
+
+ private:
+  using TClock = std::chrono::steady_clock;
+
+  struct Connection {
+    int fd;
+    std::string remote_addr;
+    HTTPRequestParser parser;
+    std::string in;
+    std::string out;
+    size_t out_offset = 0;
+    bool head_checked = false;
+    bool close_after_write = false;
+    // Response has been sent, write side is shut down and input is discarded until the client closes.
+    bool lingering = false;
+    bool waiting_for_write = false;
+    TClock::time_point last_activity;
+
+    Connection(int fd, std::string && remote_addr, const HTTPServerConfig & config)
+        : fd(fd), remote_addr(std::move(remote_addr)), parser(config.max_body_bytes, config.max_head_bytes),
+          last_activity(TClock::now()) {}
+  };
+  using TConnections = std::unordered_map<int, std::unique_ptr<Connection>>;
+
+  // Returns listening socket or -1 on error.
+  int Listen() {
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    addrinfo * info = nullptr;
+    if (0 != ::getaddrinfo(config_.address.c_str(), std::to_string(port_).c_str(), &hints, &info)) {
+      errno = EINVAL;
+      return -1;
+    }
+    std::unique_ptr<addrinfo, void (*)(addrinfo *)> info_deleter(info, &::freeaddrinfo);
+    const int fd = ::socket(info->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    const int on = 1;
+    if (0 != ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+        0 != ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) ||
+        0 != ::bind(fd, info->ai_addr, info->ai_addrlen) || 0 != ::listen(fd, SOMAXCONN)) {
+      const int error = errno;
+      ::close(fd);
+      errno = error;
+      return -1;
+    }
+    if (port_ == 0) {
+      // Other workers should listen on the same port.
+      sockaddr_storage address;
+      socklen_t length = sizeof(address);
+      if (0 != ::getsockname(fd, reinterpret_cast<sockaddr *>(&address), &length)) {
+        const int error = errno;
+        ::close(fd);
+        errno = error;
+        return -1;
+      }
+      port_ = ntohs(address.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6 *>(&address)->sin6_port
+                                                  : reinterpret_cast<sockaddr_in *>(&address)->sin_port);
+    }
+    return fd;
+  }
+
+  void Close() {
+    for (int fd : listen_fds_) {
+      ::close(fd);
+    }
+    listen_fds_.clear();
+    if (stop_fd_ >= 0) {
+      ::close(stop_fd_);
+      stop_fd_ = -1;
+    }
+  }
+
+  static std::string AddressToString(const sockaddr_storage & address) {
+    char buffer[INET6_ADDRSTRLEN] = "";
+    if (address.ss_family == AF_INET6) {
+      ::inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6 *>(&address)->sin6_addr, buffer, sizeof(buffer));
+    } else if (address.ss_family == AF_INET) {
+      ::inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in *>(&address)->sin_addr, buffer, sizeof(buffer));
+    }
+    return buffer;
+  }
+
+  static bool Watch(int epoll_fd, int op, int fd, uint32_t events) {
+    epoll_event event;
+    std::memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    return 0 == ::epoll_ctl(epoll_fd, op, fd, &event);
+  }
+
+  void Worker(int listen_fd) {
+    const int epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0 || !Watch(epoll_fd, EPOLL_CTL_ADD, listen_fd, EPOLLIN) ||
+        !Watch(epoll_fd, EPOLL_CTL_ADD, stop_fd_, EPOLLIN)) {
+      ALOG("ERROR: Can't initialize epoll:", std::strerror(errno));
+      if (epoll_fd >= 0) {
+        ::close(epoll_fd);
+      }
+      Stop();
+      return;
+    }
+    TConnections connections;
+    std::vector<char> read_buffer(kHTTPServerReadBufferSize);
+    epoll_event events[kHTTPServerMaxEvents];
+    TClock::time_point last_tick = TClock::now();
+    while (!stop_.load()) {
+      const int count = ::epoll_wait(epoll_fd, events, kHTTPServerMaxEvents, 1000);
+      if (count < 0 && errno != EINTR) {
+        ALOG("ERROR: epoll_wait has failed:", std::strerror(errno));
+        break;
+      }
+      for (int i = 0; i < count; ++i) {
+        const int fd = events[i].data.fd;
+        if (fd == stop_fd_) {
+          continue;
+        }
+        if (fd == listen_fd) {
+          Accept(epoll_fd, listen_fd, connections);
+          continue;
+        }
+        const auto found = connections.find(fd);
+        if (found == connections.end()) {
+          continue;
+        }
+        Connection & connection = *found->second;
+        bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP));
+        if (alive && (events[i].events & EPOLLOUT)) {
+          alive = Write(epoll_fd, connection);
+        }
+        if (alive && (events[i].events & EPOLLIN)) {
+          alive = Read(epoll_fd, connection, read_buffer);
+        }
+        if (!alive) {
+          ::close(fd);
+          connections.erase(found);
+        }
+      }
+      const TClock::time_point now = TClock::now();
+      if (now - last_tick >= std::chrono::seconds(1) || count <= 0) {
+        last_tick = now;
+        CloseIdleConnections(now, connections);
+        if (handlers_.on_tick) {
+          handlers_.on_tick();
+        }
+      }
+    }
+    for (const auto & connection : connections) {
+      ::close(connection.first);
+    }
+    ::close(epoll_fd);
+  }
+
+  void Accept(int epoll_fd, int listen_fd, TConnections & connections) {
+    while (true) {
+      sockaddr_storage address;
+      socklen_t length = sizeof(address);
+      const int fd = ::accept4(listen_fd, reinterpret_cast<sockaddr *>(&address), &length,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          ALOG("WARNING: accept has failed:", std::strerror(errno));
+        }
+        return;
+      }
+      if (connections.size() >= config_.max_connections_per_worker) {
+        ::close(fd);
+        continue;
+      }
+      const int on = 1;
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      if (!Watch(epoll_fd, EPOLL_CTL_ADD, fd, EPOLLIN)) {
+        ::close(fd);
+        continue;
+      }
+      connections[fd].reset(new Connection(fd, AddressToString(address), config_));
+    }
+  }
+
+  void CloseIdleConnections(TClock::time_point now, TConnections & connections) {
+    for (auto it = connections.begin(); it != connections.end();) {
+      const Connection & connection = *it->second;
+      const auto timeout = std::chrono::seconds(connection.lingering ? kHTTPServerLingerTimeoutSeconds
+                                                                     : config_.keep_alive_timeout_seconds);
+      if (now - connection.last_activity > timeout) {
+        ::close(it->first);
+        it = connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Returns false if connection should be closed.
+  bool Read(int epoll_fd, Connection & connection, std::vector<char> & buffer) {
+    // Reading is paused while the response is being sent.
+    while (!connection.waiting_for_write) {
+      const ssize_t size = ::read(connection.fd, buffer.data(), buffer.size());
+      if (size < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      if (size == 0) {
+        return false;
+      }
+      connection.last_activity = TClock::now();
+      if (connection.lingering) {
+        continue;
+      }
+      connection.in.append(buffer.data(), static_cast<size_t>(size));
+      if (!Process(epoll_fd, connection)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Handles all complete requests from the input buffer. Returns false if connection should be closed.
+  bool Process(int epoll_fd, Connection & connection) {
+    while (!connection.close_after_write) {
+      HTTPRequestParser & parser = connection.parser;
+      const HTTPRequestParser::State state = parser.Parse(connection.in);
+      if (state == HTTPRequestParser::State::Head) {
+        break;
+      }
+      HTTPResponse response;
+      if (state == HTTPRequestParser::State::Error) {
+        response.status = parser.ErrorStatus();
+        response.body = HTTPStatusText(response.status);
+        Respond(connection, response, false);
+        break;
+      }
+      HTTPRequest & request = parser.Request();
+      try {
+        if (!connection.head_checked) {
+          connection.head_checked = true;
+          request.remote_addr = connection.remote_addr;
+          if (handlers_.on_head && !handlers_.on_head(request, response)) {
+            Respond(connection, response, request.keep_alive && parser.RemainingBodyBytes() == 0);
+            parser.Reset();
+            connection.head_checked = false;
+            continue;
+          }
+          if (state == HTTPRequestParser::State::Body && request.expect_continue && request.minor_version == 1) {
+            connection.out += "HTTP/1.1 100 Continue\r\n\r\n";
+          }
+        }
+        if (state == HTTPRequestParser::State::Body) {
+          break;
+        }
+        handlers_.on_request(request, response);
+      } catch (const std::exception & ex) {
+        ALOG("WARNING: Exception was thrown:", ex.what(), connection.remote_addr, request.uri);
+        response = HTTPResponse();
+        response.status = 500;
+        response.body = HTTPStatusText(response.status);
+        Respond(connection, response, false);
+        break;
+      }
+      Respond(connection, response, request.keep_alive);
+      parser.Reset();
+      connection.head_checked = false;
+    }
+    return connection.out.empty() || Write(epoll_fd, connection);
+  }
+
+  static void Respond(Connection & connection, const HTTPResponse & response, bool keep_alive) {
+    connection.out += FormatHTTPResponse(response, keep_alive);
+    connection.close_after_write = !keep_alive;
+  }
+
+  // Returns false if connection should be closed.
+  bool Write(int epoll_fd, Connection & connection) {
+    while (connection.out_offset < connection.out.size()) {
+      const ssize_t size = ::send(connection.fd, connection.out.data() + connection.out_offset,
+                                  connection.out.size() - connection.out_offset, MSG_NOSIGNAL);
+      if (size < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          return false;
+        }
+        if (!connection.waiting_for_write) {
+          connection.waiting_for_write = true;
+          return Watch(epoll_fd, EPOLL_CTL_MOD, connection.fd, EPOLLOUT);
+        }
+        return true;
+      }
+      connection.out_offset += static_cast<size_t>(size);
+      connection.last_activity = TClock::now();
+    }
+    connection.out.clear();
+    connection.out_offset = 0;
+    if (connection.waiting_for_write) {
+      connection.waiting_for_write = false;
+      if (!Watch(epoll_fd, EPOLL_CTL_MOD, connection.fd, EPOLLIN)) {
+        return false;
+      }
+    }
+    if (connection.close_after_write) {
+      if (connection.lingering) {
+        return true;
+      }
+      // Unread request data would reset the connection together with the response,
+      // so the rest of the input is discarded until the client closes the connection.
+      connection.lingering = true;
+      connection.in.clear();
+      return 0 == ::shutdown(connection.fd, SHUT_WR);
+    }
+    // Pipelined requests which were received while the response was being sent.
+    return connection.in.empty() || Process(epoll_fd, connection);
+  }
+
+  const HTTPServerConfig config_;
+  const HTTPHandlers handlers_;
+  uint16_t port_;
+  std::vector<int> listen_fds_;
+  int stop_fd_ = -1;
+  std::atomic<bool> stop_{false};
+};
+
+}  // namespace alohalytics
+
+#endif  // EPOLL_HTTP_SERVER_H
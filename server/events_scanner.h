@@ -0,0 +1,401 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#ifndef EVENTS_SCANNER_H
+#define EVENTS_SCANNER_H
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+
+#include "src/location.h"
+
+namespace alohalytics {
+
+// Validating byte-level walker over cereal-serialized events, as they are sent by clients.
+// Accepts exactly the same input as cereal's polymorphic unique_ptr<AlohalyticsBaseEvent> loading
+// with the single archive per body, but never throws and never allocates.
+class EventsScanner {
+ public:
+  enum class Error : uint8_t {
+    None,
+    // Body ends in the middle of an event.
+    Truncated,
+    // Null pointer or zero "valid" flag, cereal loads nullptr in this case.
+    NullEvent,
+    // Reference to a type id which was not registered before in the body.
+    UnknownTypeId,
+    // Type name which is not registered in event_base.h.
+    UnknownTypeName,
+    // Location can't be decoded (see Location::Decode).
+    InvalidLocation,
+    // Body references more different type ids than the scanner can remember.
+    TooManyTypeIds
+  };
+
+  static const char * ErrorToString(Error error) {
+    switch (error) {
+      case Error::None: return "None";
+      case Error::Truncated: return "Truncated";
+      case Error::NullEvent: return "NullEvent";
+      case Error::UnknownTypeId: return "UnknownTypeId";
+      case Error::UnknownTypeName: return "UnknownTypeName";
+      case Error::InvalidLocation: return "InvalidLocation";
+      case Error::TooManyTypeIds: return "TooManyTypeIds";
+    }
+    return "Unknown";
+  }
+
+  // Types registered in event_base.h.
+  enum class Type : uint8_t {
+    Base,
+    Id,
+    IdServer,
+    Key,
+    KeyValue,
+    KeyPairs,
+    KeyLocation,
+    KeyValueLocation,
+    KeyPairsLocation
+  };
+
+  static const char * TypeName(Type type) {
+    static const char * const kNames[] = {"b", "i", "is", "k", "v", "p", "kl", "vl", "pl"};
+    return kNames[static_cast<size_t>(type)];
+  }
+
+  struct StringRef {
+    const char * data = nullptr;
+    size_t size = 0;
+
+    std::string ToString() const { return std::string(data, size); }
+  };
+
+  // All offsets are relative to the scanned buffer.
+  struct Event {
+    Type type;
+    uint64_t timestamp;
+    // Polymorphic id of the event.
+    size_t begin;
+    // Serialized AlohalyticsBaseEvent::timestamp.
+    size_t data_begin;
+    // Serialized pairs size (if any).
+    size_t pairs_begin;
+    // End of all fields except location. [data_begin, fields_end) is written by cereal in the same way.
+    size_t fields_end;
+    size_t end;
+    // For Id and IdServer events.
+    StringRef id;
+    // For *Location events, encoded location without the size.
+    StringRef location;
+    // True if pairs are sorted and unique, like in std::map. Otherwise cereal keeps the first
+    // value for every key and sorts them.
+    bool pairs_are_canonical;
+  };
+
+  EventsScanner(const char * data, size_t size) : data_(data), size_(size) {}
+
+  // Returns false at the end of the buffer or on error.
+  bool Next(Event & event) {
+    if (error_ != Error::None || offset_ == size_) {
+      return false;
+    }
+    event.begin = event_begin_ = offset_;
+    event.id = StringRef();
+    event.location = StringRef();
+    uint32_t name_id;
+    if (!Read(name_id)) {
+      return Fail(Error::Truncated);
+    }
+    if (name_id == 0) {
+      return Fail(Error::NullEvent);
+    }
+    if (name_id & kMsb2) {
+      // Cereal's shortcut for non-derived AlohalyticsBaseEvent.
+      event.type = Type::Base;
+    } else if (name_id & kMsb) {
+      StringRef name;
+      if (!Read(name)) {
+        return Fail(Error::Truncated);
+      }
+      if (!TypeFromName(name, event.type)) {
+        return Fail(Error::UnknownTypeName);
+      }
+      if (!RegisterTypeId(name_id & ~kMsb, event.type)) {
+        return Fail(Error::TooManyTypeIds);
+      }
+    } else if (!FindTypeId(name_id, event.type)) {
+      return Fail(Error::UnknownTypeId);
+    }
+    uint8_t valid;
+    if (!Read(valid)) {
+      return Fail(Error::Truncated);
+    }
+    if (!valid) {
+      return Fail(Error::NullEvent);
+    }
+    event.data_begin = offset_;
+    if (!Read(event.timestamp)) {
+      return Fail(Error::Truncated);
+    }
+    event.pairs_are_canonical = true;
+    StringRef unused;
+    switch (event.type) {
+      case Type::Base: break;
+      case Type::Id:
+        if (!Read(event.id)) {
+          return Fail(Error::Truncated);
+        }
+        break;
+      case Type::IdServer: {
+        uint64_t server_timestamp;
+        if (!Read(event.id) || !Read(server_timestamp) || !Read(unused) || !Read(unused) || !Read(unused)) {
+          return Fail(Error::Truncated);
+        }
+      } break;
+      case Type::Key:
+      case Type::KeyLocation:
+        if (!Read(unused)) {
+          return Fail(Error::Truncated);
+        }
+        break;
+      case Type::KeyValue:
+      case Type::KeyValueLocation:
+        if (!Read(unused) || !Read(unused)) {
+          return Fail(Error::Truncated);
+        }
+        break;
+      case Type::KeyPairs:
+      case Type::KeyPairsLocation:
+        if (!Read(unused)) {
+          return Fail(Error::Truncated);
+        }
+        event.pairs_begin = offset_;
+        if (!ReadPairs(event.pairs_are_canonical)) {
+          return Fail(Error::Truncated);
+        }
+        break;
+    }
+    event.fields_end = offset_;
+    if (event.type == Type::KeyLocation || event.type == Type::KeyValueLocation ||
+        event.type == Type::KeyPairsLocation) {
+      if (!Read(event.location)) {
+        return Fail(Error::Truncated);
+      }
+      if (event.location.size == 0 ||
+          event.location.size < Location::EncodedSize(static_cast<uint8_t>(event.location.data[0]))) {
+        return Fail(Error::InvalidLocation);
+      }
+    }
+    event.end = offset_;
+    return true;
+  }
+
+  // Continues scanning of the same body with the next portion of data, e.g. when it is inflated by chunks.
+  // Registered type ids are kept, error and offsets are reset.
+  void Continue(const char * data, size_t size) {
+    Reset(data, size);
+    pairs_cursor_.valid = false;
+  }
+
+  // Like Continue(), but data starts with the Truncated event, e.g. it's bytes with the next inflated chunk
+  // appended. Pairs which were already checked are not scanned again, so a large event costs O(size)
+  // however many chunks it spans.
+  void ContinueTruncated(const char * data, size_t size) { Reset(data, size); }
+
+  const char * Data() const { return data_; }
+  size_t Size() const { return size_; }
+  Error GetError() const { return error_; }
+  // Offset where the error was detected.
+  size_t ErrorOffset() const { return error_offset_; }
+  // Offset of the next event.
+  size_t Offset() const { return offset_; }
+  // Offset of the last event started by Next(). It is incomplete if error is Truncated.
+  size_t EventBegin() const { return event_begin_; }
+
+  // Calls function(key, value) for every serialized pair. Pairs should be already validated by Next().
+  template <typename TFunction>
+  static void ForEachPair(const char * data, size_t pairs_begin, TFunction && function) {
+    EventsScanner scanner(data + pairs_begin, std::numeric_limits<size_t>::max());
+    uint64_t count;
+    scanner.Read(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      StringRef key, value;
+      scanner.Read(key);
+      scanner.Read(value);
+      function(key, value);
+    }
+  }
+
+ private:
+  static constexpr uint32_t kMsb = 0x80000000;
+  static constexpr uint32_t kMsb2 = 0x40000000;
+  // Clients use up to 9 types.
+  static constexpr size_t kMaxTypeIds = 32;
+
+  template <typename T>
+  bool Read(T & value) {
+    if (size_ - offset_ < sizeof(T)) {
+      return false;
+    }
+    std::memcpy(&value, data_ + offset_, sizeof(T));
+    offset_ += sizeof(T);
+    return true;
+  }
+
+  bool Read(StringRef & str) {
+    uint64_t size;
+    if (!Read(size) || size_ - offset_ < size) {
+      return false;
+    }
+    str.data = data_ + offset_;
+    str.size = static_cast<size_t>(size);
+    offset_ += str.size;
+    return true;
+  }
+
+  bool ReadPairs(bool & canonical) {
+    // Offsets of the cursor are relative to the event's beginning, it moves to the buffer's beginning.
+    const size_t pairs_begin = offset_ - event_begin_;
+    uint64_t count;
+    if (!Read(count)) {
+      return false;
+    }
+    StringRef previous_key, key, value;
+    uint64_t i = 0;
+    if (pairs_cursor_.valid && pairs_cursor_.pairs_begin == pairs_begin) {
+      i = pairs_cursor_.index;
+      offset_ = event_begin_ + pairs_cursor_.offset;
+      canonical = pairs_cursor_.canonical;
+      previous_key.data = data_ + event_begin_ + pairs_cursor_.previous_key_offset;
+      previous_key.size = pairs_cursor_.previous_key_size;
+    }
+    pairs_cursor_.valid = false;
+    for (; i < count; ++i) {
+      const size_t pair_begin = offset_;
+      if (!Read(key) || !Read(value)) {
+        pairs_cursor_.valid = true;
+        pairs_cursor_.pairs_begin = pairs_begin;
+        pairs_cursor_.index = i;
+        pairs_cursor_.offset = pair_begin - event_begin_;
+        pairs_cursor_.canonical = canonical;
+        pairs_cursor_.previous_key_offset = i > 0 ? static_cast<size_t>(previous_key.data - data_) - event_begin_ : 0;
+        pairs_cursor_.previous_key_size = previous_key.size;
+        return false;
+      }
+      if (i > 0 && canonical && Compare(previous_key, key) >= 0) {
+        canonical = false;
+      }
+      previous_key = key;
+    }
+    return true;
+  }
+
+  // The same order as std::string::compare.
+  static int Compare(const StringRef & lhs, const StringRef & rhs) {
+    const int result = std::memcmp(lhs.data, rhs.data, lhs.size < rhs.size ? lhs.size : rhs.size);
+    if (result != 0) {
+      return result;
+    }
+    return lhs.size < rhs.size ? -1 : (lhs.size > rhs.size ? 1 : 0);
+  }
+
+  static bool TypeFromName(const StringRef & name, Type & type) {
+    for (size_t i = 0; i <= static_cast<size_t>(Type::KeyPairsLocation); ++i) {
+      const char * type_name = TypeName(static_cast<Type>(i));
+      if (name.size == std::strlen(type_name) && 0 == std::memcmp(name.data, type_name, name.size)) {
+        type = static_cast<Type>(i);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Like cereal, keeps the first registration of every id.
+  bool RegisterTypeId(uint32_t id, Type type) {
+    Type unused;
+    if (FindTypeId(id, unused)) {
+      return true;
+    }
+    if (type_ids_count_ == kMaxTypeIds) {
+      return false;
+    }
+    type_ids_[type_ids_count_] = id;
+    types_[type_ids_count_] = type;
+    ++type_ids_count_;
+    return true;
+  }
+
+  bool FindTypeId(uint32_t id, Type & type) const {
+    for (size_t i = 0; i < type_ids_count_; ++i) {
+      if (type_ids_[i] == id) {
+        type = types_[i];
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void Reset(const char * data, size_t size) {
+    data_ = data;
+    size_ = size;
+    offset_ = event_begin_ = error_offset_ = 0;
+    error_ = Error::None;
+  }
+
+  bool Fail(Error error) {
+    error_ = error;
+    error_offset_ = offset_;
+    return false;
+  }
+
+  const char * data_;
+  size_t size_;
+  size_t offset_ = 0;
+  size_t event_begin_ = 0;
+  Error error_ = Error::None;
+  size_t error_offset_ = 0;
+  // Where ReadPairs() of the Truncated event has stopped.
+  struct PairsCursor {
+    bool valid = false;
+    size_t pairs_begin;
+    uint64_t index;
+    // Of the first unchecked pair.
+    size_t offset;
+    bool canonical;
+    size_t previous_key_offset;
+    size_t previous_key_size;
+  } pairs_cursor_;
+  uint32_t type_ids_[kMaxTypeIds];
+  Type types_[kMaxTypeIds];
+  size_t type_ids_count_ = 0;
+};
+
+// Number of EventsScanner::Type values.
+constexpr size_t kEventTypesCount = static_cast<size_t>(EventsScanner::Type::KeyPairsLocation) + 1;
+
+}  // namespace alohalytics
+
+#endif  // EVENTS_SCANNER_H
@@ -34,28 +34,49 @@
 // $http_content_encoding should be set to gzip (except of monitoring uri)
 
 // Monitoring URI is a simple is-server-alive check. POST any content-type there and get it back without any modifications.
+// With --metrics-uri, requests to it get requests, stage timings, queue and rejection counters in the Prometheus
+// text format (see server/ingest_metrics.h). Such location should allow GET requests in nginx.conf.
 
 // This binary shoud be spawn as a FastCGI app, for example:
-// $ spawn-fcgi [-n] -a 127.0.0.1 -p <port number> -P /path/to/pid.file -- ./fcgi_server /dir/to/store/received/data /monitoring/uri [/optional/path/to/log.file]
+// $ spawn-fcgi [-n] -a 127.0.0.1 -p <port number> -P /path/to/pid.file -- ./fcgi_server [--threads N] /dir/to/store/received/data /monitoring/uri [/optional/path/to/log.file]
 // pid.file can be used by logrotate (see logrotate.conf).
+// With --threads N, N accept loops with their own FCGX_Requests share the same listening socket and
+// the same data file, so one instance can use several cores instead of spawning many instances.
+// With --shards N, data is written into N files by N writers (see StatisticsReceiver), so the single
+// writer does not limit many accept loops.
+// With --durable, replies are sent only after received data is flushed to the storage device, so a crash can't
+// lose acknowledged data. Concurrent requests share flushes, so more threads give more requests per flush.
+// With backpressure limits (--soft-pending-bytes etc.), overloaded server asks clients to retry later and to sample
+// their events, in an additional line of the reply body (see src/upload_hint.h), or rejects requests with 503 status.
+// With --admission-config, requests over the per-IP or per-client rate limit get 429 status before being inflated.
+// With --dedup-window-seconds, bodies which clients resend after a lost reply are acknowledged but not stored again.
+// Warnings about rejected bodies are rate-limited (--rejected-logs-per-second), and with --quarantine-dir a sample of
+// them is saved for investigation.
+// Log lines are written by a background thread (see server/async_logger.h), and every log call site is limited to
+// --log-lines-per-second lines.
 // clang-format on
 
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstdlib>
 #include <ctime>
 #include <exception>
-#include <fstream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
+
+#include <sys/socket.h>
 
 #include <fcgiapp.h>
 #include <fcgio.h>
 
 #include "src/logger.h"
 
+#include "server/async_logger.h"
 #include "server/statistics_receiver.h"
 
 using namespace std;
@@ -64,63 +85,383 @@ using namespace std;
 static const string kBodyTextForGoodServerReply = "Mahalo";
 static const string kBodyTextForBadServerReply = "Hohono";
 
+// Replies are recorded here if metrics are enabled (see --metrics-uri).
+alohalytics::IngestMetrics * gIngestMetrics = nullptr;
+
 // We always reply to our clients that we have received everything they sent, even if it was a complete junk.
 // The difference is only in the body of the reply.
 // Custom content type is used for monitoring.
 void Reply200OKWithBody(FCGX_Stream * out, const string & body, const char * content_type = "text/plain") {
+  if (gIngestMetrics) {
+    gIngestMetrics->RecordReply(200, body.size());
+  }
   FCGX_FPrintF(out, "Status: 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n%s\n", content_type,
                body.size(), body.c_str());
 }
 
+// Old clients check only the status code, new ones follow the hint in the second line (see src/upload_hint.h).
+string BodyWithHint(const string & body, const alohalytics::UploadHint & hint) {
+  return hint.Empty() ? body : body + '\n' + hint.ToString();
+}
+
+// Error reply with the hint, and with Retry-After header if the hint has a delay.
+void ReplyRetryLater(FCGX_Stream * out, const char * status, const alohalytics::UploadHint & hint) {
+  const string body = BodyWithHint(kBodyTextForBadServerReply, hint);
+  const string retry_after =
+      hint.retry_after_seconds ? "Retry-After: " + to_string(hint.retry_after_seconds) + "\r\n" : string();
+  if (gIngestMetrics) {
+    gIngestMetrics->RecordReply(atoi(status), body.size());
+  }
+  FCGX_FPrintF(out, "Status: %s\r\n%sContent-Type: text/plain\r\nContent-Length: %ld\r\n\r\n%s", status,
+               retry_after.c_str(), body.size(), body.c_str());
+}
+
+void ReplyServiceUnavailable(FCGX_Stream * out, const alohalytics::UploadHint & hint = alohalytics::UploadHint()) {
+  ReplyRetryLater(out, "503 Service Unavailable", hint);
+}
+
+void ReplyTooManyRequests(FCGX_Stream * out, uint32_t retry_after_seconds) {
+  alohalytics::UploadHint hint;
+  hint.retry_after_seconds = retry_after_seconds;
+  ReplyRetryLater(out, "429 Too Many Requests", hint);
+}
+
+// Returns backpressure limit for the command line flag, or nullptr if it is not a backpressure flag.
+uint64_t * BackpressureFlag(const string & flag, alohalytics::BackpressureLimits & limits) {
+  if (flag == "--soft-pending-bytes") {
+    return &limits.soft_pending_bytes;
+  } else if (flag == "--hard-pending-bytes") {
+    return &limits.hard_pending_bytes;
+  } else if (flag == "--soft-latency-us") {
+    return &limits.soft_store_latency_us;
+  } else if (flag == "--hard-latency-us") {
+    return &limits.hard_store_latency_us;
+  } else if (flag == "--retry-after") {
+    return &limits.min_retry_after_seconds;
+  } else if (flag == "--max-retry-after") {
+    return &limits.max_retry_after_seconds;
+  } else if (flag == "--min-sampling-percent") {
+    return &limits.min_sampling_percent;
+  }
+  return nullptr;
+}
+
+// FastCGI listening socket, as passed by spawn-fcgi.
+static const int kListenSocket = 0;
+static const unsigned long kMaxThreads = 1024;
+
 // Global variables to correctly reopen data and log files after signals from logrotate utility.
 volatile sig_atomic_t gReceivedSIGHUP = 0;
 volatile sig_atomic_t gReceivedSIGUSR1 = 0;
-// Redirects all cout output into a file if good log_file_path was given in constructor.
-// Can always ReopenLogFile() if needed (e.g. for log rotation).
-struct CoutToFileRedirector {
-  char const * path;
-  unique_ptr<ofstream> log_file;
-  streambuf * original_cout_buf;
-
-  CoutToFileRedirector(const char * log_file_path) : path(log_file_path), original_cout_buf(cout.rdbuf()) {
-    ReopenLogFile();
-  }
-  void ReopenLogFile() {
-    if (!path) {
-      return;
-    }
-    log_file.reset(nullptr);
-    log_file.reset(new ofstream(path, ofstream::out | ofstream::app));
-    if (log_file->good()) {
-      cout.rdbuf(log_file->rdbuf());
-    } else {
-      ALOG("ERROR: Could not open log file", path, "for writing.");
+// Any accept loop can notice the signal, the mutex guarantees that every file is reopened only once.
+void ReopenFilesOnSignals(alohalytics::StatisticsReceiver & receiver, alohalytics::AsyncLogger & logger) {
+  if (gReceivedSIGHUP != SIGHUP && gReceivedSIGUSR1 != SIGUSR1) {
+    return;
+  }
+  static mutex signals_mutex;
+  lock_guard<mutex> lock(signals_mutex);
+  // Correctly reopen data file in the queue.
+  if (gReceivedSIGHUP == SIGHUP) {
+    receiver.ReopenDataFile();
+    gReceivedSIGHUP = 0;
+  }
+  // Correctly reopen debug log file.
+  if (gReceivedSIGUSR1 == SIGUSR1) {
+    logger.ReopenLogFile();
+    gReceivedSIGUSR1 = 0;
+  }
+}
+
+// Accept loop, runs until shutdown. Every thread has its own request object and buffers,
+// receiver is shared.
+void ServeRequests(FCGX_Request & request,
+                   alohalytics::StatisticsReceiver & receiver,
+                   alohalytics::AsyncLogger & logger,
+                   const string & kMonitoringURI,
+                   const string & kMetricsURI,
+                   alohalytics::LogRateLimiter & rejected_log) {
+  string gzipped_body;
+  long long content_length;
+  const char * remote_addr_str = nullptr;
+  const char * request_uri_str = nullptr;
+  const char * user_agent_str = nullptr;
+  while (FCGX_Accept_r(&request) >= 0) {
+    ReopenFilesOnSignals(receiver, logger);
+
+    try {
+      remote_addr_str = FCGX_GetParam("REMOTE_ADDR", request.envp);
+      if (!remote_addr_str) {
+        ALOG("WARNING: Missing REMOTE_ADDR. Please check your http server configuration.");
+      }
+      request_uri_str = FCGX_GetParam("REQUEST_URI", request.envp);
+      if (!request_uri_str) {
+        ALOG("WARNING: Missing REQUEST_URI. Please check your http server configuration.");
+      }
+      user_agent_str = FCGX_GetParam("HTTP_USER_AGENT", request.envp);
+      if (!user_agent_str) {
+        ALOG("WARNING: Missing HTTP User-Agent. Please check your http server configuration.");
+      }
+
+      if (request_uri_str && !kMetricsURI.empty() && request_uri_str == kMetricsURI) {
+        Reply200OKWithBody(request.out, receiver.MetricsText(), alohalytics::kPrometheusContentType);
+        continue;
+      }
+
+      const char * content_length_str = FCGX_GetParam("HTTP_CONTENT_LENGTH", request.envp);
+      content_length = 0;
+      if (!content_length_str || ((content_length = atoll(content_length_str)) <= 0)) {
+        ALOG("WARNING: Request is ignored due to invalid or missing Content-Length header", content_length_str,
+              remote_addr_str, request_uri_str, user_agent_str);
+        Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
+        continue;
+      }
+      // Handle special URI for server monitoring.
+      if (request_uri_str && request_uri_str == kMonitoringURI) {
+        if (static_cast<uint64_t>(content_length) > receiver.GetIngestLimits().max_compressed_bytes) {
+          ALOG("WARNING: Monitoring request is ignored due to too large Content-Length", content_length);
+          Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
+          continue;
+        }
+        gzipped_body.resize(content_length);
+        if (fcgi_istream(request.in).read(&gzipped_body[0], content_length).fail()) {
+          ALOG("WARNING: Request is ignored because it's body could not be read.", remote_addr_str, request_uri_str,
+                user_agent_str);
+          Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
+          continue;
+        }
+        const char * content_type_str = FCGX_GetParam("HTTP_CONTENT_TYPE", request.envp);
+        // Reply with the same content and content-type.
+        Reply200OKWithBody(request.out, gzipped_body, content_type_str ? content_type_str : "text/plain");
+        continue;
+      }
+
+      // Rate limited requests are not logged, as there can be a flood of them, see counters at shutdown.
+      if (!receiver.AdmitRequest(remote_addr_str ? remote_addr_str : "")) {
+        ReplyTooManyRequests(request.out, receiver.RateLimitRetryAfterSeconds());
+        continue;
+      }
+      alohalytics::UploadHint hint;
+      if (receiver.CheckBackpressure(hint)) {
+        ALOG("WARNING: Request is rejected due to overload", content_length, remote_addr_str, request_uri_str,
+              user_agent_str);
+        ReplyServiceUnavailable(request.out, hint);
+        continue;
+      }
+      // Read, process and store received body by chunks. Too large body is not read at all.
+      const auto read = [&request](char * buffer, size_t size) {
+        const int read_bytes = FCGX_GetStr(buffer, static_cast<int>(size), request.in);
+        return read_bytes > 0 ? static_cast<size_t>(read_bytes) : size_t(0);
+      };
+      alohalytics::IngestFailure failure;
+      const alohalytics::IngestResult result =
+          receiver.ProcessReceivedHTTPStream(read, content_length, AlohalyticsBaseEvent::CurrentTimestamp(),
+                                             remote_addr_str ? remote_addr_str : "",
+                                             user_agent_str ? user_agent_str : "",
+                                             request_uri_str ? request_uri_str : "", &failure);
+      if (result == alohalytics::IngestResult::SyncError) {
+        // Client should not delete its data and should retry later.
+        ALOG("ERROR: Request could not be stored durably", remote_addr_str, request_uri_str, user_agent_str);
+        ReplyServiceUnavailable(request.out, hint);
+        continue;
+      }
+      if (result == alohalytics::IngestResult::RateLimited) {
+        ReplyTooManyRequests(request.out, max(hint.retry_after_seconds, receiver.RateLimitRetryAfterSeconds()));
+        continue;
+      }
+      // Duplicate was already stored, so client should delete it's copy.
+      if (result != alohalytics::IngestResult::Ok && result != alohalytics::IngestResult::Duplicate) {
+        // Junk traffic can be heavy, so only some bodies are logged, and a sample is saved with --quarantine-dir.
+        uint64_t suppressed = 0;
+        if (rejected_log.Allow(suppressed)) {
+          ALOG("WARNING: Request is rejected:", alohalytics::IngestResultToString(result), failure.ToString(),
+               content_length, remote_addr_str, request_uri_str, user_agent_str, "Not logged before:", suppressed);
+        }
+        Reply200OKWithBody(request.out, BodyWithHint(kBodyTextForBadServerReply, hint));
+        continue;
+      }
+      Reply200OKWithBody(request.out, BodyWithHint(kBodyTextForGoodServerReply, hint));
+    } catch (const exception & ex) {
+      uint64_t suppressed = 0;
+      if (rejected_log.Allow(suppressed)) {
+        ALOG("WARNING: Exception was thrown:", ex.what(), remote_addr_str, request_uri_str, user_agent_str,
+             "Not logged before:", suppressed);
+      }
+      Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
     }
   }
-  // Restore original cout streambuf.
-  ~CoutToFileRedirector() { cout.rdbuf(original_cout_buf); }
-};
+}
 
 int main(int argc, char * argv[]) {
+  // Positional arguments without options.
+  vector<char *> args;
+  unsigned long threads_count = 1;
+  unsigned long shards_count = 1;
+  auto shard_by = alohalytics::StatisticsReceiver::ShardBy::Thread;
+  alohalytics::IngestLimits limits;
+  bool durable = false;
+  unsigned long sync_window_us = 0;
+  alohalytics::BackpressureLimits backpressure;
+  alohalytics::AdmissionConfig admission;
+  unsigned long dedup_window_seconds = 0;
+  unsigned long dedup_capacity = 1024 * 1024;
+  string metrics_uri;
+  alohalytics::QuarantineConfig quarantine;
+  uint64_t rejected_logs_per_second = 10;
+  uint64_t log_lines_per_second = 100;
+  for (int i = 0; i < argc; ++i) {
+    const string arg = argv[i];
+    if (arg == "--quarantine-dir") {
+      quarantine.directory = (i + 1 < argc) ? argv[++i] : "";
+    } else if (arg == "--quarantine-one-of" || arg == "--quarantine-max-files" ||
+               arg == "--rejected-logs-per-second") {
+      uint64_t & value = arg == "--quarantine-one-of"
+                             ? quarantine.sample_one_of
+                             : (arg == "--quarantine-max-files" ? quarantine.max_files : rejected_logs_per_second);
+      char * end = nullptr;
+      value = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--quarantine-one-of" && value == 0)) {
+        ALOG("ERROR:", arg, "should be followed by a non-negative number (positive for --quarantine-one-of).");
+        return -1;
+      }
+    } else if (arg == "--log-lines-per-second") {
+      char * end = nullptr;
+      log_lines_per_second = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0') {
+        ALOG("ERROR: --log-lines-per-second should be followed by a non-negative number.");
+        return -1;
+      }
+    } else if (arg == "--metrics-uri") {
+      metrics_uri = (i + 1 < argc) ? argv[++i] : "";
+      if (metrics_uri.empty() || metrics_uri.front() != '/') {
+        ALOG("ERROR: --metrics-uri should be followed by an URI which starts with a slash.");
+        return -1;
+      }
+    } else if (arg == "--dedup-window-seconds" || arg == "--dedup-capacity") {
+      unsigned long & value = arg == "--dedup-window-seconds" ? dedup_window_seconds : dedup_capacity;
+      char * end = nullptr;
+      value = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--dedup-capacity" && value == 0)) {
+        ALOG("ERROR:", arg, "should be followed by a number of seconds or a positive number of hashes.");
+        return -1;
+      }
+    } else if (arg == "--admission-config") {
+      try {
+        admission = alohalytics::AdmissionConfig::FromFile(i + 1 < argc ? argv[++i] : "");
+      } catch (const exception & ex) {
+        ALOG("ERROR:", ex.what());
+        return -1;
+      }
+    } else if (uint64_t * value = BackpressureFlag(arg, backpressure)) {
+      char * end = nullptr;
+      *value = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--min-sampling-percent" && (*value == 0 || *value > 100))) {
+        ALOG("ERROR:", arg, "should be followed by a non-negative number (percent from 1 to 100 for sampling).");
+        return -1;
+      }
+    } else if (arg == "--durable") {
+      durable = true;
+    } else if (arg == "--sync-window-us") {
+      char * end = nullptr;
+      sync_window_us = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || sync_window_us > 1000000) {
+        ALOG("ERROR: --sync-window-us should be followed by a number of microseconds from 0 to 1000000.");
+        return -1;
+      }
+    } else if (arg == "--max-body-bytes" || arg == "--max-inflated-bytes") {
+      uint64_t & bytes = arg == "--max-body-bytes" ? limits.max_compressed_bytes : limits.max_inflated_bytes;
+      char * end = nullptr;
+      bytes = (i + 1 < argc) ? strtoull(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || bytes == 0) {
+        ALOG("ERROR:", arg, "should be followed by a positive number of bytes.");
+        return -1;
+      }
+    } else if (arg == "--max-inflate-ratio") {
+      char * end = nullptr;
+      limits.max_inflate_ratio = (i + 1 < argc) ? strtod(argv[++i], &end) : 0;
+      if (!end || *end != '\0' || !(limits.max_inflate_ratio >= 1.)) {
+        ALOG("ERROR: --max-inflate-ratio should be followed by a number not less than 1.");
+        return -1;
+      }
+    } else if (arg == "--threads" || arg == "--shards") {
+      unsigned long & count = arg == "--threads" ? threads_count : shards_count;
+      char * end = nullptr;
+      count = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || count == 0 || count > kMaxThreads) {
+        ALOG("ERROR:", arg, "should be followed by a number from 1 to", kMaxThreads);
+        return -1;
+      }
+    } else if (arg == "--shard-by") {
+      const string value = (i + 1 < argc) ? argv[++i] : "";
+      if (value == "client_id") {
+        shard_by = alohalytics::StatisticsReceiver::ShardBy::ClientId;
+      } else if (value != "thread") {
+        ALOG("ERROR: --shard-by should be followed by thread or client_id.");
+        return -1;
+      }
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
 
-  if (argc < 3) {
-    ALOG("Usage:", argv[0], "<directory to store received data> "
+  if (args.size() < 3) {
+    ALOG("Usage:", argv[0], "[--threads N] [--shards N] [--shard-by thread|client_id] "
+                            "[--max-body-bytes N] [--max-inflated-bytes N] [--max-inflate-ratio R] "
+                            "[--durable [--sync-window-us N]] "
+                            "[--soft-pending-bytes N] [--hard-pending-bytes N] [--soft-latency-us N] "
+                            "[--hard-latency-us N] [--retry-after S] [--max-retry-after S] [--min-sampling-percent P] "
+                            "[--admission-config path] [--dedup-window-seconds S [--dedup-capacity N]] "
+                            "[--metrics-uri /uri] [--rejected-logs-per-second N] [--log-lines-per-second N] "
+                            "[--quarantine-dir path [--quarantine-one-of N] [--quarantine-max-files N]] "
+                            "<directory to store received data> "
                             "</special/uri/for/monitoring> "
                             "[optional path to error log file]");
+    ALOG("  - --threads runs N accept loops in one process (1 by default).");
+    ALOG("  - --shards stores data into N files with separate writers, in shard-<i> subdirectories (1 by default).");
+    ALOG("    Shard is selected by the processing thread (default) or by the client id. Data files of all");
+    ALOG("    shards are listed in", alohalytics::kShardsManifestFileName, "file in the storage directory.");
+    ALOG("  - Bodies are rejected if gzipped size is larger than --max-body-bytes (default",
+         limits.max_compressed_bytes, "), if inflated size is larger than --max-inflated-bytes (default",
+         limits.max_inflated_bytes, ") or if inflated/gzipped ratio exceeds --max-inflate-ratio (default",
+         limits.max_inflate_ratio, ").");
+    ALOG("  - With --durable, clients get a reply only when their data is flushed to the storage device, or");
+    ALOG("    503 status if it has failed. Requests which arrive during a flush share the next one, and flushes");
+    ALOG("    can be delayed by --sync-window-us to group more requests (0 by default).");
+    ALOG("  - When received data waiting for writers exceeds --soft-pending-bytes, or average time to store a body");
+    ALOG("    exceeds --soft-latency-us, clients are asked to upload after --retry-after seconds (default",
+         backpressure.min_retry_after_seconds, ") and to log less events, proportionally to the load, but not later");
+    ALOG("    than --max-retry-after (default", backpressure.max_retry_after_seconds,
+         ") and not less than --min-sampling-percent (default", backpressure.min_sampling_percent, ").");
+    ALOG("    Above --hard-pending-bytes or --hard-latency-us requests are rejected with 503 status. All disabled by "
+         "default.");
+    ALOG("  - --admission-config file limits requests rate for every IP and client ID with token buckets, e.g.");
+    ALOG("    ip_rate = 1, ip_burst = 20, client_rate = 0.1, client_burst = 5 (one \"key = value\" per line, see");
+    ALOG("    AdmissionConfig). Over-limit requests get 429 status before their bodies are inflated.");
+    ALOG("  - With --dedup-window-seconds, exact copies of bodies from the same client, received during the window");
+    ALOG("    after the original one, are acknowledged but not stored again. Up to --dedup-capacity (default",
+         dedup_capacity, ") body hashes are kept, 16 bytes each.");
     ALOG("  - Monitoring URI always replies with the same body and content-type which has been received.");
-    ALOG("  - Errors are logged to stdout if error log file has not been specified.");
+    ALOG("  - --metrics-uri replies with ingest metrics in the Prometheus text format (disabled by default).");
+    ALOG("  - Up to --rejected-logs-per-second (default", rejected_logs_per_second,
+         ") rejected bodies are logged per second.");
+    ALOG("  - With --quarantine-dir, every --quarantine-one-of received body (default", quarantine.sample_one_of,
+         ") is saved there if it is rejected,");
+    ALOG("    with it's description, up to --quarantine-max-files (default", quarantine.max_files, ").");
+    ALOG("  - Errors are logged to stdout if error log file has not been specified, by a background thread.");
+    ALOG("    Every log call site writes up to --log-lines-per-second lines (default", log_lines_per_second,
+         ", 0 is unlimited),");
+    ALOG("    numbers of suppressed lines are logged once per second.");
     ALOG("  - SIGHUP reopens main data file and SIGUSR1 reopens debug log file for logrotate utility.");
     ALOG("  - SIGTERM gracefully shutdowns server daemon.");
     return -1;
   }
 
-  const string kStorageDirectory = argv[1];
+  const string kStorageDirectory = args[1];
   if (!alohalytics::FileManager::IsDirectoryWritable(kStorageDirectory)) {
     ALOG("ERROR: Directory", kStorageDirectory, "is not writable.");
     return -1;
   }
 
-  const string kMonitoringURI = argv[2];
+  const string kMonitoringURI = args[2];
   if (kMonitoringURI.empty() || kMonitoringURI.front() != '/') {
     ALOG("ERROR: Given monitoring URI", kMonitoringURI, "shoud start with a slash.");
     return -1;
@@ -132,15 +473,17 @@ int main(int argc, char * argv[]) {
     return result;
   }
 
-  FCGX_Request request;
-  result = FCGX_InitRequest(&request, 0, FCGI_FAIL_ACCEPT_ON_INTR);
-  if (0 != result) {
-    ALOG("ERROR: FCGX_InitRequest has failed with code", result);
-    return result;
+  vector<FCGX_Request> requests(threads_count);
+  for (FCGX_Request & request : requests) {
+    result = FCGX_InitRequest(&request, kListenSocket, FCGI_FAIL_ACCEPT_ON_INTR);
+    if (0 != result) {
+      ALOG("ERROR: FCGX_InitRequest has failed with code", result);
+      return result;
+    }
   }
 
-  // Redirect cout into a file if it was given in the command line.
-  CoutToFileRedirector log_redirector(argc > 3 ? argv[3] : nullptr);
+  // Log into a file if it was given in the command line, from now on ALOG does not block on writes.
+  alohalytics::AsyncLogger logger(args.size() > 3 ? args[3] : nullptr, log_lines_per_second);
   // Correctly reopen data file on SIGHUP for logrotate.
   if (SIG_ERR == ::signal(SIGHUP, [](int) { gReceivedSIGHUP = SIGHUP; })) {
     ALOG("WARNING: Could not set SIGHUP handler. Logrotate will not work correctly.");
@@ -155,6 +498,8 @@ int main(int argc, char * argv[]) {
   // To "fix" this behavior and gracefully shutdown our server, we use a trick from
   // W. Richard Stevens, Stephen A. Rago, "Advanced Programming in the UNIX Environment", 2nd edition, page 329.
   // It is also described here: http://comments.gmane.org/gmane.comp.web.fastcgi.devel/942
+  // Signal interrupts only one thread, so the listening socket is also shut down: it wakes up all other
+  // accept loops (on Linux), and they exit too.
   for (auto signo : {SIGTERM, SIGINT}) {
     struct sigaction act;
     sigemptyset(&act.sa_mask);
@@ -162,84 +507,76 @@ int main(int argc, char * argv[]) {
 #ifdef SA_INTERRUPT
     act.sa_flags |= SA_INTERRUPT;
 #endif
-    act.sa_handler = [](int) { FCGX_ShutdownPending(); };
+    act.sa_handler = [](int) {
+      FCGX_ShutdownPending();
+      ::shutdown(kListenSocket, SHUT_RDWR);
+    };
     const int result = sigaction(signo, &act, nullptr);
     if (result != 0) {
       ALOG("WARNING: Could not set", signo, "signal handler");
     }
   }
 
-  alohalytics::StatisticsReceiver receiver(kStorageDirectory);
-  string gzipped_body;
-  long long content_length;
-  const char * remote_addr_str = nullptr;
-  const char * request_uri_str = nullptr;
-  const char * user_agent_str = nullptr;
-  ALOG("FastCGI Server instance is ready to serve clients' requests.");
-  while (FCGX_Accept_r(&request) >= 0) {
-    // Correctly reopen data file in the queue.
-    if (gReceivedSIGHUP == SIGHUP) {
-      receiver.ReopenDataFile();
-      gReceivedSIGHUP = 0;
-    }
-    // Correctly reopen debug log file.
-    if (gReceivedSIGUSR1 == SIGUSR1) {
-      log_redirector.ReopenLogFile();
-      gReceivedSIGUSR1 = 0;
-    }
-
-    try {
-      remote_addr_str = FCGX_GetParam("REMOTE_ADDR", request.envp);
-      if (!remote_addr_str) {
-        ALOG("WARNING: Missing REMOTE_ADDR. Please check your http server configuration.");
-      }
-      request_uri_str = FCGX_GetParam("REQUEST_URI", request.envp);
-      if (!request_uri_str) {
-        ALOG("WARNING: Missing REQUEST_URI. Please check your http server configuration.");
-      }
-      user_agent_str = FCGX_GetParam("HTTP_USER_AGENT", request.envp);
-      if (!user_agent_str) {
-        ALOG("WARNING: Missing HTTP User-Agent. Please check your http server configuration.");
-      }
-
-      const char * content_length_str = FCGX_GetParam("HTTP_CONTENT_LENGTH", request.envp);
-      content_length = 0;
-      if (!content_length_str || ((content_length = atoll(content_length_str)) <= 0)) {
-        ALOG("WARNING: Request is ignored due to invalid or missing Content-Length header", content_length_str,
-              remote_addr_str, request_uri_str, user_agent_str);
-        Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
-        continue;
-      }
-      // TODO(AlexZ): Should we make a better check for Content-Length or basic exception handling would be enough?
-      gzipped_body.resize(content_length);
-      if (fcgi_istream(request.in).read(&gzipped_body[0], content_length).fail()) {
-        ALOG("WARNING: Request is ignored because it's body could not be read.", remote_addr_str, request_uri_str,
-              user_agent_str);
-        Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
-        continue;
-      }
-
-      // Handle special URI for server monitoring.
-      if (request_uri_str && request_uri_str == kMonitoringURI) {
-        const char * content_type_str = FCGX_GetParam("HTTP_CONTENT_TYPE", request.envp);
-        // Reply with the same content and content-type.
-        Reply200OKWithBody(request.out, gzipped_body, content_type_str ? content_type_str : "text/plain");
-        continue;
-      }
-
-      // Process and store received body.
-      // This call can throw different exceptions.
-      receiver.ProcessReceivedHTTPBody(gzipped_body,
-                                       AlohalyticsBaseEvent::CurrentTimestamp(),
-                                       remote_addr_str ? remote_addr_str : "",
-                                       user_agent_str ? user_agent_str : "",
-                                       request_uri_str ? request_uri_str : "");
-      Reply200OKWithBody(request.out, kBodyTextForGoodServerReply);
-    } catch (const exception & ex) {
-      ALOG("WARNING: Exception was thrown:", ex.what(), remote_addr_str, request_uri_str, user_agent_str);
-      // TODO(AlexZ): Log "bad" received body for investigation.
-      Reply200OKWithBody(request.out, kBodyTextForBadServerReply);
-    }
+  // Thread-safe, all accept loops store received data into the same set of shards.
+  unique_ptr<alohalytics::StatisticsReceiver> receiver_ptr;
+  try {
+    receiver_ptr.reset(new alohalytics::StatisticsReceiver(kStorageDirectory, shards_count, shard_by));
+  } catch (const exception & ex) {
+    ALOG("ERROR:", ex.what());
+    return -1;
+  }
+  alohalytics::StatisticsReceiver & receiver = *receiver_ptr;
+  receiver.SetIngestLimits(limits);
+  if (durable) {
+    receiver.EnableDurableWrites(chrono::microseconds(sync_window_us));
+  }
+  receiver.SetBackpressureLimits(backpressure);
+  receiver.SetAdmissionConfig(admission);
+  if (dedup_window_seconds) {
+    receiver.EnableDuplicateDetection(dedup_capacity, chrono::seconds(dedup_window_seconds));
+  }
+  try {
+    receiver.SetQuarantineConfig(quarantine);
+  } catch (const exception & ex) {
+    ALOG("ERROR:", ex.what());
+    return -1;
+  }
+  alohalytics::LogRateLimiter rejected_log(rejected_logs_per_second);
+  if (!metrics_uri.empty()) {
+    receiver.EnableMetrics();
+    gIngestMetrics = receiver.GetIngestMetrics();
+  }
+  ALOG("FastCGI Server instance is ready to serve clients' requests with", threads_count, "thread(s) and",
+       shards_count, "shard(s).");
+  vector<thread> threads;
+  for (size_t i = 1; i < requests.size(); ++i) {
+    threads.emplace_back(ServeRequests, ref(requests[i]), ref(receiver), ref(logger), cref(kMonitoringURI),
+                         cref(metrics_uri), ref(rejected_log));
+  }
+  ServeRequests(requests.front(), receiver, logger, kMonitoringURI, metrics_uri, rejected_log);
+  for (thread & t : threads) {
+    t.join();
+  }
+  for (size_t i = 0; i < static_cast<size_t>(alohalytics::IngestResult::Count); ++i) {
+    const auto ingest_result = static_cast<alohalytics::IngestResult>(i);
+    ALOG("Requests with", alohalytics::IngestResultToString(ingest_result), "result:",
+         receiver.IngestCounter(ingest_result));
+  }
+  const alohalytics::AdmissionCounters admission_counters = receiver.GetAdmissionCounters();
+  ALOG("Admitted/rejected requests by IP:", admission_counters.ip_admitted, admission_counters.ip_rejected,
+       "by client ID:", admission_counters.client_admitted, admission_counters.client_rejected,
+       "evicted buckets:", admission_counters.evictions);
+  if (dedup_window_seconds) {
+    const alohalytics::DuplicateCacheCounters dedup_counters = receiver.GetDuplicateCacheCounters();
+    ALOG("Duplicate bodies:", dedup_counters.hits, "of", dedup_counters.lookups, "hit rate:",
+         dedup_counters.HitRate(), "evicted hashes:", dedup_counters.evictions);
+  }
+  if (!quarantine.directory.empty()) {
+    ALOG("Rejected bodies saved into", quarantine.directory, "directory:", receiver.QuarantinedBodiesCount());
+  }
+  if (durable) {
+    const alohalytics::QueueMetrics metrics = receiver.Metrics();
+    ALOG("Flushes to the storage device:", metrics.syncs, "for", metrics.sync_requests, "requests.");
   }
   ALOG("Shutting down FastCGI server instance.");
   return 0;
@@ -0,0 +1,320 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#ifndef HTTP_REQUEST_PARSER_H
+#define HTTP_REQUEST_PARSER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace alohalytics {
+
+struct HTTPRequest {
+  std::string method;
+  std::string uri;
+  // 0 for HTTP/1.0 and 1 for HTTP/1.1.
+  int minor_version = 1;
+  // Names are lowercased, values are trimmed.
+  std::vector<std::pair<std::string, std::string>> headers;
+  bool has_content_length = false;
+  uint64_t content_length = 0;
+  bool keep_alive = true;
+  bool expect_continue = false;
+  std::string body;
+  // Is set by the server.
+  std::string remote_addr;
+
+  // Returns nullptr if there is no such header.
+  const std::string * Header(const char * lowercase_name) const {
+    for (const auto & header : headers) {
+      if (header.first == lowercase_name) {
+        return &header.second;
+      }
+    }
+    return nullptr;
+  }
+};
+
+struct HTTPResponse {
+  int status = 200;
+  std::string content_type = "text/plain";
+  // Additional headers, Content-Type, Content-Length and Connection are always added.
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::string body;
+};
+
+inline const char * HTTPStatusText(int status) {
+  switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 408: return "Request Timeout";
+    case 411: return "Length Required";
+    case 413: return "Payload Too Large";
+    case 415: return "Unsupported Media Type";
+    case 417: return "Expectation Failed";
+    case 429: return "Too Many Requests";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 503: return "Service Unavailable";
+    case 505: return "HTTP Version Not Supported";
+  }
+  return "Unknown";
+}
+
+inline std::string FormatHTTPResponse(const HTTPResponse & response, bool keep_alive) {
+  std::string out = "HTTP/1.1 " + std::to_string(response.status) + ' ' + HTTPStatusText(response.status) + "\r\n";
+  out += "Content-Type: " + response.content_type + "\r\n";
+  out += "Content-Length: " + std::to_string(response.body.size()) + "\r\n";
+  for (const auto & header : response.headers) {
+    out += header.first + ": " + header.second + "\r\n";
+  }
+  out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+  out += response.body;
+  return out;
+}
+
+// Incremental HTTP/1.x request parser for requests with Content-Length bodies.
+// Chunked transfer encoding is not supported, our clients never use it.
+class HTTPRequestParser {
+ public:
+  enum class State { Head, Body, Complete, Error };
+
+  static constexpr size_t kDefaultMaxHeadBytes = 16 * 1024;
+
+  HTTPRequestParser(uint64_t max_body_bytes, size_t max_head_bytes = kDefaultMaxHeadBytes)
+      : max_body_bytes_(max_body_bytes), max_head_bytes_(max_head_bytes) {}
+
+  // Consumes request bytes from the beginning of the buffer. Bytes after the complete request
+  // are left in the buffer, they belong to the next pipelined request.
+  State Parse(std::string & buffer) {
+    if (state_ == State::Head) {
+      const size_t head_end = buffer.find("\r\n\r\n", scanned_ > 3 ? scanned_ - 3 : 0);
+      if (head_end == std::string::npos) {
+        scanned_ = buffer.size();
+        if (buffer.size() > max_head_bytes_) {
+          return Fail(431);
+        }
+        return state_;
+      }
+      if (head_end + 4 > max_head_bytes_) {
+        return Fail(431);
+      }
+      ParseHead(buffer.data(), head_end + 2);
+      buffer.erase(0, head_end + 4);
+      if (state_ == State::Error) {
+        return state_;
+      }
+      state_ = request_.content_length ? State::Body : State::Complete;
+    }
+    if (state_ == State::Body) {
+      const size_t size = static_cast<size_t>(
+          std::min<uint64_t>(buffer.size(), request_.content_length - request_.body.size()));
+      request_.body.append(buffer, 0, size);
+      buffer.erase(0, size);
+      if (request_.body.size() == request_.content_length) {
+        state_ = State::Complete;
+      }
+    }
+    return state_;
+  }
+
+  State GetState() const { return state_; }
+  // HTTP status code to reply with if state is Error.
+  int ErrorStatus() const { return error_status_; }
+  // Body bytes which are not received yet.
+  uint64_t RemainingBodyBytes() const { return request_.content_length - request_.body.size(); }
+  HTTPRequest & Request() { return request_; }
+
+  // Prepares parser for the next request on the same connection.
+  void Reset() {
+    request_ = HTTPRequest();
+    state_ = State::Head;
+    scanned_ = 0;
+    error_status_ = 0;
+  }
+
+ private:
+  State Fail(int status) {
+    error_status_ = status;
+    state_ = State::Error;
+    return state_;
+  }
+
+  static bool IsSpace(char c) { return c == ' ' || c == '\t'; }
+
+  static std::string ToLower(const char * begin, const char * end) {
+    std::string s(begin, end);
+    for (char & c : s) {
+      if (c >= 'A' && c <= 'Z') {
+        c = static_cast<char>(c - 'A' + 'a');
+      }
+    }
+    return s;
+  }
+
+  // Returns true if comma-separated list contains given lowercase token.
+  static bool HasToken(const std::string & list, const char * token) {
+    const std::string lowercase = ToLower(list.data(), list.data() + list.size());
+    const size_t length = std::strlen(token);
+    size_t begin = 0;
+    while (begin <= lowercase.size()) {
+      size_t end = lowercase.find(',', begin);
+      if (end == std::string::npos) {
+        end = lowercase.size();
+      }
+      size_t b = begin, e = end;
+      while (b < e && IsSpace(lowercase[b])) {
+        ++b;
+      }
+      while (e > b && IsSpace(lowercase[e - 1])) {
+        --e;
+      }
+      if (e - b == length && lowercase.compare(b, length, token) == 0) {
+        return true;
+      }
+      begin = end + 1;
+    }
+    return false;
+  }
+
+  // [begin, end) contains request line and headers, every line ends with CRLF.
+  void ParseHead(const char * begin, size_t size) {
+    const char * end = begin + size;
+    const char * line_end = static_cast<const char *>(std::memchr(begin, '\r', size));
+    // Request line: METHOD SP request-target SP HTTP/1.x
+    const char * method_end = static_cast<const char *>(std::memchr(begin, ' ', line_end - begin));
+    if (!method_end || method_end == begin) {
+      Fail(400);
+      return;
+    }
+    const char * uri_begin = method_end + 1;
+    const char * uri_end = static_cast<const char *>(std::memchr(uri_begin, ' ', line_end - uri_begin));
+    if (!uri_end || uri_end == uri_begin) {
+      Fail(400);
+      return;
+    }
+    const std::string version(uri_end + 1, line_end);
+    if (version == "HTTP/1.1") {
+      request_.minor_version = 1;
+    } else if (version == "HTTP/1.0") {
+      request_.minor_version = 0;
+    } else {
+      Fail(version.compare(0, 5, "HTTP/") == 0 ? 505 : 400);
+      return;
+    }
+    request_.method.assign(begin, method_end);
+    request_.uri.assign(uri_begin, uri_end);
+    request_.keep_alive = request_.minor_version == 1;
+
+    for (const char * line = line_end + 2; line < end; line = line_end + 2) {
+      line_end = static_cast<const char *>(std::memchr(line, '\r', end - line));
+      if (line_end[1] != '\n' || IsSpace(*line)) {
+        // Bare CR and obsolete line folding.
+        Fail(400);
+        return;
+      }
+      const char * colon = static_cast<const char *>(std::memchr(line, ':', line_end - line));
+      if (!colon || colon == line || IsSpace(colon[-1])) {
+        Fail(400);
+        return;
+      }
+      const char * value_begin = colon + 1;
+      const char * value_end = line_end;
+      while (value_begin < value_end && IsSpace(*value_begin)) {
+        ++value_begin;
+      }
+      while (value_end > value_begin && IsSpace(value_end[-1])) {
+        --value_end;
+      }
+      request_.headers.emplace_back(ToLower(line, colon), std::string(value_begin, value_end));
+      if (!ProcessHeader(request_.headers.back().first, request_.headers.back().second)) {
+        return;
+      }
+    }
+  }
+
+  // Returns false on error.
+  bool ProcessHeader(const std::string & name, const std::string & value) {
+    if (name == "content-length") {
+      uint64_t length = 0;
+      if (value.empty()) {
+        Fail(400);
+        return false;
+      }
+      for (char c : value) {
+        if (c < '0' || c > '9' || length > (UINT64_MAX - 9) / 10) {
+          Fail(400);
+          return false;
+        }
+        length = length * 10 + static_cast<uint64_t>(c - '0');
+      }
+      if (request_.has_content_length && request_.content_length != length) {
+        Fail(400);
+        return false;
+      }
+      if (length > max_body_bytes_) {
+        Fail(413);
+        return false;
+      }
+      request_.has_content_length = true;
+      request_.content_length = length;
+    } else if (name == "transfer-encoding") {
+      Fail(501);
+      return false;
+    } else if (name == "connection") {
+      if (HasToken(value, "close")) {
+        request_.keep_alive = false;
+      } else if (HasToken(value, "keep-alive")) {
+        request_.keep_alive = true;
+      }
+    } else if (name == "expect") {
+      if (ToLower(value.data(), value.data() + value.size()) != "100-continue") {
+        Fail(417);
+        return false;
+      }
+      request_.expect_continue = true;
+    }
+    return true;
+  }
+
+  const uint64_t max_body_bytes_;
+  const size_t max_head_bytes_;
+  HTTPRequest request_;
+  State state_ = State::Head;
+  // Head bytes which were already searched for the end of the head.
+  size_t scanned_ = 0;
+  int error_status_ = 0;
+};
+
+}  // namespace alohalytics
+
+#endif  // HTTP_REQUEST_PARSER_H
@@ -0,0 +1,176 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Ingest counters and stage timings, exported in the Prometheus text format (see StatisticsReceiver::MetricsText).
+// Recording is lock-free: counters are relaxed atomics and timings are sharded LatencyHistograms.
+
+#ifndef INGEST_METRICS_H
+#define INGEST_METRICS_H
+
+#include "src/latency_histogram.h"
+
+#include "server/events_scanner.h"
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+namespace alohalytics {
+
+constexpr char kPrometheusContentType[] = "text/plain; version=0.0.4";
+
+// Writes metrics in the Prometheus text exposition format.
+class PrometheusText {
+ public:
+  PrometheusText() { out_.precision(10); }
+
+  // Should be called once before samples of the metric.
+  PrometheusText & Metric(const char * name, const char * type, const char * help) {
+    out_ << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    return *this;
+  }
+
+  // Labels are "key=\"value\",..." without braces, or an empty string.
+  template <typename T>
+  PrometheusText & Sample(const char * name, T value, const std::string & labels = std::string()) {
+    out_ << name;
+    if (!labels.empty()) {
+      out_ << '{' << labels << '}';
+    }
+    out_ << ' ' << value << '\n';
+    return *this;
+  }
+
+  // Nanoseconds are exported as seconds, with fixed buckets from 10us to 10s.
+  PrometheusText & Histogram(const char * name,
+                             const LatencyHistogram::Snapshot & snapshot,
+                             const std::string & labels) {
+    static const uint64_t kBoundsNs[] = {10000,    50000,     100000,    500000,     1000000,    5000000,   10000000,
+                                         50000000, 100000000, 500000000, 1000000000, 5000000000, 10000000000};
+    const std::string prefix = labels.empty() ? std::string() : labels + ',';
+    const std::string bucket = std::string(name) + "_bucket";
+    uint64_t cumulative = 0;
+    size_t index = 0;
+    for (const uint64_t bound : kBoundsNs) {
+      // Bucket is counted if all it's values are not above the bound, so counts are accurate to 1/kSubBuckets.
+      for (; index < snapshot.buckets.size() && LatencyHistogram::BucketValue(index) <= bound; ++index) {
+        cumulative += snapshot.buckets[index];
+      }
+      std::ostringstream le;
+      le << bound / 1e9;
+      Sample(bucket.c_str(), cumulative, prefix + "le=\"" + le.str() + '"');
+    }
+    Sample(bucket.c_str(), snapshot.count, prefix + "le=\"+Inf\"");
+    Sample((std::string(name) + "_sum").c_str(), snapshot.sum / 1e9, labels);
+    Sample((std::string(name) + "_count").c_str(), snapshot.count, labels);
+    return *this;
+  }
+
+  std::string str() const { return out_.str(); }
+
+ private:
+  std::ostringstream out_;
+};
+
+class IngestMetrics {
+ public:
+  // HTTP status codes from 100 to 599.
+  static constexpr int kMinStatus = 100;
+  static constexpr int kStatusesCount = 500;
+
+  // Inflating of received bodies, without time spent on their events.
+  LatencyHistogram gunzip;
+  // Decoding and encoding of received events, which is done in one pass by StatisticsReceiver::RewriteEvents.
+  LatencyHistogram rewrite;
+  // Writing into the shard's queue, including the flush in durable mode.
+  LatencyHistogram store;
+  // Whole processing of rejected bodies, which is stopped at the first error.
+  LatencyHistogram rejected;
+
+  // Every request (including rejected ones and monitoring) should be recorded once, when it's reply is sent.
+  void RecordReply(int status, uint64_t body_bytes) {
+    if (status < kMinStatus || status >= kMinStatus + kStatusesCount) {
+      status = 500;
+    }
+    replies_[status - kMinStatus].fetch_add(1, std::memory_order_relaxed);
+    bytes_out_.fetch_add(body_bytes, std::memory_order_relaxed);
+  }
+
+  // Gzipped bytes read from received bodies.
+  void RecordBytesIn(uint64_t bytes) { bytes_in_.fetch_add(bytes, std::memory_order_relaxed); }
+
+  void RecordRejected(uint64_t nanoseconds, uint64_t gzipped_bytes) {
+    rejected.Record(nanoseconds);
+    rejected_bytes_.fetch_add(gzipped_bytes, std::memory_order_relaxed);
+  }
+
+  // Counts of received events by EventsScanner::Type, for one stored body.
+  void RecordEvents(const uint64_t (&type_counts)[kEventTypesCount]) {
+    for (size_t i = 0; i < kEventTypesCount; ++i) {
+      if (type_counts[i]) {
+        events_[i].fetch_add(type_counts[i], std::memory_order_relaxed);
+      }
+    }
+  }
+
+  void AppendTo(PrometheusText & text) const {
+    text.Metric("alohalytics_requests_total", "counter", "Replied HTTP requests by status code.");
+    for (int i = 0; i < kStatusesCount; ++i) {
+      const uint64_t count = replies_[i].load(std::memory_order_relaxed);
+      if (count) {
+        text.Sample("alohalytics_requests_total", count, "code=\"" + std::to_string(kMinStatus + i) + '"');
+      }
+    }
+    text.Metric("alohalytics_received_bytes_total", "counter", "Gzipped bytes read from received bodies.")
+        .Sample("alohalytics_received_bytes_total", bytes_in_.load(std::memory_order_relaxed));
+    text.Metric("alohalytics_sent_bytes_total", "counter", "Bytes of reply bodies.")
+        .Sample("alohalytics_sent_bytes_total", bytes_out_.load(std::memory_order_relaxed));
+    text.Metric("alohalytics_events_total", "counter", "Events in stored bodies by their type.");
+    for (size_t i = 0; i < kEventTypesCount; ++i) {
+      text.Sample("alohalytics_events_total", events_[i].load(std::memory_order_relaxed),
+                  std::string("type=\"") + EventsScanner::TypeName(static_cast<EventsScanner::Type>(i)) + '"');
+    }
+    text.Metric("alohalytics_ingest_stage_seconds", "histogram",
+                "Time spent by received bodies in every processing stage (rewrite decodes and encodes events).")
+        .Histogram("alohalytics_ingest_stage_seconds", gunzip.GetSnapshot(), "stage=\"gunzip\"")
+        .Histogram("alohalytics_ingest_stage_seconds", rewrite.GetSnapshot(), "stage=\"rewrite\"")
+        .Histogram("alohalytics_ingest_stage_seconds", store.GetSnapshot(), "stage=\"store\"");
+    text.Metric("alohalytics_rejected_body_seconds", "histogram", "Time spent on every rejected body.")
+        .Histogram("alohalytics_rejected_body_seconds", rejected.GetSnapshot(), std::string());
+    text.Metric("alohalytics_rejected_bytes_total", "counter", "Gzipped bytes read from rejected bodies.")
+        .Sample("alohalytics_rejected_bytes_total", rejected_bytes_.load(std::memory_order_relaxed));
+  }
+
+ private:
+  std::atomic<uint64_t> replies_[kStatusesCount] = {};
+  std::atomic<uint64_t> bytes_in_{0};
+  std::atomic<uint64_t> bytes_out_{0};
+  std::atomic<uint64_t> rejected_bytes_{0};
+  std::atomic<uint64_t> events_[kEventTypesCount] = {};
+};
+
+}  // namespace alohalytics
+
+#endif  // INGEST_METRICS_H
@@ -0,0 +1,202 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Reading of a growing nginx log with checkpoints for logs_processor: the checkpoint is the log file's inode and
+// the offset after the last processed line, so a restarted processor continues where the previous one has stopped,
+// and a rotated log (renamed or truncated) is detected and read from the beginning.
+
+#ifndef LOG_FILE_READER_H
+#define LOG_FILE_READER_H
+
+#include "src/file_manager.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace alohalytics {
+
+constexpr size_t kLogReadChunkSize = 1 << 20;
+
+struct LogCheckpoint {
+  // Zero if nothing was processed yet.
+  uint64_t inode = 0;
+  // Offset of the first unprocessed byte.
+  uint64_t offset = 0;
+
+  bool operator==(const LogCheckpoint & other) const { return inode == other.inode && offset == other.offset; }
+  bool operator!=(const LogCheckpoint & other) const { return !(*this == other); }
+
+  // Returns false if the file does not exist or is invalid.
+  static bool Load(const std::string & path, LogCheckpoint & checkpoint) {
+    std::ifstream file(path);
+    LogCheckpoint loaded;
+    if (!(file >> loaded.inode >> loaded.offset)) {
+      return false;
+    }
+    checkpoint = loaded;
+    return true;
+  }
+
+  // Replaces the checkpoint file atomically and flushes it to the storage device, so after a crash it is
+  // either the previous or this checkpoint.
+  bool Save(const std::string & path) const {
+    const std::string data = std::to_string(inode) + ' ' + std::to_string(offset) + '\n';
+    const std::string temporary_path = path + ".tmp";
+    const int fd = ::open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      return false;
+    }
+    const bool written = ::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) &&
+                         0 == ::fsync(fd);
+    if (0 != ::close(fd) || !written || 0 != std::rename(temporary_path.c_str(), path.c_str())) {
+      std::remove(temporary_path.c_str());
+      return false;
+    }
+    // The rename itself should survive a crash too.
+    return FileManager::SyncDirectory(FileManager::GetDirectoryFromFilePath(path));
+  }
+};
+
+// Returns lines of the log file without '\n', and the position after the last returned one.
+class LogFileReader {
+ public:
+  explicit LogFileReader(const std::string & path) : path_(path) {}
+  LogFileReader(const LogFileReader &) = delete;
+  LogFileReader & operator=(const LogFileReader &) = delete;
+  ~LogFileReader() { Close(); }
+
+  // Opens the file and continues from the checkpoint if it is the same file, and it is not truncated below
+  // the checkpoint. Otherwise starts from the beginning. Returns false if the file can't be opened.
+  bool Open(const LogCheckpoint & checkpoint) {
+    Close();
+    fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd_ == -1 || 0 != ::fstat(fd_, &st)) {
+      Close();
+      return false;
+    }
+    inode_ = static_cast<uint64_t>(st.st_ino);
+    if (checkpoint.inode == inode_ && checkpoint.offset <= static_cast<uint64_t>(st.st_size) &&
+        static_cast<off_t>(checkpoint.offset) == ::lseek(fd_, static_cast<off_t>(checkpoint.offset), SEEK_SET)) {
+      read_offset_ = checkpoint.offset;
+    }
+    return true;
+  }
+
+  // Returns false if there is no complete line in the file now. With incomplete_too, the last line without
+  // '\n' is returned too, e.g. at the end of a log which is not appended anymore.
+  bool ReadLine(std::string & line, bool incomplete_too = false) {
+    while (true) {
+      const size_t end = buffer_.find('\n', buffer_position_);
+      if (end != std::string::npos) {
+        line.assign(buffer_, buffer_position_, end - buffer_position_);
+        buffer_position_ = end + 1;
+        return true;
+      }
+      if (!ReadMore()) {
+        if (!incomplete_too || buffer_position_ == buffer_.size()) {
+          return false;
+        }
+        line.assign(buffer_, buffer_position_, std::string::npos);
+        buffer_position_ = buffer_.size();
+        return true;
+      }
+    }
+  }
+
+  // Position after the last returned line.
+  LogCheckpoint Position() const {
+    LogCheckpoint position;
+    position.inode = inode_;
+    position.offset = read_offset_ - (buffer_.size() - buffer_position_);
+    return position;
+  }
+
+  // True if the path points to another non-empty file now (e.g. logrotate has renamed the log, and nginx has
+  // reopened it after USR1, so nothing is appended to the old one anymore), or if the file was truncated below
+  // the position. Remaining lines of the old file should be read before the new one is opened.
+  bool Rotated() const {
+    struct stat st;
+    if (fd_ == -1 || 0 != ::stat(path_.c_str(), &st)) {
+      return false;
+    }
+    if (static_cast<uint64_t>(st.st_ino) != inode_) {
+      return st.st_size > 0;
+    }
+    return static_cast<uint64_t>(st.st_size) < read_offset_;
+  }
+
+ private:
+  void Close() {
+    if (fd_ != -1) {
+      ::close(fd_);
+    }
+    fd_ = -1;
+    inode_ = 0;
+    read_offset_ = 0;
+    buffer_.clear();
+    buffer_position_ = 0;
+  }
+
+  // Appends the next chunk of the file to the buffer. Returns false at the end of the file or on error.
+  bool ReadMore() {
+    if (fd_ == -1) {
+      return false;
+    }
+    buffer_.erase(0, buffer_position_);
+    buffer_position_ = 0;
+    const size_t size = buffer_.size();
+    buffer_.resize(size + kLogReadChunkSize);
+    ssize_t read_bytes;
+    do {
+      read_bytes = ::read(fd_, &buffer_[size], kLogReadChunkSize);
+    } while (read_bytes == -1 && errno == EINTR);
+    buffer_.resize(size + (read_bytes > 0 ? static_cast<size_t>(read_bytes) : 0));
+    if (read_bytes <= 0) {
+      return false;
+    }
+    read_offset_ += static_cast<uint64_t>(read_bytes);
+    return true;
+  }
+
+  const std::string path_;
+  int fd_ = -1;
+  uint64_t inode_ = 0;
+  // Offset in the file of the buffer's end.
+  uint64_t read_offset_ = 0;
+  std::string buffer_;
+  // Offset in the buffer of the first unreturned byte.
+  size_t buffer_position_ = 0;
+};
+
+}  // namespace alohalytics
+
+#endif  // LOG_FILE_READER_H
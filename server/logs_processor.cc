@@ -26,7 +26,7 @@
 /*******************************************************************************
  DISCLAIMER: This code was created as a quick and simple work-around until fully functional server will be ready.
 
- It processes nginx logs from stdin and extracts temporarily stored files into statistics data files.
+ It processes nginx logs from stdin (or --log-file) and extracts temporarily stored files into statistics data files.
  Log entry example:
  192.168.3.123 [18/Jun/2015:03:43:01 +0300] "POST /2 HTTP/1.1" 200 107 /path_to_files_saved_by_nginx/393/167/188/0188167393 "Dalvik/1.6.0 (Linux; U; Android 4.4.4; m1 note Build/KTU84P)" application/alohalytics-binary-blob gzip
 
@@ -62,158 +62,534 @@
 #include "src/gzip_wrapper.h"
 #include "src/file_manager.h"
 
+#include "bounded_queue.h"
+#include "log_file_reader.h"
+#include "nginx_log_parser.h"
 #include "statistics_receiver.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
-#include <sstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
-
-#include <time.h>  // non-C++, POSIX only strptime
+#include <thread>
+#include <vector>
 
 using namespace std;
 using namespace alohalytics;
 
+// Log entries are processed by a pipeline: the main thread parses them, a pool of readers loads and deletes
+// saved bodies ahead of decoders, a pool of decoders inflates and rewrites them, and a single writer stores them
+// in the log order (and prints all warnings in that order too), so results do not depend on the threads count.
+// With --checkpoint, the writer periodically flushes stored data and only then saves the position in the log and
+// deletes body files of processed entries, so a restarted processor continues from there and nothing is lost: entries
+// after the last checkpoint (at most --checkpoint-seconds of them) are stored again after a crash.
+
+// Processing of a log file stops gracefully on SIGTERM or SIGINT, with the final checkpoint.
+volatile sig_atomic_t gStopRequested = 0;
+
 static void DeleteFile(const string & file) { std::remove(file.c_str()); }
 
+static uint64_t SteadyNanoseconds() {
+  return static_cast<uint64_t>(
+      chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+namespace {
+
+// Every log entry passes all stages.
+struct LogItem {
+  // Position in the log, the writer restores this order.
+  uint64_t index = 0;
+  // Not a log entry: asks the writer to save a checkpoint now, e.g. when the followed log is not appended.
+  bool checkpoint = false;
+  // Position in the log file after this entry.
+  LogCheckpoint position;
+  string log_entry;
+  // Is printed instead of processing the entry.
+  string skip_message;
+  // nginx HTTP code 499 means that file was received but client has aborted connection before
+  // receiving anything from the server. Such files are deleted without processing.
+  bool aborted = false;
+  uint64_t server_timestamp_ms_from_epoch = 0;
+  string ip;
+  string uri;
+  string file_path;
+  // Set if the body file should be deleted after the next checkpoint.
+  bool delete_after_checkpoint = false;
+  string user_agent;
+  string gzipped_body;
+  uint64_t gzipped_size = 0;
+  IngestResult result = IngestResult::Ok;
+  IngestFailure failure;
+  DecodedBody decoded;
+};
+
+// Throughput report for every stage.
+struct StageStats {
+  const char * const name;
+  const size_t threads;
+  atomic<uint64_t> items{0};
+  atomic<uint64_t> bytes{0};
+  // Time spent on items, without waiting for other stages.
+  atomic<uint64_t> busy_ns{0};
+
+  StageStats(const char * name, size_t threads) : name(name), threads(threads) {}
+
+  void Record(uint64_t start_ns, uint64_t item_bytes) {
+    busy_ns += SteadyNanoseconds() - start_ns;
+    bytes += item_bytes;
+    ++items;
+  }
+
+  void Print(double wall_seconds) const {
+    const double busy_seconds = busy_ns / 1e9;
+    cout << "Stage " << name << " (" << threads << " thread(s)): " << items << " items, " << bytes / 1e6
+         << " MB, " << (busy_seconds > 0 ? items * threads / busy_seconds : 0) << " items/s, busy "
+         << (wall_seconds > 0 ? 100 * busy_seconds / threads / wall_seconds : 0) << "% of the time." << endl;
+  }
+};
+
+// Limits entries between the parser and the writer, so the writer keeps a bounded number of entries which
+// have overtaken the one it waits for.
+class InFlightLimit {
+  size_t available_;
+  mutex mutex_;
+  condition_variable released_;
+
+ public:
+  explicit InFlightLimit(size_t limit) : available_(limit) {}
+
+  void Acquire() {
+    unique_lock<mutex> lock(mutex_);
+    released_.wait(lock, [this]() { return available_ > 0; });
+    --available_;
+  }
+
+  void Release() {
+    {
+      lock_guard<mutex> lock(mutex_);
+      ++available_;
+    }
+    released_.notify_one();
+  }
+};
+
+// Fills item's fields, or it's skip_message if the entry should not be processed.
+void ParseLogEntry(NginxLogParser & parser, LogItem & item, bool process_aborted) {
+  typedef NginxLogParser::Error Error;
+  const string & log_entry = item.log_entry;
+  NginxLogParser::Entry entry;
+  // Fields are checked in the log order, the parser stops at the first invalid one.
+  const Error error = parser.Parse(log_entry.data(), log_entry.size(), entry);
+  if (error == Error::IP) {
+    item.skip_message = "WARNING: Can't get IP address. Invalid log entry? " + log_entry;
+    return;
+  }
+  item.ip = entry.ip.ToString();
+  // Basic IP validity check.
+  if (count(item.ip.begin(), item.ip.end(), '.') != 3) {
+    item.skip_message = "WARNING: Invalid IP address: " + item.ip;
+    return;
+  }
+  if (error == Error::Timestamp) {
+    item.skip_message = "WARNING: Can't parse server timestamp. Invalid log entry? " + log_entry;
+    return;
+  }
+  item.server_timestamp_ms_from_epoch = entry.timestamp_ms;
+  if (error == Error::Request) {
+    item.skip_message = "WARNING: Can't get request uri. Invalid log entry? " + log_entry;
+    return;
+  }
+  item.uri = entry.uri.ToString();
+  // HTTP Code should be 200 for correct data.
+  if (error == Error::Status) {
+    item.skip_message = "WARNING: can't parse HTTP code. Invalid log entry? " + log_entry;
+    return;
+  }
+  if (entry.status != 200 && entry.status != 499) {
+    item.skip_message =
+        "Ignoring non-successful HTTP response in the log: " + to_string(entry.status) + " " + log_entry;
+    return;
+  }
+  // Path to the file with a POST body.
+  if (error == Error::ContentLength || error == Error::BodyFile || entry.body_file.data[0] != '/') {
+    item.skip_message = "WARNING: Can't get path to file. Invalid log entry? " + log_entry;
+    return;
+  }
+  item.file_path = entry.body_file.ToString();
+
+  // Now we have a path to the file and can safely delete it.
+  // Aborted data will be sent by client again, so we can safely delete these files, unless duplicates are detected.
+  if (entry.status == 499 && !process_aborted) {
+    item.aborted = true;
+    return;
+  }
+
+  if (error == Error::UserAgent) {
+    item.skip_message = "WARNING: Can't get User-Agent. Invalid log entry? " + log_entry;
+    return;
+  }
+  item.user_agent = entry.user_agent.ToString();
+
+  // Check that Content-Type and Content-Encoding are correct.
+  if (error == Error::ContentType || entry.content_type != "application/alohalytics-binary-blob" ||
+      entry.content_encoding != "gzip") {
+    item.skip_message = "WARNING: Content-Type and Content-Encoding are incorrect. Invalid log entry? " + log_entry;
+  }
+}
+
+// Deletes the body file now, or after the checkpoint which covers the entry.
+void DeleteBodyFile(LogItem & item, bool with_checkpoints) {
+  if (with_checkpoints) {
+    item.delete_after_checkpoint = true;
+  } else {
+    DeleteFile(item.file_path);
+  }
+}
+
+// Loads the body and deletes it's file, so decoders never wait for the disk.
+void ReadBody(LogItem & item, bool with_checkpoints) {
+  if (!item.skip_message.empty() || item.checkpoint) {
+    return;
+  }
+  if (item.aborted) {
+    DeleteBodyFile(item, with_checkpoints);
+    return;
+  }
+  try {
+    item.gzipped_body = FileManager::ReadFileAsString(item.file_path);
+  } catch (const exception &) {
+  }
+  item.gzipped_size = item.gzipped_body.size();
+  if (item.gzipped_body.empty()) {
+    item.skip_message = "WARNING: Can't load contents of " + item.file_path + ". Log entry: " + item.log_entry;
+    return;
+  }
+  DeleteBodyFile(item, with_checkpoints);
+}
+
+// Junk bodies are rejected at the first error, without exceptions.
+void DecodeBody(StatisticsReceiver & receiver, LogItem & item) {
+  if (!item.skip_message.empty() || item.aborted || item.checkpoint) {
+    return;
+  }
+  const string & gzipped_body = item.gzipped_body;
+  size_t offset = 0;
+  const auto read = [&gzipped_body, &offset](char * buffer, size_t size) {
+    size = min(size, gzipped_body.size() - offset);
+    memcpy(buffer, gzipped_body.data() + offset, size);
+    offset += size;
+    return size;
+  };
+  item.result = receiver.DecodeReceivedHTTPStream(read, gzipped_body.size(), item.server_timestamp_ms_from_epoch,
+                                                  item.ip, item.user_agent, item.uri, item.decoded, &item.failure);
+  string().swap(item.gzipped_body);
+}
+
+}  // namespace
+
 int main(int argc, char * argv[]) {
-  if (argc < 2) {
-    cout << "Usage: " << argv[0] << " <directory to store merged file>" << endl;
+  // Only one thread writes into cout at a time (see the writer below), and stdin is read much faster without
+  // synchronization with C stdio.
+  ios::sync_with_stdio(false);
+  // With duplicates detection, bodies of aborted (499) requests are stored too, as their resent copies are skipped.
+  unsigned long dedup_window_seconds = 0;
+  unsigned long threads_count = 1;
+  unsigned long checkpoint_seconds = 10;
+  string log_file, checkpoint_path;
+  bool follow = false;
+  vector<string> args;
+  for (int i = 1; i < argc; ++i) {
+    const string arg = argv[i];
+    if (arg == "--dedup-window-seconds" || arg == "--threads" || arg == "--checkpoint-seconds") {
+      unsigned long & value = arg == "--threads" ? threads_count
+                              : arg == "--checkpoint-seconds" ? checkpoint_seconds
+                                                               : dedup_window_seconds;
+      char * end = nullptr;
+      value = (i + 1 < argc) ? strtoul(argv[++i], &end, 10) : 0;
+      if (!end || *end != '\0' || (arg == "--threads" && (value == 0 || value > 1024))) {
+        cout << "ERROR: " << arg << " should be followed by a number (from 1 to 1024 for --threads)." << endl;
+        return -1;
+      }
+    } else if (arg == "--log-file" || arg == "--checkpoint") {
+      if (i + 1 == argc) {
+        cout << "ERROR: " << arg << " should be followed by a path." << endl;
+        return -1;
+      }
+      (arg == "--log-file" ? log_file : checkpoint_path) = argv[++i];
+    } else if (arg == "--follow") {
+      follow = true;
+    } else {
+      args.push_back(arg);
+    }
+  }
+  if (args.empty()) {
+    cout << "Usage: " << argv[0] << " [--threads N] [--dedup-window-seconds S] [--log-file path [--checkpoint path]"
+         << " [--checkpoint-seconds S] [--follow]] <directory to store merged file>" << endl;
+    cout << "  - --threads sets the number of threads which read and which decode bodies (1 by default)." << endl;
+    cout << "  - --log-file is read instead of stdin." << endl;
+    cout << "  - --checkpoint file keeps the position in the log, processing continues from it after restarts." << endl;
+    cout << "  - --checkpoint-seconds sets how often the checkpoint is saved (10 by default)." << endl;
+    cout << "  - --follow waits for new lines at the end of the log, like tail -F, until SIGTERM or SIGINT." << endl;
+    return -1;
+  }
+  if (log_file.empty() && (follow || !checkpoint_path.empty())) {
+    cout << "ERROR: --checkpoint and --follow can be used only with --log-file." << endl;
     return -1;
   }
-  string directory(argv[1]);
+  string directory(args.front());
   FileManager::AppendDirectorySlash(directory);
   if (!FileManager::IsDirectoryWritable(directory)) {
     cout << "ERROR: Directory " << directory << " is not writable, please specify another one." << endl;
     return -1;
   }
 
-  // Parse nginx log entries from stdin one by one.
-  string log_entry;
+  const bool with_checkpoints = !checkpoint_path.empty();
+  unique_ptr<LogFileReader> log_reader;
+  LogCheckpoint checkpoint;
+  if (!log_file.empty()) {
+    const bool checkpoint_loaded = with_checkpoints && LogCheckpoint::Load(checkpoint_path, checkpoint);
+    log_reader.reset(new LogFileReader(log_file));
+    if (!log_reader->Open(checkpoint)) {
+      cout << "ERROR: Can't open log file " << log_file << endl;
+      return -1;
+    }
+    if (checkpoint_loaded && log_reader->Position() == checkpoint) {
+      cout << "Continuing " << log_file << " from offset " << checkpoint.offset << endl;
+    } else if (checkpoint_loaded) {
+      // Entries after the checkpoint in the rotated file are not processed, their body files are kept.
+      cout << "WARNING: " << log_file << " does not match the checkpoint (rotated?), it is processed from the "
+           << "beginning." << endl;
+    }
+    for (auto signo : {SIGTERM, SIGINT}) {
+      if (SIG_ERR == ::signal(signo, [](int) { gStopRequested = 1; })) {
+        cout << "WARNING: Could not set " << signo << " signal handler" << endl;
+      }
+    }
+  }
+
   size_t good_files_processed = 0, corrupted_files_removed = 0, other_files_removed = 0;
   size_t files_total_size = 0;
+  size_t duplicate_files_removed = 0;
+  size_t checkpoints_saved = 0;
+  // Position after the last written entry, and the saved one.
+  LogCheckpoint processed = log_reader ? log_reader->Position() : LogCheckpoint(), saved = processed;
   StatisticsReceiver receiver(directory);
-  while (getline(cin, log_entry)) {
-    // IP address.
-    string::size_type start_pos = 0;
-    string::size_type end_pos = log_entry.find_first_of(' ');
-    if (end_pos == string::npos) {
-      cout << "WARNING: Can't get IP address. Invalid log entry? " << log_entry << endl;
-      continue;
-    }
-    const string ip(log_entry, start_pos, end_pos - start_pos);
-    // Basic IP validity check.
-    if (count(ip.begin(), ip.end(), '.') != 3) {
-      cout << "WARNING: Invalid IP address: " << ip << endl;
-      continue;
-    }
+  // Body sizes are already limited by nginx, only decompression bombs are rejected.
+  IngestLimits limits;
+  limits.max_compressed_bytes = limits.max_inflated_bytes = numeric_limits<uint64_t>::max();
+  receiver.SetIngestLimits(limits);
+  if (dedup_window_seconds) {
+    receiver.EnableDuplicateDetection(1024 * 1024, chrono::seconds(dedup_window_seconds));
+  }
+  if (with_checkpoints) {
+    receiver.EnableStoredDataSync();
+  }
 
-    // Server timestamp.
-    start_pos = end_pos + 1;
-    end_pos = log_entry.find_first_of(' ', start_pos);
-    if (end_pos == string::npos) {
-      cout << "WARNING: Can't get server timestamp. Invalid log entry? " << log_entry << endl;
-      continue;
-    }
-    struct tm stm;
-    ::memset(&stm, 0, sizeof(stm));
-    if (NULL == ::strptime(&log_entry[start_pos], "[%d/%b/%Y:%H:%M:%S", &stm)) {
-      cout << "WARNING: Can't parse server timestamp: " << log_entry.substr(start_pos, end_pos - start_pos) << endl;
-      continue;
-    }
-    // TODO(AlexZ): Do not rely on time_t equal to seconds from epoch.
-    const uint64_t server_timestamp_ms_from_epoch = mktime(&stm) * 1000;
-
-    // Request URI.
-    start_pos = log_entry.find_first_of('/', end_pos);
-    if (start_pos == string::npos) {
-      cout << "WARNING: Can't get request uri. Invalid log entry? " << log_entry << endl;
-      continue;
-    }
-    end_pos = log_entry.find_first_of(' ', start_pos);
-    if (end_pos == string::npos) {
-      cout << "WARNING: Can't get request uri. Invalid log entry? " << log_entry << endl;
-      continue;
-    }
-    const string uri(log_entry, start_pos, end_pos - start_pos);
-
-    // HTTP Code should be 200 for correct data.
-    start_pos = log_entry.find_first_of(' ', end_pos + 1);
-    int http_code;
-    if ((istringstream(log_entry.substr(start_pos + 1, 3)) >> http_code).fail()) {
-      cout << "WARNING: can't parse HTTP code. Invalid log entry? " << log_entry << endl;
-      continue;
-    }
+  // Readers can load up to kQueueCapacity bodies ahead of decoders.
+  const size_t kQueueCapacity = 16 * threads_count;
+  BoundedQueue<LogItem> parsed(kQueueCapacity), loaded(kQueueCapacity), decoded(kQueueCapacity);
+  InFlightLimit in_flight(4 * kQueueCapacity);
+  StageStats parse_stats("parse", 1), read_stats("read", threads_count), decode_stats("decode", threads_count),
+      write_stats("write", 1);
+  const uint64_t start_ns = SteadyNanoseconds();
 
-    if (http_code != 200 && http_code != 499) {
-      cout << "Ignoring non-successful HTTP response in the log: " << http_code << " " << log_entry << endl;
-      continue;
-    }
+  vector<thread> readers, decoders;
+  for (size_t i = 0; i < threads_count; ++i) {
+    readers.emplace_back([&]() {
+      LogItem item;
+      while (parsed.Pop(item)) {
+        const uint64_t item_start = SteadyNanoseconds();
+        ReadBody(item, with_checkpoints);
+        read_stats.Record(item_start, item.gzipped_size);
+        loaded.Push(move(item));
+      }
+    });
+    decoders.emplace_back([&]() {
+      LogItem item;
+      while (loaded.Pop(item)) {
+        const uint64_t item_start = SteadyNanoseconds();
+        DecodeBody(receiver, item);
+        decode_stats.Record(item_start, item.decoded.message.size());
+        decoded.Push(move(item));
+      }
+    });
+  }
 
-    // Path to the file with a POST body.
-    start_pos = log_entry.find_first_of('/', start_pos);
-    if (start_pos == string::npos) {
-      cout << "WARNING: Can't get path to file. Invalid log entry? " << log_entry << endl;
-      continue;
+  const chrono::seconds checkpoint_interval(checkpoint_seconds);
+  thread writer([&]() {
+    // Entries which have overtaken the next one in the log.
+    map<uint64_t, LogItem> pending;
+    uint64_t next_index = 0;
+    // Files of written entries, they are needed to process these entries again until the checkpoint is saved.
+    vector<string> files_to_delete;
+    auto next_checkpoint = chrono::steady_clock::now() + checkpoint_interval;
+    const auto save_checkpoint = [&]() {
+      next_checkpoint = chrono::steady_clock::now() + checkpoint_interval;
+      if (processed == saved) {
+        return;
+      }
+      if (!receiver.SyncStoredData()) {
+        cout << "WARNING: Stored data could not be flushed, checkpoint is not saved." << endl;
+        return;
+      }
+      if (!processed.Save(checkpoint_path)) {
+        cout << "WARNING: Can't save checkpoint " << checkpoint_path << endl;
+        return;
+      }
+      saved = processed;
+      ++checkpoints_saved;
+      for (const string & file : files_to_delete) {
+        DeleteFile(file);
+      }
+      files_to_delete.clear();
+    };
+    LogItem item;
+    while (decoded.Pop(item)) {
+      pending.emplace(item.index, move(item));
+      for (auto found = pending.find(next_index); found != pending.end(); found = pending.find(++next_index)) {
+        const uint64_t item_start = SteadyNanoseconds();
+        LogItem & next = found->second;
+        files_total_size += next.gzipped_size;
+        if (!next.skip_message.empty()) {
+          cout << next.skip_message << endl;
+        } else if (next.aborted) {
+          ++other_files_removed;
+        } else if (!next.checkpoint) {
+          if (next.result == IngestResult::Ok) {
+            next.result = receiver.StoreDecoded(next.decoded);
+          }
+          if (next.result == IngestResult::Duplicate) {
+            ++duplicate_files_removed;
+          } else if (next.result != IngestResult::Ok) {
+            cout << "WARNING: Corrupted file " << next.file_path << ": " << IngestResultToString(next.result) << " "
+                 << next.failure.ToString() << endl;
+            ++corrupted_files_removed;
+          } else {
+            ++good_files_processed;
+          }
+        }
+        if (with_checkpoints) {
+          processed = next.position;
+          if (next.delete_after_checkpoint) {
+            files_to_delete.push_back(move(next.file_path));
+          }
+          if (next.checkpoint || chrono::steady_clock::now() >= next_checkpoint) {
+            save_checkpoint();
+          }
+        }
+        if (!next.checkpoint) {
+          write_stats.Record(item_start, next.decoded.message.size());
+        }
+        pending.erase(found);
+        in_flight.Release();
+      }
     }
-    end_pos = log_entry.find_first_of(' ', start_pos);
-    if (end_pos == string::npos) {
-      cout << "WARNING: Can't get path to file. Invalid log entry? " << log_entry << endl;
-      continue;
-    }
-    const string file_path(log_entry, start_pos, end_pos - start_pos);
-
-    // Now we have a path to the file and can safely delete it.
-    // nginx HTTP code 499 means that file was received but client has aborted connection before
-    // receiving anything from the server.
-    // This data will be sent by client again, so we can safely delete these files.
-    if (http_code == 499) {
-      DeleteFile(file_path);
-      ++other_files_removed;
-      continue;
+    if (with_checkpoints) {
+      save_checkpoint();
     }
+  });
 
-    // HTTP User-Agent.
-    start_pos = log_entry.find_first_of('"', end_pos);
-    if (start_pos == string::npos) {
-      cout << "WARNING: Can't get User-Agent. Invalid log entry? " << log_entry << endl;
-      continue;
+  // Entries read before the followed log has stopped growing are checkpointed without waiting for the next ones.
+  uint64_t entries_at_checkpoint_request = 0;
+  auto checkpoint_request_time = chrono::steady_clock::now();
+  const auto checkpoint_due = [&]() {
+    return with_checkpoints && parse_stats.items > entries_at_checkpoint_request &&
+           chrono::steady_clock::now() >= checkpoint_request_time + checkpoint_interval;
+  };
+  // Returns the next line of stdin or of the log file, and false at the end. The followed log file ends only
+  // on a signal, and idle is set if it is not appended and the checkpoint is due.
+  const auto read_line = [&](string & line, bool & idle) -> bool {
+    if (!log_reader) {
+      return static_cast<bool>(getline(cin, line));
     }
-    end_pos = log_entry.find("\" ", start_pos + 1);
-    if (end_pos == string::npos) {
-      cout << "WARNING: Can't get User-Agent. Invalid log entry? " << log_entry << endl;
-      continue;
+    while (!gStopRequested) {
+      if (log_reader->ReadLine(line, !follow)) {
+        return true;
+      }
+      if (!follow) {
+        return false;
+      }
+      if (log_reader->Rotated()) {
+        // Remaining lines of the old file are processed first.
+        if (log_reader->ReadLine(line, true)) {
+          return true;
+        }
+        while (!log_reader->Open(LogCheckpoint()) && !gStopRequested) {
+          this_thread::sleep_for(chrono::milliseconds(200));
+        }
+        continue;
+      }
+      if (checkpoint_due()) {
+        idle = true;
+        return false;
+      }
+      this_thread::sleep_for(chrono::milliseconds(200));
     }
-    const string user_agent(log_entry, start_pos + 1, end_pos - start_pos - 1);
+    return false;
+  };
 
-    // Check that Content-Type and Content-Encoding are correct.
-    if (string::npos == log_entry.find(" application/alohalytics-binary-blob gzip", end_pos + 1)) {
-      cout << "WARNING: Content-Type and Content-Encoding are incorrect. Invalid log entry? " << log_entry << endl;
-      continue;
+  // Parse nginx log entries one by one.
+  NginxLogParser parser;
+  LogItem item;
+  uint64_t index = 0;
+  while (true) {
+    bool idle = false;
+    if (!read_line(item.log_entry, idle)) {
+      if (!idle) {
+        break;
+      }
+      item.checkpoint = true;
+      entries_at_checkpoint_request = parse_stats.items;
+      checkpoint_request_time = chrono::steady_clock::now();
+    } else {
+      const uint64_t item_start = SteadyNanoseconds();
+      ParseLogEntry(parser, item, dedup_window_seconds != 0);
+      parse_stats.Record(item_start, item.log_entry.size() + 1);
     }
-
-    const string gzipped_body = FileManager::ReadFileAsString(file_path);
-    files_total_size += gzipped_body.size();
-    if (gzipped_body.empty()) {
-      cout << "WARNING: Can't load contents of " << file_path << ". Log entry: " << log_entry << endl;
-      continue;
+    item.index = index++;
+    if (log_reader) {
+      item.position = log_reader->Position();
     }
-
-    try {
-      receiver.ProcessReceivedHTTPBody(gzipped_body, server_timestamp_ms_from_epoch, ip, user_agent, uri);
-    } catch (const std::exception & ex) {
-      cout << "WARNING: Corrupted file " << file_path << ", exception: " << ex.what() << endl;
-      DeleteFile(file_path);
-      ++corrupted_files_removed;
-      continue;
-    }
-    DeleteFile(file_path);
-    ++good_files_processed;
+    in_flight.Acquire();
+    parsed.Push(move(item));
+    item = LogItem();
+  }
+  parsed.Close();
+  for (thread & reader : readers) {
+    reader.join();
   }
+  loaded.Close();
+  for (thread & decoder : decoders) {
+    decoder.join();
+  }
+  decoded.Close();
+  writer.join();
+  const double wall_seconds = (SteadyNanoseconds() - start_ns) / 1e9;
+
   cout << "Successfully processed " << good_files_processed << " files." << endl;
-  cout << "Deleted " << corrupted_files_removed << " corrupted and " << other_files_removed << " files." << endl;
+  cout << "Deleted " << corrupted_files_removed << " corrupted, " << duplicate_files_removed << " duplicate and "
+       << other_files_removed << " files." << endl;
   cout << "Good and corrupted files total size: " << files_total_size << endl;
+  cout << "Processed " << parse_stats.items << " log entries in " << wall_seconds << " seconds." << endl;
+  if (with_checkpoints) {
+    cout << "Saved " << checkpoints_saved << " checkpoints, the last one is at offset " << saved.offset << " of "
+         << log_file << endl;
+  }
+  for (const StageStats * stats : {&parse_stats, &read_stats, &decode_stats, &write_stats}) {
+    stats->Print(wall_seconds);
+  }
 
   return 0;
 }
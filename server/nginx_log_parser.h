@@ -0,0 +1,265 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Single-pass tokenizer for nginx access log lines in the storebodyinfile format (see logs_processor.cc):
+// $remote_addr [$time_local] "$request" $status $content_length $request_body_file "$http_user_agent" $content_type
+// $http_content_encoding
+// Fields point into the parsed line, nothing is copied or allocated. nginx escapes quotes in logged strings as \x22,
+// so quoted fields end at the first quote.
+
+#ifndef NGINX_LOG_PARSER_H
+#define NGINX_LOG_PARSER_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace alohalytics {
+
+class NginxLogParser {
+ public:
+  // Field which could not be parsed, all fields before it are set.
+  enum class Error : uint8_t {
+    None,
+    IP,
+    Timestamp,
+    Request,
+    Status,
+    ContentLength,
+    BodyFile,
+    UserAgent,
+    ContentType,
+  };
+
+  static const char * ErrorToString(Error error) {
+    switch (error) {
+      case Error::None: return "None";
+      case Error::IP: return "IP";
+      case Error::Timestamp: return "Timestamp";
+      case Error::Request: return "Request";
+      case Error::Status: return "Status";
+      case Error::ContentLength: return "ContentLength";
+      case Error::BodyFile: return "BodyFile";
+      case Error::UserAgent: return "UserAgent";
+      case Error::ContentType: return "ContentType";
+    }
+    return "Unknown";
+  }
+
+  struct StringRef {
+    const char * data = nullptr;
+    size_t size = 0;
+
+    std::string ToString() const { return std::string(data, size); }
+    bool operator==(const char * str) const { return std::strlen(str) == size && 0 == std::memcmp(data, str, size); }
+    bool operator!=(const char * str) const { return !(*this == str); }
+  };
+
+  struct Entry {
+    StringRef ip;
+    // $time_local converted to UTC with it's own offset.
+    uint64_t timestamp_ms = 0;
+    StringRef method;
+    StringRef uri;
+    int status = 0;
+    StringRef content_length;
+    StringRef body_file;
+    StringRef user_agent;
+    StringRef content_type;
+    // Fields after it (if the format is extended) are ignored.
+    StringRef content_encoding;
+  };
+
+  // Line should not contain the trailing newline.
+  Error Parse(const char * line, size_t size, Entry & entry) {
+    entry = Entry();
+    const char * it = line;
+    const char * const end = line + size;
+    if (!Token(it, end, ' ', entry.ip) || entry.ip.size == 0) {
+      return Error::IP;
+    }
+    StringRef time_local;
+    if (!Expect(it, end, '[') || !Token(it, end, ']', time_local) || !Expect(it, end, ' ') ||
+        !TimeLocalToMilliseconds(time_local, entry.timestamp_ms)) {
+      return Error::Timestamp;
+    }
+    StringRef request;
+    if (!Expect(it, end, '"') || !Token(it, end, '"', request) || !Expect(it, end, ' ') ||
+        !SplitRequest(request, entry)) {
+      return Error::Request;
+    }
+    StringRef status;
+    if (!Token(it, end, ' ', status) || !ParseStatus(status, entry.status)) {
+      return Error::Status;
+    }
+    if (!Token(it, end, ' ', entry.content_length) || entry.content_length.size == 0) {
+      return Error::ContentLength;
+    }
+    if (!Token(it, end, ' ', entry.body_file) || entry.body_file.size == 0) {
+      return Error::BodyFile;
+    }
+    if (!Expect(it, end, '"') || !Token(it, end, '"', entry.user_agent) || !Expect(it, end, ' ')) {
+      return Error::UserAgent;
+    }
+    if (!Token(it, end, ' ', entry.content_type) || entry.content_type.size == 0) {
+      return Error::ContentType;
+    }
+    const char * encoding_end = static_cast<const char *>(std::memchr(it, ' ', end - it));
+    entry.content_encoding.data = it;
+    entry.content_encoding.size = (encoding_end ? encoding_end : end) - it;
+    return entry.content_encoding.size ? Error::None : Error::ContentType;
+  }
+
+ private:
+  // "18/Jun/2015:03:43:01 +0300".
+  static constexpr size_t kTimeLocalSize = 26;
+  // Consecutive lines mostly have the same second, and always the same day.
+  char cached_time_[kTimeLocalSize] = {};
+  uint64_t cached_ms_ = 0;
+  // UTC seconds of the cached day start, with the cached offset applied.
+  int64_t cached_day_seconds_ = 0;
+
+  // Reads until the delimiter and skips it.
+  static bool Token(const char *& it, const char * end, char delimiter, StringRef & token) {
+    const char * found = static_cast<const char *>(std::memchr(it, delimiter, end - it));
+    if (!found) {
+      return false;
+    }
+    token.data = it;
+    token.size = found - it;
+    it = found + 1;
+    return true;
+  }
+
+  static bool Expect(const char *& it, const char * end, char c) {
+    if (it == end || *it != c) {
+      return false;
+    }
+    ++it;
+    return true;
+  }
+
+  // "POST /2 HTTP/1.1" or "POST /2" for HTTP/0.9.
+  static bool SplitRequest(StringRef request, Entry & entry) {
+    const char * it = request.data;
+    const char * const end = request.data + request.size;
+    if (!Token(it, end, ' ', entry.method) || entry.method.size == 0) {
+      return false;
+    }
+    if (!Token(it, end, ' ', entry.uri)) {
+      entry.uri.data = it;
+      entry.uri.size = end - it;
+    }
+    return entry.uri.size && entry.uri.data[0] == '/';
+  }
+
+  static bool ParseStatus(StringRef status, int & code) {
+    if (status.size != 3) {
+      return false;
+    }
+    code = 0;
+    for (size_t i = 0; i < 3; ++i) {
+      if (status.data[i] < '0' || status.data[i] > '9') {
+        return false;
+      }
+      code = code * 10 + (status.data[i] - '0');
+    }
+    return true;
+  }
+
+  static bool Digits(const char * str, size_t count, int & value) {
+    value = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (str[i] < '0' || str[i] > '9') {
+        return false;
+      }
+      value = value * 10 + (str[i] - '0');
+    }
+    return true;
+  }
+
+  static int Month(const char * name) {
+    static const char kMonths[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    for (int month = 0; month < 12; ++month) {
+      if (0 == std::memcmp(kMonths + month * 3, name, 3)) {
+        return month + 1;
+      }
+    }
+    return 0;
+  }
+
+  // Days since 1970-01-01 in the proleptic Gregorian calendar, see
+  // http://howardhinnant.github.io/date_algorithms.html#days_from_civil
+  static int64_t DaysFromCivil(int64_t year, int month, int day) {
+    year -= month <= 2;
+    const int64_t era = (year >= 0 ? year : year - 399) / 400;
+    const int64_t year_of_era = year - era * 400;
+    const int64_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    const int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+  }
+
+  // Does not depend on the local timezone, unlike mktime.
+  bool TimeLocalToMilliseconds(StringRef time, uint64_t & ms) {
+    if (time.size != kTimeLocalSize) {
+      return false;
+    }
+    const char * t = time.data;
+    if (0 == std::memcmp(cached_time_, t, kTimeLocalSize)) {
+      ms = cached_ms_;
+      return true;
+    }
+    int hour, minute, second;
+    if (t[11] != ':' || !Digits(t + 12, 2, hour) || t[14] != ':' || !Digits(t + 15, 2, minute) || t[17] != ':' ||
+        !Digits(t + 18, 2, second) || hour > 23 || minute > 59 || second > 60) {
+      return false;
+    }
+    // Date and offset are mostly the same as in the cached time.
+    int64_t day_seconds = cached_day_seconds_;
+    if (cached_time_[0] == 0 || 0 != std::memcmp(cached_time_, t, 11) ||
+        0 != std::memcmp(cached_time_ + 20, t + 20, 6)) {
+      int day, year, offset_hours, offset_minutes;
+      const int month = Month(t + 3);
+      if (!Digits(t, 2, day) || t[2] != '/' || month == 0 || t[6] != '/' || !Digits(t + 7, 4, year) || t[20] != ' ' ||
+          (t[21] != '+' && t[21] != '-') || !Digits(t + 22, 2, offset_hours) || !Digits(t + 24, 2, offset_minutes) ||
+          day < 1 || day > 31 || offset_hours > 23 || offset_minutes > 59) {
+        return false;
+      }
+      const int64_t offset_seconds = (t[21] == '-' ? -1 : 1) * (offset_hours * 3600 + offset_minutes * 60);
+      day_seconds = DaysFromCivil(year, month, day) * 86400 - offset_seconds;
+    }
+    const int64_t seconds = day_seconds + hour * 3600 + minute * 60 + second;
+    if (seconds < 0) {
+      return false;
+    }
+    std::memcpy(cached_time_, t, kTimeLocalSize);
+    cached_day_seconds_ = day_seconds;
+    cached_ms_ = ms = static_cast<uint64_t>(seconds) * 1000;
+    return true;
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // NGINX_LOG_PARSER_H
@@ -0,0 +1,138 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Keeps the cost of junk traffic bounded: warnings about rejected bodies are rate-limited, and only a sample
+// of rejected bodies is saved into a quarantine directory for investigation.
+
+#ifndef REJECTED_BODIES_H
+#define REJECTED_BODIES_H
+
+#include "src/file_manager.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+namespace alohalytics {
+
+// Allows up to per_second messages in every second, and counts the rest. Lock-free, so it can be checked
+// for every rejected request.
+class LogRateLimiter {
+ public:
+  explicit LogRateLimiter(uint64_t per_second) : per_second_(per_second) {}
+
+  // Returns true if the message should be logged, suppressed is set to the number of messages which were not logged
+  // since the previous allowed one. Zero per_second suppresses all messages.
+  bool Allow(uint64_t & suppressed) {
+    return Allow(suppressed, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                                       std::chrono::steady_clock::now().time_since_epoch())
+                                                       .count()));
+  }
+  bool Allow(uint64_t & suppressed, uint64_t now_seconds) {
+    uint64_t second = second_.load(std::memory_order_relaxed);
+    if (second != now_seconds && second_.compare_exchange_strong(second, now_seconds)) {
+      count_.store(0, std::memory_order_relaxed);
+    }
+    if (count_.fetch_add(1, std::memory_order_relaxed) >= per_second_) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  const uint64_t per_second_;
+  std::atomic<uint64_t> second_{0};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> suppressed_{0};
+};
+
+struct QuarantineConfig {
+  // Empty directory disables the quarantine.
+  std::string directory;
+  // Every N-th received body is a candidate, so only it's data is kept in memory while it is processed.
+  uint64_t sample_one_of = 100;
+  // Bodies are not saved any more when this number is reached, until the directory is cleaned and server restarted.
+  uint64_t max_files = 1000;
+};
+
+// Saves sampled rejected bodies as <directory>/rejected-<ms>-<n>.gz files (only received data up to the error,
+// which is enough to reproduce it) and their descriptions into .txt files with the same names.
+class BodyQuarantine {
+ public:
+  // Throws if the directory is not writable.
+  explicit BodyQuarantine(const QuarantineConfig & config) : config_(config) {
+    FileManager::AppendDirectorySlash(config_.directory);
+    if (!FileManager::IsDirectoryWritable(config_.directory)) {
+      throw std::runtime_error("Quarantine directory " + config_.directory + " is not writable.");
+    }
+    if (config_.sample_one_of == 0) {
+      config_.sample_one_of = 1;
+    }
+  }
+
+  // Should be called for every received body before processing it. Returns true if it's data should be kept
+  // in case it is rejected.
+  bool Sample() {
+    return stored_.load(std::memory_order_relaxed) < config_.max_files &&
+           received_.fetch_add(1, std::memory_order_relaxed) % config_.sample_one_of == 0;
+  }
+
+  // Returns path to the saved body, or an empty string if the limit was reached or files could not be written.
+  std::string Store(const std::string & gzipped, const std::string & description) {
+    const uint64_t index = stored_.fetch_add(1, std::memory_order_relaxed);
+    if (index >= config_.max_files) {
+      return std::string();
+    }
+    const std::string path =
+        config_.directory + "rejected-" +
+        std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                           std::chrono::system_clock::now().time_since_epoch())
+                           .count()) +
+        '-' + std::to_string(index);
+    if (!FileManager::AppendStringToFile(gzipped, path + ".gz") ||
+        !FileManager::AppendStringToFile(description + '\n', path + ".txt")) {
+      return std::string();
+    }
+    return path + ".gz";
+  }
+
+  // Saved bodies, including ones which could not be written.
+  uint64_t StoredCount() const {
+    const uint64_t stored = stored_.load(std::memory_order_relaxed);
+    return stored < config_.max_files ? stored : config_.max_files;
+  }
+
+ private:
+  QuarantineConfig config_;
+  std::atomic<uint64_t> received_{0};
+  std::atomic<uint64_t> stored_{0};
+};
+
+}  // namespace alohalytics
+
+#endif  // REJECTED_BODIES_H
@@ -28,31 +28,850 @@
 #include "src/event_base.h"
 #include "src/gzip_wrapper.h"
 #include "src/messages_queue.h"
+#include "src/upload_hint.h"
 
+#include "server/admission_control.h"
+#include "server/duplicate_cache.h"
+#include "server/events_scanner.h"
+#include "server/ingest_metrics.h"
+#include "server/rejected_bodies.h"
+#include "server/xxhash64.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <utility>
+#include <vector>
 
 namespace alohalytics {
 
+// Lists data files of all receiver's shards, one path (relative to the storage directory) per line.
+constexpr char kShardsManifestFileName[] = "alohalytics_shards";
+
+// Protects the server from huge bodies and decompression bombs, see ProcessReceivedHTTPStream.
+struct IngestLimits {
+  uint64_t max_compressed_bytes = 16 * 1024 * 1024;
+  uint64_t max_inflated_bytes = 128 * 1024 * 1024;
+  // Maximum ratio of inflated to compressed bytes. It is checked only after the first
+  // kRatioCheckMinInflatedBytes, as small bodies can legitimately be compressed very well.
+  double max_inflate_ratio = 200.;
+  static constexpr uint64_t kRatioCheckMinInflatedBytes = 1024 * 1024;
+};
+
+// Server asks clients to upload less often and to sample their events (see UploadHint) when any soft limit is
+// exceeded, proportionally to the load. When any hard limit is exceeded, requests are rejected with 503 status
+// before their bodies are processed, so clients keep their data for later. Zero disables a limit.
+struct BackpressureLimits {
+  // Received data which is waiting for all shards' writers.
+  uint64_t soft_pending_bytes = 0;
+  uint64_t hard_pending_bytes = 0;
+  // Average time to store a body (including the flush in durable mode) during the last update interval.
+  uint64_t soft_store_latency_us = 0;
+  uint64_t hard_store_latency_us = 0;
+  // Retry interval grows with the load from the minimum one at soft limits.
+  uint64_t min_retry_after_seconds = 60;
+  uint64_t max_retry_after_seconds = 3600;
+  uint64_t min_sampling_percent = 10;
+  // Hint is updated at most once per interval, so it costs nothing for every request.
+  std::chrono::milliseconds update_interval = std::chrono::milliseconds(1000);
+
+  bool Enabled() const {
+    return soft_pending_bytes || hard_pending_bytes || soft_store_latency_us || hard_store_latency_us;
+  }
+};
+
+enum class IngestResult {
+  Ok,
+  // Reader has returned less data than the body size.
+  ReadError,
+  CompressedTooLarge,
+  InflatedTooLarge,
+  RatioTooHigh,
+  GunzipError,
+  CorruptedEvents,
+  // Body was valid but could not be flushed to the storage device in durable mode, client should retry.
+  SyncError,
+  // Client ID has exceeded it's rate limit (see AdmissionControl), client should retry later.
+  RateLimited,
+  // Exact copy of a recently stored body of the same client, it should be acknowledged but it is not stored again.
+  Duplicate,
+  // Not a result, the number of results.
+  Count
+};
+
+inline const char * IngestResultToString(IngestResult result) {
+  switch (result) {
+    case IngestResult::Ok: return "Ok";
+    case IngestResult::ReadError: return "ReadError";
+    case IngestResult::CompressedTooLarge: return "CompressedTooLarge";
+    case IngestResult::InflatedTooLarge: return "InflatedTooLarge";
+    case IngestResult::RatioTooHigh: return "RatioTooHigh";
+    case IngestResult::GunzipError: return "GunzipError";
+    case IngestResult::CorruptedEvents: return "CorruptedEvents";
+    case IngestResult::SyncError: return "SyncError";
+    case IngestResult::RateLimited: return "RateLimited";
+    case IngestResult::Duplicate: return "Duplicate";
+    case IngestResult::Count: break;
+  }
+  return "Unknown";
+}
+
+// Results for invalid or junk bodies, which are acknowledged as received, but are not stored.
+inline bool IsRejectedBody(IngestResult result) {
+  switch (result) {
+    case IngestResult::ReadError:
+    case IngestResult::CompressedTooLarge:
+    case IngestResult::InflatedTooLarge:
+    case IngestResult::RatioTooHigh:
+    case IngestResult::GunzipError:
+    case IngestResult::CorruptedEvents: return true;
+    default: return false;
+  }
+}
+
+// Where a rejected body has failed, see ProcessReceivedHTTPStream.
+struct IngestFailure {
+  // Set for CorruptedEvents result only.
+  EventsScanner::Error events_error = EventsScanner::Error::None;
+  // Offset in the inflated body where the invalid event was detected for CorruptedEvents (see
+  // EventsScanner::ErrorOffset), of the inflated byte which has exceeded the limit for InflatedTooLarge and
+  // RatioTooHigh, or number of gzipped bytes read for other results.
+  uint64_t offset = 0;
+  uint64_t compressed_bytes = 0;
+  uint64_t inflated_bytes = 0;
+
+  std::string ToString() const {
+    std::string str;
+    if (events_error != EventsScanner::Error::None) {
+      str = std::string(EventsScanner::ErrorToString(events_error)) + ' ';
+    }
+    return str + "at offset " + std::to_string(offset) + ", read " + std::to_string(compressed_bytes) +
+           " gzipped and " + std::to_string(inflated_bytes) + " inflated bytes";
+  }
+};
+
+// Valid body which is rewritten but not stored yet, see DecodeReceivedHTTPStream.
+struct DecodedBody {
+  // Set only if duplicates detection is enabled.
+  uint64_t gzipped_body_hash = 0;
+  // The first client id in the body.
+  std::string client_id;
+  std::string message;
+  // Set only if metrics are enabled.
+  uint64_t type_counts[kEventTypesCount] = {};
+};
+
 class StatisticsReceiver {
+ public:
+  enum class ShardBy {
+    // Every processing thread always writes into the same shard.
+    Thread,
+    // All bodies of the same client are stored in the same shard.
+    ClientId
+  };
+
+ private:
   std::string storage_directory_;
-  TUnlimitedFileQueue file_storage_queue_;
+  // Every shard has its own file and worker thread.
+  std::vector<std::unique_ptr<TUnlimitedFileQueue>> shards_;
+  ShardBy shard_by_;
+  const uint64_t instance_id_ = NextInstanceId();
+  std::atomic<size_t> threads_count_{0};
+  IngestLimits limits_;
+  bool durable_ = false;
+  // Number of ProcessReceivedHTTPStream calls for every result.
+  std::atomic<uint64_t> ingest_counters_[static_cast<size_t>(IngestResult::Count)] = {};
+  // Store() latencies since the last backpressure update.
+  std::atomic<uint64_t> store_latency_sum_us_{0};
+  std::atomic<uint64_t> stores_count_{0};
+  BackpressureLimits backpressure_;
+  std::unique_ptr<AdmissionControl> admission_;
+  std::unique_ptr<DuplicateCache> duplicates_;
+  // Bodies which are being stored by StoreUnique, by their duplicates cache key.
+  std::mutex pending_stores_mutex_;
+  std::map<uint64_t, std::shared_future<IngestResult>> pending_stores_;
+  std::unique_ptr<IngestMetrics> metrics_;
+  std::unique_ptr<BodyQuarantine> quarantine_;
+  std::atomic<uint64_t> backpressure_rejections_{0};
+  std::mutex backpressure_mutex_;
+  // Guarded by backpressure_mutex_.
+  std::chrono::steady_clock::time_point backpressure_update_time_;
+  UploadHint hint_;
+  bool overloaded_ = false;
+
+  // Stable between runs, unlike std::hash. FNV-1a.
+  static uint64_t Hash(const std::string & str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : str) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  static uint64_t SteadyNanoseconds() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+  }
+
+  TUnlimitedFileQueue & Shard(const std::string & client_id) {
+    if (shards_.size() == 1) {
+      return *shards_.front();
+    }
+    if (shard_by_ == ShardBy::ClientId && !client_id.empty()) {
+      return *shards_[Hash(client_id) % shards_.size()];
+    }
+    // Threads are assigned to shards of every receiver in a round-robin manner, thread's index is assigned once.
+    static thread_local std::map<uint64_t, size_t> thread_indexes;
+    const auto inserted = thread_indexes.emplace(instance_id_, 0);
+    if (inserted.second) {
+      inserted.first->second = threads_count_++;
+    }
+    return *shards_[inserted.first->second % shards_.size()];
+  }
+
+  // Unlike addresses, identifiers are never reused by another receiver.
+  static uint64_t NextInstanceId() {
+    static std::atomic<uint64_t> instances_count{0};
+    return instances_count++;
+  }
+
+  // Single shard stores data directly in the storage directory, as before sharding was introduced.
+  static std::string ShardSubdirectory(size_t shard, size_t shards_count) {
+    return shards_count == 1 ? std::string() : "shard-" + std::to_string(shard) + FileManager::kDirectorySeparator;
+  }
+
+  void WriteManifest() const {
+    std::string manifest;
+    for (size_t shard = 0; shard < shards_.size(); ++shard) {
+      manifest += ShardSubdirectory(shard, shards_.size()) + kCurrentFileName + "\n";
+    }
+    // Readers should never see a partially written manifest.
+    const std::string manifest_path = storage_directory_ + kShardsManifestFileName;
+    const std::string temporary_path = manifest_path + ".tmp";
+    std::remove(temporary_path.c_str());
+    if (!FileManager::AppendStringToFile(manifest, temporary_path) ||
+        0 != std::rename(temporary_path.c_str(), manifest_path.c_str())) {
+      throw std::runtime_error("Can't write shards manifest " + manifest_path);
+    }
+  }
+
+  // Fills failure for rejected bodies, and appends all read data to optional captured. Valid body is returned in
+  // decoded.
+  template <typename TReader>
+  IngestResult ProcessStream(TReader & read,
+                             uint64_t compressed_size,
+                             uint64_t server_timestamp,
+                             const std::string & ip,
+                             const std::string & user_agent,
+                             const std::string & uri,
+                             IngestFailure & failure,
+                             std::string * captured,
+                             DecodedBody & decoded) {
+    if (compressed_size > limits_.max_compressed_bytes) {
+      return IngestResult::CompressedTooLarge;
+    }
+    GunzipStream gunzip;
+    EventsScanner scanner(nullptr, 0);
+    // Incomplete event from the previous inflated chunk.
+    std::string pending;
+    std::string & out = decoded.message;
+    std::string & client_id = decoded.client_id;
+    bool client_admitted = false;
+    XXHash64 compressed_hash;
+    // Sizes of rejected bodies are reported in failure.
+    uint64_t & compressed_read = failure.compressed_bytes;
+    uint64_t & inflated = failure.inflated_bytes;
+    // Stage timings and events are recorded only if metrics are enabled.
+    uint64_t gunzip_ns = 0, rewrite_ns = 0;
+    uint64_t (&type_counts)[kEventTypesCount] = decoded.type_counts;
+    IngestResult result = IngestResult::Ok;
+    const auto process_inflated = [&](const char * data, size_t size) {
+      // Offset of the scanned buffer in the inflated body.
+      const uint64_t buffer_offset = inflated - pending.size();
+      inflated += size;
+      if (inflated > limits_.max_inflated_bytes) {
+        failure.offset = limits_.max_inflated_bytes;
+        result = IngestResult::InflatedTooLarge;
+        return false;
+      }
+      if (inflated > IngestLimits::kRatioCheckMinInflatedBytes &&
+          inflated > limits_.max_inflate_ratio * compressed_read) {
+        failure.offset = inflated;
+        result = IngestResult::RatioTooHigh;
+        return false;
+      }
+      if (pending.empty()) {
+        scanner.Continue(data, size);
+      } else {
+        pending.append(data, size);
+        scanner.ContinueTruncated(pending.data(), pending.size());
+      }
+      const uint64_t rewrite_start = metrics_ ? SteadyNanoseconds() : 0;
+      const bool rewritten = RewriteEvents(scanner, server_timestamp, ip, user_agent, uri, out, client_id,
+                                           metrics_ ? type_counts : nullptr);
+      if (metrics_) {
+        rewrite_ns += SteadyNanoseconds() - rewrite_start;
+      }
+      // ID event is the first one, so the rest of a rate limited body is not inflated.
+      if (!client_admitted && !client_id.empty() && admission_) {
+        if (!admission_->AdmitClient(client_id)) {
+          result = IngestResult::RateLimited;
+          return false;
+        }
+        client_admitted = true;
+      }
+      if (rewritten) {
+        pending.clear();
+        return true;
+      }
+      if (scanner.GetError() != EventsScanner::Error::Truncated) {
+        failure.events_error = scanner.GetError();
+        failure.offset = buffer_offset + scanner.ErrorOffset();
+        result = IngestResult::CorruptedEvents;
+        return false;
+      }
+      // Event continues in the next chunk.
+      if (pending.empty()) {
+        pending.assign(data + scanner.EventBegin(), size - scanner.EventBegin());
+      } else {
+        pending.erase(0, scanner.EventBegin());
+      }
+      return true;
+    };
+    std::string buffer(kGzipBufferSize, '\0');
+    int gunzip_result = Z_OK;
+    while (gunzip_result == Z_OK && compressed_read < compressed_size) {
+      const size_t size = read(&buffer[0], std::min<uint64_t>(buffer.size(), compressed_size - compressed_read));
+      if (size == 0) {
+        failure.offset = compressed_read;
+        return IngestResult::ReadError;
+      }
+      compressed_read += size;
+      if (captured) {
+        captured->append(buffer.data(), size);
+      }
+      if (duplicates_) {
+        compressed_hash.Update(buffer.data(), size);
+      }
+      if (metrics_) {
+        metrics_->RecordBytesIn(size);
+        const uint64_t inflate_start = SteadyNanoseconds();
+        const uint64_t rewrite_ns_before = rewrite_ns;
+        gunzip_result = gunzip.Inflate(buffer.data(), size, process_inflated);
+        gunzip_ns += SteadyNanoseconds() - inflate_start - (rewrite_ns - rewrite_ns_before);
+      } else {
+        gunzip_result = gunzip.Inflate(buffer.data(), size, process_inflated);
+      }
+      if (result != IngestResult::Ok) {
+        return result;
+      }
+    }
+    if (gunzip_result != Z_STREAM_END) {
+      failure.offset = compressed_read;
+      return IngestResult::GunzipError;
+    }
+    if (!pending.empty()) {
+      failure.events_error = EventsScanner::Error::Truncated;
+      failure.offset = inflated - pending.size();
+      return IngestResult::CorruptedEvents;
+    }
+    decoded.gzipped_body_hash = compressed_hash.Digest();
+    if (metrics_) {
+      metrics_->gunzip.Record(gunzip_ns);
+      metrics_->rewrite.Record(rewrite_ns);
+    }
+    return IngestResult::Ok;
+  }
+
+  // Stores the message unless the same gzipped body of the same client was stored during the duplicates window.
+  IngestResult StoreUnique(uint64_t gzipped_body_hash, const std::string & client_id, const std::string & message) {
+    if (!duplicates_) {
+      return Store(client_id, message);
+    }
+    XXHash64 hasher(gzipped_body_hash);
+    hasher.Update(client_id);
+    const uint64_t key = hasher.Digest();
+    // Body is remembered only after it was stored, and a copy which arrives meanwhile (e.g. client's retry after
+    // a timeout) waits for the result of the original. If it has failed, client should retry again.
+    std::promise<IngestResult> promise;
+    {
+      std::unique_lock<std::mutex> lock(pending_stores_mutex_);
+      const auto pending = pending_stores_.find(key);
+      if (pending != pending_stores_.end()) {
+        const std::shared_future<IngestResult> original = pending->second;
+        lock.unlock();
+        const IngestResult result = original.get();
+        return result == IngestResult::Ok ? IngestResult::Duplicate : result;
+      }
+      if (duplicates_->Contains(key)) {
+        return IngestResult::Duplicate;
+      }
+      pending_stores_.emplace(key, promise.get_future().share());
+    }
+    const IngestResult result = Store(client_id, message);
+    if (result == IngestResult::Ok) {
+      duplicates_->Insert(key);
+    }
+    {
+      std::lock_guard<std::mutex> lock(pending_stores_mutex_);
+      pending_stores_.erase(key);
+    }
+    promise.set_value(result);
+    return result;
+  }
+
+  // In durable mode, blocks until the message is flushed to the storage device. Concurrent requests
+  // to the same shard share one flush.
+  IngestResult Store(const std::string & client_id, const std::string & message) {
+    const auto start = std::chrono::steady_clock::now();
+    TUnlimitedFileQueue & shard = Shard(client_id);
+    shard.PushMessage(message);
+    IngestResult result = IngestResult::Ok;
+    if (durable_) {
+      // Callback is called on the shard's thread and can outlive this call.
+      const std::shared_ptr<std::promise<bool>> synced = std::make_shared<std::promise<bool>>();
+      std::future<bool> future = synced->get_future();
+      shard.SyncMessages([synced](bool synced_result) { synced->set_value(synced_result); });
+      result = future.get() ? IngestResult::Ok : IngestResult::SyncError;
+    }
+    const auto latency = std::chrono::steady_clock::now() - start;
+    store_latency_sum_us_ +=
+        static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+    ++stores_count_;
+    if (metrics_) {
+      metrics_->store.Record(
+          static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count()));
+    }
+    return result;
+  }
+
+  // Should be called with locked backpressure_mutex_.
+  void UpdateBackpressure() {
+    const BackpressureLimits & limits = backpressure_;
+    const uint64_t pending_bytes = Metrics().messages_buffer_bytes;
+    const uint64_t stores = stores_count_.exchange(0);
+    const uint64_t latency_sum_us = store_latency_sum_us_.exchange(0);
+    const uint64_t latency_us = stores ? latency_sum_us / stores : 0;
+    // Load is 1 at the lowest soft limit.
+    double load = 0.;
+    overloaded_ = false;
+    const auto check = [&load, this](uint64_t value, uint64_t soft_limit, uint64_t hard_limit) {
+      if (soft_limit) {
+        load = std::max(load, static_cast<double>(value) / soft_limit);
+      }
+      if (hard_limit && value >= hard_limit) {
+        overloaded_ = true;
+      }
+    };
+    check(pending_bytes, limits.soft_pending_bytes, limits.hard_pending_bytes);
+    check(latency_us, limits.soft_store_latency_us, limits.hard_store_latency_us);
+    hint_ = UploadHint();
+    if (load < 1. && !overloaded_) {
+      return;
+    }
+    load = std::max(load, 1.);
+    const double retry_after = std::min(static_cast<double>(limits.max_retry_after_seconds),
+                                        std::max(1., limits.min_retry_after_seconds * load));
+    hint_.retry_after_seconds = static_cast<uint32_t>(std::min(retry_after, double(kMaxUploadRetryAfterSeconds)));
+    const double sampling_percent = std::max(static_cast<double>(limits.min_sampling_percent), 100. / load);
+    hint_.sampling_percent = static_cast<uint32_t>(std::min(100., std::max(1., sampling_percent)));
+  }
+
+  template <typename T>
+  static void Append(std::string & out, T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  static void AppendString(std::string & out, const char * str, size_t size) {
+    Append(out, static_cast<uint64_t>(size));
+    out.append(str, size);
+  }
+
+  // Polymorphic unique_ptr header, as cereal writes it into a new archive.
+  static void AppendHeader(std::string & out, EventsScanner::Type type) {
+    if (type == EventsScanner::Type::Base) {
+      // Non-derived type is marked with the second most significant bit.
+      Append(out, uint32_t(0x40000000));
+    } else {
+      Append(out, uint32_t(0x80000001));
+      const char * name = EventsScanner::TypeName(type);
+      AppendString(out, name, std::strlen(name));
+    }
+    // Valid pointer.
+    out.push_back(1);
+  }
 
  public:
-  explicit StatisticsReceiver(const std::string & storage_directory) : storage_directory_(storage_directory) {
+  // Throws if shard directories or the manifest can't be created.
+  explicit StatisticsReceiver(const std::string & storage_directory,
+                              size_t shards_count = 1,
+                              ShardBy shard_by = ShardBy::Thread)
+      : storage_directory_(storage_directory), shard_by_(shard_by) {
+    if (shards_count == 0) {
+      throw std::invalid_argument("At least one shard is required.");
+    }
     FileManager::AppendDirectorySlash(storage_directory_);
-    file_storage_queue_.SetStorageDirectory(storage_directory_);
+    for (size_t shard = 0; shard < shards_count; ++shard) {
+      const std::string directory = storage_directory_ + ShardSubdirectory(shard, shards_count);
+      if (!FileManager::MakeDirectory(directory)) {
+        throw std::runtime_error("Can't create shard directory " + directory);
+      }
+      shards_.emplace_back(new TUnlimitedFileQueue());
+      shards_.back()->SetStorageDirectory(directory);
+    }
+    // New shard directories should survive a crash, as acknowledged data is synced into them.
+    if (shards_count > 1 && !FileManager::SyncDirectory(storage_directory_)) {
+      throw std::runtime_error("Can't sync storage directory " + storage_directory_);
+    }
+    WriteManifest();
+  }
+
+  size_t ShardsCount() const { return shards_.size(); }
+
+  // Should be called before processing.
+  void SetIngestLimits(const IngestLimits & limits) { limits_ = limits; }
+
+  // Should be called before processing. Processing calls return only when their data is flushed
+  // to the storage device, so replies are sent only for data which survives a crash.
+  // See MessagesQueue::EnableSync() for batch_window.
+  void EnableDurableWrites(std::chrono::microseconds batch_window = std::chrono::microseconds(0)) {
+    durable_ = true;
+    for (auto & shard : shards_) {
+      shard->EnableSync(batch_window);
+    }
+  }
+
+  // Should be called before processing to use SyncStoredData() without waiting for a flush on every store,
+  // e.g. for periodic checkpoints.
+  void EnableStoredDataSync() {
+    for (auto & shard : shards_) {
+      shard->EnableSync();
+    }
+  }
+
+  // Blocks until all data stored before this call is flushed to the storage device. Returns false on any error
+  // since the previous sync, see MessagesQueue::SyncMessages().
+  bool SyncStoredData() {
+    std::vector<std::future<bool>> futures;
+    for (auto & shard : shards_) {
+      // Callback is called on the shard's thread and can outlive this call.
+      const std::shared_ptr<std::promise<bool>> synced = std::make_shared<std::promise<bool>>();
+      futures.push_back(synced->get_future());
+      shard->SyncMessages([synced](bool synced_result) { synced->set_value(synced_result); });
+    }
+    bool result = true;
+    for (auto & future : futures) {
+      result = future.get() && result;
+    }
+    return result;
+  }
+
+  // Sum of all shards' metrics.
+  QueueMetrics Metrics() {
+    QueueMetrics metrics;
+    for (auto & shard : shards_) {
+      const QueueMetrics shard_metrics = shard->GetMetrics();
+      metrics.messages_buffer_bytes += shard_metrics.messages_buffer_bytes;
+      metrics.inmemory_storage_bytes += shard_metrics.inmemory_storage_bytes;
+      metrics.worker_queue_depth += shard_metrics.worker_queue_depth;
+      metrics.archived_files += shard_metrics.archived_files;
+      metrics.syncs += shard_metrics.syncs;
+      metrics.sync_requests += shard_metrics.sync_requests;
+      metrics.directory_syncs += shard_metrics.directory_syncs;
+    }
+    return metrics;
+  }
+  const IngestLimits & GetIngestLimits() const { return limits_; }
+
+  // Should be called before processing. Up to capacity hashes of stored bodies (with their client IDs) are kept
+  // for the window, and exact copies of them are not stored again (IngestResult::Duplicate).
+  void EnableDuplicateDetection(size_t capacity, std::chrono::seconds window) {
+    duplicates_.reset(new DuplicateCache(capacity, window));
+  }
+  DuplicateCacheCounters GetDuplicateCacheCounters() const {
+    return duplicates_ ? duplicates_->Counters() : DuplicateCacheCounters();
+  }
+
+  // Should be called before processing. Enables recording of requests, stage timings and events (see
+  // IngestMetrics), which are exported with all other receiver's counters by MetricsText().
+  void EnableMetrics() { metrics_.reset(new IngestMetrics()); }
+  // Servers record their replies here, nullptr if metrics are not enabled.
+  IngestMetrics * GetIngestMetrics() { return metrics_.get(); }
+
+  // All counters and gauges of the receiver in the Prometheus text format (kPrometheusContentType).
+  std::string MetricsText() {
+    PrometheusText text;
+    if (metrics_) {
+      metrics_->AppendTo(text);
+    }
+    text.Metric("alohalytics_ingest_bodies_total", "counter", "Processed bodies by result (see IngestResult).");
+    for (size_t i = 0; i < static_cast<size_t>(IngestResult::Count); ++i) {
+      text.Sample("alohalytics_ingest_bodies_total", IngestCounter(static_cast<IngestResult>(i)),
+                  std::string("result=\"") + IngestResultToString(static_cast<IngestResult>(i)) + '"');
+    }
+    text.Metric("alohalytics_quarantined_bodies_total", "counter", "Rejected bodies saved for investigation.")
+        .Sample("alohalytics_quarantined_bodies_total", QuarantinedBodiesCount());
+    text.Metric("alohalytics_backpressure_rejected_total", "counter", "Requests rejected due to overload.")
+        .Sample("alohalytics_backpressure_rejected_total", backpressure_rejections_.load());
+    const AdmissionCounters admission = GetAdmissionCounters();
+    text.Metric("alohalytics_admission_total", "counter", "Rate limit decisions by IP and client ID.")
+        .Sample("alohalytics_admission_total", admission.ip_admitted, "key=\"ip\",decision=\"admitted\"")
+        .Sample("alohalytics_admission_total", admission.ip_rejected, "key=\"ip\",decision=\"rejected\"")
+        .Sample("alohalytics_admission_total", admission.client_admitted, "key=\"client\",decision=\"admitted\"")
+        .Sample("alohalytics_admission_total", admission.client_rejected, "key=\"client\",decision=\"rejected\"");
+    text.Metric("alohalytics_admission_evictions_total", "counter", "Token buckets evicted from full tables.")
+        .Sample("alohalytics_admission_evictions_total", admission.evictions);
+    const DuplicateCacheCounters duplicates = GetDuplicateCacheCounters();
+    text.Metric("alohalytics_duplicate_lookups_total", "counter", "Bodies checked in the duplicates cache.")
+        .Sample("alohalytics_duplicate_lookups_total", duplicates.lookups);
+    text.Metric("alohalytics_duplicate_hits_total", "counter", "Bodies which were not stored as duplicates.")
+        .Sample("alohalytics_duplicate_hits_total", duplicates.hits);
+    text.Metric("alohalytics_duplicate_evictions_total", "counter", "Hashes evicted from the full duplicates cache.")
+        .Sample("alohalytics_duplicate_evictions_total", duplicates.evictions);
+    const QueueMetrics queue = Metrics();
+    text.Metric("alohalytics_queue_pending_bytes", "gauge", "Received data waiting for shards' writers.")
+        .Sample("alohalytics_queue_pending_bytes", queue.messages_buffer_bytes);
+    text.Metric("alohalytics_queue_inmemory_bytes", "gauge", "Data kept in memory as files can't be written.")
+        .Sample("alohalytics_queue_inmemory_bytes", queue.inmemory_storage_bytes);
+    text.Metric("alohalytics_queue_depth", "gauge", "Commands waiting for shards' writers.")
+        .Sample("alohalytics_queue_depth", queue.worker_queue_depth);
+    text.Metric("alohalytics_queue_syncs_total", "counter", "Flushes to the storage device in durable mode.")
+        .Sample("alohalytics_queue_syncs_total", queue.syncs);
+    text.Metric("alohalytics_queue_sync_requests_total", "counter", "Requests served by flushes in durable mode.")
+        .Sample("alohalytics_queue_sync_requests_total", queue.sync_requests);
+    return text.str();
+  }
+
+  // Should be called before processing. Sampled rejected bodies are saved into the quarantine directory.
+  // Throws if the directory is not writable.
+  void SetQuarantineConfig(const QuarantineConfig & config) {
+    quarantine_.reset(config.directory.empty() ? nullptr : new BodyQuarantine(config));
   }
+  uint64_t QuarantinedBodiesCount() const { return quarantine_ ? quarantine_->StoredCount() : 0; }
 
-  // Throws exceptions on any error.
-  void ProcessReceivedHTTPBody(const std::string & gzipped_body,
+  // Should be called before processing.
+  void SetAdmissionConfig(const AdmissionConfig & config) {
+    admission_.reset(new AdmissionControl(config));
+    if (!admission_->Enabled()) {
+      admission_.reset();
+    }
+  }
+
+  // Cheap check of the client's IP rate limit, which should be done before the body is read.
+  // Rejected requests should get 429 status with RateLimitRetryAfterSeconds() (client keeps it's data).
+  bool AdmitRequest(const std::string & ip) { return !admission_ || admission_->AdmitIP(ip); }
+  uint32_t RateLimitRetryAfterSeconds() const { return admission_ ? admission_->RetryAfterSeconds() : 0; }
+  AdmissionCounters GetAdmissionCounters() const {
+    return admission_ ? admission_->Counters() : AdmissionCounters();
+  }
+
+  // Should be called before processing.
+  void SetBackpressureLimits(const BackpressureLimits & limits) { backpressure_ = limits; }
+
+  // Returns true if the request should be rejected with 503 status before it's body is processed.
+  // Hint (which can be empty) should be appended to the reply in any case, see UploadHint.
+  bool CheckBackpressure(UploadHint & hint) {
+    if (!backpressure_.Enabled()) {
+      hint = UploadHint();
+      return false;
+    }
+    std::lock_guard<std::mutex> lock(backpressure_mutex_);
+    const auto now = std::chrono::steady_clock::now();
+    if (now >= backpressure_update_time_) {
+      backpressure_update_time_ = now + backpressure_.update_interval;
+      UpdateBackpressure();
+    }
+    hint = hint_;
+    if (overloaded_) {
+      ++backpressure_rejections_;
+    }
+    return overloaded_;
+  }
+  uint64_t IngestCounter(IngestResult result) const { return ingest_counters_[static_cast<size_t>(result)]; }
+
+  // Reads gzipped body of compressed_size bytes in chunks with read(char * buffer, size_t size) -> size_t
+  // (which returns 0 on error), inflates and rewrites it by chunks, and stores it only if the whole body is valid.
+  // Unlike ProcessReceivedHTTPBody, memory usage is bounded by limits instead of client-provided sizes, and
+  // bodies are rejected as soon as a limit is hit or the first invalid event is found, without exceptions.
+  // Optional failure is filled for rejected bodies (see IsRejectedBody). Never throws.
+  template <typename TReader>
+  IngestResult ProcessReceivedHTTPStream(TReader && read,
+                                         uint64_t compressed_size,
+                                         uint64_t server_timestamp,
+                                         const std::string & ip,
+                                         const std::string & user_agent,
+                                         const std::string & uri,
+                                         IngestFailure * failure = nullptr) {
+    DecodedBody decoded;
+    const IngestResult result =
+        DecodeReceivedHTTPStream(read, compressed_size, server_timestamp, ip, user_agent, uri, decoded, failure);
+    return result == IngestResult::Ok ? StoreDecoded(decoded) : result;
+  }
+
+  // The first half of ProcessReceivedHTTPStream: on Ok result, valid body is returned in decoded and should be
+  // passed to StoreDecoded. Bodies can be decoded in parallel and stored later in the order of their arrival.
+  template <typename TReader>
+  IngestResult DecodeReceivedHTTPStream(TReader && read,
+                                        uint64_t compressed_size,
+                                        uint64_t server_timestamp,
+                                        const std::string & ip,
+                                        const std::string & user_agent,
+                                        const std::string & uri,
+                                        DecodedBody & decoded,
+                                        IngestFailure * failure = nullptr) {
+    const uint64_t start = metrics_ ? SteadyNanoseconds() : 0;
+    IngestFailure local_failure;
+    IngestFailure & body_failure = failure ? *failure : local_failure;
+    body_failure = IngestFailure();
+    decoded = DecodedBody();
+    std::string captured;
+    const bool capture = quarantine_ && quarantine_->Sample();
+    IngestResult result;
+    try {
+      result = ProcessStream(read, compressed_size, server_timestamp, ip, user_agent, uri, body_failure,
+                             capture ? &captured : nullptr, decoded);
+    } catch (const std::bad_alloc &) {
+      result = IngestResult::InflatedTooLarge;
+    }
+    if (result == IngestResult::Ok) {
+      // Counted by StoreDecoded.
+      return result;
+    }
+    ++ingest_counters_[static_cast<size_t>(result)];
+    if (IsRejectedBody(result)) {
+      if (metrics_) {
+        metrics_->RecordRejected(SteadyNanoseconds() - start, body_failure.compressed_bytes);
+      }
+      if (capture) {
+        quarantine_->Store(captured, std::string(IngestResultToString(result)) + ' ' + body_failure.ToString() +
+                                         "\nIP: " + ip + "\nUser-Agent: " + user_agent + "\nURI: " + uri);
+      }
+    }
+    return result;
+  }
+
+  // The second half of ProcessReceivedHTTPStream, returns Ok, Duplicate or SyncError. Never throws.
+  IngestResult StoreDecoded(const DecodedBody & decoded) {
+    IngestResult result;
+    try {
+      result = StoreUnique(decoded.gzipped_body_hash, decoded.client_id, decoded.message);
+    } catch (const std::bad_alloc &) {
+      result = IngestResult::InflatedTooLarge;
+    }
+    if (result == IngestResult::Ok && metrics_) {
+      metrics_->RecordEvents(decoded.type_counts);
+    }
+    ++ingest_counters_[static_cast<size_t>(result)];
+    return result;
+  }
+
+  // Throws exceptions on any error. Returns false if the body is a duplicate (see EnableDuplicateDetection)
+  // and it was not stored again.
+  bool ProcessReceivedHTTPBody(const std::string & gzipped_body,
                                uint64_t server_timestamp,
                                const std::string & ip,
                                const std::string & user_agent,
                                const std::string & uri) {
     // Throws GunzipErrorException.
     const std::string body = Gunzip(gzipped_body);
+    std::string out;
+    // The first client id in the body.
+    std::string client_id;
+    EventsScanner scanner(body.data(), body.size());
+    if (!RewriteEvents(scanner, server_timestamp, ip, user_agent, uri, out, client_id)) {
+      throw std::invalid_argument(std::string("Corrupted body: ") + EventsScanner::ErrorToString(scanner.GetError()) +
+                                  " at offset " + std::to_string(scanner.ErrorOffset()) + ".");
+    }
+    const uint64_t gzipped_body_hash = duplicates_ ? XXHash64::Hash(gzipped_body.data(), gzipped_body.size()) : 0;
+    const IngestResult result = StoreUnique(gzipped_body_hash, client_id, out);
+    if (result == IngestResult::SyncError) {
+      throw std::runtime_error("Received data could not be flushed to the storage device.");
+    }
+    return result != IngestResult::Duplicate;
+  }
+
+  // Appends all scanned events to out as cereal serializes them, but without deserialization. ID events are
+  // replaced by AlohalyticsIdServerEvent with given server-side fields, other events are mostly copied as is.
+  // Returns false if scanner has found an error, out is not complete in this case.
+  // Received events are counted by their type in optional type_counts array of kEventTypesCount elements.
+  static bool RewriteEvents(EventsScanner & scanner,
+                            uint64_t server_timestamp,
+                            const std::string & ip,
+                            const std::string & user_agent,
+                            const std::string & uri,
+                            std::string & out,
+                            std::string & client_id,
+                            uint64_t * type_counts = nullptr) {
+    using Type = EventsScanner::Type;
+    const char * data = scanner.Data();
+    // Chunked input should not disable amortized growth.
+    const size_t expected_size = out.size() + scanner.Size() + scanner.Size() / 8;
+    if (out.capacity() < expected_size) {
+      out.reserve(std::max(expected_size, out.capacity() * 2));
+    }
+    EventsScanner::Event event;
+    while (scanner.Next(event)) {
+      if (type_counts) {
+        ++type_counts[static_cast<size_t>(event.type)];
+      }
+      if (event.type == Type::Id || event.type == Type::IdServer) {
+        if (client_id.empty()) {
+          client_id = event.id.ToString();
+        }
+        AppendHeader(out, Type::IdServer);
+        Append(out, event.timestamp);
+        AppendString(out, event.id.data, event.id.size);
+        Append(out, server_timestamp);
+        AppendString(out, ip.data(), ip.size());
+        AppendString(out, user_agent.data(), user_agent.size());
+        AppendString(out, uri.data(), uri.size());
+        continue;
+      }
+      AppendHeader(out, event.type);
+      if (event.pairs_are_canonical) {
+        out.append(data + event.data_begin, event.fields_end - event.data_begin);
+      } else {
+        out.append(data + event.data_begin, event.pairs_begin - event.data_begin);
+        // Rare case, cereal keeps the first value for every key and sorts them.
+        std::map<std::string, std::string> pairs;
+        using StringRef = EventsScanner::StringRef;
+        EventsScanner::ForEachPair(data, event.pairs_begin, [&pairs](StringRef const & key, StringRef const & value) {
+          pairs.emplace(key.ToString(), value.ToString());
+        });
+        Append(out, static_cast<uint64_t>(pairs.size()));
+        for (const auto & pair : pairs) {
+          AppendString(out, pair.first.data(), pair.first.size());
+          AppendString(out, pair.second.data(), pair.second.size());
+        }
+      }
+      if (event.location.size) {
+        // Cereal stores decoded and encoded again location, which can differ from the received one.
+        const std::string location = Location(event.location.ToString()).Encode();
+        AppendString(out, location.data(), location.size());
+      }
+    }
+    return scanner.GetError() == EventsScanner::Error::None;
+  }
 
+  // Original implementation of the events rewriting which fully deserializes every event with cereal.
+  // RewriteEvents should produce exactly the same output, it is used as a reference in tests and benchmarks.
+  static std::string RewriteEventsWithCereal(const std::string & body,
+                                             uint64_t server_timestamp,
+                                             const std::string & ip,
+                                             const std::string & user_agent,
+                                             const std::string & uri,
+                                             std::string & client_id) {
     std::istringstream in_stream(body);
     cereal::BinaryInputArchive in_ar(in_stream);
     std::ostringstream out_stream;
@@ -61,12 +880,9 @@ class StatisticsReceiver {
     while (bytes_to_read > in_stream.tellg()) {
       in_ar(ptr);
       // Cereal does not check if binary data is valid. Let's do it ourselves.
-      // TODO(AlexZ): Switch from Cereal to another library.
       if (!ptr) {
         throw std::invalid_argument("Corrupted Cereal object, this == 0.");
       }
-      // TODO(AlexZ): Looks like an overhead to cast every event instead of only the first one,
-      // but what if stream contains several mixed bodies?
       const AlohalyticsIdEvent * id_event = dynamic_cast<const AlohalyticsIdEvent *>(ptr.get());
       if (id_event) {
         std::unique_ptr<AlohalyticsIdServerEvent> server_id_event(new AlohalyticsIdServerEvent());
@@ -76,16 +892,23 @@ class StatisticsReceiver {
         server_id_event->ip = ip;
         server_id_event->user_agent = user_agent;
         server_id_event->uri = uri;
+        if (client_id.empty()) {
+          client_id = id_event->id;
+        }
         ptr = std::move(server_id_event);
       }
       // Serialize it back.
       cereal::BinaryOutputArchive(out_stream) << ptr;
     }
-    file_storage_queue_.PushMessage(out_stream.str());
+    return out_stream.str();
   }
 
-  // Correct logrotate utility support for queue's file.
-  void ReopenDataFile() { file_storage_queue_.LogrotateCurrentFile(); }
+  // Correct logrotate utility support for queues' files.
+  void ReopenDataFile() {
+    for (auto & shard : shards_) {
+      shard->LogrotateCurrentFile();
+    }
+  }
 };
 
 }  // namespace alohalytics
@@ -0,0 +1,152 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Streaming XXH64 (https://github.com/Cyan4973/xxHash), fast non-cryptographic 64-bit hash.
+// Output is the same as the reference implementation's on any platform.
+
+#ifndef XXHASH64_H
+#define XXHASH64_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace alohalytics {
+
+class XXHash64 {
+  static constexpr uint64_t kPrime1 = 11400714785074694791ULL;
+  static constexpr uint64_t kPrime2 = 14029467366897019727ULL;
+  static constexpr uint64_t kPrime3 = 1609587929392839161ULL;
+  static constexpr uint64_t kPrime4 = 9650029242287828579ULL;
+  static constexpr uint64_t kPrime5 = 2870177450012600261ULL;
+  static constexpr size_t kStripeSize = 32;
+
+  uint64_t accumulators_[4];
+  uint64_t seed_;
+  uint64_t total_size_ = 0;
+  // Incomplete stripe from the previous Update.
+  unsigned char buffer_[kStripeSize];
+  size_t buffer_size_ = 0;
+
+  static uint64_t RotateLeft(uint64_t x, int bits) { return (x << bits) | (x >> (64 - bits)); }
+
+  static uint64_t Read64(const unsigned char * p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i) {
+      value = (value << 8) | p[i];
+    }
+    return value;
+  }
+
+  static uint64_t Read32(const unsigned char * p) {
+    return uint64_t(p[0]) | (uint64_t(p[1]) << 8) | (uint64_t(p[2]) << 16) | (uint64_t(p[3]) << 24);
+  }
+
+  static uint64_t Round(uint64_t accumulator, uint64_t input) {
+    return RotateLeft(accumulator + input * kPrime2, 31) * kPrime1;
+  }
+
+  static uint64_t MergeRound(uint64_t hash, uint64_t accumulator) {
+    return (hash ^ Round(0, accumulator)) * kPrime1 + kPrime4;
+  }
+
+  void ProcessStripe(const unsigned char * p) {
+    for (int i = 0; i < 4; ++i) {
+      accumulators_[i] = Round(accumulators_[i], Read64(p + i * 8));
+    }
+  }
+
+ public:
+  explicit XXHash64(uint64_t seed = 0) : seed_(seed) {
+    accumulators_[0] = seed + kPrime1 + kPrime2;
+    accumulators_[1] = seed + kPrime2;
+    accumulators_[2] = seed;
+    accumulators_[3] = seed - kPrime1;
+  }
+
+  void Update(const void * data, size_t size) {
+    const unsigned char * p = static_cast<const unsigned char *>(data);
+    const unsigned char * const end = p + size;
+    total_size_ += size;
+    if (buffer_size_ + size < kStripeSize) {
+      std::memcpy(buffer_ + buffer_size_, p, size);
+      buffer_size_ += size;
+      return;
+    }
+    if (buffer_size_) {
+      const size_t missing = kStripeSize - buffer_size_;
+      std::memcpy(buffer_ + buffer_size_, p, missing);
+      ProcessStripe(buffer_);
+      p += missing;
+      buffer_size_ = 0;
+    }
+    for (; p + kStripeSize <= end; p += kStripeSize) {
+      ProcessStripe(p);
+    }
+    buffer_size_ = static_cast<size_t>(end - p);
+    std::memcpy(buffer_, p, buffer_size_);
+  }
+  void Update(const std::string & data) { Update(data.data(), data.size()); }
+
+  // Does not change the state, so more data can be added after it.
+  uint64_t Digest() const {
+    uint64_t hash;
+    if (total_size_ >= kStripeSize) {
+      hash = RotateLeft(accumulators_[0], 1) + RotateLeft(accumulators_[1], 7) + RotateLeft(accumulators_[2], 12) +
+             RotateLeft(accumulators_[3], 18);
+      for (const uint64_t accumulator : accumulators_) {
+        hash = MergeRound(hash, accumulator);
+      }
+    } else {
+      hash = seed_ + kPrime5;
+    }
+    hash += total_size_;
+    const unsigned char * p = buffer_;
+    const unsigned char * const end = buffer_ + buffer_size_;
+    for (; p + 8 <= end; p += 8) {
+      hash = RotateLeft(hash ^ Round(0, Read64(p)), 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end) {
+      hash = RotateLeft(hash ^ (Read32(p) * kPrime1), 23) * kPrime2 + kPrime3;
+      p += 4;
+    }
+    for (; p < end; ++p) {
+      hash = RotateLeft(hash ^ (*p * kPrime5), 11) * kPrime1;
+    }
+    hash = (hash ^ (hash >> 33)) * kPrime2;
+    hash = (hash ^ (hash >> 29)) * kPrime3;
+    return hash ^ (hash >> 32);
+  }
+
+  static uint64_t Hash(const void * data, size_t size, uint64_t seed = 0) {
+    XXHash64 hasher(seed);
+    hasher.Update(data, size);
+    return hasher.Digest();
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // XXHASH64_H
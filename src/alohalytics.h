@@ -25,18 +25,81 @@
 #ifndef ALOHALYTICS_H
 #define ALOHALYTICS_H
 
+#include "src/event_field.h"
+#include "src/event_rules.h"
 #include "src/location.h"
 #include "src/messages_queue.h"
+#include "src/shared_ring.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <string>
 #include <map>
 #include <list>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 namespace alohalytics {
 
 typedef std::map<std::string, std::string> TStringMap;
 
+// Sampled events (see Stats::SetEventSampling) are stored as pairs events with these additional keys.
+constexpr char kSamplingRateKey[] = "$sampling_rate";
+// Value of sampled LogEvent(name, value) event.
+constexpr char kSampledValueKey[] = "$value";
+// See Stats::EnableMetricsEvent.
+constexpr char kMetricsEvent[] = "$alohalyticsMetrics";
+
+// Event for the Stats::LogEvents batch API, has the same variants as LogEvent overloads.
+struct Event {
+  explicit Event(std::string name) : name(std::move(name)) {}
+  Event(std::string name, Location const & location)
+      : name(std::move(name)), location(location), has_location(true) {}
+  Event(std::string name, std::string value) : name(std::move(name)), value(std::move(value)), has_value(true) {}
+  Event(std::string name, std::string value, Location const & location)
+      : name(std::move(name)), value(std::move(value)), location(location), has_value(true), has_location(true) {}
+  Event(std::string name, TStringMap pairs) : name(std::move(name)), pairs(std::move(pairs)), has_pairs(true) {}
+  Event(std::string name, TStringMap pairs, Location const & location)
+      : name(std::move(name)), pairs(std::move(pairs)), location(location), has_pairs(true), has_location(true) {}
+
+  std::string name;
+  std::string value;
+  TStringMap pairs;
+  Location location;
+  bool has_value = false;
+  bool has_pairs = false;
+  bool has_location = false;
+};
+
+// Library's own overhead, see Stats::GetMetrics().
+struct EngineMetrics {
+  // Events stored into the queues.
+  uint64_t events_logged = 0;
+  // Events dropped by rate limits (see Stats::SetEventRateLimit).
+  uint64_t events_dropped = 0;
+  // Events dropped by sampling (see Stats::SetEventSampling).
+  uint64_t events_sampled_out = 0;
+  // Sums for all channels.
+  QueueMetrics queues;
+  uint64_t archived_bytes_before_gzip = 0;
+  uint64_t archived_bytes_after_gzip = 0;
+  uint64_t gzip_time_us = 0;
+  // Every uploaded file or in-memory buffer is a separate attempt.
+  uint64_t upload_attempts = 0;
+  uint64_t upload_failures = 0;
+  uint64_t uploaded_bytes = 0;
+  uint64_t upload_time_us = 0;
+  // Uploads which were not attempted because the server has asked to retry later (see UploadHint).
+  uint64_t uploads_deferred = 0;
+
+  double GzipRatio() const {
+    return archived_bytes_after_gzip ? double(archived_bytes_before_gzip) / archived_bytes_after_gzip : 0.;
+  }
+};
+
 class Stats final {
   // Is statistics engine enabled or disabled.
   // Used if users want to opt-out from events collection.
@@ -46,14 +109,117 @@ class Stats final {
   // In current implementation it is used to distinguish between different users in the events stream on the server.
   // NOTE: Statistics will not be uploaded if unique client id was not set.
   std::string unique_client_id_;
+  // Only one upload request is sent at a time, regardless of the channel.
+  // Declared before the queues, because their destructors can still upload something.
+  std::mutex upload_request_mutex_;
   THundredKilobytesFileQueue messages_queue_;
   bool debug_mode_ = false;
+  EventRules event_rules_;
+  // Relaxed counters for GetMetrics(), updated on the hot path.
+  std::atomic<uint64_t> events_logged_{0};
+  std::atomic<uint64_t> archived_bytes_before_gzip_{0};
+  std::atomic<uint64_t> archived_bytes_after_gzip_{0};
+  std::atomic<uint64_t> gzip_time_us_{0};
+  std::atomic<uint64_t> upload_attempts_{0};
+  std::atomic<uint64_t> upload_failures_{0};
+  std::atomic<uint64_t> uploaded_bytes_{0};
+  std::atomic<uint64_t> upload_time_us_{0};
+  std::atomic<uint64_t> uploads_deferred_{0};
+  // Steady clock time in microseconds, before which nothing is uploaded, as the server has asked (see UploadHint).
+  std::atomic<int64_t> upload_not_before_us_{0};
+  bool metrics_event_enabled_ = false;
+  // Storage path for all channels, channels use it's subdirectories.
+  std::string storage_path_;
+
+  // Events can be routed into separate channels, see AddChannel().
+  struct Channel {
+    Channel(const std::string & channel_name,
+            TFileArchiver archiver,
+            std::streamoff max_archive_size,
+            std::chrono::seconds delay)
+        : name(channel_name), upload_delay(delay), queue(archiver, max_archive_size) {}
+    const std::string name;
+    // Zero means that channel is uploaded only by Upload() call.
+    const std::chrono::seconds upload_delay;
+    THundredKilobytesFileQueue queue;
+    // Cheap check that upload is already scheduled, to avoid locking upload_mutex_ for every event.
+    std::atomic<bool> upload_scheduled{false};
+    // Guarded by upload_mutex_.
+    bool upload_pending = false;
+    std::chrono::steady_clock::time_point upload_deadline;
+  };
+  static constexpr size_t kMaxChannels = 8;
+  // Channel with index 0 is the default one, it uses messages_queue_ and is never created here.
+  // Other channels are never deleted, so can be accessed without locks after their index was published.
+  std::unique_ptr<Channel> channels_[kMaxChannels];
+  // Guarded by upload_mutex_.
+  size_t channels_count_ = 1;
+
+  // Shared upload executor for all channels with upload delay.
+  std::mutex upload_mutex_;
+  std::condition_variable upload_condition_variable_;
+  bool upload_thread_should_exit_ = false;
+  std::thread upload_thread_;
+
+  // Multi-process mode, see EnableSharedStorage(). Ring is published once and never reset.
+  uint32_t shared_ring_capacity_ = 0;
+  std::unique_ptr<SharedRing> shared_ring_owner_;
+  std::atomic<SharedRing *> shared_ring_{nullptr};
+  // Guards ring's consumer side and the fields below.
+  std::mutex shared_ring_mutex_;
+  std::condition_variable shared_ring_condition_variable_;
+  bool shared_ring_thread_should_exit_ = false;
+  std::string shared_storage_path_;
+  std::chrono::steady_clock::time_point next_spill_files_adoption_;
+  std::thread shared_ring_thread_;
+  // Set before the ring is published.
+  std::string spill_file_path_;
+  // Set once under upload_mutex_, when this process becomes the writer.
+  std::atomic<bool> shared_writer_{false};
 
   // Use alohalytics::Stats::Instance() to access statistics engine.
   Stats();
+  ~Stats();
+
+  THundredKilobytesFileQueue & Queue(uint32_t channel) {
+    return channel == 0 ? messages_queue_ : channels_[channel]->queue;
+  }
+  // Called for every logged event, schedules upload for channels with upload delay.
+  void OnEventLogged(uint32_t channel) {
+    events_logged_.fetch_add(1, std::memory_order_relaxed);
+    if (channel != 0) {
+      ScheduleChannelUpload(*channels_[channel]);
+    }
+  }
+  void ScheduleChannelUpload(Channel & channel);
+  void UploadThread();
+  // Returns true if storage path is used by the shared ring.
+  bool OpenSharedStorage(const std::string & storage_path);
+  void SharedRingThread();
+  // Should be called with locked shared_ring_mutex_. Elects this process as a writer if possible,
+  // writer moves all messages from the ring and from spill files of other processes into channels' queues.
+  void DrainSharedRing();
+
+  // Messages of all channels go to the shared ring (if any) with channel index in the first byte, otherwise
+  // directly to channel's queue.
+  template <typename TWriter>
+  void PushMessage(uint32_t channel, size_t message_size, TWriter && writer);
+  // Serializes event with an optional value or pairs and location directly into the channel's queue.
+  void PushEvent(uint32_t channel,
+                 std::string const & key,
+                 std::string const * value,
+                 TStringMap const * pairs,
+                 Location const * location);
+  void LogSampledEvent(uint32_t channel,
+                       std::string const & event_name,
+                       TStringMap pairs,
+                       Location const * location,
+                       double sampling_rate);
 
   // Should return false on upload error.
   bool UploadFileImpl(bool file_name_in_content, const std::string & content);
+  // Follows server's backpressure hint from the reply body.
+  void ApplyUploadHint(const std::string & server_response);
 
   // Called by the queue when file size limit was hit or immediately before file is sent to a server.
   // in_file will be:
@@ -62,6 +228,17 @@ class Stats final {
   // - Deleted.
   void GzipAndArchiveFileInTheQueue(const std::string & in_file, const std::string & out_archive);
 
+  // Non-template part of LogEvent(name, Field, ...). Sorts fields array in place,
+  // fields array should have one more spare element at the end.
+  void LogFieldsEvent(std::string const & event_name, Field const ** fields, size_t fields_count);
+  // Appends sampling rate field into the spare element, so it is formatted only for sampled events.
+  void LogSampledFieldsEvent(uint32_t channel,
+                             std::string const & event_name,
+                             Field const ** fields,
+                             size_t fields_count,
+                             double sampling_rate);
+  void PushFieldsEvent(uint32_t channel, std::string const & event_name, Field const ** fields, size_t fields_count);
+
  public:
   static Stats & Instance();
 
@@ -75,15 +252,45 @@ class Stats final {
   void Enable();
 
   // If not set, collected data will never be uploaded.
+  // Server can ask to upload later and to sample default channel events when it is overloaded, see UploadHint.
   Stats & SetServerUrl(const std::string & url_to_upload_statistics_to);
 
   // If not set, data will be stored in memory only.
   Stats & SetStoragePath(const std::string & full_path_to_storage_with_a_slash_at_the_end);
 
+  // Should be called before SetStoragePath() by all processes of the app which use the same storage path
+  // (e.g. UI and background service processes on Android). Their events (of all channels, so all processes
+  // should add the same channels in the same order) are appended into one shared memory-mapped ring of
+  // ring_capacity bytes in the storage directory, and only one process (the first one which has locked the ring)
+  // stores them into files and uploads them. Another process takes over when the writer exits. If the ring is
+  // full, the writer stores events directly, and other processes append them into their own spill files in the
+  // storage directory, which the writer adopts every few seconds, so events are not lost.
+  // Not supported on Windows, where it does nothing.
+  Stats & EnableSharedStorage(uint32_t ring_capacity = 1024 * 1024);
+
   // If not set, data will never be uploaded.
   // TODO(AlexZ): Should we allow anonymous statistics uploading?
   Stats & SetClientId(const std::string & unique_client_id);
 
+  // Creates a named channel with it's own queue and storage subdirectory (channel_name should be a valid
+  // directory name). It allows to deliver critical events (e.g. purchases) faster than bulk telemetry:
+  // - Archives are created when max_archive_size is hit, so critical channels should use small archives.
+  // - If upload_delay is not zero, channel is uploaded automatically in upload_delay after an event was logged
+  //   into it. Otherwise it is uploaded by Upload() call only (together with other channels).
+  // Up to kMaxChannels - 1 channels can be created.
+  Stats & AddChannel(const std::string & channel_name,
+                     std::streamoff max_archive_size,
+                     std::chrono::seconds upload_delay = std::chrono::seconds(0));
+  // Stores all event_name events in the given channel (see AddChannel), instead of the default one.
+  Stats & SetEventChannel(std::string const & event_name, const std::string & channel_name);
+
+  // Logs only sampling_rate part of event_name events, the rest is dropped. Logged events are stored as
+  // pairs events with kSamplingRateKey, so the server can re-weight them.
+  Stats & SetEventSampling(std::string const & event_name, double sampling_rate);
+  // Drops event_name events logged more often than events_per_second (on average, bursts of max_burst events
+  // are allowed). Zero events_per_second removes the limit.
+  Stats & SetEventRateLimit(std::string const & event_name, double events_per_second, uint32_t max_burst = 1);
+
   void LogEvent(std::string const & event_name);
   void LogEvent(std::string const & event_name, Location const & location);
 
@@ -92,8 +299,34 @@ class Stats final {
 
   void LogEvent(std::string const & event_name, TStringMap const & value_pairs);
   void LogEvent(std::string const & event_name, TStringMap const & value_pairs, Location const & location);
+  // Temporary pairs are moved if event has to be copied (e.g. for sampling).
+  void LogEvent(std::string const & event_name, TStringMap && value_pairs);
+  void LogEvent(std::string const & event_name, TStringMap && value_pairs, Location const & location);
+
+  // Serializes all events of one channel into a single queue message, it is much cheaper than
+  // calling LogEvent for every event. All events in a batch get the same timestamp.
+  void LogEvents(Event const * events, size_t events_count);
+  void LogEvents(std::vector<Event> const & events) { LogEvents(events.data(), events.size()); }
+
+  // Cheaper alternative to LogEvent(name, TStringMap) which does not allocate any temporary containers.
+  // Event is stored in the same format as TStringMap's one, e.g.
+  // LogEvent("route_built", Field("dist_m", 1234), Field("mode", "car"))
+  // is received on the server as a pairs event {"dist_m": "1234", "mode": "car"}.
+  // Field names should be unique.
+  template <typename... TFields>
+  void LogEvent(std::string const & event_name, Field const & field, TFields const &... other_fields) {
+    Field const * fields[] = {&field, &other_fields..., nullptr};
+    LogFieldsEvent(event_name, fields, sizeof...(other_fields) + 1);
+  }
 
-  // Uploads all previously collected data to the server.
+  // Snapshot of the library's own counters. Cheap enough to be called periodically.
+  EngineMetrics GetMetrics();
+  // If enabled, GetMetrics() snapshot is logged as kMetricsEvent pairs event before every Upload() call,
+  // so library overhead can be tracked on the server.
+  Stats & EnableMetricsEvent(bool enable);
+
+  // Uploads all previously collected data from all channels to the server.
+  // Callback gets an error if any channel has failed.
   void Upload(TFileProcessingFinishedCallback upload_finished_callback = TFileProcessingFinishedCallback());
 };
 
@@ -115,6 +348,19 @@ inline void LogEvent(std::string const & event_name, TStringMap const & value_pa
 inline void LogEvent(std::string const & event_name, TStringMap const & value_pairs, Location const & location) {
   Stats::Instance().LogEvent(event_name, value_pairs, location);
 }
+inline void LogEvent(std::string const & event_name, TStringMap && value_pairs) {
+  Stats::Instance().LogEvent(event_name, std::move(value_pairs));
+}
+inline void LogEvent(std::string const & event_name, TStringMap && value_pairs, Location const & location) {
+  Stats::Instance().LogEvent(event_name, std::move(value_pairs), location);
+}
+
+inline void LogEvents(std::vector<Event> const & events) { Stats::Instance().LogEvents(events); }
+
+template <typename... TFields>
+inline void LogEvent(std::string const & event_name, Field const & field, TFields const &... other_fields) {
+  Stats::Instance().LogEvent(event_name, field, other_fields...);
+}
 
 }  // namespace alohalytics
 
@@ -27,21 +27,21 @@
 #define __ASSERT_MACROS_DEFINE_VERSIONS_WITHOUT_UNDERSCORES 0
 #endif
 
+#include <algorithm>  // sort
 #include <cassert>
 #include <cerrno>
 #include <cstdio>  // remove
+#include <cstring>  // strlen
+#include <vector>
 
 #include "src/alohalytics.h"
-#include "src/event_base.h"
+#include "src/event_encoder.h"
 #include "src/file_manager.h"
 #include "src/gzip_wrapper.h"
 #include "src/http_client.h"
+#include "src/latency_histogram.h"
 #include "src/logger.h"
-
-// TODO(AlexZ): Refactor out cereal library - it's too heavy overkill for us.
-#include "src/cereal/include/archives/binary.hpp"
-#include "src/cereal/include/types/string.hpp"
-#include "src/cereal/include/types/map.hpp"
+#include "src/upload_hint.h"
 
 #define LOG_IF_DEBUG(...)                                  \
   if (debug_mode_) {                                       \
@@ -56,11 +56,40 @@ namespace alohalytics {
 
 static constexpr const char * kAlohalyticsHTTPContentType = "application/alohalytics-binary-blob";
 
+static uint64_t MicrosecondsSince(std::chrono::steady_clock::time_point start) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+static int64_t SteadyMicroseconds() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 // Use alohalytics::Stats::Instance() to access statistics engine.
 Stats::Stats()
     : messages_queue_(
           std::bind(&Stats::GzipAndArchiveFileInTheQueue, this, std::placeholders::_1, std::placeholders::_2)) {}
 
+Stats::~Stats() {
+  {
+    std::lock_guard<std::mutex> lock(shared_ring_mutex_);
+    shared_ring_thread_should_exit_ = true;
+    shared_ring_condition_variable_.notify_all();
+  }
+  if (shared_ring_thread_.joinable()) {
+    shared_ring_thread_.join();
+  }
+  {
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    upload_thread_should_exit_ = true;
+    upload_condition_variable_.notify_all();
+  }
+  if (upload_thread_.joinable()) {
+    upload_thread_.join();
+  }
+}
+
 void Stats::Disable() {
   LOG_IF_DEBUG("Statistics collection disabled.");
   enabled_ = false;
@@ -72,19 +101,20 @@ void Stats::Enable() {
 }
 
 void Stats::GzipAndArchiveFileInTheQueue(const std::string & in_file, const std::string & out_archive) {
+  ALOHALYTICS_LATENCY_SCOPE(archive);
   std::string encoded_unique_client_id;
   if (unique_client_id_.empty()) {
     LOG_IF_DEBUG(
         "Warning: unique client id was not set in GzipAndArchiveFileInTheQueue,"
         "statistics will be completely anonymous and hard to process on the server.");
   } else {
-    // Pre-calculation for special ID event.
+    // Pre-calculation for special ID event (AlohalyticsIdEvent).
     // We do it for every archived file to have a fresh timestamp.
-    AlohalyticsIdEvent event;
-    event.id = unique_client_id_;
-    std::ostringstream ostream;
-    { cereal::BinaryOutputArchive(ostream) << std::unique_ptr<AlohalyticsBaseEvent, NoOpDeleter>(&event); }
-    encoded_unique_client_id = ostream.str();
+    encoded_unique_client_id.resize(EventEncoder::EventHeaderSize(kIdEventType) +
+                                    EventEncoder::StringSize(unique_client_id_.size()));
+    EventEncoder(&encoded_unique_client_id[0])
+        .EventHeader(kIdEventType, EventEncoder::CurrentTimestamp())
+        .String(unique_client_id_);
   }
   LOG_IF_DEBUG("Archiving", in_file, "to", out_archive);
   // Append unique installation id in the beginning of each archived file.
@@ -108,7 +138,11 @@ void Stats::GzipAndArchiveFileInTheQueue(const std::string & in_file, const std:
       std::ofstream fo;
       fo.exceptions(std::ifstream::failbit | std::ifstream::badbit);
       fo.open(out_archive, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+      const auto gzip_start = std::chrono::steady_clock::now();
       const std::string gzipped_buffer = Gzip(buffer);
+      gzip_time_us_.fetch_add(MicrosecondsSince(gzip_start), std::memory_order_relaxed);
+      archived_bytes_before_gzip_.fetch_add(buffer.size(), std::memory_order_relaxed);
+      archived_bytes_after_gzip_.fetch_add(gzipped_buffer.size(), std::memory_order_relaxed);
       std::string().swap(buffer);  // Free memory.
       fo.write(gzipped_buffer.data(), gzipped_buffer.size());
     }
@@ -140,97 +174,671 @@ Stats & Stats::SetServerUrl(const std::string & url_to_upload_statistics_to) {
   return *this;
 }
 
+// Every channel has it's own subdirectory in the storage.
+static void SetChannelStorageDirectory(const std::string & storage_path,
+                                       const std::string & channel_name,
+                                       THundredKilobytesFileQueue & queue) {
+  std::string directory = storage_path;
+  FileManager::AppendDirectorySlash(directory);
+  directory += channel_name;
+  if (FileManager::MakeDirectory(directory)) {
+    queue.SetStorageDirectory(directory);
+  } else {
+    ALOG("ERROR: Can't create directory", directory, "for channel", channel_name);
+  }
+}
+
 Stats & Stats::SetStoragePath(const std::string & full_path_to_storage_with_a_slash_at_the_end) {
   LOG_IF_DEBUG("Set storage path:", full_path_to_storage_with_a_slash_at_the_end);
-  messages_queue_.SetStorageDirectory(full_path_to_storage_with_a_slash_at_the_end);
+  const bool shared = OpenSharedStorage(full_path_to_storage_with_a_slash_at_the_end);
+  if (!shared) {
+    messages_queue_.SetStorageDirectory(full_path_to_storage_with_a_slash_at_the_end);
+  }
+  std::lock_guard<std::mutex> lock(upload_mutex_);
+  storage_path_ = full_path_to_storage_with_a_slash_at_the_end;
+  // In the shared mode only the writer stores channels, see DrainSharedRing().
+  if (!shared) {
+    for (size_t i = 1; i < channels_count_; ++i) {
+      SetChannelStorageDirectory(storage_path_, channels_[i]->name, channels_[i]->queue);
+    }
+  }
+  return *this;
+}
+
+Stats & Stats::EnableSharedStorage(uint32_t ring_capacity) {
+  LOG_IF_DEBUG("Enable shared storage with ring capacity", ring_capacity);
+  std::lock_guard<std::mutex> lock(shared_ring_mutex_);
+  shared_ring_capacity_ = ring_capacity;
   return *this;
 }
 
+bool Stats::OpenSharedStorage(const std::string & storage_path) {
+  std::lock_guard<std::mutex> lock(shared_ring_mutex_);
+  if (shared_ring_capacity_ == 0) {
+    return false;
+  }
+  if (shared_ring_owner_) {
+    LOG_IF_DEBUG("ERROR: Shared storage path can't be changed.");
+    return true;
+  }
+  shared_storage_path_ = storage_path;
+  FileManager::AppendDirectorySlash(shared_storage_path_);
+  std::unique_ptr<SharedRing> ring(new SharedRing());
+  if (!ring->Open(shared_storage_path_ + kSharedRingFileName, shared_ring_capacity_)) {
+    LOG_IF_DEBUG("ERROR: Can't open shared ring in", shared_storage_path_, ", shared storage is disabled.");
+    return false;
+  }
+  spill_file_path_ = SpillFilePath(shared_storage_path_);
+  shared_ring_owner_ = std::move(ring);
+  shared_ring_.store(shared_ring_owner_.get(), std::memory_order_release);
+  // Storage directories of the queues are set only if this process becomes the writer.
+  DrainSharedRing();
+  shared_ring_thread_ = std::thread(&Stats::SharedRingThread, this);
+  return true;
+}
+
+void Stats::DrainSharedRing() {
+  SharedRing & ring = *shared_ring_owner_;
+  if (!ring.IsWriter()) {
+    if (!ring.TryBecomeWriter()) {
+      return;
+    }
+    LOG_IF_DEBUG("This process is the writer of the shared storage", shared_storage_path_);
+    messages_queue_.SetStorageDirectory(shared_storage_path_);
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    // SetStoragePath() may not have set it yet, but AddChannel() needs it from now on.
+    storage_path_ = shared_storage_path_;
+    for (size_t i = 1; i < channels_count_; ++i) {
+      SetChannelStorageDirectory(storage_path_, channels_[i]->name, channels_[i]->queue);
+    }
+    shared_writer_.store(true, std::memory_order_release);
+    next_spill_files_adoption_ = std::chrono::steady_clock::time_point();
+  }
+  size_t channels_count;
+  {
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    channels_count = channels_count_;
+  }
+  std::string messages[kMaxChannels];
+  const auto route = [this, &messages, channels_count](const char * message, size_t size) {
+    if (size == 0) {
+      return;
+    }
+    size_t channel = static_cast<unsigned char>(message[0]);
+    if (channel >= channels_count) {
+      LOG_IF_DEBUG("ERROR: Unknown channel", channel, "in the shared storage, event is stored in the default one.");
+      channel = 0;
+    }
+    messages[channel].append(message + 1, size - 1);
+  };
+  ring.Drain(route);
+  const auto now = std::chrono::steady_clock::now();
+  if (now >= next_spill_files_adoption_) {
+    next_spill_files_adoption_ = now + std::chrono::seconds(5);
+    // Includes files renamed by a previous writer which has crashed before it has deleted them.
+    FileManager::ForEachFileInDir(shared_storage_path_, [this, &route](const std::string & full_path) {
+      if (0 == full_path.compare(shared_storage_path_.size(), std::strlen(kSpillFilePrefix), kSpillFilePrefix) &&
+          !DrainSpillFile(full_path, route)) {
+        LOG_IF_DEBUG("ERROR: Can't adopt spill file", full_path);
+      }
+      return true;
+    });
+  }
+  for (size_t i = 0; i < channels_count; ++i) {
+    if (!messages[i].empty()) {
+      Queue(static_cast<uint32_t>(i)).PushMessage(messages[i]);
+      if (i != 0) {
+        ScheduleChannelUpload(*channels_[i]);
+      }
+    }
+  }
+}
+
+void Stats::SharedRingThread() {
+  std::unique_lock<std::mutex> lock(shared_ring_mutex_);
+  while (!shared_ring_thread_should_exit_) {
+    shared_ring_condition_variable_.wait_for(lock, std::chrono::milliseconds(100));
+    DrainSharedRing();
+  }
+}
+
 Stats & Stats::SetClientId(const std::string & unique_client_id) {
   LOG_IF_DEBUG("Set unique client id:", unique_client_id);
   unique_client_id_ = unique_client_id;
   return *this;
 }
 
-static inline void LogEventImpl(AlohalyticsBaseEvent const & event, THundredKilobytesFileQueue & messages_queue) {
-  std::ostringstream sstream;
-  {
-    // unique_ptr is used to correctly serialize polymorphic types.
-    cereal::BinaryOutputArchive(sstream) << std::unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event);
+// Client event type names table, indexed by [value or pairs][has location], see event_encoder.h.
+static const char * const kEventTypes[3][2] = {{kKeyEventType, kKeyLocationEventType},
+                                               {kKeyValueEventType, kKeyValueLocationEventType},
+                                               {kKeyPairsEventType, kKeyPairsLocationEventType}};
+
+template <typename TWriter>
+void Stats::PushMessage(uint32_t channel, size_t message_size, TWriter && writer) {
+  SharedRing * ring = shared_ring_.load(std::memory_order_acquire);
+  if (!ring) {
+    Queue(channel).PushMessage(message_size, writer);
+    return;
   }
-  messages_queue.PushMessage(sstream.str());
+  const auto tagged_writer = [channel, &writer](char * out) {
+    *out = static_cast<char>(channel);
+    writer(out + 1);
+  };
+  if (ring->Push(message_size + 1, tagged_writer)) {
+    return;
+  }
+  // Ring is full or message is too big. Only the writer's queues have storage directories.
+  if (shared_writer_.load(std::memory_order_acquire)) {
+    Queue(channel).PushMessage(message_size, writer);
+  } else if (!AppendToSpillFile(spill_file_path_, message_size + 1, tagged_writer)) {
+    LOG_IF_DEBUG("ERROR: Can't append to", spill_file_path_, ", event is lost.");
+  }
+}
+
+namespace {
+// Event with an optional value or pairs and location, which is written exactly as cereal does it
+// for the corresponding Alohalytics*Event type. Referenced strings and pairs should outlive it.
+class EventWriter {
+ public:
+  EventWriter(std::string const & key, std::string const * value, TStringMap const * pairs, Location const * location)
+      : type_(kEventTypes[value ? 1 : (pairs ? 2 : 0)][location ? 1 : 0]),
+        type_size_(std::strlen(type_)),
+        key_(&key),
+        value_(value),
+        pairs_(pairs),
+        has_location_(location != nullptr) {
+    if (location) {
+      encoded_location_ = location->Encode();
+    }
+  }
+
+  size_t Size() const {
+    size_t size =
+        EventEncoder::PolymorphicHeaderSize(type_size_) + sizeof(uint64_t) + EventEncoder::StringSize(key_->size());
+    if (value_) {
+      size += EventEncoder::StringSize(value_->size());
+    } else if (pairs_) {
+      size += EventEncoder::PairsSize(*pairs_);
+    }
+    if (has_location_) {
+      size += EventEncoder::StringSize(encoded_location_.size());
+    }
+    return size;
+  }
+
+  // Returns pointer to the end of written data.
+  char * Write(char * out, uint64_t timestamp) const {
+    EventEncoder encoder(out);
+    encoder.PolymorphicHeader(type_, type_size_).UInt64(timestamp).String(*key_);
+    if (value_) {
+      encoder.String(*value_);
+    } else if (pairs_) {
+      encoder.Pairs(*pairs_);
+    }
+    if (has_location_) {
+      encoder.String(encoded_location_);
+    }
+    return out + Size();
+  }
+
+ private:
+  const char * type_;
+  size_t type_size_;
+  std::string const * key_;
+  std::string const * value_;
+  TStringMap const * pairs_;
+  bool has_location_;
+  std::string encoded_location_;
+};
+}  // namespace
+
+void Stats::PushEvent(uint32_t channel,
+                      std::string const & key,
+                      std::string const * value,
+                      TStringMap const * pairs,
+                      Location const * location) {
+  const EventWriter event(key, value, pairs, location);
+  const uint64_t timestamp = EventEncoder::CurrentTimestamp();
+  PushMessage(channel, event.Size(), [&](char * out) { event.Write(out, timestamp); });
+}
+
+// Sampled events are always stored as pairs events with an additional kSamplingRateKey pair,
+// so the server can re-weight them. Single value (if any) is stored with kSampledValueKey.
+void Stats::LogSampledEvent(uint32_t channel,
+                            std::string const & event_name,
+                            TStringMap pairs,
+                            Location const * location,
+                            double sampling_rate) {
+  const Field rate(kSamplingRateKey, sampling_rate);
+  pairs[kSamplingRateKey].assign(rate.Value(), rate.ValueSize());
+  PushEvent(channel, event_name, nullptr, &pairs, location);
 }
 
 void Stats::LogEvent(std::string const & event_name) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
   LOG_IF_DEBUG("LogEvent:", event_name);
   if (enabled_) {
-    AlohalyticsKeyEvent event;
-    event.key = event_name;
-    LogEventImpl(event, messages_queue_);
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, TStringMap(), nullptr, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, nullptr, nullptr, nullptr);
+    }
+    OnEventLogged(verdict.channel);
   }
 }
 
 void Stats::LogEvent(std::string const & event_name, Location const & location) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
   LOG_IF_DEBUG("LogEvent:", event_name, location.ToDebugString());
   if (enabled_) {
-    AlohalyticsKeyLocationEvent event;
-    event.key = event_name;
-    event.location = location;
-    LogEventImpl(event, messages_queue_);
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, TStringMap(), &location, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, nullptr, nullptr, &location);
+    }
+    OnEventLogged(verdict.channel);
   }
 }
 
 void Stats::LogEvent(std::string const & event_name, std::string const & event_value) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
   LOG_IF_DEBUG("LogEvent:", event_name, "=", event_value);
   if (enabled_) {
-    AlohalyticsKeyValueEvent event;
-    event.key = event_name;
-    event.value = event_value;
-    LogEventImpl(event, messages_queue_);
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, {{kSampledValueKey, event_value}}, nullptr, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, &event_value, nullptr, nullptr);
+    }
+    OnEventLogged(verdict.channel);
   }
 }
 
 void Stats::LogEvent(std::string const & event_name, std::string const & event_value, Location const & location) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
   LOG_IF_DEBUG("LogEvent:", event_name, "=", event_value, location.ToDebugString());
   if (enabled_) {
-    AlohalyticsKeyValueLocationEvent event;
-    event.key = event_name;
-    event.value = event_value;
-    event.location = location;
-    LogEventImpl(event, messages_queue_);
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, {{kSampledValueKey, event_value}}, &location, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, &event_value, nullptr, &location);
+    }
+    OnEventLogged(verdict.channel);
   }
 }
 
 void Stats::LogEvent(std::string const & event_name, TStringMap const & value_pairs) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
   LOG_IF_DEBUG("LogEvent:", event_name, "=", value_pairs);
   if (enabled_) {
-    AlohalyticsKeyPairsEvent event;
-    event.key = event_name;
-    event.pairs = value_pairs;
-    LogEventImpl(event, messages_queue_);
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, value_pairs, nullptr, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, nullptr, &value_pairs, nullptr);
+    }
+    OnEventLogged(verdict.channel);
   }
 }
 
 void Stats::LogEvent(std::string const & event_name, TStringMap const & value_pairs, Location const & location) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
   LOG_IF_DEBUG("LogEvent:", event_name, "=", value_pairs, location.ToDebugString());
   if (enabled_) {
-    AlohalyticsKeyPairsLocationEvent event;
-    event.key = event_name;
-    event.pairs = value_pairs;
-    event.location = location;
-    LogEventImpl(event, messages_queue_);
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, value_pairs, &location, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, nullptr, &value_pairs, &location);
+    }
+    OnEventLogged(verdict.channel);
   }
 }
 
+void Stats::LogEvent(std::string const & event_name, TStringMap && value_pairs) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
+  LOG_IF_DEBUG("LogEvent:", event_name, "=", value_pairs);
+  if (enabled_) {
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, std::move(value_pairs), nullptr, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, nullptr, &value_pairs, nullptr);
+    }
+    OnEventLogged(verdict.channel);
+  }
+}
+
+void Stats::LogEvent(std::string const & event_name, TStringMap && value_pairs, Location const & location) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
+  LOG_IF_DEBUG("LogEvent:", event_name, "=", value_pairs, location.ToDebugString());
+  if (enabled_) {
+    if (verdict.sampling_rate < 1.) {
+      LogSampledEvent(verdict.channel, event_name, std::move(value_pairs), &location, verdict.sampling_rate);
+    } else {
+      PushEvent(verdict.channel, event_name, nullptr, &value_pairs, &location);
+    }
+    OnEventLogged(verdict.channel);
+  }
+}
+
+void Stats::LogEvents(Event const * events, size_t events_count) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  // Events are grouped by channels, every group is pushed into the channel's queue at once.
+  std::vector<EventWriter> batches[kMaxChannels];
+  size_t batch_sizes[kMaxChannels] = {};
+  for (size_t i = 0; i < events_count; ++i) {
+    Event const & event = events[i];
+    EventRules::Verdict verdict;
+    if (!event_rules_.Check(event.name, verdict)) {
+      continue;
+    }
+    LOG_IF_DEBUG("LogEvent:", event.name, "=", event.value, event.pairs, event.location.ToDebugString());
+    if (!enabled_) {
+      continue;
+    }
+    Location const * location = event.has_location ? &event.location : nullptr;
+    if (verdict.sampling_rate < 1.) {
+      // Rare case, sampled events are logged one by one.
+      LogSampledEvent(verdict.channel, event.name,
+                      event.has_pairs ? event.pairs
+                                      : (event.has_value ? TStringMap{{kSampledValueKey, event.value}} : TStringMap()),
+                      location, verdict.sampling_rate);
+    } else {
+      std::vector<EventWriter> & batch = batches[verdict.channel];
+      if (batch.empty()) {
+        batch.reserve(events_count - i);
+      }
+      batch.emplace_back(event.name, event.has_value ? &event.value : nullptr, event.has_pairs ? &event.pairs : nullptr,
+                         location);
+      batch_sizes[verdict.channel] += batch.back().Size();
+    }
+    OnEventLogged(verdict.channel);
+  }
+  const uint64_t timestamp = EventEncoder::CurrentTimestamp();
+  for (uint32_t channel = 0; channel < kMaxChannels; ++channel) {
+    std::vector<EventWriter> const & batch = batches[channel];
+    if (!batch.empty()) {
+      PushMessage(channel, batch_sizes[channel], [&batch, timestamp](char * out) {
+        for (EventWriter const & event : batch) {
+          out = event.Write(out, timestamp);
+        }
+      });
+    }
+  }
+}
+
+// Used for debug logging only.
+static TStringMap FieldsToStringMap(Field const * const * fields, size_t fields_count) {
+  TStringMap pairs;
+  for (size_t i = 0; i < fields_count; ++i) {
+    pairs.emplace(std::string(fields[i]->Name(), fields[i]->NameSize()),
+                  std::string(fields[i]->Value(), fields[i]->ValueSize()));
+  }
+  return pairs;
+}
+
+void Stats::LogFieldsEvent(std::string const & event_name, Field const ** fields, size_t fields_count) {
+  ALOHALYTICS_LATENCY_SCOPE(log_event);
+  EventRules::Verdict verdict;
+  if (!event_rules_.Check(event_name, verdict)) {
+    return;
+  }
+  LOG_IF_DEBUG("LogEvent:", event_name, "=", FieldsToStringMap(fields, fields_count));
+  if (enabled_) {
+    if (verdict.sampling_rate < 1.) {
+      LogSampledFieldsEvent(verdict.channel, event_name, fields, fields_count, verdict.sampling_rate);
+    } else {
+      PushFieldsEvent(verdict.channel, event_name, fields, fields_count);
+    }
+    OnEventLogged(verdict.channel);
+  }
+}
+
+void Stats::LogSampledFieldsEvent(uint32_t channel,
+                                  std::string const & event_name,
+                                  Field const ** fields,
+                                  size_t fields_count,
+                                  double sampling_rate) {
+  // fields array always has one spare slot at the end.
+  const Field rate(kSamplingRateKey, sampling_rate);
+  fields[fields_count] = &rate;
+  PushFieldsEvent(channel, event_name, fields, fields_count + 1);
+}
+
+void Stats::PushFieldsEvent(uint32_t channel,
+                            std::string const & event_name,
+                            Field const ** fields,
+                            size_t fields_count) {
+  // Server expects pairs in std::map's order.
+  std::sort(fields, fields + fields_count, &Field::NameLess);
+  const uint64_t timestamp = EventEncoder::CurrentTimestamp();
+  PushMessage(channel, EventEncoder::KeyPairsEventSize(event_name, fields, fields_count), [&](char * out) {
+    EventEncoder(out).KeyPairsEvent(timestamp, event_name, fields, fields_count);
+  });
+}
+
+Stats & Stats::AddChannel(const std::string & channel_name,
+                          std::streamoff max_archive_size,
+                          std::chrono::seconds upload_delay) {
+  LOG_IF_DEBUG("Add channel", channel_name, "with archive size", max_archive_size, "and upload delay",
+               upload_delay.count(), "seconds");
+  std::lock_guard<std::mutex> lock(upload_mutex_);
+  if (channels_count_ == kMaxChannels) {
+    LOG_IF_DEBUG("ERROR: Too many channels,", channel_name, "was not created.");
+    return *this;
+  }
+  for (size_t i = 1; i < channels_count_; ++i) {
+    if (channels_[i]->name == channel_name) {
+      LOG_IF_DEBUG("ERROR: Channel", channel_name, "already exists.");
+      return *this;
+    }
+  }
+  channels_[channels_count_].reset(new Channel(
+      channel_name, std::bind(&Stats::GzipAndArchiveFileInTheQueue, this, std::placeholders::_1, std::placeholders::_2),
+      max_archive_size, upload_delay));
+  // In the shared mode only the writer stores channels.
+  if (!storage_path_.empty() && (!shared_ring_.load(std::memory_order_acquire) || shared_writer_)) {
+    SetChannelStorageDirectory(storage_path_, channel_name, channels_[channels_count_]->queue);
+  }
+  ++channels_count_;
+  if (upload_delay.count() > 0 && !upload_thread_.joinable()) {
+    upload_thread_ = std::thread(&Stats::UploadThread, this);
+  }
+  return *this;
+}
+
+Stats & Stats::SetEventChannel(std::string const & event_name, const std::string & channel_name) {
+  LOG_IF_DEBUG("Set channel", channel_name, "for", event_name);
+  uint32_t channel = 0;
+  {
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    for (size_t i = 1; i < channels_count_; ++i) {
+      if (channels_[i]->name == channel_name) {
+        channel = static_cast<uint32_t>(i);
+      }
+    }
+  }
+  if (channel == 0) {
+    LOG_IF_DEBUG("ERROR: Channel", channel_name, "does not exist.");
+  } else if (!event_rules_.SetChannel(event_name, channel)) {
+    LOG_IF_DEBUG("ERROR: Too many event rules, channel for", event_name, "was not set.");
+  }
+  return *this;
+}
+
+void Stats::ScheduleChannelUpload(Channel & channel) {
+  if (channel.upload_delay.count() == 0 || channel.upload_scheduled.exchange(true)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(upload_mutex_);
+  channel.upload_pending = true;
+  channel.upload_deadline = std::chrono::steady_clock::now() + channel.upload_delay;
+  upload_condition_variable_.notify_all();
+}
+
+void Stats::UploadThread() {
+  std::unique_lock<std::mutex> lock(upload_mutex_);
+  while (!upload_thread_should_exit_) {
+    const auto now = std::chrono::steady_clock::now();
+    auto next_deadline = std::chrono::steady_clock::time_point::max();
+    for (size_t i = 1; i < channels_count_; ++i) {
+      Channel & channel = *channels_[i];
+      if (!channel.upload_pending) {
+        continue;
+      }
+      if (channel.upload_deadline <= now) {
+        channel.upload_pending = false;
+        // Events logged from now on schedule the next upload.
+        channel.upload_scheduled = false;
+        if (enabled_ && !upload_url_.empty()) {
+          LOG_IF_DEBUG("Uploading channel", channel.name);
+          channel.queue.ProcessArchivedFiles(
+              std::bind(&Stats::UploadFileImpl, this, std::placeholders::_1, std::placeholders::_2));
+        }
+      } else if (channel.upload_deadline < next_deadline) {
+        next_deadline = channel.upload_deadline;
+      }
+    }
+    if (next_deadline == std::chrono::steady_clock::time_point::max()) {
+      upload_condition_variable_.wait(lock);
+    } else {
+      upload_condition_variable_.wait_until(lock, next_deadline);
+    }
+  }
+}
+
+Stats & Stats::SetEventSampling(std::string const & event_name, double sampling_rate) {
+  LOG_IF_DEBUG("Set sampling rate for", event_name, "to", sampling_rate);
+  if (!event_rules_.SetSampling(event_name, sampling_rate)) {
+    LOG_IF_DEBUG("ERROR: Too many event rules, sampling for", event_name, "was not set.");
+  }
+  return *this;
+}
+
+Stats & Stats::SetEventRateLimit(std::string const & event_name, double events_per_second, uint32_t max_burst) {
+  LOG_IF_DEBUG("Set rate limit for", event_name, "to", events_per_second, "events per second with burst", max_burst);
+  if (!event_rules_.SetRateLimit(event_name, events_per_second, max_burst)) {
+    LOG_IF_DEBUG("ERROR: Too many event rules, rate limit for", event_name, "was not set.");
+  }
+  return *this;
+}
+
+EngineMetrics Stats::GetMetrics() {
+  EngineMetrics metrics;
+  metrics.events_logged = events_logged_.load(std::memory_order_relaxed);
+  metrics.events_dropped = event_rules_.RateLimitedCount();
+  metrics.events_sampled_out = event_rules_.SampledOutCount();
+  size_t channels_count;
+  {
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    channels_count = channels_count_;
+  }
+  for (size_t i = 0; i < channels_count; ++i) {
+    const QueueMetrics queue = Queue(static_cast<uint32_t>(i)).GetMetrics();
+    metrics.queues.messages_buffer_bytes += queue.messages_buffer_bytes;
+    metrics.queues.inmemory_storage_bytes += queue.inmemory_storage_bytes;
+    metrics.queues.worker_queue_depth += queue.worker_queue_depth;
+    metrics.queues.archived_files += queue.archived_files;
+  }
+  metrics.archived_bytes_before_gzip = archived_bytes_before_gzip_.load(std::memory_order_relaxed);
+  metrics.archived_bytes_after_gzip = archived_bytes_after_gzip_.load(std::memory_order_relaxed);
+  metrics.gzip_time_us = gzip_time_us_.load(std::memory_order_relaxed);
+  metrics.upload_attempts = upload_attempts_.load(std::memory_order_relaxed);
+  metrics.upload_failures = upload_failures_.load(std::memory_order_relaxed);
+  metrics.uploaded_bytes = uploaded_bytes_.load(std::memory_order_relaxed);
+  metrics.upload_time_us = upload_time_us_.load(std::memory_order_relaxed);
+  metrics.uploads_deferred = uploads_deferred_.load(std::memory_order_relaxed);
+  return metrics;
+}
+
+Stats & Stats::EnableMetricsEvent(bool enable) {
+  LOG_IF_DEBUG(enable ? "Enabled" : "Disabled", "metrics event.");
+  metrics_event_enabled_ = enable;
+  return *this;
+}
+
 void Stats::Upload(TFileProcessingFinishedCallback upload_finished_callback) {
   if (upload_url_.empty()) {
     LOG_IF_DEBUG("Warning: upload server url has not been set, nothing was uploaded.");
     return;
   }
+  if (metrics_event_enabled_) {
+    const EngineMetrics m = GetMetrics();
+    LogEvent(kMetricsEvent, Field("events_logged", m.events_logged), Field("events_dropped", m.events_dropped),
+             Field("events_sampled_out", m.events_sampled_out),
+             Field("messages_buffer_bytes", m.queues.messages_buffer_bytes),
+             Field("inmemory_storage_bytes", m.queues.inmemory_storage_bytes),
+             Field("worker_queue_depth", m.queues.worker_queue_depth),
+             Field("archived_files", m.queues.archived_files),
+             Field("archived_bytes_before_gzip", m.archived_bytes_before_gzip),
+             Field("archived_bytes_after_gzip", m.archived_bytes_after_gzip), Field("gzip_time_us", m.gzip_time_us),
+             Field("upload_attempts", m.upload_attempts), Field("upload_failures", m.upload_failures),
+             Field("uploaded_bytes", m.uploaded_bytes), Field("upload_time_us", m.upload_time_us),
+             Field("uploads_deferred", m.uploads_deferred));
+  }
   if (enabled_) {
     LOG_IF_DEBUG("Trying to upload collected statistics to", upload_url_);
-    messages_queue_.ProcessArchivedFiles(
-        std::bind(&Stats::UploadFileImpl, this, std::placeholders::_1, std::placeholders::_2), upload_finished_callback);
+    if (shared_ring_.load(std::memory_order_acquire)) {
+      // Writer uploads everything which other processes have logged so far.
+      std::lock_guard<std::mutex> lock(shared_ring_mutex_);
+      DrainSharedRing();
+    }
+    std::lock_guard<std::mutex> lock(upload_mutex_);
+    // Callback is called once, when all channels are processed.
+    struct UploadState {
+      std::mutex mutex;
+      size_t channels_left;
+      ProcessingResult result = ProcessingResult::ENothingToProcess;
+      TFileProcessingFinishedCallback callback;
+    };
+    std::shared_ptr<UploadState> state = std::make_shared<UploadState>();
+    state->channels_left = channels_count_;
+    state->callback = upload_finished_callback;
+    const TFileProcessingFinishedCallback channel_finished = [state](ProcessingResult result) {
+      std::unique_lock<std::mutex> state_lock(state->mutex);
+      if (result == ProcessingResult::EProcessingError || (result == ProcessingResult::EProcessedSuccessfully &&
+                                                           state->result == ProcessingResult::ENothingToProcess)) {
+        state->result = result;
+      }
+      if (--state->channels_left == 0 && state->callback) {
+        state_lock.unlock();
+        state->callback(state->result);
+      }
+    };
+    for (size_t i = 0; i < channels_count_; ++i) {
+      Queue(static_cast<uint32_t>(i))
+          .ProcessArchivedFiles(std::bind(&Stats::UploadFileImpl, this, std::placeholders::_1, std::placeholders::_2),
+                                channel_finished);
+    }
   } else {
     LOG_IF_DEBUG("Statistics is disabled. Nothing was uploaded.");
   }
@@ -239,23 +847,62 @@ void Stats::Upload(TFileProcessingFinishedCallback upload_finished_callback) {
 bool Stats::UploadFileImpl(bool file_name_in_content, const std::string & content) {
   // This code should never be called if upload_url_ was not set.
   assert(!upload_url_.empty());
+  std::lock_guard<std::mutex> lock(upload_request_mutex_);
+  // Data is kept in the queue and uploaded later.
+  if (SteadyMicroseconds() < upload_not_before_us_.load(std::memory_order_relaxed)) {
+    uploads_deferred_.fetch_add(1, std::memory_order_relaxed);
+    LOG_IF_DEBUG("Upload is deferred as requested by the server.");
+    return false;
+  }
   HTTPClientPlatformWrapper request(upload_url_);
   request.set_debug_mode(debug_mode_);
+  upload_attempts_.fetch_add(1, std::memory_order_relaxed);
+  const auto upload_start = std::chrono::steady_clock::now();
 
+  bool upload_succeeded = false;
   try {
+    uint64_t body_size;
     if (file_name_in_content) {
+      body_size = FileManager::GetFileSize(content);
       request.set_body_file(content, kAlohalyticsHTTPContentType, "POST", "gzip");
     } else {
-      request.set_body_data(alohalytics::Gzip(content), kAlohalyticsHTTPContentType, "POST", "gzip");
+      std::string gzipped = alohalytics::Gzip(content);
+      body_size = gzipped.size();
+      request.set_body_data(std::move(gzipped), kAlohalyticsHTTPContentType, "POST", "gzip");
     }
-    const bool uploadSucceeded = request.RunHTTPRequest() && 200 == request.error_code() && !request.was_redirected();
+    upload_succeeded = request.RunHTTPRequest() && 200 == request.error_code() && !request.was_redirected();
     LOG_IF_DEBUG("RunHTTPRequest has returned code", request.error_code(),
                  request.was_redirected() ? "and request was redirected to " + request.url_received() : " ");
-    return uploadSucceeded;
+    if (upload_succeeded) {
+      uploaded_bytes_.fetch_add(body_size, std::memory_order_relaxed);
+    }
+    // Overloaded server can reply with an error status, but still with a hint.
+    if (request.error_code() > 0 && !request.was_redirected()) {
+      ApplyUploadHint(request.server_response());
+    }
   } catch (const std::exception & ex) {
     LOG_IF_DEBUG("Exception in UploadFileImpl:", ex.what());
   }
-  return false;
+  upload_time_us_.fetch_add(MicrosecondsSince(upload_start), std::memory_order_relaxed);
+  if (!upload_succeeded) {
+    upload_failures_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return upload_succeeded;
+}
+
+void Stats::ApplyUploadHint(const std::string & server_response) {
+  const UploadHint hint = UploadHint::Parse(server_response);
+  if (hint.retry_after_seconds) {
+    LOG_IF_DEBUG("Server has asked to retry uploads in", hint.retry_after_seconds, "seconds.");
+    upload_not_before_us_.store(SteadyMicroseconds() + int64_t(hint.retry_after_seconds) * 1000000,
+                                std::memory_order_relaxed);
+  }
+  // Every reply without sampling_percent key restores full sampling.
+  const double sampling_rate = hint.sampling_percent / 100.;
+  if (sampling_rate != event_rules_.DefaultChannelSampling()) {
+    LOG_IF_DEBUG("Server has asked to sample default channel events at", sampling_rate);
+    event_rules_.SetDefaultChannelSampling(sampling_rate);
+  }
 }
 
 }  // namespace alohalytics
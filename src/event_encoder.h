@@ -0,0 +1,151 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Minimal writer which produces exactly the same bytes as cereal::BinaryOutputArchive does for
+// std::unique_ptr<AlohalyticsBaseEvent> with a registered polymorphic type.
+// It is used on a client side to serialize events directly into the queue's buffer,
+// without temporary streams, containers and cereal's polymorphic machinery.
+// Server decodes these events with cereal as before.
+
+#ifndef EVENT_ENCODER_H
+#define EVENT_ENCODER_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>  // memcpy
+#include <map>
+#include <string>
+
+#include "src/event_field.h"
+
+namespace alohalytics {
+
+// Constant table of client events' type names, should be equal to the names registered
+// with CEREAL_REGISTER_TYPE_WITH_NAME in event_base.h (see test_event_encoder.cc).
+// Client does not need cereal's polymorphic types registration at all.
+constexpr char kIdEventType[] = "i";
+constexpr char kKeyEventType[] = "k";
+constexpr char kKeyValueEventType[] = "v";
+constexpr char kKeyPairsEventType[] = "p";
+constexpr char kKeyLocationEventType[] = "kl";
+constexpr char kKeyValueLocationEventType[] = "vl";
+constexpr char kKeyPairsLocationEventType[] = "pl";
+
+class EventEncoder {
+  char * out_;
+
+  template <typename T>
+  EventEncoder & Raw(const T & value) {
+    std::memcpy(out_, &value, sizeof(value));
+    out_ += sizeof(value);
+    return *this;
+  }
+
+ public:
+  // Every event is serialized by a separate archive, so the polymorphic type always gets id 1
+  // and is followed by its registered name (see CEREAL_REGISTER_TYPE_WITH_NAME in event_base.h).
+  static constexpr uint32_t kFirstPolymorphicTypeId = 0x80000001;
+
+  // Serialized size of std::string.
+  static size_t StringSize(size_t size) { return sizeof(uint64_t) + size; }
+  // Serialized size of polymorphic type id, its name and unique_ptr's validity flag.
+  static size_t PolymorphicHeaderSize(size_t type_name_size) {
+    return sizeof(uint32_t) + StringSize(type_name_size) + sizeof(uint8_t);
+  }
+
+  // The same as AlohalyticsBaseEvent::CurrentTimestamp(), milliseconds since epoch.
+  static uint64_t CurrentTimestamp() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::system_clock::now().time_since_epoch()).count());
+  }
+
+  // Serialized size of polymorphic header and event's timestamp, common for all events.
+  template <size_t N>
+  static size_t EventHeaderSize(const char (&)[N]) {
+    return PolymorphicHeaderSize(N - 1) + sizeof(uint64_t);
+  }
+  // Serialized size of std::map<std::string, std::string>.
+  static size_t PairsSize(const std::map<std::string, std::string> & pairs) {
+    size_t size = sizeof(uint64_t);
+    for (const auto & pair : pairs) {
+      size += StringSize(pair.first.size()) + StringSize(pair.second.size());
+    }
+    return size;
+  }
+
+  // out should point to the buffer which is big enough to hold all written data.
+  explicit EventEncoder(char * out) : out_(out) {}
+
+  EventEncoder & PolymorphicHeader(const char * type_name, size_t type_name_size) {
+    Raw(uint32_t(kFirstPolymorphicTypeId));
+    String(type_name, type_name_size);
+    return Raw(uint8_t(1));
+  }
+
+  // Event type should be one of k...EventType constants above.
+  template <size_t N>
+  EventEncoder & EventHeader(const char (&type)[N], uint64_t timestamp) {
+    return PolymorphicHeader(type, N - 1).UInt64(timestamp);
+  }
+
+  EventEncoder & UInt64(uint64_t value) { return Raw(value); }
+
+  EventEncoder & String(const char * str, size_t size) {
+    Raw(static_cast<uint64_t>(size));
+    std::memcpy(out_, str, size);
+    out_ += size;
+    return *this;
+  }
+  EventEncoder & String(const std::string & str) { return String(str.data(), str.size()); }
+  EventEncoder & Pairs(const std::map<std::string, std::string> & pairs) {
+    UInt64(pairs.size());
+    for (const auto & pair : pairs) {
+      String(pair.first).String(pair.second);
+    }
+    return *this;
+  }
+
+  // AlohalyticsKeyPairsEvent, fields should be sorted with Field::NameLess.
+  static size_t KeyPairsEventSize(const std::string & key, Field const * const * fields, size_t fields_count) {
+    size_t size = EventHeaderSize(kKeyPairsEventType) + StringSize(key.size()) + sizeof(uint64_t);
+    for (size_t i = 0; i < fields_count; ++i) {
+      size += StringSize(fields[i]->NameSize()) + StringSize(fields[i]->ValueSize());
+    }
+    return size;
+  }
+  EventEncoder & KeyPairsEvent(uint64_t timestamp,
+                               const std::string & key,
+                               Field const * const * fields,
+                               size_t fields_count) {
+    EventHeader(kKeyPairsEventType, timestamp).String(key).UInt64(fields_count);
+    for (size_t i = 0; i < fields_count; ++i) {
+      String(fields[i]->Name(), fields[i]->NameSize()).String(fields[i]->Value(), fields[i]->ValueSize());
+    }
+    return *this;
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // EVENT_ENCODER_H
@@ -0,0 +1,114 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#ifndef EVENT_FIELD_H
+#define EVENT_FIELD_H
+
+#include <algorithm>  // min
+#include <cstdint>
+#include <cstdio>  // snprintf
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace alohalytics {
+
+// Typed key/value pair for LogEvent(name, Field(...), Field(...), ...).
+// Field names should be string literals, value's type is resolved at compile time:
+// numbers are formatted into the internal buffer without any heap allocations,
+// strings are referenced without copying.
+// Fields are temporaries, they should not outlive the full expression they were created in.
+class Field {
+  const char * name_;
+  size_t name_size_;
+  // Points to buffer_ if nullptr.
+  const char * value_ = nullptr;
+  size_t value_size_ = 0;
+  // Enough for any 64-bit integer and for "%.15g" formatted double.
+  char buffer_[32];
+
+  template <typename T>
+  void FormatUnsigned(T value, bool negative) {
+    char * end = buffer_ + sizeof(buffer_);
+    char * p = end;
+    do {
+      *--p = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value);
+    if (negative) {
+      *--p = '-';
+    }
+    value_size_ = static_cast<size_t>(end - p);
+    std::memmove(buffer_, p, value_size_);
+  }
+
+ public:
+  // Integers are formatted exactly as std::to_string does.
+  template <size_t N,
+            typename T,
+            typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value, int>::type = 0>
+  Field(const char (&name)[N], T value)
+      : name_(name), name_size_(N - 1) {
+    typedef typename std::make_unsigned<T>::type TUnsigned;
+    const bool negative = value < 0;
+    // Negation is done in unsigned type to correctly handle the minimum value.
+    FormatUnsigned(negative ? TUnsigned(0) - static_cast<TUnsigned>(value) : static_cast<TUnsigned>(value), negative);
+  }
+
+  // Stored as "1" or "0", the same as std::to_string(bool) does.
+  template <size_t N>
+  Field(const char (&name)[N], bool value)
+      : name_(name), name_size_(N - 1), value_(value ? "1" : "0"), value_size_(1) {}
+
+  // Doubles are stored with 15 significant digits, which is enough for coordinates and most of the measurements.
+  template <size_t N, typename T, typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0>
+  Field(const char (&name)[N], T value)
+      : name_(name), name_size_(N - 1) {
+    const int written = std::snprintf(buffer_, sizeof(buffer_), "%.15g", static_cast<double>(value));
+    value_size_ = written > 0 ? static_cast<size_t>(written) : 0;
+  }
+
+  template <size_t N>
+  Field(const char (&name)[N], const char * value)
+      : name_(name), name_size_(N - 1), value_(value ? value : ""), value_size_(value ? std::strlen(value) : 0) {}
+
+  template <size_t N>
+  Field(const char (&name)[N], const std::string & value)
+      : name_(name), name_size_(N - 1), value_(value.data()), value_size_(value.size()) {}
+
+  const char * Name() const { return name_; }
+  size_t NameSize() const { return name_size_; }
+  const char * Value() const { return value_ ? value_ : buffer_; }
+  size_t ValueSize() const { return value_size_; }
+
+  // The same order as std::map<std::string, std::string> has.
+  static bool NameLess(const Field * lhs, const Field * rhs) {
+    const int cmp = std::memcmp(lhs->name_, rhs->name_, std::min(lhs->name_size_, rhs->name_size_));
+    return cmp < 0 || (cmp == 0 && lhs->name_size_ < rhs->name_size_);
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // EVENT_FIELD_H
@@ -0,0 +1,257 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Per-event-name sampling, rate limiting and routing rules, which are checked in the very beginning of every
+// LogEvent call.
+// Rules are set rarely (usually once on startup), but read very often from any thread,
+// so the table has a fixed size and it's lookups are lock-free.
+
+#ifndef EVENT_RULES_H
+#define EVENT_RULES_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace alohalytics {
+
+class EventRules {
+ public:
+  static constexpr size_t kMaxRules = 64;
+
+  // What should be done with the event which has passed the rules.
+  struct Verdict {
+    // Rate which was applied to this event, 1 if it was not sampled.
+    double sampling_rate = 1.;
+    // Index of the channel (see Stats::AddChannel) event should be stored into, 0 is the default one.
+    uint32_t channel = 0;
+  };
+
+  // Returns false if there is no free space for a new rule.
+  // sampling_rate should be in (0, 1] range, 1 means that all events are logged.
+  bool SetSampling(const std::string & event_name, double sampling_rate) {
+    Rule * rule = FindOrInsert(Hash(event_name));
+    if (!rule) {
+      return false;
+    }
+    const double clamped = sampling_rate > 1. ? 1. : (sampling_rate < 0. ? 0. : sampling_rate);
+    rule->sampling_rate.store(clamped, std::memory_order_relaxed);
+    rule->sampling_threshold.store(static_cast<uint64_t>(clamped * kThresholdScale), std::memory_order_release);
+    return true;
+  }
+
+  // Allows no more than events_per_second on average with bursts of max_burst events.
+  // Zero events_per_second removes the limit.
+  bool SetRateLimit(const std::string & event_name, double events_per_second, uint32_t max_burst) {
+    Rule * rule = FindOrInsert(Hash(event_name));
+    if (!rule) {
+      return false;
+    }
+    if (events_per_second <= 0.) {
+      rule->interval_us.store(0, std::memory_order_release);
+      return true;
+    }
+    const int64_t interval_us = static_cast<int64_t>(1e6 / events_per_second);
+    rule->interval_us.store(interval_us > 0 ? interval_us : 1, std::memory_order_relaxed);
+    rule->burst_tolerance_us.store((max_burst > 1 ? max_burst - 1 : 0) * interval_us, std::memory_order_release);
+    return true;
+  }
+
+  // Routes all event_name events into the given channel.
+  bool SetChannel(const std::string & event_name, uint32_t channel) {
+    Rule * rule = FindOrInsert(Hash(event_name));
+    if (!rule) {
+      return false;
+    }
+    rule->channel.store(channel, std::memory_order_release);
+    return true;
+  }
+
+  // Samples all events of the default channel (0) in addition to their own rules, e.g. to follow server's
+  // backpressure hints (see UploadHint). Other channels are used for critical events and are never sampled
+  // this way. sampling_rate 1 disables it.
+  void SetDefaultChannelSampling(double sampling_rate) {
+    const double clamped = sampling_rate > 1. ? 1. : (sampling_rate < 0. ? 0. : sampling_rate);
+    default_sampling_rate_.store(clamped, std::memory_order_relaxed);
+    default_sampling_threshold_.store(static_cast<uint64_t>(clamped * kThresholdScale), std::memory_order_release);
+  }
+  double DefaultChannelSampling() const { return default_sampling_rate_.load(std::memory_order_relaxed); }
+
+  // Returns false if event should be dropped. Otherwise verdict describes how to store it.
+  bool Check(const std::string & event_name, Verdict & verdict) {
+    verdict = Verdict();
+    // Fast path: nothing was configured.
+    if (0 == rules_count_.load(std::memory_order_acquire) &&
+        default_sampling_threshold_.load(std::memory_order_acquire) >= kNoSampling) {
+      return true;
+    }
+    return CheckAll(event_name, verdict, NowInMicroseconds());
+  }
+
+  // Events dropped by Check() since the table was created.
+  uint64_t SampledOutCount() const { return sampled_out_count_.load(std::memory_order_relaxed); }
+  uint64_t RateLimitedCount() const { return rate_limited_count_.load(std::memory_order_relaxed); }
+
+  // For unit tests, to control time.
+  bool Check(const std::string & event_name, Verdict & verdict, int64_t now_us) {
+    verdict = Verdict();
+    return CheckAll(event_name, verdict, now_us);
+  }
+
+ private:
+  static constexpr uint64_t kEmptySlot = 0;
+  static constexpr double kThresholdScale = 4294967296.;  // 2^32.
+  static constexpr uint64_t kNoSampling = 4294967296ULL;
+
+  struct Rule {
+    std::atomic<uint64_t> hash{kEmptySlot};
+    // Event is logged if it's pseudo-random 32-bit number is less than threshold.
+    std::atomic<uint64_t> sampling_threshold{static_cast<uint64_t>(kThresholdScale)};
+    std::atomic<double> sampling_rate{1.};
+    std::atomic<uint64_t> sampling_counter{0};
+    // Rate limiting is implemented as a Generic Cell Rate Algorithm, which is equivalent to a token bucket,
+    // but needs only one atomic variable (theoretical arrival time) for it's state.
+    std::atomic<int64_t> interval_us{0};
+    std::atomic<int64_t> burst_tolerance_us{0};
+    std::atomic<int64_t> theoretical_arrival_time_us{0};
+    std::atomic<uint32_t> channel{0};
+  };
+
+  // 64-bit FNV-1a.
+  static uint64_t Hash(const std::string & str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char c : str) {
+      hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+    }
+    return hash == kEmptySlot ? 1 : hash;
+  }
+
+  // Finalizer from splitmix64, it turns sequential counter values into evenly distributed numbers.
+  static uint64_t Mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+  }
+
+  static int64_t NowInMicroseconds() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  bool CheckAll(const std::string & event_name, Verdict & verdict, int64_t now_us) {
+    Rule * rule = Find(Hash(event_name));
+    if (rule && !CheckRule(*rule, verdict, now_us)) {
+      return false;
+    }
+    return verdict.channel != 0 || CheckDefaultChannelSampling(verdict);
+  }
+
+  bool CheckDefaultChannelSampling(Verdict & verdict) {
+    const uint64_t threshold = default_sampling_threshold_.load(std::memory_order_acquire);
+    if (threshold >= kNoSampling) {
+      return true;
+    }
+    const uint64_t n = default_sampling_counter_.fetch_add(1, std::memory_order_relaxed);
+    if ((Mix(n) & 0xffffffff) >= threshold) {
+      sampled_out_count_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    verdict.sampling_rate *= default_sampling_rate_.load(std::memory_order_relaxed);
+    return true;
+  }
+
+  bool CheckRule(Rule & rule, Verdict & verdict, int64_t now_us) {
+    verdict.channel = rule.channel.load(std::memory_order_acquire);
+    const uint64_t threshold = rule.sampling_threshold.load(std::memory_order_relaxed);
+    if (threshold < static_cast<uint64_t>(kThresholdScale)) {
+      const uint64_t n = rule.sampling_counter.fetch_add(1, std::memory_order_relaxed);
+      if ((Mix(n ^ rule.hash.load(std::memory_order_relaxed)) & 0xffffffff) >= threshold) {
+        sampled_out_count_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      verdict.sampling_rate = rule.sampling_rate.load(std::memory_order_relaxed);
+    }
+    const int64_t interval_us = rule.interval_us.load(std::memory_order_relaxed);
+    if (interval_us == 0) {
+      return true;
+    }
+    const int64_t tolerance_us = rule.burst_tolerance_us.load(std::memory_order_relaxed);
+    int64_t tat = rule.theoretical_arrival_time_us.load(std::memory_order_relaxed);
+    while (true) {
+      const int64_t start = tat > now_us ? tat : now_us;
+      if (start - now_us > tolerance_us) {
+        rate_limited_count_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      if (rule.theoretical_arrival_time_us.compare_exchange_weak(tat, start + interval_us,
+                                                                 std::memory_order_relaxed)) {
+        return true;
+      }
+    }
+  }
+
+  Rule * Find(uint64_t hash) {
+    for (size_t i = 0; i < kMaxRules; ++i) {
+      Rule & rule = rules_[(hash + i) % kMaxRules];
+      const uint64_t slot_hash = rule.hash.load(std::memory_order_acquire);
+      if (slot_hash == hash) {
+        return &rule;
+      }
+      if (slot_hash == kEmptySlot) {
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+  // Rules are never removed, so the slot stays valid forever once it was taken.
+  Rule * FindOrInsert(uint64_t hash) {
+    for (size_t i = 0; i < kMaxRules; ++i) {
+      Rule & rule = rules_[(hash + i) % kMaxRules];
+      uint64_t slot_hash = rule.hash.load(std::memory_order_acquire);
+      if (slot_hash == kEmptySlot &&
+          rule.hash.compare_exchange_strong(slot_hash, hash, std::memory_order_acq_rel)) {
+        rules_count_.fetch_add(1, std::memory_order_release);
+        return &rule;
+      }
+      if (slot_hash == hash) {
+        return &rule;
+      }
+    }
+    return nullptr;
+  }
+
+  Rule rules_[kMaxRules];
+  std::atomic<size_t> rules_count_{0};
+  std::atomic<uint64_t> default_sampling_threshold_{kNoSampling};
+  std::atomic<double> default_sampling_rate_{1.};
+  std::atomic<uint64_t> default_sampling_counter_{0};
+  std::atomic<uint64_t> sampled_out_count_{0};
+  std::atomic<uint64_t> rate_limited_count_{0};
+};
+
+}  // namespace alohalytics
+
+#endif  // EVENT_RULES_H
@@ -26,6 +26,7 @@ SOFTWARE.
 #define FILE_MANAGER_H
 
 #include <algorithm>
+#include <cstdint>
 #include <functional>
 #include <fstream>
 #include <string>
@@ -127,6 +128,30 @@ struct FileManager {
 
   // Throws std::ios_base::failure exception if file is absent or is a directory.
   static uint64_t GetFileSize(const std::string & full_path_to_file);
+
+  // Creates directory if it does not exist. Returns true if directory exists after the call.
+  static bool MakeDirectory(const std::string & directory);
+
+  // Flushes directory entries (e.g. of a new or renamed file) to the storage device. Returns false on error.
+  static bool SyncDirectory(const std::string & directory);
+};
+
+// Keeps an existing file open to flush its data to the storage device. It still refers to the same file
+// if it is renamed (e.g. by logrotate), so data written before the rename is flushed too.
+// Implemented separately for each platform.
+class FileSyncer {
+ public:
+  explicit FileSyncer(const std::string & full_path_to_file);
+  ~FileSyncer();
+  FileSyncer(const FileSyncer &) = delete;
+  FileSyncer & operator=(const FileSyncer &) = delete;
+
+  bool IsOpen() const { return handle_ != -1; }
+  // Flushes data written to the file by any descriptor. Returns false on error.
+  bool Sync();
+
+ private:
+  intptr_t handle_;
 };
 
 }  // namespace alohalytics
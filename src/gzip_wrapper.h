@@ -44,10 +44,11 @@ struct GzipErrorException : public std::exception {
 };
 
 // Throws GzipErrorException on any gzip processing error.
-inline std::string Gzip(const std::string & data_to_compress) {
+// level is zlib's compression level, from Z_BEST_SPEED to Z_BEST_COMPRESSION.
+inline std::string Gzip(const std::string & data_to_compress, int level = Z_BEST_COMPRESSION) {
   z_stream z;
   std::memset(&z, 0, sizeof(z));
-  int res = ::deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  int res = ::deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
   if (Z_OK == res) {
     z.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(data_to_compress.data()));
     // TODO(AlexZ): Check situation when uInt is < than size of the data to compress.
@@ -106,5 +107,59 @@ inline std::string Gunzip(const std::string & data_to_decompress) {
   throw GunzipErrorException(res, z.msg);
 }
 
+// Incremental gunzip for data which arrives in chunks, e.g. from the network.
+class GunzipStream {
+  z_stream z_;
+  int result_;
+  bool initialized_;
+  std::vector<Bytef> buffer_;
+
+ public:
+  GunzipStream() : buffer_(kGzipBufferSize) {
+    std::memset(&z_, 0, sizeof(z_));
+    result_ = ::inflateInit2(&z_, 16 + MAX_WBITS);
+    initialized_ = (result_ == Z_OK);
+  }
+  ~GunzipStream() {
+    if (initialized_) {
+      ::inflateEnd(&z_);
+    }
+  }
+  GunzipStream(const GunzipStream &) = delete;
+  GunzipStream & operator=(const GunzipStream &) = delete;
+
+  // Decompresses next chunk and calls output(const char * data, size_t size) for every decompressed part.
+  // Output can return false to stop decompression.
+  // Returns Z_OK if more input is needed (or output has stopped decompression), Z_STREAM_END if the end of
+  // the gzip stream was reached (the rest of the input is ignored, like Gunzip() does), or zlib's error.
+  template <typename TOutput>
+  int Inflate(const char * data, size_t size, TOutput && output) {
+    if (result_ != Z_OK) {
+      return result_;
+    }
+    z_.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(data));
+    z_.avail_in = static_cast<uInt>(size);
+    do {
+      z_.next_out = buffer_.data();
+      z_.avail_out = static_cast<uInt>(buffer_.size());
+      result_ = ::inflate(&z_, Z_NO_FLUSH);
+      if (result_ != Z_OK && result_ != Z_STREAM_END) {
+        // Not enough input is not an error for a stream.
+        if (result_ == Z_BUF_ERROR) {
+          result_ = Z_OK;
+        }
+        return result_;
+      }
+      const size_t decompressed = buffer_.size() - z_.avail_out;
+      if (decompressed && !output(reinterpret_cast<const char *>(buffer_.data()), decompressed)) {
+        return result_;
+      }
+    } while (result_ == Z_OK && (z_.avail_in || !z_.avail_out));
+    return result_;
+  }
+
+  const char * ErrorMessage() const { return z_.msg ? z_.msg : ""; }
+};
+
 }  // namespace alohalytics
 #endif  // GZIP_WRAPPER_H
@@ -0,0 +1,215 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+// Lightweight log-bucket (HDR-style) latency histograms for the library's own hot paths.
+// Recording is compiled in only if ALOHALYTICS_LATENCY_HISTOGRAMS is defined, otherwise
+// ALOHALYTICS_LATENCY_SCOPE and ALOHALYTICS_LATENCY_RECORD are no-ops. Histograms are always available
+// for reading (and are empty in that case): LatencyHistograms::Instance().ToString().
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace alohalytics {
+
+class LatencyHistogram {
+ public:
+  // Every power of two is split into kSubBuckets linear buckets, so relative error is below 1/kSubBuckets.
+  static constexpr uint32_t kSubBucketBits = 4;
+  static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits;
+  // Values are in nanoseconds, larger values (more than 39 hours) are clamped.
+  static constexpr uint32_t kMaxValueBits = 47;
+  static constexpr size_t kBucketsCount = (kMaxValueBits - kSubBucketBits + 1) * kSubBuckets;
+  // Threads are spread over shards to avoid contention on the same cache lines.
+  static constexpr size_t kShardsCount = 8;
+
+  static size_t BucketIndex(uint64_t value) {
+    if (value < kSubBuckets) {
+      return static_cast<size_t>(value);
+    }
+    if (value >> kMaxValueBits) {
+      return kBucketsCount - 1;
+    }
+    // Index of the highest set bit.
+    uint32_t exponent = 0;
+    for (uint32_t step = 32; step; step >>= 1) {
+      if (value >> (exponent + step)) {
+        exponent += step;
+      }
+    }
+    const uint32_t shift = exponent - kSubBucketBits;
+    return static_cast<size_t>((exponent - kSubBucketBits + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1)));
+  }
+
+  // Highest value which is stored in the bucket.
+  static uint64_t BucketValue(size_t index) {
+    if (index < kSubBuckets) {
+      return index;
+    }
+    const uint32_t shift = static_cast<uint32_t>(index / kSubBuckets) - 1;
+    return ((kSubBuckets + index % kSubBuckets + 1) << shift) - 1;
+  }
+
+  void Record(uint64_t nanoseconds) {
+    Shard & shard = shards_[ThreadShard()];
+    shard.buckets[BucketIndex(nanoseconds)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(nanoseconds, std::memory_order_relaxed);
+  }
+
+  struct Snapshot {
+    std::vector<uint64_t> buckets;
+    uint64_t count = 0;
+    // Of all recorded values, in nanoseconds.
+    uint64_t sum = 0;
+
+    // Returns value (in nanoseconds) below or equal to which percentile% of values are.
+    uint64_t Percentile(double percentile) const {
+      if (count == 0) {
+        return 0;
+      }
+      uint64_t rank = static_cast<uint64_t>(percentile / 100. * count + 0.5);
+      if (rank == 0) {
+        rank = 1;
+      }
+      uint64_t seen = 0;
+      for (size_t i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+          return BucketValue(i);
+        }
+      }
+      return BucketValue(buckets.size() - 1);
+    }
+    uint64_t Max() const { return Percentile(100.); }
+  };
+
+  Snapshot GetSnapshot() const {
+    Snapshot snapshot;
+    snapshot.buckets.resize(size_t(kBucketsCount));
+    for (const Shard & shard : shards_) {
+      for (size_t i = 0; i < kBucketsCount; ++i) {
+        const uint64_t value = shard.buckets[i].load(std::memory_order_relaxed);
+        snapshot.buckets[i] += value;
+        snapshot.count += value;
+      }
+      snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+  }
+
+  void Reset() {
+    for (Shard & shard : shards_) {
+      for (auto & bucket : shard.buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+      shard.sum.store(0, std::memory_order_relaxed);
+    }
+  }
+
+ private:
+  static size_t ThreadShard() {
+    static std::atomic<size_t> next_shard{0};
+    static thread_local const size_t shard = next_shard.fetch_add(1, std::memory_order_relaxed) % kShardsCount;
+    return shard;
+  }
+
+  struct Shard {
+    std::atomic<uint64_t> buckets[kBucketsCount];
+    std::atomic<uint64_t> sum{0};
+    Shard() {
+      for (auto & bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+  Shard shards_[kShardsCount];
+};
+
+struct LatencyHistograms {
+  // Time spent in Stats::LogEvent calls, i.e. latency added to the caller's thread.
+  LatencyHistogram log_event;
+  // Lag between MessagesQueue::PushMessage and the message being written into the file.
+  LatencyHistogram push_to_disk;
+  // Time spent in Stats::GzipAndArchiveFileInTheQueue.
+  LatencyHistogram archive;
+
+  static LatencyHistograms & Instance() {
+    static LatencyHistograms histograms;
+    return histograms;
+  }
+
+  // One line per histogram with count and percentiles in microseconds.
+  std::string ToString() const {
+    std::ostringstream out;
+    Print(out, "log_event", log_event);
+    Print(out, "push_to_disk", push_to_disk);
+    Print(out, "archive", archive);
+    return out.str();
+  }
+
+ private:
+  static void Print(std::ostream & out, const char * name, const LatencyHistogram & histogram) {
+    const LatencyHistogram::Snapshot snapshot = histogram.GetSnapshot();
+    out << name << " count=" << snapshot.count;
+    for (const double percentile : {50., 90., 99., 99.9}) {
+      out << " p" << percentile << "=" << snapshot.Percentile(percentile) / 1000. << "us";
+    }
+    out << " max=" << snapshot.Max() / 1000. << "us\n";
+  }
+};
+
+// Records time until the end of the current scope.
+class ScopedLatency {
+ public:
+  explicit ScopedLatency(LatencyHistogram & histogram)
+      : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+  ~ScopedLatency() {
+    histogram_.Record(static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count()));
+  }
+
+ private:
+  LatencyHistogram & histogram_;
+  const std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace alohalytics
+
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+#define ALOHALYTICS_LATENCY_SCOPE(histogram) \
+  alohalytics::ScopedLatency alohalytics_scoped_latency(alohalytics::LatencyHistograms::Instance().histogram)
+#define ALOHALYTICS_LATENCY_RECORD(histogram, nanoseconds) \
+  alohalytics::LatencyHistograms::Instance().histogram.Record(nanoseconds)
+#else
+#define ALOHALYTICS_LATENCY_SCOPE(histogram)
+#define ALOHALYTICS_LATENCY_RECORD(histogram, nanoseconds)
+#endif
+
+#endif  // #ifndef LATENCY_HISTOGRAM_H
@@ -104,6 +104,25 @@ class Location {
     return s;
   }
 
+  // Size of Encode() result for the given valid values mask (the first encoded byte).
+  // Decode() accepts any encoded string which is not shorter.
+  static size_t EncodedSize(uint8_t mask) {
+    size_t size = 1;
+    if (mask & HAS_LATLON) {
+      size += 18 + ((mask & HAS_SOURCE) ? 1 : 0);
+    }
+    if (mask & HAS_ALTITUDE) {
+      size += 6;
+    }
+    if (mask & HAS_BEARING) {
+      size += 4;
+    }
+    if (mask & HAS_SPEED) {
+      size += 2;
+    }
+    return size;
+  }
+
   // Initializes location from serialized byte array created by ToString() method.
   // TODO(AlexZ): we don't care about endianness right now.
   explicit Location(const std::string & encoded) { Decode(encoded); }
@@ -25,8 +25,11 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <atomic>
+#include <cstdint>
 #include <ctime>
 #include <sstream>
+#include <string>
 
 #if defined(__OBJC__)
 #include <Foundation/Foundation.h>
@@ -45,6 +48,43 @@ std::ostream & operator<<(std::ostream & out, const std::pair<T, U> & p) {
 
 namespace alohalytics {
 
+// Every ALOG call site has one, so a backend can limit noisy sites. Constant-initialized, without any cost
+// unless a backend is installed.
+struct LogSite {
+  const char * const file;
+  const int line;
+  // State of the installed backend, e.g. messages in the current second and suppressed ones.
+  std::atomic<uint64_t> second{0};
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> suppressed{0};
+  // Sites with suppressed messages are linked into a list by the backend.
+  std::atomic<bool> listed{false};
+  LogSite * next = nullptr;
+
+  constexpr LogSite(const char * file, int line) : file(file), line(line) {}
+};
+
+// Receives all ALOG lines instead of std::cout when installed (except on Apple and Android, which have their own
+// system logs), e.g. to write them asynchronously.
+class LogBackend {
+ public:
+  virtual ~LogBackend() = default;
+  // Returns false if the message should be dropped, before its arguments are evaluated and formatted.
+  virtual bool Allow(LogSite & site) = 0;
+  // Complete line with time and a trailing newline.
+  virtual void Write(const std::string & line) = 0;
+
+  // Installed backend should outlive all logging threads, nullptr restores std::cout.
+  static std::atomic<LogBackend *> & Installed() {
+    static std::atomic<LogBackend *> backend{nullptr};
+    return backend;
+  }
+  static bool AllowSite(LogSite & site) {
+    LogBackend * backend = Installed().load(std::memory_order_acquire);
+    return !backend || backend->Allow(site);
+  }
+};
+
 class Logger {
   std::ostringstream out_;
 
@@ -64,7 +104,14 @@ class Logger {
     char buf[100] = "";
     const time_t now = time(nullptr);
     (void)::strftime(buf, sizeof(buf), "%d/%b/%Y:%H:%M:%S ", ::localtime(&now));
-    std::cout << buf << "Alohalytics: " << out_.str() << std::endl;
+    const std::string line = buf + ("Alohalytics: " + out_.str()) + '\n';
+    LogBackend * backend = LogBackend::Installed().load(std::memory_order_acquire);
+    if (backend) {
+      backend->Write(line);
+    } else {
+      // One write per line keeps lines from different threads intact.
+      std::cout << line << std::flush;
+    }
 #endif
   }
 
@@ -119,6 +166,12 @@ class Logger {
 }  // namespace alohalytics
 
 #define ATRACE(...) alohalytics::Logger(__FILE__, __LINE__).Log(__VA_ARGS__)
-#define ALOG(...) alohalytics::Logger().Log(__VA_ARGS__)
+#define ALOG(...)                                                            \
+  do {                                                                       \
+    static alohalytics::LogSite alohalytics_log_site(__FILE__, __LINE__);    \
+    if (alohalytics::LogBackend::AllowSite(alohalytics_log_site)) {          \
+      alohalytics::Logger().Log(__VA_ARGS__);                                \
+    }                                                                        \
+  } while (false)
 
 #endif  // #ifndef LOGGER_H
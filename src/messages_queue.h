@@ -24,14 +24,16 @@ SOFTWARE.
 
 // This queue stores incoming messages in the memory on a separate thread as a continuous
 // block of bytes. If storage directory is set, it stores everything in a file (on a separate thread too).
-// When TMaxFileSizeInBytes limit is hit, file is "archived" (see TFileArchiver in constructor)
-// and a new file is created instead.
+// When TMaxFileSizeInBytes (or constructor's max_file_size) limit is hit, file is "archived"
+// (see TFileArchiver in constructor) and a new file is created instead.
 // Destructor gracefully processes all commands left in the queue.
 
 #ifndef MESSAGES_QUEUE_H
 #define MESSAGES_QUEUE_H
 
+#include <atomic>              // atomic
 #include <cerrno>              // errno
+#include <chrono>              // steady_clock
 #include <condition_variable>  // condition_variable
 #include <cstdio>              // rename, remove
 #include <ctime>               // time, gmtime
@@ -39,12 +41,14 @@ SOFTWARE.
 #include <functional>          // bind, function
 #include <limits>              // numeric_limits
 #include <list>                // list
+#include <vector>              // vector
 #include <memory>              // unique_ptr
 #include <mutex>               // mutex
 #include <string>              // string
 #include <thread>              // thread
 
 #include "src/file_manager.h"
+#include "src/latency_histogram.h"
 #include "src/logger.h"
 
 namespace alohalytics {
@@ -56,6 +60,25 @@ typedef std::function<void(const std::string & file_to_archive, const std::strin
 typedef std::function<bool(bool file_name_in_content, const std::string & content)> TArchivedFilesProcessor;
 enum class ProcessingResult { EProcessedSuccessfully, EProcessingError, ENothingToProcess };
 typedef std::function<void(ProcessingResult)> TFileProcessingFinishedCallback;
+// Is called with true if messages were written and flushed to the storage device.
+typedef std::function<void(bool synced)> TSyncCallback;
+
+// Snapshot of the queue's state, see MessagesQueue::GetMetrics().
+struct QueueMetrics {
+  // Messages which were pushed but not stored yet.
+  uint64_t messages_buffer_bytes = 0;
+  // Messages stored in memory because storage directory was not set.
+  uint64_t inmemory_storage_bytes = 0;
+  // Commands waiting for the worker thread.
+  uint64_t worker_queue_depth = 0;
+  // Files archived since the queue was created.
+  uint64_t archived_files = 0;
+  // Flushes to the storage device and sync requests served by them, see MessagesQueue::SyncMessages().
+  uint64_t syncs = 0;
+  uint64_t sync_requests = 0;
+  // Flushes of the storage directory, once for every new "current" file.
+  uint64_t directory_syncs = 0;
+};
 
 // Default name for "active" file where we store messages.
 constexpr char kCurrentFileName[] = "alohalytics_messages";
@@ -75,7 +98,10 @@ class MessagesQueue final {
   }
 
   // Pass custom processing function here, e.g. append IDs, gzip everything before archiving file etc.
-  MessagesQueue(TFileArchiver file_archiver = &ArchiveFileByRenamingIt) : file_archiver_(file_archiver) {}
+  // max_file_size can override TMaxFileSizeInBytes limit in runtime.
+  MessagesQueue(TFileArchiver file_archiver = &ArchiveFileByRenamingIt,
+                std::streamoff max_file_size = TMaxFileSizeInBytes)
+      : file_archiver_(file_archiver), max_file_size_(max_file_size) {}
 
   ~MessagesQueue() {
     {
@@ -83,16 +109,16 @@ class MessagesQueue final {
       worker_thread_should_exit_ = true;
       commands_condition_variable_.notify_all();
     }
-    worker_thread_.join();
+    if (worker_thread_.joinable()) {
+      worker_thread_.join();
+    }
   }
 
   // Sets working directory (and flushes in-memory messages into the file).
   // Executed on the WorkerThread.
   void SetStorageDirectory(std::string directory) {
     FileManager::AppendDirectorySlash(directory);
-    std::lock_guard<std::mutex> lock(commands_mutex_);
-    commands_queue_.push_back(std::bind(&MessagesQueue::ProcessInitializeStorageCommand, this, directory));
-    commands_condition_variable_.notify_all();
+    PushCommand(std::bind(&MessagesQueue::ProcessInitializeStorageCommand, this, directory));
   }
   // Stores message into a file archive (if SetStorageDirectory was called with a valid directory),
   // otherwise stores messages in-memory.
@@ -100,11 +126,23 @@ class MessagesQueue final {
   void PushMessage(const std::string & message) {
     {
       std::lock_guard<std::mutex> lock(messages_mutex_);
+      RememberOldestMessageTime();
       messages_buffer_.append(message);
     }
-    std::lock_guard<std::mutex> lock(commands_mutex_);
-    commands_queue_.push_back(std::bind(&MessagesQueue::ProcessMessageCommand, this));
-    commands_condition_variable_.notify_all();
+    PushCommand(std::bind(&MessagesQueue::ProcessMessageCommand, this));
+  }
+  // The same as above, but message_size bytes are written by writer(char * out) directly into the queue's buffer.
+  // It allows to avoid temporary copies of the message. Writer is called under the lock and should be fast.
+  template <typename TWriter>
+  void PushMessage(size_t message_size, TWriter && writer) {
+    {
+      std::lock_guard<std::mutex> lock(messages_mutex_);
+      RememberOldestMessageTime();
+      const size_t offset = messages_buffer_.size();
+      messages_buffer_.resize(offset + message_size);
+      writer(&messages_buffer_[offset]);
+    }
+    PushCommand(std::bind(&MessagesQueue::ProcessMessageCommand, this));
   }
 
   // Processor should return true if file was successfully processed (e.g. uploaded to a server, etc.).
@@ -115,16 +153,59 @@ class MessagesQueue final {
   // Executed on the WorkerThread.
   void ProcessArchivedFiles(TArchivedFilesProcessor processor,
                             TFileProcessingFinishedCallback callback = TFileProcessingFinishedCallback()) {
-    std::lock_guard<std::mutex> lock(commands_mutex_);
-    commands_queue_.push_back(std::bind(&MessagesQueue::ProcessArchivedFilesCommand, this, processor, callback));
-    commands_condition_variable_.notify_all();
+    PushCommand(std::bind(&MessagesQueue::ProcessArchivedFilesCommand, this, processor, callback));
+  }
+
+  // Allows SyncMessages() calls. Messages are tracked since this call, so it should be called before pushing
+  // messages which should be synced. Sync requests are collected for batch_window after the first one,
+  // so more of them share the same flush, at the cost of the added latency.
+  // Executed on the WorkerThread.
+  void EnableSync(std::chrono::microseconds batch_window = std::chrono::microseconds(0)) {
+    PushCommand(std::bind(&MessagesQueue::ProcessEnableSyncCommand, this, batch_window));
+  }
+
+  // Callback is called on the WorkerThread with true, when all messages pushed before this call are written
+  // and flushed to the storage device, or with false on any error since the previous sync (and always
+  // for in-memory storage). Requests which arrive while the previous flush is in progress are served together
+  // by the next one (group commit), so durability does not cost a flush per message.
+  void SyncMessages(TSyncCallback callback) {
+    bool schedule_sync;
+    {
+      std::lock_guard<std::mutex> lock(messages_mutex_);
+      sync_callbacks_.push_back(std::move(callback));
+      schedule_sync = !sync_scheduled_;
+      if (schedule_sync) {
+        sync_scheduled_ = true;
+        first_sync_request_time_ = std::chrono::steady_clock::now();
+      }
+    }
+    if (schedule_sync) {
+      PushCommand(std::bind(&MessagesQueue::ProcessSyncCommand, this));
+    }
+  }
+
+  // Can be called from any thread, it is cheap but locks the queue for a moment.
+  QueueMetrics GetMetrics() {
+    QueueMetrics metrics;
+    {
+      std::lock_guard<std::mutex> lock(messages_mutex_);
+      metrics.messages_buffer_bytes = messages_buffer_.size();
+    }
+    {
+      std::lock_guard<std::mutex> lock(commands_mutex_);
+      metrics.worker_queue_depth = commands_queue_.size();
+    }
+    metrics.inmemory_storage_bytes = inmemory_storage_size_.load(std::memory_order_relaxed);
+    metrics.archived_files = archived_files_.load(std::memory_order_relaxed);
+    metrics.syncs = syncs_.load(std::memory_order_relaxed);
+    metrics.sync_requests = sync_requests_.load(std::memory_order_relaxed);
+    metrics.directory_syncs = directory_syncs_.load(std::memory_order_relaxed);
+    return metrics;
   }
 
   // This may be needed for correct logrotate utility support on *nix systems.
   void LogrotateCurrentFile() {
-    std::lock_guard<std::mutex> lock(commands_mutex_);
-    commands_queue_.push_back(std::bind(&MessagesQueue::ProcessLogrotateCurrentFileCommand, this));
-    commands_condition_variable_.notify_all();
+    PushCommand(std::bind(&MessagesQueue::ProcessLogrotateCurrentFileCommand, this));
   }
 
  private:
@@ -143,56 +224,120 @@ class MessagesQueue final {
   // current_file_ is single-threaded.
   void ArchiveCurrentFile() {
     if (current_file_) {
-      current_file_.reset(nullptr);
+      CloseCurrentFile();
       const std::string current_file_path = storage_directory_ + kCurrentFileName;
       file_archiver_(current_file_path.c_str(), GenerateFullFilePathForArchive(storage_directory_).c_str());
-      current_file_.reset(new std::ofstream(current_file_path, std::ios_base::app | std::ios_base::binary));
+      archived_files_.fetch_add(1, std::memory_order_relaxed);
+      OpenCurrentFile(current_file_path);
+    }
+  }
+
+  // Synced messages in the closed file should be flushed before it is renamed or archived.
+  void CloseCurrentFile() {
+    if (sync_enabled_ && has_unsynced_writes_ && !SyncCurrentFile()) {
+      sync_failed_ = true;
+    }
+    has_unsynced_writes_ = false;
+    current_file_syncer_.reset(nullptr);
+    current_file_.reset(nullptr);
+  }
+
+  void OpenCurrentFile(const std::string & path) {
+    current_file_.reset(new std::ofstream(path, std::ios_base::app | std::ios_base::binary));
+    current_file_directory_synced_ = false;
+    if (sync_enabled_) {
+      current_file_syncer_.reset(new FileSyncer(path));
+    }
+  }
+
+  // The file can be a new one (at the first start, after logrotate or archiving), so it's directory entry is
+  // flushed too, before the first successful sync, otherwise synced messages can disappear after a crash.
+  bool SyncCurrentFile() {
+    if (!current_file_syncer_ || !current_file_syncer_->Sync()) {
+      return false;
     }
+    if (!current_file_directory_synced_) {
+      if (!FileManager::SyncDirectory(storage_directory_)) {
+        return false;
+      }
+      current_file_directory_synced_ = true;
+      directory_syncs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return true;
   }
 
   void StoreMessages(std::string const & messages) {
     if (current_file_) {
       // TODO(AlexZ): Consider using write instead of operator<<.
       *current_file_ << messages << std::flush;
+      has_unsynced_writes_ = true;
       if (current_file_->fail()) {
+        sync_failed_ = true;
         ALOG("ERROR: Write to", storage_directory_ + kCurrentFileName, "has failed.");
-      } else if (current_file_->tellp() >= kMaxFileSizeInBytes) {
+      } else if (current_file_->tellp() >= max_file_size_) {
         ArchiveCurrentFile();
       }
     } else {
       inmemory_storage_.append(messages);
+      inmemory_storage_size_.store(inmemory_storage_.size(), std::memory_order_relaxed);
     }
   }
 
   void ProcessInitializeStorageCommand(const std::string & directory) {
-    current_file_.reset(nullptr);
-    std::unique_ptr<std::ofstream> new_current_file(
-        new std::ofstream(directory + kCurrentFileName, std::ios_base::app | std::ios_base::binary));
-    if (new_current_file->fail()) {
+    CloseCurrentFile();
+    OpenCurrentFile(directory + kCurrentFileName);
+    if (current_file_->fail()) {
       // If file could not be created, fall back to the in-memory storage.
+      CloseCurrentFile();
       storage_directory_.clear();
       ALOG("ERROR: Could not create file", directory + kCurrentFileName);
     } else {
       storage_directory_ = directory;
-      current_file_ = std::move(new_current_file);
       // Also check if there are any messages in the memory storage, and save them to file.
       if (!inmemory_storage_.empty()) {
         StoreMessages(inmemory_storage_);
         inmemory_storage_.clear();
+        inmemory_storage_size_.store(0, std::memory_order_relaxed);
       }
     }
   }
 
+  // Messages are stored in batches, so push to disk latency is measured for the oldest message in the batch.
+  void RememberOldestMessageTime() {
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+    if (messages_buffer_.empty()) {
+      oldest_message_time_ = std::chrono::steady_clock::now();
+    }
+#endif
+  }
+
   void ProcessMessageCommand() {
     std::string messages_buffer_copy;
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+    std::chrono::steady_clock::time_point oldest_message_time;
+#endif
     {
       std::lock_guard<std::mutex> lock(messages_mutex_);
       if (!messages_buffer_.empty()) {
         messages_buffer_copy.swap(messages_buffer_);
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+        oldest_message_time = oldest_message_time_;
+#endif
       }
     }
     if (!messages_buffer_copy.empty()) {
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+      const bool stored_to_file = static_cast<bool>(current_file_);
+#endif
       StoreMessages(messages_buffer_copy);
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+      if (stored_to_file) {
+        const auto lag = std::chrono::steady_clock::now() - oldest_message_time;
+        ALOHALYTICS_LATENCY_RECORD(
+            push_to_disk,
+            static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(lag).count()));
+      }
+#endif
     }
   }
 
@@ -203,6 +348,7 @@ class MessagesQueue final {
     if (!inmemory_storage_.empty()) {
       if (processor(false /* in-memory buffer */, inmemory_storage_)) {
         inmemory_storage_.clear();
+        inmemory_storage_size_.store(0, std::memory_order_relaxed);
         result = ProcessingResult::EProcessedSuccessfully;
       } else {
         result = ProcessingResult::EProcessingError;
@@ -253,14 +399,58 @@ class MessagesQueue final {
 
   void ProcessLogrotateCurrentFileCommand() {
     // Here we simply reopen the file. It should be already moved by logrotate.
-    current_file_.reset(nullptr);
-    current_file_.reset(
-        new std::ofstream(storage_directory_ + kCurrentFileName, std::ios_base::app | std::ios_base::binary));
+    CloseCurrentFile();
+    OpenCurrentFile(storage_directory_ + kCurrentFileName);
     if (current_file_->fail()) {
       ALOG("ERROR: Could not reopen", storage_directory_ + kCurrentFileName);
     }
   }
 
+  void ProcessEnableSyncCommand(std::chrono::microseconds batch_window) {
+    sync_enabled_ = true;
+    sync_batch_window_ = batch_window;
+    if (current_file_ && !current_file_syncer_) {
+      current_file_syncer_.reset(new FileSyncer(storage_directory_ + kCurrentFileName));
+    }
+  }
+
+  void ProcessSyncCommand() {
+    std::chrono::steady_clock::time_point first_request_time;
+    {
+      std::lock_guard<std::mutex> lock(messages_mutex_);
+      first_request_time = first_sync_request_time_;
+    }
+    // Other requests can join this sync during the batch window.
+    std::this_thread::sleep_until(first_request_time + sync_batch_window_);
+    std::vector<TSyncCallback> callbacks;
+    // All messages pushed before sync requests are either here or already stored.
+    std::string messages_buffer_copy;
+    {
+      std::lock_guard<std::mutex> lock(messages_mutex_);
+      callbacks.swap(sync_callbacks_);
+      messages_buffer_copy.swap(messages_buffer_);
+      sync_scheduled_ = false;
+    }
+    if (!messages_buffer_copy.empty()) {
+      StoreMessages(messages_buffer_copy);
+    }
+    bool synced = sync_enabled_ && !sync_failed_ && current_file_;
+    if (synced && has_unsynced_writes_) {
+      synced = SyncCurrentFile();
+      syncs_.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (!synced && sync_enabled_) {
+      ALOG("ERROR: Could not sync", storage_directory_ + kCurrentFileName);
+    }
+    // Failed flush is retried by the next sync.
+    has_unsynced_writes_ = has_unsynced_writes_ && !synced;
+    sync_failed_ = false;
+    sync_requests_.fetch_add(callbacks.size(), std::memory_order_relaxed);
+    for (auto & callback : callbacks) {
+      callback(synced);
+    }
+  }
+
   void WorkerThread() {
     TCommand command_to_execute;
     while (true) {
@@ -285,24 +475,57 @@ class MessagesQueue final {
 
  private:
   TFileArchiver file_archiver_;
+  const std::streamoff max_file_size_;
   // Synchronized buffer to pass messages between threads.
   std::string messages_buffer_;
+#ifdef ALOHALYTICS_LATENCY_HISTOGRAMS
+  // Guarded by messages_mutex_, time of the first message in empty messages_buffer_.
+  std::chrono::steady_clock::time_point oldest_message_time_;
+#endif
   // Directory with a slash at the end, where we store "current" file and archived files.
   std::string storage_directory_;
   // Used as an in-memory storage if storage_dir_ was not set.
   std::string inmemory_storage_;
+  // For GetMetrics() calls from other threads.
+  std::atomic<uint64_t> inmemory_storage_size_{0};
+  std::atomic<uint64_t> archived_files_{0};
+  std::atomic<uint64_t> syncs_{0};
+  std::atomic<uint64_t> sync_requests_{0};
+  std::atomic<uint64_t> directory_syncs_{0};
+  // Guarded by messages_mutex_, requests which wait for the scheduled ProcessSyncCommand.
+  std::vector<TSyncCallback> sync_callbacks_;
+  bool sync_scheduled_ = false;
+  std::chrono::steady_clock::time_point first_sync_request_time_;
   typedef std::function<void()> TCommand;
   std::list<TCommand> commands_queue_;
 
+  // Worker thread is started by the first command, so creating a queue does not slow down app's start.
+  void PushCommand(TCommand && command) {
+    std::lock_guard<std::mutex> lock(commands_mutex_);
+    commands_queue_.push_back(std::move(command));
+    if (!worker_thread_.joinable()) {
+      worker_thread_ = std::thread(&MessagesQueue::WorkerThread, this);
+    }
+    commands_condition_variable_.notify_all();
+  }
+
   // Should be guarded by commands_mutex_.
   bool worker_thread_should_exit_ = false;
   std::mutex messages_mutex_;
   std::mutex commands_mutex_;
   std::condition_variable commands_condition_variable_;
-  // Only WorkerThread accesses this variable.
+  // Only WorkerThread accesses these variables.
   std::unique_ptr<std::ofstream> current_file_;
-  // Should be the last member of the class to initialize after all other members.
-  std::thread worker_thread_ = std::thread(&MessagesQueue::WorkerThread, this);
+  std::unique_ptr<FileSyncer> current_file_syncer_;
+  bool current_file_directory_synced_ = false;
+  bool sync_enabled_ = false;
+  std::chrono::microseconds sync_batch_window_{0};
+  // Current file has messages which were not flushed to the storage device yet.
+  bool has_unsynced_writes_ = false;
+  // Some messages since the last sync could not be written or flushed.
+  bool sync_failed_ = false;
+  // Guarded by commands_mutex_, see PushCommand().
+  std::thread worker_thread_;
 };
 
 typedef MessagesQueue<1024 * 100> THundredKilobytesFileQueue;
@@ -28,6 +28,7 @@ SOFTWARE.
 #include <cerrno>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -76,4 +77,47 @@ uint64_t FileManager::GetFileSize(const std::string & full_path_to_file) {
   throw std::ios_base::failure(std::string("Can't stat file ") + full_path_to_file/*,
                                std::error_code(errno, std::generic_category())*/);
 }
+
+bool FileManager::MakeDirectory(const std::string & directory) {
+  if (0 == ::mkdir(directory.c_str(), 0755) || errno == EEXIST) {
+    struct stat st;
+    return 0 == ::stat(directory.c_str(), &st) && S_ISDIR(st.st_mode);
+  }
+  return false;
+}
+
+bool FileManager::SyncDirectory(const std::string & directory) {
+  const int fd = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  const bool synced = 0 == ::fsync(fd);
+  ::close(fd);
+  return synced;
+}
+
+FileSyncer::FileSyncer(const std::string & full_path_to_file)
+    : handle_(::open(full_path_to_file.c_str(), O_WRONLY | O_CLOEXEC)) {}
+
+FileSyncer::~FileSyncer() {
+  if (IsOpen()) {
+    ::close(static_cast<int>(handle_));
+  }
+}
+
+bool FileSyncer::Sync() {
+  if (!IsOpen()) {
+    return false;
+  }
+  const int fd = static_cast<int>(handle_);
+#if defined(__APPLE__)
+  // fsync on Apple platforms does not flush the drive's cache.
+  return 0 == ::fcntl(fd, F_FULLFSYNC) || 0 == ::fsync(fd);
+#elif defined(__linux__)
+  // File size changes are also flushed, other metadata is not needed to read the data back.
+  return 0 == ::fdatasync(fd);
+#else
+  return 0 == ::fsync(fd);
+#endif
+}
 }  // namespace alohalytics
@@ -0,0 +1,418 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Multi-process ring buffer in a memory-mapped file, used when several processes of one app
+// (e.g. UI process and background service on Android) share the same storage directory.
+// Any process can append messages (a record is taken with an atomic compare-and-swap of it's header in the shared
+// memory), but only one of them, the elected writer (it holds an exclusive flock on the ring's lock file),
+// drains the ring into its own MessagesQueue, which archives and uploads them as usual.
+// Writer is re-elected automatically when the process which holds the lock exits.
+// POSIX only, on other platforms Open() always fails and the caller should use the usual queue.
+
+#ifndef SHARED_RING_H
+#define SHARED_RING_H
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>   // remove, rename
+#include <cstring>  // memcpy
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <signal.h>    // kill
+#include <sys/file.h>  // flock
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace alohalytics {
+
+constexpr char kSharedRingFileName[] = "alohalytics_ring";
+// Messages which do not fit into the ring are appended by non-writer processes to their own spill files,
+// see AppendToSpillFile().
+constexpr char kSpillFilePrefix[] = "alohalytics_spill-";
+
+class SharedRing {
+  // All offsets are "virtual": they grow monotonically, real position in data is offset % capacity.
+  struct Header {
+    uint64_t magic;
+    uint64_t capacity;
+    // End of the taken records. It is only a hint for producers: a record is taken with it's header, and any
+    // producer advances head past taken records, so a producer which dies in between does not block others.
+    std::atomic<uint64_t> head;
+    // End of the consumed (and freed) space.
+    std::atomic<uint64_t> tail;
+  };
+  static constexpr uint64_t kMagic = 0x414c4f4852494e32ULL;  // "ALOHRIN2".
+  static constexpr size_t kHeaderSize = 64;
+  static_assert(sizeof(Header) <= kHeaderSize, "Header should fit into the first cache line.");
+
+  // Data is divided into 8-byte units, and every unit has an 8-byte header word in a separate array, so payloads
+  // can never be mistaken for headers. Word of the record's first unit is:
+  // (payload size << 32) | (owner pid << 2) | state for taken records,
+  // (lap << 2) | EFree for free units, where lap (offset / capacity, modulo 2^30) is the one in which the unit can
+  // be taken next, so a producer with a stale head (e.g. suspended for a while) can't take it in a wrong lap.
+  enum State : uint32_t { EFree = 0, EReserved = 1, ECommitted = 2, EPadding = 3 };
+  static constexpr size_t kUnitSize = sizeof(uint64_t);
+  static constexpr uint64_t kPidOrLapMask = (uint64_t(1) << 30) - 1;
+
+  static uint64_t Align(uint64_t size) { return (size + kUnitSize - 1) & ~uint64_t(kUnitSize - 1); }
+  static uint64_t Word(uint64_t size, uint64_t pid_or_lap, State state) {
+    return (size << 32) | ((pid_or_lap & kPidOrLapMask) << 2) | state;
+  }
+  static State StateOf(uint64_t word) { return static_cast<State>(word & 3); }
+  static uint64_t SizeOf(uint64_t word) { return word >> 32; }
+  static uint64_t RecordSize(uint64_t word) {
+    // Empty messages take one unit too, so every record has it's own header.
+    return StateOf(word) == EPadding ? SizeOf(word) : (SizeOf(word) == 0 ? kUnitSize : Align(SizeOf(word)));
+  }
+
+  uint64_t FreeWord(uint64_t offset) const { return Word(0, offset / header_->capacity, EFree); }
+  std::atomic<uint64_t> & HeaderWord(uint64_t offset) { return words_[offset % header_->capacity / kUnitSize]; }
+
+  // Any producer can do it for the record taken at head.
+  void AdvanceHead(uint64_t head, uint64_t word) {
+    header_->head.compare_exchange_strong(head, head + RecordSize(word), std::memory_order_acq_rel,
+                                          std::memory_order_relaxed);
+  }
+
+  // Reserved record of a live process (even if it was suspended for a long time) is never taken from it.
+  // If a pid is reused after a crash, the record is freed when that process exits.
+  static bool IsOwnerDead(uint64_t word) {
+#ifndef _WIN32
+    const pid_t pid = static_cast<pid_t>((word >> 2) & kPidOrLapMask);
+    return ::kill(pid, 0) == -1 && errno == ESRCH;
+#else
+    (void)word;
+    return false;
+#endif
+  }
+
+ public:
+  SharedRing() = default;
+  SharedRing(const SharedRing &) = delete;
+  SharedRing & operator=(const SharedRing &) = delete;
+  ~SharedRing() { Close(); }
+
+  // Creates or opens existing ring file. All processes should use the same capacity, otherwise
+  // the capacity of the process which has created the file is used.
+  bool Open(const std::string & file_path, uint32_t capacity) {
+#ifndef _WIN32
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Lock-free 64-bit atomics are required in the shared memory.");
+    Close();
+    capacity = static_cast<uint32_t>(Align(capacity));
+    const int fd = ::open(file_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    // Serializes initialization between processes.
+    ::flock(fd, LOCK_EX);
+    struct stat st;
+    bool ok = 0 == ::fstat(fd, &st);
+    const bool created = ok && st.st_size == 0;
+    // Header words array is as large as data.
+    if (created) {
+      ok = 0 == ::ftruncate(fd, static_cast<off_t>(kHeaderSize + 2 * uint64_t(capacity)));
+    } else if (ok) {
+      ok = st.st_size > static_cast<off_t>(kHeaderSize);
+    }
+    const size_t size = created ? kHeaderSize + 2 * size_t(capacity) : static_cast<size_t>(st.st_size);
+    void * memory = ok ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (memory != MAP_FAILED) {
+      Header * header = static_cast<Header *>(memory);
+      if (created) {
+        // New file is filled with zeroes, so all units are free in the first lap.
+        header->capacity = capacity;
+        header->magic = kMagic;
+      }
+      if (header->magic != kMagic || 2 * header->capacity != size - kHeaderSize) {
+        ::munmap(memory, size);
+        memory = MAP_FAILED;
+      } else {
+        header_ = header;
+        words_ = reinterpret_cast<std::atomic<uint64_t> *>(static_cast<char *>(memory) + kHeaderSize);
+        data_ = static_cast<char *>(memory) + kHeaderSize + header->capacity;
+        mapped_size_ = size;
+      }
+    }
+    ::flock(fd, LOCK_UN);
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+      return false;
+    }
+    lock_file_path_ = file_path + ".lock";
+    return true;
+#else
+    (void)file_path;
+    (void)capacity;
+    return false;
+#endif
+  }
+
+  void Close() {
+#ifndef _WIN32
+    if (header_) {
+      ::munmap(header_, mapped_size_);
+      header_ = nullptr;
+      words_ = nullptr;
+      data_ = nullptr;
+    }
+    if (lock_fd_ >= 0) {
+      ::close(lock_fd_);
+      lock_fd_ = -1;
+    }
+#endif
+  }
+
+  bool IsOpen() const { return header_ != nullptr; }
+
+  // Non-blocking, returns true if this process is (or has just become) the writer.
+  bool TryBecomeWriter() {
+#ifndef _WIN32
+    if (lock_fd_ >= 0) {
+      return true;
+    }
+    if (!header_) {
+      return false;
+    }
+    const int fd = ::open(lock_file_path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    if (0 != ::flock(fd, LOCK_EX | LOCK_NB)) {
+      ::close(fd);
+      return false;
+    }
+    lock_fd_ = fd;
+    return true;
+#else
+    return false;
+#endif
+  }
+  bool IsWriter() const { return lock_fd_ >= 0; }
+
+  // Larger messages never fit into the ring.
+  size_t MaxMessageSize() const { return header_ ? static_cast<size_t>(header_->capacity) : 0; }
+
+  // Appends message_size bytes written by writer(char * out). Can be called from any thread of any process.
+  // Returns false if ring is full or is not opened.
+  template <typename TWriter>
+  bool Push(size_t message_size, TWriter && writer) {
+#ifndef _WIN32
+    if (!header_ || message_size > MaxMessageSize()) {
+      return false;
+    }
+    const uint64_t capacity = header_->capacity;
+    const uint64_t pid = static_cast<uint64_t>(::getpid());
+    const uint64_t reserved = Word(message_size, pid, EReserved);
+    const uint64_t record_size = RecordSize(reserved);
+    while (true) {
+      // Tail is loaded first, so it is never ahead of head.
+      const uint64_t tail = header_->tail.load(std::memory_order_acquire);
+      const uint64_t head = header_->head.load(std::memory_order_acquire);
+      // Records are never split, the end of the ring is skipped with a padding record.
+      const uint64_t contiguous = capacity - head % capacity;
+      const uint64_t padding = contiguous < record_size ? contiguous : 0;
+      if (head + padding + record_size - tail > capacity) {
+        return false;
+      }
+      std::atomic<uint64_t> & word = HeaderWord(head);
+      uint64_t expected = FreeWord(head);
+      const uint64_t taken = padding ? Word(padding, 0, EPadding) : reserved;
+      if (word.compare_exchange_strong(expected, taken, std::memory_order_acq_rel, std::memory_order_acquire)) {
+        AdvanceHead(head, taken);
+        if (padding) {
+          continue;
+        }
+        writer(data_ + head % capacity);
+        word.store(Word(message_size, pid, ECommitted), std::memory_order_release);
+        return true;
+      }
+      // Another producer has taken the record at head and has not advanced head yet (or has died), or head is
+      // stale and CAS fails.
+      if (StateOf(expected) != EFree) {
+        AdvanceHead(head, expected);
+      }
+    }
+#else
+    (void)message_size;
+    (void)writer;
+    return false;
+#endif
+  }
+
+  // Calls processor(const char * message, size_t size) for every committed message in order and frees their space.
+  // Stops at the first message which is still being written by a live process. Should be called by one consumer
+  // only. Returns number of processed messages.
+  template <typename TProcessor>
+  size_t Drain(TProcessor && processor) {
+    if (!header_) {
+      return 0;
+    }
+    const uint64_t capacity = header_->capacity;
+    uint64_t tail = header_->tail.load(std::memory_order_relaxed);
+    const uint64_t head = header_->head.load(std::memory_order_acquire);
+    size_t processed = 0;
+    while (tail < head) {
+      const uint64_t word = HeaderWord(tail).load(std::memory_order_acquire);
+      const State state = StateOf(word);
+      if (state == ECommitted) {
+        processor(static_cast<const char *>(data_ + tail % capacity), static_cast<size_t>(SizeOf(word)));
+        ++processed;
+      } else if (state == EFree || (state == EReserved && !IsOwnerDead(word))) {
+        // Record is being written. Free units are never below head, it is just a precaution.
+        break;
+      }
+      // Units of the record can be taken only in the next lap.
+      const uint64_t record_size = RecordSize(word);
+      const uint64_t free_word = FreeWord(tail + capacity);
+      for (uint64_t offset = tail; offset < tail + record_size; offset += kUnitSize) {
+        HeaderWord(offset).store(free_word, std::memory_order_relaxed);
+      }
+      tail += record_size;
+      header_->tail.store(tail, std::memory_order_release);
+    }
+    return processed;
+  }
+
+ private:
+  Header * header_ = nullptr;
+  std::atomic<uint64_t> * words_ = nullptr;
+  char * data_ = nullptr;
+  size_t mapped_size_ = 0;
+  std::string lock_file_path_;
+  int lock_fd_ = -1;
+};
+
+// Spill file of this process in the storage directory (with a slash at the end).
+inline std::string SpillFilePath(const std::string & storage_directory) {
+#ifndef _WIN32
+  return storage_directory + kSpillFilePrefix + std::to_string(::getpid());
+#else
+  return storage_directory + kSpillFilePrefix;
+#endif
+}
+
+// Spill file of a process keeps messages which did not fit into the ring, as records of 8-byte size and payload,
+// until the writer adopts it with DrainSpillFile(). Every append holds an exclusive flock on the file, and
+// is retried if the file was adopted meanwhile. Returns false on error.
+template <typename TWriter>
+bool AppendToSpillFile(const std::string & file_path, size_t message_size, TWriter && writer) {
+#ifndef _WIN32
+  std::string record(sizeof(uint64_t) + message_size, '\0');
+  const uint64_t size = message_size;
+  std::memcpy(&record[0], &size, sizeof(size));
+  writer(&record[sizeof(uint64_t)]);
+  while (true) {
+    const int fd = ::open(file_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat st;
+    if (0 != ::flock(fd, LOCK_EX) || 0 != ::fstat(fd, &st)) {
+      ::close(fd);
+      return false;
+    }
+    // File was adopted by the writer before this process has locked it.
+    struct stat linked;
+    if (0 != ::stat(file_path.c_str(), &linked) || linked.st_ino != st.st_ino) {
+      ::close(fd);
+      continue;
+    }
+    const bool written = ::write(fd, record.data(), record.size()) == static_cast<ssize_t>(record.size());
+    ::close(fd);
+    return written;
+  }
+#else
+  (void)file_path;
+  (void)message_size;
+  (void)writer;
+  return false;
+#endif
+}
+
+// Calls processor(const char * message, size_t size) for every message in the spill file, and deletes it. File is
+// renamed first, so it's owner appends new messages into a new file. If the writer crashes, the renamed file is
+// adopted by the next one (with the extension). Returns false if the file could not be read.
+template <typename TProcessor>
+bool DrainSpillFile(const std::string & file_path, TProcessor && processor) {
+#ifndef _WIN32
+  static const std::string kAdoptedExtension = ".adopted";
+  std::string adopted_path = file_path;
+  if (adopted_path.size() < kAdoptedExtension.size() ||
+      adopted_path.compare(adopted_path.size() - kAdoptedExtension.size(), std::string::npos, kAdoptedExtension)) {
+    adopted_path += kAdoptedExtension;
+    if (0 != std::rename(file_path.c_str(), adopted_path.c_str())) {
+      return false;
+    }
+  }
+  const int fd = ::open(adopted_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  // Waits for an append which has started before the rename.
+  struct stat st;
+  if (0 != ::flock(fd, LOCK_EX) || 0 != ::fstat(fd, &st)) {
+    ::close(fd);
+    return false;
+  }
+  std::string data(static_cast<size_t>(st.st_size), '\0');
+  size_t read_bytes = 0;
+  while (read_bytes < data.size()) {
+    const ssize_t result = ::read(fd, &data[read_bytes], data.size() - read_bytes);
+    if (result <= 0) {
+      break;
+    }
+    read_bytes += static_cast<size_t>(result);
+  }
+  ::close(fd);
+  if (read_bytes != data.size()) {
+    return false;
+  }
+  // Incomplete record at the end (e.g. after a crash during append) is dropped.
+  for (size_t offset = 0; data.size() - offset >= sizeof(uint64_t);) {
+    uint64_t size;
+    std::memcpy(&size, &data[offset], sizeof(size));
+    offset += sizeof(size);
+    if (data.size() - offset < size) {
+      break;
+    }
+    processor(static_cast<const char *>(&data[offset]), static_cast<size_t>(size));
+    offset += static_cast<size_t>(size);
+  }
+  std::remove(adopted_path.c_str());
+  return true;
+#else
+  (void)file_path;
+  (void)processor;
+  return false;
+#endif
+}
+
+}  // namespace alohalytics
+
+#endif  // SHARED_RING_H
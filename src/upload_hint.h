@@ -0,0 +1,117 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Server's reply body starts with "Mahalo" or "Hohono" line, and can be followed by a line with a backpressure
+// hint for the client, e.g. "Mahalo\nretry_after=120&sampling_percent=50\n":
+// - retry_after: client should not upload anything for the given number of seconds.
+// - sampling_percent: client should log only given percent of it's bulk (default channel) events until
+//   the next reply without this key.
+// Unknown keys are ignored, and clients which do not know about hints check only the status code, so new keys
+// can be added later. Integers are used to avoid locale-dependent number formats.
+
+#ifndef UPLOAD_HINT_H
+#define UPLOAD_HINT_H
+
+#include <cstdint>
+#include <string>
+
+namespace alohalytics {
+
+// Broken or malicious server should not be able to stop uploads forever.
+constexpr uint32_t kMaxUploadRetryAfterSeconds = 24 * 60 * 60;
+
+struct UploadHint {
+  uint32_t retry_after_seconds = 0;
+  // From 1 to 100, 100 means that all events should be logged.
+  uint32_t sampling_percent = 100;
+
+  bool Empty() const { return retry_after_seconds == 0 && sampling_percent == 100; }
+
+  // Returns an empty string for an empty hint.
+  std::string ToString() const {
+    std::string out;
+    if (retry_after_seconds) {
+      out += "retry_after=" + std::to_string(retry_after_seconds);
+    }
+    if (sampling_percent != 100) {
+      out += (out.empty() ? "sampling_percent=" : "&sampling_percent=") + std::to_string(sampling_percent);
+    }
+    return out;
+  }
+
+  // Never fails, invalid values are ignored.
+  static UploadHint Parse(const std::string & reply_body) {
+    UploadHint hint;
+    size_t pos = reply_body.find('\n');
+    if (pos == std::string::npos) {
+      return hint;
+    }
+    const size_t end = reply_body.find('\n', ++pos);
+    const std::string line = reply_body.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+    pos = 0;
+    while (pos < line.size()) {
+      size_t pair_end = line.find('&', pos);
+      if (pair_end == std::string::npos) {
+        pair_end = line.size();
+      }
+      const size_t equals = line.find('=', pos);
+      if (equals < pair_end) {
+        const std::string key = line.substr(pos, equals - pos);
+        uint64_t value;
+        if (ParseNumber(line, equals + 1, pair_end, value)) {
+          if (key == "retry_after") {
+            hint.retry_after_seconds =
+                static_cast<uint32_t>(value < kMaxUploadRetryAfterSeconds ? value : kMaxUploadRetryAfterSeconds);
+          } else if (key == "sampling_percent" && value >= 1 && value <= 100) {
+            hint.sampling_percent = static_cast<uint32_t>(value);
+          }
+        }
+      }
+      pos = pair_end + 1;
+    }
+    return hint;
+  }
+
+ private:
+  // Decimal digits only, saturates instead of overflowing.
+  static bool ParseNumber(const std::string & str, size_t begin, size_t end, uint64_t & value) {
+    if (begin == end) {
+      return false;
+    }
+    value = 0;
+    for (size_t i = begin; i < end; ++i) {
+      if (str[i] < '0' || str[i] > '9') {
+        return false;
+      }
+      if (value < 0xffffffffULL) {
+        value = value * 10 + static_cast<uint64_t>(str[i] - '0');
+      }
+    }
+    return true;
+  }
+};
+
+}  // namespace alohalytics
+
+#endif  // UPLOAD_HINT_H
@@ -80,4 +80,28 @@ uint64_t FileManager::GetFileSize(const std::string & full_path_to_file) {
   throw std::ios_base::failure(std::strerror(ENOENT), std::error_code(ENOENT, std::generic_category()));
 }
 
+bool FileManager::MakeDirectory(const std::string & directory) {
+  if (0 == ::_mkdir(directory.c_str()) || errno == EEXIST) {
+    const DWORD attributes = ::GetFileAttributesA(directory.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+  }
+  return false;
+}
+
+// NTFS journals directory entries, and FlushFileBuffers can't be called for a directory without admin rights.
+bool FileManager::SyncDirectory(const std::string &) { return true; }
+
+FileSyncer::FileSyncer(const std::string & full_path_to_file)
+    : handle_(reinterpret_cast<intptr_t>(::CreateFileA(full_path_to_file.c_str(), GENERIC_WRITE,
+                                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                                       OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL))) {}
+
+FileSyncer::~FileSyncer() {
+  if (IsOpen()) {
+    ::CloseHandle(reinterpret_cast<HANDLE>(handle_));
+  }
+}
+
+bool FileSyncer::Sync() { return IsOpen() && 0 != ::FlushFileBuffers(reinterpret_cast<HANDLE>(handle_)); }
+
 }  // namespace alohalytics
@@ -0,0 +1,155 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/admission_control.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "generate_temporary_file_name.h"
+
+using alohalytics::AdmissionConfig;
+using alohalytics::AdmissionControl;
+using alohalytics::TokenBucketTable;
+
+TEST(TokenBucketTable, RateAndBurst) {
+  // 2 tokens per second, up to 3.
+  TokenBucketTable table(2., 3., 16, 4);
+  int64_t now_us = 1000000;
+  EXPECT_TRUE(table.Take("key", now_us));
+  EXPECT_TRUE(table.Take("key", now_us));
+  EXPECT_TRUE(table.Take("key", now_us));
+  EXPECT_FALSE(table.Take("key", now_us));
+  // Other keys have their own buckets.
+  EXPECT_TRUE(table.Take("other", now_us));
+  now_us += 499999;
+  EXPECT_FALSE(table.Take("key", now_us));
+  now_us += 1;
+  EXPECT_TRUE(table.Take("key", now_us));
+  EXPECT_FALSE(table.Take("key", now_us));
+  // Bucket is never filled above the burst.
+  now_us += 100000000;
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(table.Take("key", now_us));
+  }
+  EXPECT_FALSE(table.Take("key", now_us));
+  EXPECT_EQ(0u, table.Evictions());
+}
+
+TEST(TokenBucketTable, LeastRecentlyUsedIsEvicted) {
+  // One stripe with 4 buckets, nearly no refill.
+  TokenBucketTable table(1e-6, 1., 4, 1);
+  const int64_t now_us = 0;
+  for (const char * key : {"a", "b", "c", "d"}) {
+    EXPECT_TRUE(table.Take(key, now_us));
+    EXPECT_FALSE(table.Take(key, now_us));
+  }
+  // "a" is used recently, so "b" is evicted instead of it.
+  EXPECT_FALSE(table.Take("a", now_us));
+  EXPECT_TRUE(table.Take("e", now_us));
+  EXPECT_EQ(1u, table.Evictions());
+  EXPECT_FALSE(table.Take("a", now_us));
+  EXPECT_FALSE(table.Take("c", now_us));
+  EXPECT_FALSE(table.Take("e", now_us));
+  // Forgotten bucket starts with a full burst again, and evicts "d".
+  EXPECT_TRUE(table.Take("b", now_us));
+  EXPECT_EQ(2u, table.Evictions());
+  EXPECT_TRUE(table.Take("d", now_us));
+  // Many new keys never need more memory.
+  for (int i = 0; i < 10000; ++i) {
+    EXPECT_TRUE(table.Take(std::to_string(i), now_us));
+  }
+  EXPECT_EQ(10003u, table.Evictions());
+}
+
+TEST(TokenBucketTable, Concurrent) {
+  TokenBucketTable table(1e-6, 100., 1024, 8);
+  std::atomic<int> taken{0};
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&table, &taken]() {
+      for (int i = 0; i < 1000; ++i) {
+        if (table.Take("key" + std::to_string(i % 10), 0)) {
+          ++taken;
+        }
+      }
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(1000, taken);
+}
+
+TEST(AdmissionControl, Limits) {
+  AdmissionConfig config;
+  EXPECT_FALSE(AdmissionControl(config).Enabled());
+  config.ip_rate = 1.;
+  config.ip_burst = 2.;
+  config.client_rate = 0.1;
+  config.client_burst = 1.;
+  AdmissionControl admission(config);
+  EXPECT_TRUE(admission.Enabled());
+  EXPECT_TRUE(admission.AdmitIP("1.1.1.1", 0));
+  EXPECT_TRUE(admission.AdmitIP("1.1.1.1", 0));
+  EXPECT_FALSE(admission.AdmitIP("1.1.1.1", 0));
+  EXPECT_TRUE(admission.AdmitIP("1.1.1.1", 1000000));
+  // Client IDs and IPs are limited separately.
+  EXPECT_TRUE(admission.AdmitClient("1.1.1.1", 0));
+  EXPECT_FALSE(admission.AdmitClient("1.1.1.1", 0));
+  EXPECT_EQ(10u, admission.RetryAfterSeconds());
+  const alohalytics::AdmissionCounters counters = admission.Counters();
+  EXPECT_EQ(3u, counters.ip_admitted);
+  EXPECT_EQ(1u, counters.ip_rejected);
+  EXPECT_EQ(1u, counters.client_admitted);
+  EXPECT_EQ(1u, counters.client_rejected);
+}
+
+TEST(AdmissionConfig, FromFile) {
+  const std::string path = GenerateTemporaryFileName();
+  {
+    std::ofstream file(path);
+    file << "# Comment.\n\n  ip_rate = 2.5\nip_burst=20\r\nclient_rate = 0.1\ntable_capacity = 1000\n";
+  }
+  const AdmissionConfig config = AdmissionConfig::FromFile(path);
+  EXPECT_EQ(2.5, config.ip_rate);
+  EXPECT_EQ(20., config.ip_burst);
+  EXPECT_EQ(0.1, config.client_rate);
+  EXPECT_EQ(AdmissionConfig().client_burst, config.client_burst);
+  EXPECT_EQ(1000u, config.table_capacity);
+  for (const char * invalid :
+       {"ip_rate 1\n", "ip_rate = -1\n", "ip_rate = 1x\n", "unknown = 1\n", "table_stripes = 0\n"}) {
+    std::ofstream(path) << invalid;
+    EXPECT_THROW(AdmissionConfig::FromFile(path), std::runtime_error) << invalid;
+  }
+  std::remove(path.c_str());
+  EXPECT_THROW(AdmissionConfig::FromFile(path), std::runtime_error);
+}
@@ -0,0 +1,139 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+// Counts heap allocations made by the library on the calling thread, to keep LogEvent cheap for
+// memory-constrained apps. Budgets below are average allocations per call measured with libstdc++, plus one
+// for the queue's buffer which grows again every time the worker thread takes it. Lower them when the code
+// is optimized, never raise them without a good reason.
+
+#include "gtest/gtest.h"
+
+#include "../src/alohalytics.h"
+#include "../src/messages_queue.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+// Only allocations on the thread which has enabled counting are counted, so worker threads do not interfere.
+thread_local bool gCountAllocations = false;
+thread_local uint64_t gAllocationsCount = 0;
+}  // namespace
+
+void * operator new(std::size_t size) {
+  if (gCountAllocations) {
+    ++gAllocationsCount;
+  }
+  if (void * ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void * ptr) noexcept { std::free(ptr); }
+// Sized version is used by C++14 compilers, it should match the replaced unsized one.
+void operator delete(void * ptr, std::size_t) noexcept { operator delete(ptr); }
+
+namespace {
+
+using alohalytics::Field;
+using alohalytics::Location;
+using alohalytics::Stats;
+using alohalytics::THundredKilobytesFileQueue;
+using alohalytics::TStringMap;
+
+constexpr uint64_t kCalls = 1000;
+
+// Returns average number of allocations per function() call.
+template <typename TFunction>
+double AllocationsPerCall(TFunction && function) {
+  // Warm up: initialize statics and reserve the queue's buffer.
+  function();
+  gAllocationsCount = 0;
+  gCountAllocations = true;
+  for (uint64_t i = 0; i < kCalls; ++i) {
+    function();
+  }
+  gCountAllocations = false;
+  return static_cast<double>(gAllocationsCount) / kCalls;
+}
+
+const std::string kEvent = "allocations_test";
+const std::string kValue = "value";
+const TStringMap kPairs = {{"key1", "value1"}, {"key2", "value2"}};
+const Location kLocation = Location::FromLatLon(55.75, 37.62).SetAltitude(150, 5);
+
+}  // namespace
+
+TEST(Allocations, Counter) {
+  const double allocations = AllocationsPerCall([]() { std::unique_ptr<int> p(new int(1)); });
+  EXPECT_EQ(1., allocations);
+}
+
+TEST(Allocations, LogEvent) {
+  Stats & stats = Stats::Instance();
+  // All events are written directly into the queue's buffer, location is encoded into a temporary string.
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent); }), 3.);
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, kLocation); }), 4.);
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, kValue); }), 3.);
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, kValue, kLocation); }), 4.);
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, kPairs); }), 3.);
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, kPairs, kLocation); }), 4.);
+  EXPECT_LE(AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, Field("key1", 1), Field("key2", kValue)); }),
+            3.);
+}
+
+TEST(Allocations, LogEventsBatch) {
+  Stats & stats = Stats::Instance();
+  const std::vector<alohalytics::Event> batch(100, alohalytics::Event(kEvent, kPairs, kLocation));
+  // Batch is pushed into the queue at once: a few allocations per batch, plus encoded location per event.
+  EXPECT_LE(AllocationsPerCall([&stats, &batch]() { stats.LogEvents(batch); }), 4. + batch.size());
+  const std::vector<alohalytics::Event> plain_batch(100, alohalytics::Event(kEvent, kPairs));
+  EXPECT_LE(AllocationsPerCall([&stats, &plain_batch]() { stats.LogEvents(plain_batch); }), 4.);
+}
+
+TEST(Allocations, DroppedEvents) {
+  Stats & stats = Stats::Instance();
+  const std::string sampled_out = "allocations_test_sampled_out";
+  stats.SetEventSampling(sampled_out, 0.);
+  EXPECT_EQ(0., AllocationsPerCall([&]() { stats.LogEvent(sampled_out, kPairs, kLocation); }));
+  EXPECT_EQ(0., AllocationsPerCall([&]() { stats.LogEvent(sampled_out, Field("key1", 1)); }));
+  stats.Disable();
+  EXPECT_EQ(0., AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, kPairs, kLocation); }));
+  EXPECT_EQ(0., AllocationsPerCall([&stats]() { stats.LogEvent(kEvent, Field("key1", 1)); }));
+  stats.Enable();
+}
+
+TEST(Allocations, MessagesQueuePush) {
+  THundredKilobytesFileQueue queue;
+  // Command's list node and std::function's storage.
+  EXPECT_LE(AllocationsPerCall([&queue]() { queue.PushMessage(kValue); }), 3.);
+  EXPECT_LE(AllocationsPerCall([&queue]() {
+    queue.PushMessage(kValue.size(), [](char * out) { std::memcpy(out, kValue.data(), kValue.size()); });
+  }), 3.);
+}
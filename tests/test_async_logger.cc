@@ -0,0 +1,195 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "generate_temporary_file_name.h"
+
+#include "../server/async_logger.h"
+#include "../src/file_manager.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using alohalytics::AsyncLogger;
+using alohalytics::FileManager;
+using alohalytics::LogBackend;
+using alohalytics::LogRing;
+using alohalytics::ScopedRemoveFile;
+using std::string;
+using std::vector;
+
+namespace {
+
+vector<string> PopAll(LogRing & ring) {
+  vector<string> lines;
+  while (ring.Pop([&lines](const char * data, size_t size) { lines.emplace_back(data, size); })) {
+  }
+  return lines;
+}
+
+size_t CountLines(const string & text, const string & substring) {
+  size_t count = 0;
+  std::istringstream stream(text);
+  string line;
+  while (std::getline(stream, line)) {
+    if (line.find(substring) != string::npos) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+}  // namespace
+
+TEST(LogRing, OrderAndOverflow) {
+  LogRing ring(3);
+  EXPECT_TRUE(PopAll(ring).empty());
+  // Capacity is rounded up to 4.
+  EXPECT_TRUE(ring.Push("a", 1));
+  EXPECT_TRUE(ring.Push("bb", 2));
+  EXPECT_TRUE(ring.Push("ccc", 3));
+  EXPECT_TRUE(ring.Push("d", 1));
+  EXPECT_FALSE(ring.Push("e", 1));
+  EXPECT_EQ(4u, ring.Pushed());
+  EXPECT_EQ((vector<string>{"a", "bb", "ccc", "d"}), PopAll(ring));
+  // Slots are reused after wrap around.
+  for (int i = 0; i < 10; ++i) {
+    const string line = std::to_string(i);
+    EXPECT_TRUE(ring.Push(line.data(), line.size()));
+    EXPECT_EQ(vector<string>{line}, PopAll(ring));
+  }
+}
+
+TEST(LogRing, TruncatesLongLines) {
+  LogRing ring(1);
+  const string line(alohalytics::kLogRecordSize * 2, 'x');
+  EXPECT_TRUE(ring.Push(line.data(), line.size()));
+  const vector<string> lines = PopAll(ring);
+  ASSERT_EQ(1u, lines.size());
+  EXPECT_EQ(alohalytics::kLogRecordSize, lines.front().size());
+  EXPECT_EQ(string(alohalytics::kLogRecordSize - 4, 'x') + "...\n", lines.front());
+}
+
+TEST(LogRing, ConcurrentProducers) {
+  LogRing ring(1024);
+  vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&ring, t]() {
+      for (int i = 0; i < 200; ++i) {
+        const string line = std::to_string(t) + ':' + std::to_string(i);
+        EXPECT_TRUE(ring.Push(line.data(), line.size()));
+      }
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  const vector<string> lines = PopAll(ring);
+  ASSERT_EQ(800u, lines.size());
+  // Lines of every thread keep their order.
+  vector<int> next(4, 0);
+  for (const string & line : lines) {
+    const int t = line[0] - '0';
+    EXPECT_EQ(std::to_string(t) + ':' + std::to_string(next[t]++), line);
+  }
+}
+
+TEST(AsyncLogger, WritesIntoFile) {
+  const string path = GenerateTemporaryFileName();
+  ScopedRemoveFile remover(path);
+  {
+    AsyncLogger logger(path.c_str(), 0);
+    EXPECT_EQ(&logger, LogBackend::Installed().load());
+    for (int i = 0; i < 10; ++i) {
+      ALOG("Async line", i);
+    }
+    logger.Flush();
+    const string text = FileManager::ReadFileAsString(path);
+    EXPECT_EQ(10u, CountLines(text, "Alohalytics: Async line"));
+    EXPECT_NE(string::npos, text.find("Async line 9\n"));
+    ALOG("Written before destruction");
+  }
+  EXPECT_EQ(nullptr, LogBackend::Installed().load());
+  EXPECT_EQ(1u, CountLines(FileManager::ReadFileAsString(path), "Written before destruction"));
+}
+
+TEST(AsyncLogger, LimitsCallSites) {
+  const string path = GenerateTemporaryFileName();
+  ScopedRemoveFile remover(path);
+  AsyncLogger logger(path.c_str(), 5);
+  int evaluated = 0;
+  for (int i = 0; i < 100; ++i) {
+    ALOG("Noisy line", ++evaluated);
+  }
+  ALOG("Another site");
+  // Arguments of suppressed messages are not evaluated. Up to two windows could be used if the second has changed.
+  EXPECT_GE(evaluated, 5);
+  EXPECT_LE(evaluated, 10);
+  // Suppressed messages are reported by the writer once per second.
+  string text;
+  for (int i = 0; i < 300 && text.find("messages were suppressed") == string::npos; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    logger.Flush();
+    text = FileManager::ReadFileAsString(path);
+  }
+  EXPECT_EQ(static_cast<size_t>(evaluated), CountLines(text, "Noisy line"));
+  EXPECT_EQ(1u, CountLines(text, "Another site"));
+  size_t suppressed = 0;
+  std::istringstream stream(text);
+  string line;
+  while (std::getline(stream, line)) {
+    const size_t found = line.find("WARNING: ");
+    if (found != string::npos && line.find("test_async_logger.cc") != string::npos) {
+      suppressed += std::stoul(line.substr(found + 9));
+    }
+  }
+  EXPECT_EQ(100u, evaluated + suppressed);
+  EXPECT_EQ(0u, logger.Dropped());
+}
+
+TEST(AsyncLogger, ReopensLogFile) {
+  const string path = GenerateTemporaryFileName();
+  const string rotated = path + ".1";
+  ScopedRemoveFile remover(path), rotated_remover(rotated);
+  AsyncLogger logger(path.c_str(), 0);
+  ALOG("Before rotation");
+  logger.Flush();
+  ASSERT_EQ(0, std::rename(path.c_str(), rotated.c_str()));
+  logger.ReopenLogFile();
+  // The writer thread creates the new file.
+  for (int i = 0; i < 300 && !std::ifstream(path).good(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ALOG("After rotation");
+  logger.Flush();
+  EXPECT_EQ(1u, CountLines(FileManager::ReadFileAsString(rotated), "Before rotation"));
+  EXPECT_EQ(0u, CountLines(FileManager::ReadFileAsString(rotated), "After rotation"));
+  EXPECT_EQ(1u, CountLines(FileManager::ReadFileAsString(path), "After rotation"));
+}
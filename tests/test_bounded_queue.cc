@@ -0,0 +1,103 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/bounded_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using alohalytics::BoundedQueue;
+using std::unique_ptr;
+using std::vector;
+
+TEST(BoundedQueue, OrderAndClose) {
+  BoundedQueue<unique_ptr<int>> queue(3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(queue.Push(unique_ptr<int>(new int(i))));
+  }
+  unique_ptr<int> item;
+  EXPECT_TRUE(queue.Pop(item));
+  EXPECT_EQ(0, *item);
+  queue.Close();
+  EXPECT_FALSE(queue.Push(unique_ptr<int>(new int(3))));
+  // Remaining items are still popped after close.
+  EXPECT_TRUE(queue.Pop(item));
+  EXPECT_EQ(1, *item);
+  EXPECT_TRUE(queue.Pop(item));
+  EXPECT_EQ(2, *item);
+  EXPECT_FALSE(queue.Pop(item));
+}
+
+TEST(BoundedQueue, ProducerWaitsWhileFull) {
+  BoundedQueue<int> queue(2);
+  std::atomic<int> pushed(0);
+  std::thread producer([&queue, &pushed]() {
+    for (int i = 0; i < 5; ++i) {
+      queue.Push(int(i));
+      ++pushed;
+    }
+    queue.Close();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_EQ(2, pushed);
+  vector<int> items;
+  int item;
+  while (queue.Pop(item)) {
+    items.push_back(item);
+  }
+  producer.join();
+  EXPECT_EQ((vector<int>{0, 1, 2, 3, 4}), items);
+}
+
+TEST(BoundedQueue, ManyProducersAndConsumers) {
+  BoundedQueue<int> queue(8);
+  std::atomic<long long> sum(0);
+  vector<std::thread> producers, consumers;
+  for (int t = 0; t < 4; ++t) {
+    producers.emplace_back([&queue]() {
+      for (int i = 1; i <= 1000; ++i) {
+        queue.Push(int(i));
+      }
+    });
+    consumers.emplace_back([&queue, &sum]() {
+      int item;
+      while (queue.Pop(item)) {
+        sum += item;
+      }
+    });
+  }
+  for (auto & producer : producers) {
+    producer.join();
+  }
+  queue.Close();
+  for (auto & consumer : consumers) {
+    consumer.join();
+  }
+  EXPECT_EQ(4 * 1000 * 1001 / 2, sum);
+}
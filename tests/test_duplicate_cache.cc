@@ -0,0 +1,109 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/duplicate_cache.h"
+#include "../server/xxhash64.h"
+
+#include <chrono>
+#include <string>
+
+using alohalytics::DuplicateCache;
+using alohalytics::XXHash64;
+
+TEST(XXHash64, ReferenceValues) {
+  EXPECT_EQ(0xef46db3751d8e999ULL, XXHash64::Hash("", 0));
+  EXPECT_EQ(0x44bc2cf5ad770999ULL, XXHash64::Hash("abc", 3));
+  const std::string text = "Nobody inspects the spammish repetition";
+  EXPECT_EQ(0xfbcea83c8a378bf1ULL, XXHash64::Hash(text.data(), text.size()));
+  // Streaming by any chunks gives the same hash.
+  std::string long_text;
+  for (int i = 0; i < 100; ++i) {
+    long_text += text;
+  }
+  const uint64_t expected = XXHash64::Hash(long_text.data(), long_text.size(), 42);
+  for (size_t chunk = 1; chunk < 70; chunk += 7) {
+    XXHash64 hasher(42);
+    for (size_t offset = 0; offset < long_text.size(); offset += chunk) {
+      hasher.Update(long_text.substr(offset, chunk));
+    }
+    EXPECT_EQ(expected, hasher.Digest()) << chunk;
+  }
+  EXPECT_NE(expected, XXHash64::Hash(long_text.data(), long_text.size()));
+}
+
+TEST(DuplicateCache, Window) {
+  DuplicateCache cache(1024, std::chrono::seconds(10));
+  EXPECT_FALSE(cache.CheckAndInsert(123, 1000000));
+  EXPECT_TRUE(cache.CheckAndInsert(123, 1000000));
+  EXPECT_TRUE(cache.CheckAndInsert(123, 10999999));
+  EXPECT_FALSE(cache.CheckAndInsert(456, 1000000));
+  // Window is counted from the first insert.
+  EXPECT_FALSE(cache.CheckAndInsert(123, 11000000));
+  EXPECT_TRUE(cache.CheckAndInsert(123, 11000000));
+  cache.Erase(123);
+  EXPECT_FALSE(cache.CheckAndInsert(123, 11000000));
+  // Zero hash is a valid one.
+  EXPECT_FALSE(cache.CheckAndInsert(0, 0));
+  EXPECT_TRUE(cache.CheckAndInsert(0, 0));
+  const alohalytics::DuplicateCacheCounters counters = cache.Counters();
+  EXPECT_EQ(9u, counters.lookups);
+  EXPECT_EQ(4u, counters.hits);
+  EXPECT_EQ(0u, counters.evictions);
+  EXPECT_DOUBLE_EQ(4.0 / 9, counters.HitRate());
+}
+
+TEST(DuplicateCache, OldestIsEvicted) {
+  // One set of 4 slots.
+  DuplicateCache cache(1, std::chrono::seconds(100));
+  for (uint64_t hash = 1; hash <= 4; ++hash) {
+    EXPECT_FALSE(cache.CheckAndInsert(hash, static_cast<int64_t>(hash)));
+  }
+  EXPECT_FALSE(cache.CheckAndInsert(5, 10));
+  EXPECT_EQ(1u, cache.Counters().evictions);
+  EXPECT_FALSE(cache.CheckAndInsert(1, 11));
+  EXPECT_EQ(2u, cache.Counters().evictions);
+  for (uint64_t hash = 3; hash <= 5; ++hash) {
+    EXPECT_TRUE(cache.CheckAndInsert(hash, 12));
+  }
+  EXPECT_TRUE(cache.CheckAndInsert(1, 12));
+}
+
+TEST(DuplicateCache, ContainsAndInsert) {
+  DuplicateCache cache(1024, std::chrono::seconds(10));
+  EXPECT_FALSE(cache.Contains(123, 1000000));
+  EXPECT_FALSE(cache.Contains(123, 1000000));
+  cache.Insert(123, 1000000);
+  EXPECT_TRUE(cache.Contains(123, 1000000));
+  // Insert of a remembered hash does not restart it's window.
+  cache.Insert(123, 5000000);
+  EXPECT_FALSE(cache.Contains(123, 11000000));
+  EXPECT_FALSE(cache.CheckAndInsert(123, 11000000));
+  EXPECT_TRUE(cache.Contains(123, 11000000));
+  // Inserts are not counted as lookups.
+  const alohalytics::DuplicateCacheCounters counters = cache.Counters();
+  EXPECT_EQ(6u, counters.lookups);
+  EXPECT_EQ(2u, counters.hits);
+}
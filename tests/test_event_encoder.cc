@@ -0,0 +1,194 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../src/event_base.h"
+#include "../src/event_encoder.h"
+#include "../src/event_field.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+using alohalytics::EventEncoder;
+using alohalytics::Field;
+using alohalytics::NoOpDeleter;
+
+static std::string ToString(const Field & field) { return std::string(field.Value(), field.ValueSize()); }
+
+TEST(EventEncoder, FieldFormatting) {
+  EXPECT_EQ("1234", ToString(Field("a", 1234)));
+  EXPECT_EQ("0", ToString(Field("a", 0)));
+  EXPECT_EQ("-42", ToString(Field("a", -42)));
+  EXPECT_EQ(std::to_string(std::numeric_limits<int64_t>::min()),
+            ToString(Field("a", std::numeric_limits<int64_t>::min())));
+  EXPECT_EQ(std::to_string(std::numeric_limits<uint64_t>::max()),
+            ToString(Field("a", std::numeric_limits<uint64_t>::max())));
+  EXPECT_EQ("1", ToString(Field("a", true)));
+  EXPECT_EQ("0", ToString(Field("a", false)));
+  EXPECT_EQ("53.9045398", ToString(Field("a", 53.9045398)));
+  EXPECT_EQ("car", ToString(Field("a", "car")));
+  const std::string value = "string value";
+  EXPECT_EQ(value, ToString(Field("a", value)));
+  EXPECT_EQ("", ToString(Field("a", static_cast<const char *>(nullptr))));
+  const Field field("name", 1);
+  EXPECT_EQ(std::string("name"), std::string(field.Name(), field.NameSize()));
+  // Copies should not reference the original's buffer.
+  std::unique_ptr<Field> original(new Field("a", 987));
+  const Field copy(*original);
+  original.reset();
+  EXPECT_EQ("987", ToString(copy));
+}
+
+TEST(EventEncoder, KeyPairsEventIsCompatibleWithCereal) {
+  const std::string mode = "car";
+  const Field dist("dist_m", 1234), mode_field("mode", mode), a("a", -1.5), empty("empty", "");
+  Field const * fields[] = {&mode_field, &dist, &empty, &a};
+  std::sort(std::begin(fields), std::end(fields), &Field::NameLess);
+
+  AlohalyticsKeyPairsEvent event;
+  event.key = "route_built";
+  event.pairs = {{"dist_m", "1234"}, {"mode", mode}, {"a", "-1.5"}, {"empty", ""}};
+  std::ostringstream sstream;
+  { cereal::BinaryOutputArchive(sstream) << std::unique_ptr<AlohalyticsBaseEvent, NoOpDeleter>(&event); }
+  const std::string expected = sstream.str();
+
+  const size_t size = EventEncoder::KeyPairsEventSize(event.key, fields, 4);
+  ASSERT_EQ(expected.size(), size);
+  std::string encoded(size, '\0');
+  EventEncoder(&encoded[0]).KeyPairsEvent(event.timestamp, event.key, fields, 4);
+  EXPECT_EQ(expected, encoded);
+
+  // And it can be decoded back with cereal.
+  std::istringstream in_stream(encoded);
+  cereal::BinaryInputArchive in_ar(in_stream);
+  std::unique_ptr<AlohalyticsBaseEvent> ptr;
+  in_ar(ptr);
+  const AlohalyticsKeyPairsEvent * decoded = dynamic_cast<const AlohalyticsKeyPairsEvent *>(ptr.get());
+  ASSERT_NE(nullptr, decoded);
+  EXPECT_EQ(event.timestamp, decoded->timestamp);
+  EXPECT_EQ(event.key, decoded->key);
+  EXPECT_EQ(event.pairs, decoded->pairs);
+}
+
+static std::string SerializeWithCereal(const AlohalyticsBaseEvent & event) {
+  std::ostringstream sstream;
+  { cereal::BinaryOutputArchive(sstream) << std::unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event); }
+  return sstream.str();
+}
+
+// Client uses the constant type names table instead of cereal's registration.
+TEST(EventEncoder, AllClientEventTypesAreCompatibleWithCereal) {
+  const uint64_t timestamp = EventEncoder::CurrentTimestamp();
+  const std::string key = "key", value = "value";
+  const std::map<std::string, std::string> pairs = {{"a", "1"}, {"b", "2"}};
+  const alohalytics::Location location = alohalytics::Location::FromLatLon(55.75, 37.62);
+  const std::string encoded_location = location.Encode();
+  std::string encoded;
+  const auto encoder = [&encoded](size_t size) {
+    encoded.assign(size, '\0');
+    return EventEncoder(&encoded[0]);
+  };
+
+  AlohalyticsIdEvent id;
+  id.timestamp = timestamp;
+  id.id = "client id";
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kIdEventType) + EventEncoder::StringSize(id.id.size()))
+      .EventHeader(alohalytics::kIdEventType, timestamp)
+      .String(id.id);
+  EXPECT_EQ(SerializeWithCereal(id), encoded);
+
+  AlohalyticsKeyEvent key_event;
+  key_event.timestamp = timestamp;
+  key_event.key = key;
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kKeyEventType) + EventEncoder::StringSize(key.size()))
+      .EventHeader(alohalytics::kKeyEventType, timestamp)
+      .String(key);
+  EXPECT_EQ(SerializeWithCereal(key_event), encoded);
+
+  AlohalyticsKeyValueEvent value_event;
+  value_event.timestamp = timestamp;
+  value_event.key = key;
+  value_event.value = value;
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kKeyValueEventType) + EventEncoder::StringSize(key.size()) +
+          EventEncoder::StringSize(value.size()))
+      .EventHeader(alohalytics::kKeyValueEventType, timestamp)
+      .String(key)
+      .String(value);
+  EXPECT_EQ(SerializeWithCereal(value_event), encoded);
+
+  AlohalyticsKeyPairsEvent pairs_event;
+  pairs_event.timestamp = timestamp;
+  pairs_event.key = key;
+  pairs_event.pairs = pairs;
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kKeyPairsEventType) + EventEncoder::StringSize(key.size()) +
+          EventEncoder::PairsSize(pairs))
+      .EventHeader(alohalytics::kKeyPairsEventType, timestamp)
+      .String(key)
+      .Pairs(pairs);
+  EXPECT_EQ(SerializeWithCereal(pairs_event), encoded);
+
+  AlohalyticsKeyLocationEvent key_location_event;
+  key_location_event.timestamp = timestamp;
+  key_location_event.key = key;
+  key_location_event.location = location;
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kKeyLocationEventType) + EventEncoder::StringSize(key.size()) +
+          EventEncoder::StringSize(encoded_location.size()))
+      .EventHeader(alohalytics::kKeyLocationEventType, timestamp)
+      .String(key)
+      .String(encoded_location);
+  EXPECT_EQ(SerializeWithCereal(key_location_event), encoded);
+
+  AlohalyticsKeyValueLocationEvent value_location_event;
+  value_location_event.timestamp = timestamp;
+  value_location_event.key = key;
+  value_location_event.value = value;
+  value_location_event.location = location;
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kKeyValueLocationEventType) +
+          EventEncoder::StringSize(key.size()) + EventEncoder::StringSize(value.size()) +
+          EventEncoder::StringSize(encoded_location.size()))
+      .EventHeader(alohalytics::kKeyValueLocationEventType, timestamp)
+      .String(key)
+      .String(value)
+      .String(encoded_location);
+  EXPECT_EQ(SerializeWithCereal(value_location_event), encoded);
+
+  AlohalyticsKeyPairsLocationEvent pairs_location_event;
+  pairs_location_event.timestamp = timestamp;
+  pairs_location_event.key = key;
+  pairs_location_event.pairs = pairs;
+  pairs_location_event.location = location;
+  encoder(EventEncoder::EventHeaderSize(alohalytics::kKeyPairsLocationEventType) +
+          EventEncoder::StringSize(key.size()) + EventEncoder::PairsSize(pairs) +
+          EventEncoder::StringSize(encoded_location.size()))
+      .EventHeader(alohalytics::kKeyPairsLocationEventType, timestamp)
+      .String(key)
+      .Pairs(pairs)
+      .String(encoded_location);
+  EXPECT_EQ(SerializeWithCereal(pairs_location_event), encoded);
+}
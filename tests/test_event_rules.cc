@@ -0,0 +1,178 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../src/event_rules.h"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using alohalytics::EventRules;
+
+TEST(EventRules, NoRules) {
+  EventRules rules;
+  EventRules::Verdict verdict;
+  EXPECT_TRUE(rules.Check("event", verdict));
+  EXPECT_EQ(1., verdict.sampling_rate);
+}
+
+TEST(EventRules, Sampling) {
+  EventRules rules;
+  EXPECT_TRUE(rules.SetSampling("sampled", 0.25));
+  const int kEvents = 100000;
+  int logged = 0;
+  EventRules::Verdict verdict;
+  for (int i = 0; i < kEvents; ++i) {
+    if (rules.Check("sampled", verdict)) {
+      ++logged;
+      EXPECT_EQ(0.25, verdict.sampling_rate);
+    }
+  }
+  EXPECT_NEAR(kEvents * 0.25, logged, kEvents * 0.01);
+  // Other events are not affected.
+  EXPECT_TRUE(rules.Check("other", verdict));
+  EXPECT_EQ(1., verdict.sampling_rate);
+  // Rate 1 switches sampling off.
+  EXPECT_TRUE(rules.SetSampling("sampled", 1.));
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(rules.Check("sampled", verdict));
+    EXPECT_EQ(1., verdict.sampling_rate);
+  }
+  EXPECT_TRUE(rules.SetSampling("sampled", 0.));
+  EXPECT_FALSE(rules.Check("sampled", verdict));
+}
+
+TEST(EventRules, DefaultChannelSampling) {
+  EventRules rules;
+  EXPECT_TRUE(rules.SetChannel("critical", 1));
+  EXPECT_TRUE(rules.SetSampling("sampled", 0.5));
+  rules.SetDefaultChannelSampling(0.25);
+  EXPECT_EQ(0.25, rules.DefaultChannelSampling());
+  const int kEvents = 100000;
+  int logged = 0, sampled_logged = 0;
+  EventRules::Verdict verdict;
+  for (int i = 0; i < kEvents; ++i) {
+    if (rules.Check("event", verdict)) {
+      ++logged;
+      EXPECT_EQ(0.25, verdict.sampling_rate);
+    }
+    if (rules.Check("sampled", verdict)) {
+      ++sampled_logged;
+      EXPECT_EQ(0.125, verdict.sampling_rate);
+    }
+    // Other channels are never sampled.
+    EXPECT_TRUE(rules.Check("critical", verdict));
+    EXPECT_EQ(1., verdict.sampling_rate);
+  }
+  EXPECT_NEAR(kEvents * 0.25, logged, kEvents * 0.01);
+  EXPECT_NEAR(kEvents * 0.125, sampled_logged, kEvents * 0.01);
+  rules.SetDefaultChannelSampling(1.);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(rules.Check("event", verdict));
+    EXPECT_EQ(1., verdict.sampling_rate);
+  }
+}
+
+TEST(EventRules, RateLimit) {
+  EventRules rules;
+  EventRules::Verdict verdict;
+  // 10 events per second with bursts of 3 events.
+  EXPECT_TRUE(rules.SetRateLimit("limited", 10., 3));
+  int64_t now_us = 1000000;
+  EXPECT_TRUE(rules.Check("limited", verdict, now_us));
+  EXPECT_TRUE(rules.Check("limited", verdict, now_us));
+  EXPECT_TRUE(rules.Check("limited", verdict, now_us));
+  EXPECT_FALSE(rules.Check("limited", verdict, now_us));
+  // One more token in 100ms.
+  now_us += 100000;
+  EXPECT_TRUE(rules.Check("limited", verdict, now_us));
+  EXPECT_FALSE(rules.Check("limited", verdict, now_us));
+  // Bucket is full again after a long pause, but not more than burst.
+  now_us += 10000000;
+  int allowed = 0;
+  for (int i = 0; i < 10; ++i) {
+    allowed += rules.Check("limited", verdict, now_us);
+  }
+  EXPECT_EQ(3, allowed);
+  // Zero rate removes the limit.
+  EXPECT_TRUE(rules.SetRateLimit("limited", 0., 0));
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(rules.Check("limited", verdict, now_us));
+  }
+}
+
+TEST(EventRules, TableIsFull) {
+  EventRules rules;
+  for (size_t i = 0; i < EventRules::kMaxRules; ++i) {
+    EXPECT_TRUE(rules.SetSampling("event" + std::to_string(i), 0.5));
+  }
+  EXPECT_FALSE(rules.SetSampling("one more event", 0.5));
+  // Existing rules can be updated.
+  EXPECT_TRUE(rules.SetSampling("event0", 0.1));
+  EventRules::Verdict verdict;
+  EXPECT_TRUE(rules.Check("one more event", verdict));
+}
+
+TEST(EventRules, ConcurrentRateLimit) {
+  EventRules rules;
+  // Very low rate, so only burst events pass.
+  EXPECT_TRUE(rules.SetRateLimit("limited", 0.001, 100));
+  std::atomic<int> allowed(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&rules, &allowed]() {
+      EventRules::Verdict verdict;
+      for (int i = 0; i < 1000; ++i) {
+        if (rules.Check("limited", verdict)) {
+          ++allowed;
+        }
+      }
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(100, allowed);
+}
+
+TEST(EventRules, Channels) {
+  EventRules rules;
+  EventRules::Verdict verdict;
+  EXPECT_TRUE(rules.SetChannel("purchase", 2));
+  EXPECT_TRUE(rules.Check("purchase", verdict));
+  EXPECT_EQ(2u, verdict.channel);
+  EXPECT_TRUE(rules.Check("other", verdict));
+  EXPECT_EQ(0u, verdict.channel);
+  // Routing works together with sampling.
+  EXPECT_TRUE(rules.SetSampling("purchase", 0.5));
+  bool logged = false;
+  while (!logged) {
+    logged = rules.Check("purchase", verdict);
+  }
+  EXPECT_EQ(2u, verdict.channel);
+  EXPECT_EQ(0.5, verdict.sampling_rate);
+}
@@ -0,0 +1,273 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/statistics_receiver.h"
+
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+
+using alohalytics::EventsScanner;
+using alohalytics::Location;
+using alohalytics::NoOpDeleter;
+using alohalytics::StatisticsReceiver;
+
+using namespace std;
+
+namespace {
+
+const uint64_t kServerTimestamp = 1234567890123ULL;
+const string kIP = "192.168.0.1";
+const string kUA = "Test User Agent";
+const string kURI = "/test/uri";
+
+// Every event is serialized into a separate archive, as clients do it.
+template <typename TEvent>
+string Serialize(const TEvent & event) {
+  ostringstream stream;
+  cereal::BinaryOutputArchive(stream) << unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event);
+  return stream.str();
+}
+
+// Checks that pass-through output is exactly the same as cereal's one.
+void TestRewrite(const string & body) {
+  string cereal_client_id;
+  const string expected = StatisticsReceiver::RewriteEventsWithCereal(body, kServerTimestamp, kIP, kUA, kURI,
+                                                                      cereal_client_id);
+  EventsScanner scanner(body.data(), body.size());
+  string out, client_id;
+  ASSERT_TRUE(StatisticsReceiver::RewriteEvents(scanner, kServerTimestamp, kIP, kUA, kURI, out, client_id))
+      << EventsScanner::ErrorToString(scanner.GetError()) << " at " << scanner.ErrorOffset();
+  EXPECT_EQ(expected, out);
+  EXPECT_EQ(cereal_client_id, client_id);
+}
+
+// Checks that both cereal and scanner reject the body.
+EventsScanner::Error TestCorrupted(const string & body) {
+  string client_id;
+  EXPECT_ANY_THROW(StatisticsReceiver::RewriteEventsWithCereal(body, kServerTimestamp, kIP, kUA, kURI, client_id));
+  EventsScanner scanner(body.data(), body.size());
+  string out;
+  EXPECT_FALSE(StatisticsReceiver::RewriteEvents(scanner, kServerTimestamp, kIP, kUA, kURI, out, client_id));
+  EXPECT_NE(EventsScanner::Error::None, scanner.GetError());
+  EXPECT_LE(scanner.ErrorOffset(), body.size());
+  return scanner.GetError();
+}
+
+string AllEventTypes() {
+  const Location location = Location::FromLatLon(55.75, 37.62).SetAltitude(150, 5).SetBearing(90).SetSpeed(10);
+  string body;
+  AlohalyticsIdEvent id;
+  id.timestamp = 1;
+  id.id = "client id";
+  body += Serialize(id);
+  AlohalyticsKeyEvent key;
+  key.timestamp = 2;
+  key.key = "key";
+  body += Serialize(key);
+  AlohalyticsKeyValueEvent value;
+  value.timestamp = 3;
+  value.key = "key";
+  value.value = "value";
+  body += Serialize(value);
+  AlohalyticsKeyPairsEvent pairs;
+  pairs.timestamp = 4;
+  pairs.key = "key";
+  pairs.pairs = {{"a", "1"}, {"b", "2"}, {"", ""}};
+  body += Serialize(pairs);
+  AlohalyticsKeyLocationEvent key_location;
+  key_location.timestamp = 5;
+  key_location.key = "key";
+  key_location.location = location;
+  body += Serialize(key_location);
+  AlohalyticsKeyValueLocationEvent value_location;
+  value_location.timestamp = 6;
+  value_location.key = "key";
+  value_location.value = "value";
+  value_location.location = location;
+  body += Serialize(value_location);
+  AlohalyticsKeyPairsLocationEvent pairs_location;
+  pairs_location.timestamp = 7;
+  pairs_location.key = "key";
+  pairs_location.pairs = {{"a", "1"}};
+  pairs_location.location = Location::FromLatLon(-10, -20).SetSource(Location::NETWORK);
+  body += Serialize(pairs_location);
+  AlohalyticsBaseEvent base;
+  base.timestamp = 8;
+  body += Serialize(base);
+  AlohalyticsIdServerEvent server_id;
+  server_id.timestamp = 9;
+  server_id.id = "second client id";
+  server_id.server_timestamp = 10;
+  server_id.ip = "ip";
+  server_id.user_agent = "ua";
+  server_id.uri = "uri";
+  body += Serialize(server_id);
+  return body;
+}
+
+}  // namespace
+
+TEST(EventsScanner, AllEventTypes) {
+  TestRewrite(AllEventTypes());
+  TestRewrite(string());
+}
+
+TEST(EventsScanner, EventsInOneArchive) {
+  // Repeated types are stored as ids without names.
+  AlohalyticsKeyValueEvent value;
+  value.timestamp = 1;
+  value.key = "key";
+  AlohalyticsIdEvent id;
+  id.timestamp = 2;
+  id.id = "id";
+  ostringstream stream;
+  {
+    cereal::BinaryOutputArchive archive(stream);
+    for (int i = 0; i < 3; ++i) {
+      value.value = to_string(i);
+      archive << unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&value)
+              << unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&id);
+    }
+  }
+  TestRewrite(stream.str());
+  // Several archives in one body: ids are registered by the first archive only.
+  TestRewrite(Serialize(value) + stream.str() + Serialize(id) + stream.str());
+}
+
+TEST(EventsScanner, NonCanonicalPairs) {
+  // Hand-made pairs, std::map can't store them this way.
+  string body = Serialize(AlohalyticsKeyPairsEvent());
+  const auto append_string = [&body](const string & str) {
+    const uint64_t size = str.size();
+    body.append(reinterpret_cast<const char *>(&size), sizeof(size)).append(str);
+  };
+  body.resize(body.size() - sizeof(uint64_t));
+  const uint64_t count = 4;
+  body.append(reinterpret_cast<const char *>(&count), sizeof(count));
+  for (const char * str : {"b", "1", "a", "2", "b", "3", "ab", "4"}) {
+    append_string(str);
+  }
+  TestRewrite(body);
+}
+
+TEST(EventsScanner, ContinueTruncatedPairs) {
+  AlohalyticsKeyPairsLocationEvent canonical;
+  canonical.key = "key";
+  for (int i = 0; i < 50; ++i) {
+    canonical.pairs[to_string(i)] = string(i % 7, 'v');
+  }
+  canonical.location = Location::FromLatLon(1, 2);
+  string non_canonical = Serialize(AlohalyticsKeyPairsEvent());
+  non_canonical.resize(non_canonical.size() - sizeof(uint64_t));
+  const uint64_t count = 40;
+  non_canonical.append(reinterpret_cast<const char *>(&count), sizeof(count));
+  for (uint64_t i = 0; i < 2 * count; ++i) {
+    // The only unordered key is in the middle.
+    const string str = i == count ? "0" : to_string(1000 + i);
+    const uint64_t size = str.size();
+    non_canonical.append(reinterpret_cast<const char *>(&size), sizeof(size)).append(str);
+  }
+  for (const string & body : {Serialize(canonical), non_canonical}) {
+    EventsScanner full(body.data(), body.size());
+    EventsScanner::Event expected;
+    ASSERT_TRUE(full.Next(expected));
+    // The event grows by step bytes, like a pending event with the next inflated chunks.
+    for (size_t step = 1; step < 20; ++step) {
+      string pending = body.substr(0, step);
+      EventsScanner scanner(pending.data(), pending.size());
+      EventsScanner::Event event;
+      while (!scanner.Next(event)) {
+        ASSERT_EQ(EventsScanner::Error::Truncated, scanner.GetError());
+        ASSERT_LT(pending.size(), body.size());
+        pending = body.substr(0, pending.size() + step);
+        scanner.ContinueTruncated(pending.data(), pending.size());
+      }
+      EXPECT_EQ(expected.type, event.type);
+      EXPECT_EQ(expected.pairs_begin, event.pairs_begin);
+      EXPECT_EQ(expected.pairs_are_canonical, event.pairs_are_canonical);
+      EXPECT_EQ(expected.end, event.end);
+    }
+  }
+}
+
+TEST(EventsScanner, NonCanonicalLocation) {
+  AlohalyticsKeyLocationEvent event;
+  event.timestamp = 1;
+  event.key = "key";
+  event.location = Location::FromLatLon(0.0000123, 1);
+  string body = Serialize(event);
+  // Extra trailing bytes are dropped by Location::Decode.
+  const string encoded = event.location.Encode();
+  const size_t location_size_offset = body.size() - encoded.size() - sizeof(uint64_t);
+  const uint64_t new_size = encoded.size() + 3;
+  body.replace(location_size_offset, sizeof(uint64_t), reinterpret_cast<const char *>(&new_size), sizeof(new_size));
+  body += "xyz";
+  TestRewrite(body);
+}
+
+TEST(EventsScanner, CorruptedBodies) {
+  const string body = AllEventTypes();
+  set<size_t> events_ends;
+  {
+    EventsScanner scanner(body.data(), body.size());
+    EventsScanner::Event event;
+    while (scanner.Next(event)) {
+      events_ends.insert(event.end);
+    }
+  }
+  // Every body truncated in the middle of an event is rejected.
+  for (size_t size = 1; size < body.size(); ++size) {
+    EventsScanner scanner(body.data(), size);
+    EventsScanner::Event event;
+    while (scanner.Next(event)) {
+    }
+    EXPECT_EQ(events_ends.count(size) == 0, scanner.GetError() != EventsScanner::Error::None) << size;
+  }
+  EXPECT_EQ(EventsScanner::Error::Truncated, TestCorrupted(body.substr(0, body.size() - 1)));
+
+  // Null pointer.
+  EXPECT_EQ(EventsScanner::Error::NullEvent, TestCorrupted(string(4, '\0')));
+  // Zero valid flag.
+  string invalid = Serialize(AlohalyticsKeyEvent());
+  invalid[4 + 8 + 1] = 0;
+  EXPECT_EQ(EventsScanner::Error::NullEvent, TestCorrupted(invalid));
+  // Unknown type name.
+  string unknown_name = Serialize(AlohalyticsKeyEvent());
+  unknown_name[4 + 8] = 'x';
+  EXPECT_EQ(EventsScanner::Error::UnknownTypeName, TestCorrupted(unknown_name));
+  // Type id was not registered.
+  string unknown_id = Serialize(AlohalyticsKeyEvent());
+  unknown_id[3] = 0;
+  EXPECT_EQ(EventsScanner::Error::UnknownTypeId, TestCorrupted(unknown_id));
+  // Location is shorter than its mask requires.
+  AlohalyticsKeyLocationEvent location_event;
+  location_event.location = Location::FromLatLon(1, 2);
+  string short_location = Serialize(location_event);
+  short_location[short_location.size() - Location::EncodedSize(1)] = 3;
+  EXPECT_EQ(EventsScanner::Error::InvalidLocation, TestCorrupted(short_location));
+}
@@ -0,0 +1,298 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/http_request_parser.h"
+#ifdef __linux__
+#include "../server/epoll_http_server.h"
+#endif
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using alohalytics::HTTPRequest;
+using alohalytics::HTTPRequestParser;
+using alohalytics::HTTPResponse;
+
+using namespace std;
+
+namespace {
+
+const uint64_t kMaxBodyBytes = 1000;
+
+using State = HTTPRequestParser::State;
+
+// Parses request split into pieces of given size.
+State ParseByPieces(HTTPRequestParser & parser, const string & request, size_t piece_size) {
+  string buffer;
+  State state = State::Head;
+  for (size_t offset = 0; offset < request.size(); offset += piece_size) {
+    buffer.append(request, offset, piece_size);
+    state = parser.Parse(buffer);
+    if (state == State::Error || state == State::Complete) {
+      break;
+    }
+  }
+  return state;
+}
+
+int ErrorStatus(const string & request) {
+  HTTPRequestParser parser(kMaxBodyBytes, 100);
+  string buffer = request;
+  EXPECT_EQ(State::Error, parser.Parse(buffer)) << request;
+  return parser.ErrorStatus();
+}
+
+}  // namespace
+
+TEST(HTTPRequestParser, Request) {
+  const string request =
+      "POST /android/1.0/2 HTTP/1.1\r\n"
+      "Host: aloha.with.you\r\n"
+      "Content-Type:application/alohalytics-binary-blob\r\n"
+      "CONTENT-ENCODING: gzip  \r\n"
+      "Content-Length: 5\r\n"
+      "\r\n"
+      "12345";
+  for (size_t piece_size : {size_t(1), size_t(7), request.size()}) {
+    HTTPRequestParser parser(kMaxBodyBytes);
+    ASSERT_EQ(State::Complete, ParseByPieces(parser, request, piece_size));
+    const HTTPRequest & r = parser.Request();
+    EXPECT_EQ("POST", r.method);
+    EXPECT_EQ("/android/1.0/2", r.uri);
+    EXPECT_EQ(1, r.minor_version);
+    EXPECT_TRUE(r.keep_alive);
+    EXPECT_FALSE(r.expect_continue);
+    ASSERT_TRUE(r.Header("content-type"));
+    EXPECT_EQ("application/alohalytics-binary-blob", *r.Header("content-type"));
+    ASSERT_TRUE(r.Header("content-encoding"));
+    EXPECT_EQ("gzip", *r.Header("content-encoding"));
+    EXPECT_EQ(nullptr, r.Header("user-agent"));
+    EXPECT_TRUE(r.has_content_length);
+    EXPECT_EQ(5u, r.content_length);
+    EXPECT_EQ("12345", r.body);
+  }
+}
+
+TEST(HTTPRequestParser, PipelinedRequests) {
+  string buffer =
+      "POST /a HTTP/1.1\r\nContent-Length: 2\r\nExpect: 100-continue\r\n\r\nab"
+      "GET /b HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n"
+      "GET /c HTTP/1.0\r\n\r\n"
+      "POST /d HTTP/1.1\r\nConnection: foo, close\r\nContent-Length: 3\r\n\r\nde";
+  HTTPRequestParser parser(kMaxBodyBytes);
+  ASSERT_EQ(State::Complete, parser.Parse(buffer));
+  EXPECT_EQ("/a", parser.Request().uri);
+  EXPECT_EQ("ab", parser.Request().body);
+  EXPECT_TRUE(parser.Request().expect_continue);
+  parser.Reset();
+  ASSERT_EQ(State::Complete, parser.Parse(buffer));
+  EXPECT_EQ("/b", parser.Request().uri);
+  EXPECT_EQ(0, parser.Request().minor_version);
+  EXPECT_TRUE(parser.Request().keep_alive);
+  EXPECT_FALSE(parser.Request().has_content_length);
+  parser.Reset();
+  ASSERT_EQ(State::Complete, parser.Parse(buffer));
+  EXPECT_EQ("/c", parser.Request().uri);
+  EXPECT_FALSE(parser.Request().keep_alive);
+  parser.Reset();
+  ASSERT_EQ(State::Body, parser.Parse(buffer));
+  EXPECT_EQ(1u, parser.RemainingBodyBytes());
+  EXPECT_FALSE(parser.Request().keep_alive);
+  EXPECT_TRUE(buffer.empty());
+  buffer = "fGET";
+  ASSERT_EQ(State::Complete, parser.Parse(buffer));
+  EXPECT_EQ("def", parser.Request().body);
+  EXPECT_EQ("GET", buffer);
+}
+
+TEST(HTTPRequestParser, Errors) {
+  EXPECT_EQ(400, ErrorStatus("POST\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST /\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / FTP/1.1\r\n\r\n"));
+  EXPECT_EQ(505, ErrorStatus("POST / HTTP/2.0\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nNoColon\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nName : value\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nName: value\r\n folded\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nName: va\rlue\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n"));
+  EXPECT_EQ(400, ErrorStatus("POST / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n"));
+  EXPECT_EQ(413, ErrorStatus("POST / HTTP/1.1\r\nContent-Length: 1001\r\n\r\n"));
+  EXPECT_EQ(501, ErrorStatus("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"));
+  EXPECT_EQ(417, ErrorStatus("POST / HTTP/1.1\r\nExpect: something\r\n\r\n"));
+  EXPECT_EQ(431, ErrorStatus("POST / HTTP/1.1\r\nName: " + string(100, 'x') + "\r\n\r\n"));
+  // Head without the end is also limited.
+  EXPECT_EQ(431, ErrorStatus("POST / HTTP/1.1\r\nName: " + string(100, 'x')));
+}
+
+TEST(HTTPRequestParser, FormatResponse) {
+  HTTPResponse response;
+  response.body = "Mahalo";
+  EXPECT_EQ("HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 6\r\nConnection: keep-alive\r\n\r\nMahalo",
+            alohalytics::FormatHTTPResponse(response, true));
+  response.status = 405;
+  response.content_type = "foo/bar";
+  response.headers.emplace_back("Allow", "POST");
+  response.body.clear();
+  EXPECT_EQ("HTTP/1.1 405 Method Not Allowed\r\nContent-Type: foo/bar\r\nContent-Length: 0\r\nAllow: POST\r\n"
+            "Connection: close\r\n\r\n",
+            alohalytics::FormatHTTPResponse(response, false));
+}
+
+#ifdef __linux__
+namespace {
+
+// Sends parts of data with pauses and receives everything until the server closes the connection
+// or timeout expires.
+string Exchange(uint16_t port, const vector<string> & parts, bool close_write = false) {
+  const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  EXPECT_GE(fd, 0);
+  timeval timeout = {1, 0};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  EXPECT_EQ(0, ::connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+  for (const string & data : parts) {
+    if (&data != &parts.front()) {
+      this_thread::sleep_for(chrono::milliseconds(50));
+    }
+    for (size_t offset = 0; offset < data.size();) {
+      const ssize_t size = ::send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+      if (size <= 0) {
+        break;
+      }
+      offset += static_cast<size_t>(size);
+    }
+  }
+  if (close_write) {
+    ::shutdown(fd, SHUT_WR);
+  }
+  string received;
+  char buffer[4096];
+  ssize_t size;
+  while ((size = ::read(fd, buffer, sizeof(buffer))) > 0) {
+    received.append(buffer, static_cast<size_t>(size));
+  }
+  ::close(fd);
+  return received;
+}
+
+class EchoServer {
+ public:
+  EchoServer(size_t workers) {
+    alohalytics::HTTPServerConfig config;
+    config.address = "127.0.0.1";
+    config.port = 0;
+    config.workers = workers;
+    config.max_body_bytes = kMaxBodyBytes;
+    alohalytics::HTTPHandlers handlers;
+    handlers.on_head = [](const HTTPRequest & request, HTTPResponse & response) {
+      if (request.method != "POST") {
+        response.status = 405;
+        return false;
+      }
+      return true;
+    };
+    handlers.on_request = [](HTTPRequest & request, HTTPResponse & response) {
+      if (request.uri == "/throw") {
+        throw runtime_error("Test exception");
+      }
+      response.body = request.uri + ':' + request.body;
+    };
+    server_.reset(new alohalytics::EpollHTTPServer(config, handlers));
+    thread_ = thread(&alohalytics::EpollHTTPServer::Run, server_.get());
+  }
+  ~EchoServer() {
+    server_->Stop();
+    thread_.join();
+  }
+  uint16_t Port() const { return server_->Port(); }
+
+ private:
+  unique_ptr<alohalytics::EpollHTTPServer> server_;
+  thread thread_;
+};
+
+string Response(int status, const string & body, bool keep_alive) {
+  HTTPResponse response;
+  response.status = status;
+  response.body = body;
+  return alohalytics::FormatHTTPResponse(response, keep_alive);
+}
+
+}  // namespace
+
+TEST(EpollHTTPServer, KeepAliveAndPipelining) {
+  EchoServer server(2);
+  EXPECT_EQ(Response(200, "/a:12", true) + Response(200, "/b:", true) + Response(200, "/c:3", false),
+            Exchange(server.Port(),
+                     {"POST /a HTTP/1.1\r\nContent-Length: 2\r\n\r\n12"
+                      "POST /b HTTP/1.1\r\n\r\n"
+                      "POST /c HTTP/1.1\r\nContent-Length: 1\r\nConnection: close\r\n\r\n3"}));
+  // Keep-alive connection is closed by the client.
+  EXPECT_EQ(Response(200, "/d:4", true),
+            Exchange(server.Port(), {"POST /d HTTP/1.1\r\nContent-Length: 1\r\n\r\n4"}, true));
+  EXPECT_EQ(Response(200, "/e:", false), Exchange(server.Port(), {"POST /e HTTP/1.0\r\n\r\n"}));
+  // Large body is received in many reads and many responses are sent in many writes.
+  string requests;
+  string responses;
+  for (int i = 0; i < 10000; ++i) {
+    requests += "POST /" + to_string(i) + " HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789";
+    responses += Response(200, '/' + to_string(i) + ":0123456789", true);
+  }
+  EXPECT_EQ(responses, Exchange(server.Port(), {requests}, true));
+}
+
+TEST(EpollHTTPServer, Errors) {
+  EchoServer server(1);
+  const string k100Continue = "HTTP/1.1 100 Continue\r\n\r\n";
+  EXPECT_EQ(k100Continue + Response(200, "/a:1", false),
+            Exchange(server.Port(), {"POST /a HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 1\r\n"
+                                     "Connection: close\r\n\r\n",
+                                     "1"}));
+  // Body has been already received.
+  EXPECT_EQ(Response(200, "/a:1", false),
+            Exchange(server.Port(), {"POST /a HTTP/1.1\r\nExpect: 100-continue\r\nContent-Length: 1\r\n"
+                                     "Connection: close\r\n\r\n1"}));
+  // Body is not read if request is rejected by its head.
+  HTTPResponse method_not_allowed;
+  method_not_allowed.status = 405;
+  EXPECT_EQ(alohalytics::FormatHTTPResponse(method_not_allowed, false),
+            Exchange(server.Port(), {"PUT /a HTTP/1.1\r\nContent-Length: 10\r\n\r\n", "0123456789"}));
+  EXPECT_EQ(alohalytics::FormatHTTPResponse(method_not_allowed, true) + Response(200, "/b:", false),
+            Exchange(server.Port(), {"GET /a HTTP/1.1\r\n\r\nPOST /b HTTP/1.0\r\n\r\n"}));
+  EXPECT_EQ(Response(413, "Payload Too Large", false),
+            Exchange(server.Port(), {"POST /a HTTP/1.1\r\nContent-Length: 1001\r\n\r\n"}));
+  EXPECT_EQ(Response(400, "Bad Request", false), Exchange(server.Port(), {"junk\r\n\r\n"}));
+  EXPECT_EQ(Response(500, "Internal Server Error", false),
+            Exchange(server.Port(), {"POST /throw HTTP/1.1\r\n\r\n"}));
+}
+#endif  // __linux__
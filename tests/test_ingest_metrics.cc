@@ -0,0 +1,102 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/ingest_metrics.h"
+
+#include <string>
+
+using alohalytics::IngestMetrics;
+using alohalytics::PrometheusText;
+using std::string;
+
+namespace {
+bool Contains(const string & text, const string & line) { return text.find(line + '\n') != string::npos; }
+}  // namespace
+
+TEST(PrometheusText, Samples) {
+  PrometheusText text;
+  text.Metric("requests_total", "counter", "Requests.")
+      .Sample("requests_total", 3)
+      .Sample("requests_total", 1, "code=\"429\"")
+      .Sample("ratio", 0.25);
+  EXPECT_EQ(
+      "# HELP requests_total Requests.\n"
+      "# TYPE requests_total counter\n"
+      "requests_total 3\n"
+      "requests_total{code=\"429\"} 1\n"
+      "ratio 0.25\n",
+      text.str());
+}
+
+TEST(PrometheusText, Histogram) {
+  alohalytics::LatencyHistogram histogram;
+  // 20us, 2ms and 20s.
+  histogram.Record(20000);
+  histogram.Record(2000000);
+  histogram.Record(20000000000ULL);
+  PrometheusText text;
+  text.Histogram("stage_seconds", histogram.GetSnapshot(), "stage=\"gunzip\"");
+  const string str = text.str();
+  EXPECT_TRUE(Contains(str, "stage_seconds_bucket{stage=\"gunzip\",le=\"1e-05\"} 0")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_bucket{stage=\"gunzip\",le=\"5e-05\"} 1")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_bucket{stage=\"gunzip\",le=\"0.001\"} 1")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_bucket{stage=\"gunzip\",le=\"0.005\"} 2")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_bucket{stage=\"gunzip\",le=\"10\"} 2")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_bucket{stage=\"gunzip\",le=\"+Inf\"} 3")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_sum{stage=\"gunzip\"} 20.00202")) << str;
+  EXPECT_TRUE(Contains(str, "stage_seconds_count{stage=\"gunzip\"} 3")) << str;
+}
+
+TEST(IngestMetrics, Counters) {
+  IngestMetrics metrics;
+  metrics.RecordReply(200, 6);
+  metrics.RecordReply(200, 6);
+  metrics.RecordReply(429, 30);
+  // Invalid status is counted as an internal error.
+  metrics.RecordReply(0, 0);
+  metrics.RecordBytesIn(1000);
+  uint64_t type_counts[alohalytics::kEventTypesCount] = {};
+  type_counts[static_cast<size_t>(alohalytics::EventsScanner::Type::Id)] = 1;
+  type_counts[static_cast<size_t>(alohalytics::EventsScanner::Type::KeyValue)] = 10;
+  metrics.RecordEvents(type_counts);
+  metrics.RecordEvents(type_counts);
+  metrics.store.Record(1000);
+  PrometheusText text;
+  metrics.AppendTo(text);
+  const string str = text.str();
+  EXPECT_TRUE(Contains(str, "alohalytics_requests_total{code=\"200\"} 2")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_requests_total{code=\"429\"} 1")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_requests_total{code=\"500\"} 1")) << str;
+  EXPECT_EQ(string::npos, str.find("code=\"404\""));
+  EXPECT_TRUE(Contains(str, "alohalytics_received_bytes_total 1000")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_sent_bytes_total 42")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_events_total{type=\"i\"} 2")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_events_total{type=\"v\"} 20")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_events_total{type=\"k\"} 0")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_ingest_stage_seconds_count{stage=\"store\"} 1")) << str;
+  EXPECT_TRUE(Contains(str, "alohalytics_ingest_stage_seconds_count{stage=\"gunzip\"} 0")) << str;
+  EXPECT_TRUE(Contains(str, "# TYPE alohalytics_ingest_stage_seconds histogram")) << str;
+}
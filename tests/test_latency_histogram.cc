@@ -0,0 +1,91 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../src/latency_histogram.h"
+
+#include <thread>
+#include <vector>
+
+using alohalytics::LatencyHistogram;
+
+TEST(LatencyHistogram, Buckets) {
+  for (uint64_t value = 0; value < LatencyHistogram::kSubBuckets; ++value) {
+    EXPECT_EQ(value, LatencyHistogram::BucketValue(LatencyHistogram::BucketIndex(value)));
+  }
+  uint64_t previous_index = 0;
+  for (uint64_t value = 1; value < (uint64_t(1) << 40); value = value * 3 / 2 + 1) {
+    const size_t index = LatencyHistogram::BucketIndex(value);
+    EXPECT_LE(previous_index, index);
+    previous_index = index;
+    const uint64_t bucket_value = LatencyHistogram::BucketValue(index);
+    // Bucket contains the value and relative error is limited.
+    EXPECT_LE(value, bucket_value);
+    EXPECT_LT(bucket_value - value, value / LatencyHistogram::kSubBuckets + 1);
+  }
+  EXPECT_EQ(LatencyHistogram::kBucketsCount - 1, LatencyHistogram::BucketIndex(~uint64_t(0)));
+}
+
+TEST(LatencyHistogram, Percentiles) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(0u, histogram.GetSnapshot().Percentile(99.));
+  for (uint64_t value = 1; value <= 1000; ++value) {
+    histogram.Record(value * 1000);
+  }
+  const LatencyHistogram::Snapshot snapshot = histogram.GetSnapshot();
+  EXPECT_EQ(1000u, snapshot.count);
+  EXPECT_EQ(500500000u, snapshot.sum);
+  EXPECT_NEAR(500000., double(snapshot.Percentile(50.)), 500000. / LatencyHistogram::kSubBuckets);
+  EXPECT_NEAR(990000., double(snapshot.Percentile(99.)), 990000. / LatencyHistogram::kSubBuckets);
+  EXPECT_NEAR(1000000., double(snapshot.Max()), 1000000. / LatencyHistogram::kSubBuckets);
+  histogram.Reset();
+  EXPECT_EQ(0u, histogram.GetSnapshot().count);
+  EXPECT_EQ(0u, histogram.GetSnapshot().sum);
+}
+
+TEST(LatencyHistogram, ConcurrentRecord) {
+  LatencyHistogram histogram;
+  const size_t kThreads = 16, kRecordsPerThread = 10000;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&histogram, i]() {
+      for (size_t j = 0; j < kRecordsPerThread; ++j) {
+        histogram.Record(i * 100 + j);
+      }
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(kThreads * kRecordsPerThread, histogram.GetSnapshot().count);
+}
+
+TEST(LatencyHistogram, ToString) {
+  alohalytics::LatencyHistograms histograms;
+  { alohalytics::ScopedLatency latency(histograms.archive); }
+  const std::string text = histograms.ToString();
+  EXPECT_NE(std::string::npos, text.find("log_event count=0"));
+  EXPECT_NE(std::string::npos, text.find("archive count=1"));
+}
@@ -0,0 +1,165 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "generate_temporary_file_name.h"
+
+#include "../server/log_file_reader.h"
+#include "../src/file_manager.h"
+
+#include <cstdio>
+#include <string>
+
+using alohalytics::FileManager;
+using alohalytics::LogCheckpoint;
+using alohalytics::LogFileReader;
+using alohalytics::ScopedRemoveFile;
+using std::string;
+
+TEST(LogCheckpoint, SaveAndLoad) {
+  const string path = GenerateTemporaryFileName();
+  ScopedRemoveFile remover(path);
+  LogCheckpoint checkpoint;
+  EXPECT_FALSE(LogCheckpoint::Load(path, checkpoint));
+  checkpoint.inode = 123456789012ULL;
+  checkpoint.offset = 42;
+  ASSERT_TRUE(checkpoint.Save(path));
+  LogCheckpoint loaded;
+  ASSERT_TRUE(LogCheckpoint::Load(path, loaded));
+  EXPECT_EQ(checkpoint, loaded);
+  checkpoint.offset = 43;
+  ASSERT_TRUE(checkpoint.Save(path));
+  ASSERT_TRUE(LogCheckpoint::Load(path, loaded));
+  EXPECT_EQ(checkpoint, loaded);
+  // Temporary file is renamed.
+  EXPECT_NE(0, std::remove((path + ".tmp").c_str()));
+
+  std::remove(path.c_str());
+  ASSERT_TRUE(FileManager::AppendStringToFile("junk", path));
+  EXPECT_FALSE(LogCheckpoint::Load(path, loaded));
+  EXPECT_EQ(checkpoint, loaded);
+}
+
+TEST(LogFileReader, LinesAndPositions) {
+  const string path = GenerateTemporaryFileName();
+  ScopedRemoveFile remover(path);
+  LogFileReader reader(path);
+  EXPECT_FALSE(reader.Open(LogCheckpoint()));
+  ASSERT_TRUE(FileManager::AppendStringToFile("a\n\nccc\ndd", path));
+  ASSERT_TRUE(reader.Open(LogCheckpoint()));
+  EXPECT_EQ(0u, reader.Position().offset);
+  EXPECT_NE(0u, reader.Position().inode);
+  string line;
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("a", line);
+  EXPECT_EQ(2u, reader.Position().offset);
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("", line);
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("ccc", line);
+  EXPECT_EQ(7u, reader.Position().offset);
+  // The last line is still being written.
+  EXPECT_FALSE(reader.ReadLine(line));
+  EXPECT_EQ(7u, reader.Position().offset);
+  ASSERT_TRUE(FileManager::AppendStringToFile("d\ne", path));
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("ddd", line);
+  EXPECT_EQ(11u, reader.Position().offset);
+  EXPECT_FALSE(reader.ReadLine(line));
+  ASSERT_TRUE(reader.ReadLine(line, true));
+  EXPECT_EQ("e", line);
+  EXPECT_EQ(12u, reader.Position().offset);
+  EXPECT_FALSE(reader.ReadLine(line, true));
+}
+
+TEST(LogFileReader, ContinuesFromCheckpoint) {
+  const string path = GenerateTemporaryFileName();
+  ScopedRemoveFile remover(path);
+  ASSERT_TRUE(FileManager::AppendStringToFile("first\nsecond\n", path));
+  LogCheckpoint checkpoint;
+  string line;
+  {
+    LogFileReader reader(path);
+    ASSERT_TRUE(reader.Open(LogCheckpoint()));
+    ASSERT_TRUE(reader.ReadLine(line));
+    checkpoint = reader.Position();
+  }
+  LogFileReader reader(path);
+  ASSERT_TRUE(reader.Open(checkpoint));
+  EXPECT_EQ(checkpoint, reader.Position());
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("second", line);
+
+  // Another file or a truncated one is read from the beginning.
+  LogCheckpoint other = checkpoint;
+  ++other.inode;
+  ASSERT_TRUE(reader.Open(other));
+  EXPECT_EQ(0u, reader.Position().offset);
+  other = checkpoint;
+  other.offset = 100;
+  ASSERT_TRUE(reader.Open(other));
+  EXPECT_EQ(0u, reader.Position().offset);
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("first", line);
+}
+
+TEST(LogFileReader, Rotation) {
+  const string path = GenerateTemporaryFileName();
+  const string rotated_path = path + ".1";
+  ScopedRemoveFile remover(path), rotated_remover(rotated_path);
+  ASSERT_TRUE(FileManager::AppendStringToFile("old\n", path));
+  LogFileReader reader(path);
+  ASSERT_TRUE(reader.Open(LogCheckpoint()));
+  string line;
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_FALSE(reader.Rotated());
+  ASSERT_EQ(0, std::rename(path.c_str(), rotated_path.c_str()));
+  EXPECT_FALSE(reader.Rotated());
+  // nginx still writes into the renamed file until it creates a new one.
+  ASSERT_TRUE(FileManager::AppendStringToFile("", path));
+  ASSERT_TRUE(FileManager::AppendStringToFile("still old\n", rotated_path));
+  EXPECT_FALSE(reader.Rotated());
+  ASSERT_TRUE(FileManager::AppendStringToFile("new\n", path));
+  EXPECT_TRUE(reader.Rotated());
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("still old", line);
+  EXPECT_FALSE(reader.ReadLine(line, true));
+  ASSERT_TRUE(reader.Open(LogCheckpoint()));
+  EXPECT_FALSE(reader.Rotated());
+  ASSERT_TRUE(reader.ReadLine(line));
+  EXPECT_EQ("new", line);
+
+  // Truncated file, e.g. by logrotate's copytruncate.
+  std::remove(path.c_str());
+  ASSERT_TRUE(FileManager::AppendStringToFile("truncated", path));
+  LogFileReader truncated(path);
+  ASSERT_TRUE(truncated.Open(LogCheckpoint()));
+  ASSERT_TRUE(truncated.ReadLine(line, true));
+  EXPECT_FALSE(truncated.Rotated());
+  std::FILE * file = std::fopen(path.c_str(), "w");
+  ASSERT_NE(nullptr, file);
+  std::fclose(file);
+  EXPECT_TRUE(truncated.Rotated());
+}
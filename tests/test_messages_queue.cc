@@ -28,7 +28,11 @@ SOFTWARE.
 #include "../src/file_manager.h"
 #include "../src/messages_queue.h"
 
+#include <atomic>
+#include <chrono>
+#include <future>
 #include <random>
+#include <thread>
 #include <vector>
 
 using alohalytics::FileManager;
@@ -154,6 +158,20 @@ TEST(MessagesQueue, InMemory_FailedProcessing) {
   EXPECT_TRUE(processor_was_called);
 }
 
+TEST(MessagesQueue, InMemory_Metrics) {
+  THundredKilobytesFileQueue q;
+  q.PushMessage(kTestMessage);
+  FinishTask finish_task;
+  q.ProcessArchivedFiles([](bool, const std::string &) { return false; },
+                         std::bind(&FinishedCallback, std::placeholders::_1, std::ref(finish_task)));
+  EXPECT_EQ(ProcessingResult::EProcessingError, finish_task.get());
+  const alohalytics::QueueMetrics metrics = q.GetMetrics();
+  EXPECT_EQ(0u, metrics.messages_buffer_bytes);
+  EXPECT_EQ(kTestMessage.size(), metrics.inmemory_storage_bytes);
+  EXPECT_EQ(0u, metrics.worker_queue_depth);
+  EXPECT_EQ(0u, metrics.archived_files);
+}
+
 TEST(MessagesQueue, SwitchFromInMemoryToFile_and_OfflineEmulation) {
   const std::string tmpdir = FileManager::GetDirectoryFromFilePath(GenerateTemporaryFileName());
   CleanUpQueueFiles(tmpdir);
@@ -251,6 +269,29 @@ TEST(MessagesQueue, CreateArchiveOnSizeLimitHit) {
   EXPECT_TRUE((file_sizes[0] > q.kMaxFileSizeInBytes) != (file_sizes[1] > q.kMaxFileSizeInBytes));
 }
 
+TEST(MessagesQueue, RuntimeMaxFileSize) {
+  const std::string tmpdir = FileManager::GetDirectoryFromFilePath(GenerateTemporaryFileName());
+  CleanUpQueueFiles(tmpdir);
+  const ScopedRemoveFile remover(tmpdir + alohalytics::kCurrentFileName);
+  {
+    THundredKilobytesFileQueue q(&THundredKilobytesFileQueue::ArchiveFileByRenamingIt, kTestMessage.size());
+    q.SetStorageDirectory(tmpdir);
+    q.PushMessage(kTestMessage);
+  }
+  // Message has hit the limit and should be archived without ProcessArchivedFiles() call.
+  EXPECT_EQ("", FileManager::ReadFileAsString(tmpdir + alohalytics::kCurrentFileName));
+  size_t archives_count = 0;
+  FileManager::ForEachFileInDir(tmpdir, [&archives_count](const std::string & file) {
+    if (EndsWith(file, alohalytics::kArchivedFilesExtension)) {
+      EXPECT_EQ(kTestMessage, FileManager::ReadFileAsString(file));
+      ++archives_count;
+    }
+    return true;
+  });
+  EXPECT_EQ(size_t(1), archives_count);
+  CleanUpQueueFiles(tmpdir);
+}
+
 TEST(MessagesQueue, HighLoadAndIntegrity) {
   // TODO(AlexZ): This test can be improved by generating really a lot of data
   // so many archives will be created. But it will make everything much more complex now.
@@ -297,3 +338,93 @@ TEST(MessagesQueue, HighLoadAndIntegrity) {
   EXPECT_EQ(ProcessingResult::EProcessedSuccessfully, finish_task.get());
   EXPECT_EQ(size_t(0), total_size);  // Zero means that processor was called.
 }
+
+// Blocks until the queue calls sync callback.
+template <typename TQueue>
+bool SyncMessages(TQueue & q) {
+  std::promise<bool> synced;
+  std::future<bool> future = synced.get_future();
+  q.SyncMessages([&synced](bool result) { synced.set_value(result); });
+  return future.get();
+}
+
+TEST(MessagesQueue, SyncMessages) {
+  const std::string tmpdir = FileManager::GetDirectoryFromFilePath(GenerateTemporaryFileName());
+  CleanUpQueueFiles(tmpdir);
+  const std::string current_file = tmpdir + alohalytics::kCurrentFileName;
+  const ScopedRemoveFile remover(current_file), rotated_remover(current_file + ".rotated");
+  {
+    alohalytics::TUnlimitedFileQueue q;
+    q.PushMessage(kTestMessage);
+    // Messages can't be synced in the memory storage.
+    q.EnableSync();
+    EXPECT_FALSE(SyncMessages(q));
+    q.SetStorageDirectory(tmpdir);
+    EXPECT_TRUE(SyncMessages(q));
+    // Messages are stored before the callback is called.
+    EXPECT_EQ(kTestMessage, FileManager::ReadFileAsString(current_file));
+    EXPECT_EQ(1u, q.GetMetrics().syncs);
+    // New file's directory entry is flushed with it's first sync only.
+    EXPECT_EQ(1u, q.GetMetrics().directory_syncs);
+    // Nothing to flush.
+    EXPECT_TRUE(SyncMessages(q));
+    EXPECT_EQ(1u, q.GetMetrics().syncs);
+    EXPECT_EQ(3u, q.GetMetrics().sync_requests);
+    q.PushMessage(kTestMessage);
+    EXPECT_TRUE(SyncMessages(q));
+    EXPECT_EQ(1u, q.GetMetrics().directory_syncs);
+
+    // Messages written before logrotate are synced in the renamed file.
+    q.PushMessage(kTestWorkerMessage);
+    EXPECT_EQ(0, std::rename(current_file.c_str(), (current_file + ".rotated").c_str()));
+    q.LogrotateCurrentFile();
+    q.PushMessage(kTestMessage);
+    EXPECT_TRUE(SyncMessages(q));
+    // The last message can be written before the file is reopened, as messages are stored in batches.
+    EXPECT_EQ(kTestMessage + kTestMessage + kTestWorkerMessage + kTestMessage,
+              FileManager::ReadFileAsString(current_file + ".rotated") + FileManager::ReadFileAsString(current_file));
+    // Reopened file is a new one in the directory.
+    q.PushMessage(kTestWorkerMessage);
+    EXPECT_TRUE(SyncMessages(q));
+    EXPECT_EQ(2u, q.GetMetrics().directory_syncs);
+  }
+  {
+    alohalytics::TUnlimitedFileQueue q;
+    q.SetStorageDirectory(tmpdir);
+    q.PushMessage(kTestMessage);
+    // Sync was not enabled.
+    EXPECT_FALSE(SyncMessages(q));
+  }
+}
+
+TEST(MessagesQueue, SyncMessagesGroupCommit) {
+  const std::string tmpdir = FileManager::GetDirectoryFromFilePath(GenerateTemporaryFileName());
+  CleanUpQueueFiles(tmpdir);
+  const ScopedRemoveFile remover(tmpdir + alohalytics::kCurrentFileName);
+  alohalytics::TUnlimitedFileQueue q;
+  q.SetStorageDirectory(tmpdir);
+  q.EnableSync(std::chrono::milliseconds(2));
+  const size_t kThreads = 32, kMessagesPerThread = 10;
+  std::atomic<size_t> failed_syncs{0};
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&q, &failed_syncs]() {
+      for (size_t message = 0; message < kMessagesPerThread; ++message) {
+        q.PushMessage(kTestMessage);
+        if (!SyncMessages(q)) {
+          ++failed_syncs;
+        }
+      }
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(0u, failed_syncs);
+  const alohalytics::QueueMetrics metrics = q.GetMetrics();
+  EXPECT_EQ(kThreads * kMessagesPerThread, metrics.sync_requests);
+  // Concurrent requests share flushes.
+  EXPECT_LT(metrics.syncs, metrics.sync_requests / 2);
+  EXPECT_EQ(kThreads * kMessagesPerThread * kTestMessage.size(),
+            FileManager::GetFileSize(tmpdir + alohalytics::kCurrentFileName));
+}
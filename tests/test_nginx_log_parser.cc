@@ -0,0 +1,140 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../server/nginx_log_parser.h"
+
+#include <string>
+
+using alohalytics::NginxLogParser;
+using std::string;
+
+namespace {
+
+const string kLine =
+    "192.168.3.123 [18/Jun/2015:03:43:01 +0300] \"POST /2 HTTP/1.1\" 200 107 "
+    "/path_to_files_saved_by_nginx/393/167/188/0188167393 \"Dalvik/1.6.0 (Linux; U; Android 4.4.4; m1 note "
+    "Build/KTU84P)\" application/alohalytics-binary-blob gzip";
+
+NginxLogParser::Error Parse(NginxLogParser & parser, const string & line, NginxLogParser::Entry & entry) {
+  return parser.Parse(line.data(), line.size(), entry);
+}
+
+uint64_t ParseTime(NginxLogParser & parser, const string & time_local) {
+  NginxLogParser::Entry entry;
+  const string line = "1.2.3.4 [" + time_local + "] \"POST /2 HTTP/1.1\" 200 1 /f \"UA\" type gzip";
+  EXPECT_EQ(NginxLogParser::Error::None, Parse(parser, line, entry)) << line;
+  return entry.timestamp_ms;
+}
+
+}  // namespace
+
+TEST(NginxLogParser, AllFields) {
+  NginxLogParser parser;
+  NginxLogParser::Entry entry;
+  ASSERT_EQ(NginxLogParser::Error::None, Parse(parser, kLine, entry));
+  EXPECT_EQ("192.168.3.123", entry.ip.ToString());
+  EXPECT_EQ(1434588181000ULL, entry.timestamp_ms);
+  EXPECT_EQ("POST", entry.method.ToString());
+  EXPECT_EQ("/2", entry.uri.ToString());
+  EXPECT_EQ(200, entry.status);
+  EXPECT_EQ("107", entry.content_length.ToString());
+  EXPECT_EQ("/path_to_files_saved_by_nginx/393/167/188/0188167393", entry.body_file.ToString());
+  EXPECT_EQ("Dalvik/1.6.0 (Linux; U; Android 4.4.4; m1 note Build/KTU84P)", entry.user_agent.ToString());
+  EXPECT_TRUE(entry.content_type == "application/alohalytics-binary-blob");
+  EXPECT_TRUE(entry.content_encoding == "gzip");
+  EXPECT_TRUE(entry.content_encoding != "gzip2");
+  // Fields point into the line.
+  EXPECT_EQ(kLine.data(), entry.ip.data);
+
+  // Empty user agent, HTTP/0.9 request and additional fields.
+  const string line = "10.0.0.1 [18/Jun/2015:03:43:01 +0300] \"GET /ok\" 499 - /f \"\" - - extra";
+  ASSERT_EQ(NginxLogParser::Error::None, Parse(parser, line, entry));
+  EXPECT_EQ("/ok", entry.uri.ToString());
+  EXPECT_EQ(499, entry.status);
+  EXPECT_EQ(0u, entry.user_agent.size);
+  EXPECT_TRUE(entry.content_encoding == "-");
+}
+
+TEST(NginxLogParser, Errors) {
+  NginxLogParser parser;
+  NginxLogParser::Entry entry;
+  EXPECT_EQ(NginxLogParser::Error::IP, Parse(parser, "", entry));
+  EXPECT_EQ(NginxLogParser::Error::Timestamp, Parse(parser, "bad line", entry));
+  EXPECT_EQ("bad", entry.ip.ToString());
+  // Every truncated line fails at the truncated field, and previous fields are set.
+  const struct {
+    size_t size;
+    NginxLogParser::Error error;
+  } kTruncated[] = {
+      {13, NginxLogParser::Error::IP},
+      {30, NginxLogParser::Error::Timestamp},
+      {50, NginxLogParser::Error::Request},
+      {63, NginxLogParser::Error::Status},
+      {66, NginxLogParser::Error::ContentLength},
+      {100, NginxLogParser::Error::BodyFile},
+      {140, NginxLogParser::Error::UserAgent},
+      {kLine.size() - 5, NginxLogParser::Error::ContentType},
+      {kLine.size() - 4, NginxLogParser::Error::ContentType},
+      {kLine.size() - 3, NginxLogParser::Error::None},
+  };
+  for (const auto & truncated : kTruncated) {
+    EXPECT_EQ(truncated.error, Parse(parser, kLine.substr(0, truncated.size), entry))
+        << truncated.size << ' ' << NginxLogParser::ErrorToString(truncated.error);
+  }
+  EXPECT_EQ(NginxLogParser::Error::ContentType, Parse(parser, kLine.substr(0, kLine.size() - 5), entry));
+  EXPECT_EQ(200, entry.status);
+  EXPECT_TRUE(entry.body_file == "/path_to_files_saved_by_nginx/393/167/188/0188167393");
+
+  EXPECT_EQ(NginxLogParser::Error::Request,
+            Parse(parser, "1.2.3.4 [18/Jun/2015:03:43:01 +0300] \"-\" 400 0 - \"-\" - -", entry));
+  EXPECT_EQ(NginxLogParser::Error::Status,
+            Parse(parser, "1.2.3.4 [18/Jun/2015:03:43:01 +0300] \"POST /2 HTTP/1.1\" 20x 0 /f \"UA\" t e", entry));
+  for (const char * time : {"18/Jun/2015:03:43:01", "18/Jux/2015:03:43:01 +0300", "18/Jun/2015:24:43:01 +0300",
+                            "18/Jun/2015:03:43:01 03000", "00/Jun/2015:03:43:01 +0300", "18-Jun-2015:03:43:01 +0300"}) {
+    const string line = "1.2.3.4 [" + string(time) + "] \"POST /2 HTTP/1.1\" 200 1 /f \"UA\" type gzip";
+    EXPECT_EQ(NginxLogParser::Error::Timestamp, Parse(parser, line, entry)) << time;
+  }
+}
+
+TEST(NginxLogParser, Timestamps) {
+  NginxLogParser parser;
+  EXPECT_EQ(1434588181000ULL, ParseTime(parser, "18/Jun/2015:03:43:01 +0300"));
+  // Cached second, day and offset.
+  EXPECT_EQ(1434588181000ULL, ParseTime(parser, "18/Jun/2015:03:43:01 +0300"));
+  EXPECT_EQ(1434588182000ULL, ParseTime(parser, "18/Jun/2015:03:43:02 +0300"));
+  EXPECT_EQ(1434591781000ULL, ParseTime(parser, "18/Jun/2015:04:43:01 +0300"));
+  // The same local time with another offset.
+  EXPECT_EQ(1434599041000ULL, ParseTime(parser, "18/Jun/2015:03:43:01 -0001"));
+  EXPECT_EQ(1434577381000ULL, ParseTime(parser, "18/Jun/2015:03:43:01 +0600"));
+  EXPECT_EQ(1456810199000ULL, ParseTime(parser, "29/Feb/2016:23:59:59 -0530"));
+  EXPECT_EQ(946681200000ULL, ParseTime(parser, "01/Jan/2000:00:00:00 +0100"));
+  EXPECT_EQ(0ULL, ParseTime(parser, "01/Jan/1970:00:00:00 +0000"));
+  // Invalid time does not break the cache.
+  NginxLogParser::Entry entry;
+  EXPECT_EQ(NginxLogParser::Error::Timestamp,
+            Parse(parser, "1.2.3.4 [01/Jan/1970:00:00:00 +0100] \"POST /2\" 200 1 /f \"UA\" type gzip", entry));
+  EXPECT_EQ(1000ULL, ParseTime(parser, "01/Jan/1970:00:00:01 +0000"));
+}
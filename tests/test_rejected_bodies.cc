@@ -0,0 +1,102 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "generate_temporary_file_name.h"
+
+#include "../server/rejected_bodies.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using alohalytics::BodyQuarantine;
+using alohalytics::FileManager;
+using alohalytics::LogRateLimiter;
+using alohalytics::QuarantineConfig;
+using alohalytics::ScopedRemoveFile;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+TEST(LogRateLimiter, PerSecond) {
+  LogRateLimiter limiter(2);
+  uint64_t suppressed = 42;
+  EXPECT_TRUE(limiter.Allow(suppressed, 1));
+  EXPECT_EQ(0u, suppressed);
+  EXPECT_TRUE(limiter.Allow(suppressed, 1));
+  EXPECT_FALSE(limiter.Allow(suppressed, 1));
+  EXPECT_FALSE(limiter.Allow(suppressed, 1));
+  EXPECT_FALSE(limiter.Allow(suppressed, 1));
+  // The first message in the next second reports all suppressed ones.
+  EXPECT_TRUE(limiter.Allow(suppressed, 2));
+  EXPECT_EQ(3u, suppressed);
+  EXPECT_TRUE(limiter.Allow(suppressed, 2));
+  EXPECT_EQ(0u, suppressed);
+  EXPECT_FALSE(limiter.Allow(suppressed, 2));
+
+  LogRateLimiter silent(0);
+  EXPECT_FALSE(silent.Allow(suppressed, 1));
+  EXPECT_FALSE(silent.Allow(suppressed, 2));
+}
+
+TEST(BodyQuarantine, SampleAndStore) {
+  QuarantineConfig config;
+  config.directory = GenerateTemporaryFileName();
+  EXPECT_THROW(BodyQuarantine quarantine(config), std::runtime_error);
+  ASSERT_TRUE(FileManager::MakeDirectory(config.directory));
+  // Files are removed before their directory.
+  vector<unique_ptr<ScopedRemoveFile>> removers;
+  removers.emplace_back(new ScopedRemoveFile(config.directory));
+  config.sample_one_of = 3;
+  config.max_files = 2;
+  BodyQuarantine quarantine(config);
+  EXPECT_TRUE(quarantine.Sample());
+  EXPECT_FALSE(quarantine.Sample());
+  EXPECT_FALSE(quarantine.Sample());
+  EXPECT_TRUE(quarantine.Sample());
+
+  const string path = quarantine.Store("gzipped", "CorruptedEvents at offset 5");
+  ASSERT_FALSE(path.empty());
+  removers.emplace(removers.begin(), new ScopedRemoveFile(path));
+  const string description_path = path.substr(0, path.size() - 3) + ".txt";
+  removers.emplace(removers.begin(), new ScopedRemoveFile(description_path));
+  EXPECT_EQ(0u, path.find(config.directory));
+  EXPECT_EQ("gzipped", FileManager::ReadFileAsString(path));
+  EXPECT_EQ("CorruptedEvents at offset 5\n", FileManager::ReadFileAsString(description_path));
+
+  const string second_path = quarantine.Store("second", "GunzipError");
+  ASSERT_FALSE(second_path.empty());
+  EXPECT_NE(path, second_path);
+  removers.emplace(removers.begin(), new ScopedRemoveFile(second_path));
+  removers.emplace(removers.begin(),
+                   new ScopedRemoveFile(second_path.substr(0, second_path.size() - 3) + ".txt"));
+  // Limit is reached.
+  EXPECT_EQ(2u, quarantine.StoredCount());
+  EXPECT_FALSE(quarantine.Sample());
+  EXPECT_TRUE(quarantine.Store("third", "").empty());
+  EXPECT_EQ(2u, quarantine.StoredCount());
+}
@@ -0,0 +1,281 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../src/file_manager.h"
+#include "../src/shared_ring.h"
+#include "generate_temporary_file_name.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+using alohalytics::AppendToSpillFile;
+using alohalytics::DrainSpillFile;
+using alohalytics::ScopedRemoveFile;
+using alohalytics::SharedRing;
+
+namespace {
+
+bool PushString(SharedRing & ring, const std::string & message) {
+  return ring.Push(message.size(), [&message](char * out) { std::memcpy(out, message.data(), message.size()); });
+}
+
+std::vector<std::string> DrainAll(SharedRing & ring) {
+  std::vector<std::string> messages;
+  ring.Drain([&messages](const char * message, size_t size) { messages.emplace_back(message, size); });
+  return messages;
+}
+
+}  // namespace
+
+TEST(SharedRing, PushAndDrain) {
+  const std::string path = GenerateTemporaryFileName();
+  const ScopedRemoveFile remover(path), lock_remover(path + ".lock");
+  SharedRing ring;
+  ASSERT_TRUE(ring.Open(path, 128));
+  EXPECT_TRUE(DrainAll(ring).empty());
+  // Payloads are aligned to 8 bytes: message0-message9 take 8 bytes, and message10-message12 take 16 bytes.
+  size_t pushed = 0;
+  while (PushString(ring, "message" + std::to_string(pushed))) {
+    ++pushed;
+  }
+  EXPECT_EQ(13u, pushed);
+  std::vector<std::string> drained = DrainAll(ring);
+  ASSERT_EQ(pushed, drained.size());
+  for (size_t i = 0; i < pushed; ++i) {
+    EXPECT_EQ("message" + std::to_string(i), drained[i]);
+  }
+  // Wrap around many times with records of different sizes.
+  for (size_t i = 0; i < 100; ++i) {
+    const std::string message(i % 50, static_cast<char>('a' + i % 26));
+    ASSERT_TRUE(PushString(ring, message));
+    drained = DrainAll(ring);
+    ASSERT_EQ(1u, drained.size());
+    EXPECT_EQ(message, drained[0]);
+  }
+  // Too big messages never fit.
+  EXPECT_FALSE(PushString(ring, std::string(200, 'x')));
+
+  // Another instance (process) sees the same ring, with the original capacity.
+  ASSERT_TRUE(PushString(ring, "persistent"));
+  SharedRing other;
+  ASSERT_TRUE(other.Open(path, 4096));
+  drained = DrainAll(other);
+  ASSERT_EQ(1u, drained.size());
+  EXPECT_EQ("persistent", drained[0]);
+}
+
+TEST(SharedRing, WriterElection) {
+  const std::string path = GenerateTemporaryFileName();
+  const ScopedRemoveFile remover(path), lock_remover(path + ".lock");
+  int child_ready[2], parent_done[2];
+  ASSERT_EQ(0, ::pipe(child_ready));
+  ASSERT_EQ(0, ::pipe(parent_done));
+  const pid_t pid = ::fork();
+  ASSERT_LE(0, pid);
+  if (pid == 0) {
+    SharedRing ring;
+    const char result = ring.Open(path, 1024) && ring.TryBecomeWriter() ? '1' : '0';
+    char unused;
+    if (::write(child_ready[1], &result, 1) != 1 || ::read(parent_done[0], &unused, 1) != 1) {
+      ::_exit(1);
+    }
+    ::_exit(0);
+  }
+  char child_result = 0;
+  ASSERT_EQ(1, ::read(child_ready[0], &child_result, 1));
+  EXPECT_EQ('1', child_result);
+  SharedRing ring;
+  ASSERT_TRUE(ring.Open(path, 1024));
+  EXPECT_FALSE(ring.TryBecomeWriter());
+  EXPECT_FALSE(ring.IsWriter());
+  // Writer exits, so another process takes over.
+  ASSERT_EQ(1, ::write(parent_done[1], "x", 1));
+  int status;
+  ASSERT_EQ(pid, ::waitpid(pid, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  EXPECT_TRUE(ring.TryBecomeWriter());
+  for (int fd : {child_ready[0], child_ready[1], parent_done[0], parent_done[1]}) {
+    ::close(fd);
+  }
+}
+
+TEST(SharedRing, ForkedProducers) {
+  const std::string path = GenerateTemporaryFileName();
+  const ScopedRemoveFile remover(path), lock_remover(path + ".lock");
+  SharedRing ring;
+  // Small ring to make producers wait for the consumer.
+  ASSERT_TRUE(ring.Open(path, 4096));
+  ASSERT_TRUE(ring.TryBecomeWriter());
+  const size_t kProcesses = 4, kMessagesPerProcess = 2000;
+  std::vector<pid_t> children;
+  for (size_t p = 0; p < kProcesses; ++p) {
+    const pid_t pid = ::fork();
+    ASSERT_LE(0, pid);
+    if (pid == 0) {
+      SharedRing producer;
+      if (!producer.Open(path, 4096) || producer.TryBecomeWriter()) {
+        ::_exit(1);
+      }
+      for (size_t i = 0; i < kMessagesPerProcess; ++i) {
+        const std::string message = std::to_string(p) + ":" + std::to_string(i);
+        while (!PushString(producer, message)) {
+          std::this_thread::yield();
+        }
+      }
+      ::_exit(0);
+    }
+    children.push_back(pid);
+  }
+  std::vector<size_t> next_message(kProcesses, 0);
+  size_t received = 0;
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+  while (received < kProcesses * kMessagesPerProcess && std::chrono::steady_clock::now() < deadline) {
+    ring.Drain([&](const char * message, size_t size) {
+      const std::string str(message, size);
+      const size_t colon = str.find(':');
+      const size_t process = std::stoul(str.substr(0, colon));
+      ASSERT_LT(process, kProcesses);
+      // Messages of every process are received in order, exactly once.
+      EXPECT_EQ(next_message[process], std::stoul(str.substr(colon + 1)));
+      next_message[process] = std::stoul(str.substr(colon + 1)) + 1;
+      ++received;
+    });
+  }
+  EXPECT_EQ(kProcesses * kMessagesPerProcess, received);
+  for (const pid_t pid : children) {
+    int status;
+    ASSERT_EQ(pid, ::waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+}
+
+TEST(SharedRing, RecordOfDeadProducerIsSkipped) {
+  const std::string path = GenerateTemporaryFileName();
+  const ScopedRemoveFile remover(path), lock_remover(path + ".lock");
+  SharedRing ring;
+  ASSERT_TRUE(ring.Open(path, 1024));
+  ASSERT_TRUE(PushString(ring, "before"));
+  const pid_t pid = ::fork();
+  ASSERT_LE(0, pid);
+  if (pid == 0) {
+    SharedRing producer;
+    if (producer.Open(path, 1024)) {
+      // Dies after the record was taken, but before it was committed.
+      producer.Push(10, [](char *) { ::_exit(0); });
+    }
+    ::_exit(1);
+  }
+  int status;
+  ASSERT_EQ(pid, ::waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_TRUE(PushString(ring, "after"));
+  const std::vector<std::string> drained = DrainAll(ring);
+  ASSERT_EQ(2u, drained.size());
+  EXPECT_EQ("before", drained[0]);
+  EXPECT_EQ("after", drained[1]);
+  // Space of the dead record is reused.
+  for (size_t i = 0; i < 200; ++i) {
+    ASSERT_TRUE(PushString(ring, "message"));
+    ASSERT_EQ(1u, DrainAll(ring).size());
+  }
+}
+
+TEST(SharedRing, SlowLiveProducerIsWaitedFor) {
+  const std::string path = GenerateTemporaryFileName();
+  const ScopedRemoveFile remover(path), lock_remover(path + ".lock");
+  SharedRing ring;
+  ASSERT_TRUE(ring.Open(path, 1024));
+  std::atomic<bool> reserved(false), release(false);
+  std::thread producer([&]() {
+    ring.Push(4, [&](char * out) {
+      reserved = true;
+      while (!release) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      std::memcpy(out, "slow", 4);
+    });
+  });
+  while (!reserved) {
+    std::this_thread::yield();
+  }
+  ASSERT_TRUE(PushString(ring, "fast"));
+  // Record of a live process is never reclaimed, however long it takes to write it.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(DrainAll(ring).empty());
+  release = true;
+  producer.join();
+  const std::vector<std::string> drained = DrainAll(ring);
+  ASSERT_EQ(2u, drained.size());
+  EXPECT_EQ("slow", drained[0]);
+  EXPECT_EQ("fast", drained[1]);
+}
+
+TEST(SharedRing, SpillFile) {
+  const std::string path = GenerateTemporaryFileName();
+  const std::string adopted_path = path + ".adopted";
+  const ScopedRemoveFile remover(path), adopted_remover(adopted_path);
+  const auto append = [&path](const std::string & message) {
+    return AppendToSpillFile(path, message.size(),
+                             [&message](char * out) { std::memcpy(out, message.data(), message.size()); });
+  };
+  std::vector<std::string> drained;
+  const auto processor = [&drained](const char * message, size_t size) { drained.emplace_back(message, size); };
+  EXPECT_FALSE(DrainSpillFile(path, processor));
+  ASSERT_TRUE(append("first"));
+  ASSERT_TRUE(append(""));
+  ASSERT_TRUE(append("third"));
+  ASSERT_TRUE(DrainSpillFile(path, processor));
+  EXPECT_EQ((std::vector<std::string>{"first", "", "third"}), drained);
+  EXPECT_EQ(-1, ::access(path.c_str(), F_OK));
+  EXPECT_EQ(-1, ::access(adopted_path.c_str(), F_OK));
+
+  // File which was renamed by a crashed writer is adopted as is, without it's incomplete last record.
+  ASSERT_TRUE(append("left"));
+  ASSERT_EQ(0, std::rename(path.c_str(), adopted_path.c_str()));
+  {
+    FILE * file = std::fopen(adopted_path.c_str(), "ab");
+    ASSERT_NE(nullptr, file);
+    const uint64_t size = 100;
+    ASSERT_EQ(1u, std::fwrite(&size, sizeof(size), 1, file));
+    std::fclose(file);
+  }
+  ASSERT_TRUE(append("new"));
+  drained.clear();
+  ASSERT_TRUE(DrainSpillFile(adopted_path, processor));
+  EXPECT_EQ(std::vector<std::string>{"left"}, drained);
+  EXPECT_EQ(-1, ::access(adopted_path.c_str(), F_OK));
+  drained.clear();
+  ASSERT_TRUE(DrainSpillFile(path, processor));
+  EXPECT_EQ(std::vector<std::string>{"new"}, drained);
+}
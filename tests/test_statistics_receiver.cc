@@ -27,10 +27,25 @@ SOFTWARE.
 #include "../src/file_manager.h"
 #include "../src/gzip_wrapper.h"
 #include "../server/statistics_receiver.h"
+#include "generate_temporary_file_name.h"
 
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+using alohalytics::DecodedBody;
+using alohalytics::EventsScanner;
 using alohalytics::FileManager;
 using alohalytics::Gzip;
+using alohalytics::IngestFailure;
+using alohalytics::IngestLimits;
+using alohalytics::IngestResult;
 using alohalytics::NoOpDeleter;
+using alohalytics::QuarantineConfig;
 using alohalytics::ScopedRemoveFile;
 using alohalytics::StatisticsReceiver;
 
@@ -39,6 +54,8 @@ using namespace std;
 static constexpr const char * kTestDirectory = ".";
 static const string kQueueFileToCleanUp =
     string(kTestDirectory) + FileManager::kDirectorySeparator + alohalytics::kCurrentFileName;
+static const string kManifestFileToCleanUp =
+    string(kTestDirectory) + FileManager::kDirectorySeparator + alohalytics::kShardsManifestFileName;
 
 static constexpr const char * kFirstEventId = "First Unique ID";
 static constexpr const char * kSecondEventId = "Second Unique ID";
@@ -58,7 +75,7 @@ string CreateCerealIdEvent(const char * id) {
 }
 
 TEST(StatisticsReceiver, SmokeTest) {
-  ScopedRemoveFile remover(kQueueFileToCleanUp);
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
   {
     StatisticsReceiver receiver(kTestDirectory);
     receiver.ProcessReceivedHTTPBody(Gzip(CreateCerealIdEvent(kFirstEventId)), AlohalyticsBaseEvent::CurrentTimestamp(),
@@ -89,3 +106,588 @@ TEST(StatisticsReceiver, SmokeTest) {
     EXPECT_EQ(static_cast<size_t>(in_stream.tellg()), cereal_binary_events.size());
   }
 }
+
+// fcgi_server shares one receiver between all its accept loops.
+TEST(StatisticsReceiver, ConcurrentBodiesAreNotMixed) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  constexpr size_t kThreads = 8;
+  constexpr size_t kBodiesPerThread = 50;
+  {
+    StatisticsReceiver receiver(kTestDirectory);
+    vector<thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+      threads.emplace_back([&receiver, t]() {
+        for (size_t i = 0; i < kBodiesPerThread; ++i) {
+          const string id = to_string(t) + "-" + to_string(i);
+          AlohalyticsKeyEvent key_event;
+          key_event.key = id;
+          ostringstream sstream;
+          cereal::BinaryOutputArchive(sstream) << unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&key_event);
+          receiver.ProcessReceivedHTTPBody(Gzip(CreateCerealIdEvent(id.c_str()) + sstream.str()),
+                                           AlohalyticsBaseEvent::CurrentTimestamp(), kFirstIP, kFirstUA, kFirstURI);
+        }
+      });
+    }
+    for (auto & thread : threads) {
+      thread.join();
+    }
+  }
+  const string cereal_binary_events = FileManager::ReadFileAsString(kQueueFileToCleanUp);
+  istringstream in_stream(cereal_binary_events);
+  cereal::BinaryInputArchive in_ar(in_stream);
+  set<string> ids;
+  unique_ptr<AlohalyticsBaseEvent> ptr;
+  while (static_cast<size_t>(in_stream.tellg()) < cereal_binary_events.size()) {
+    in_ar(ptr);
+    const AlohalyticsIdServerEvent * id_event = dynamic_cast<const AlohalyticsIdServerEvent *>(ptr.get());
+    ASSERT_NE(nullptr, id_event);
+    const string id = id_event->id;
+    // Every body is stored as a whole.
+    in_ar(ptr);
+    const AlohalyticsKeyEvent * key_event = dynamic_cast<const AlohalyticsKeyEvent *>(ptr.get());
+    ASSERT_NE(nullptr, key_event);
+    EXPECT_EQ(id, key_event->key);
+    EXPECT_TRUE(ids.insert(id).second);
+  }
+  EXPECT_EQ(kThreads * kBodiesPerThread, ids.size());
+}
+
+TEST(StatisticsReceiver, ShardsByClientId) {
+  constexpr size_t kShards = 3;
+  const string directory = GenerateTemporaryFileName() + FileManager::kDirectorySeparator;
+  ASSERT_TRUE(FileManager::MakeDirectory(directory));
+  // Files are removed before their directories, so every next remover is added to the front.
+  vector<unique_ptr<ScopedRemoveFile>> removers;
+  removers.emplace_back(new ScopedRemoveFile(directory));
+  removers.emplace(removers.begin(), new ScopedRemoveFile(directory + alohalytics::kShardsManifestFileName));
+  {
+    StatisticsReceiver receiver(directory, kShards, StatisticsReceiver::ShardBy::ClientId);
+    EXPECT_EQ(kShards, receiver.ShardsCount());
+    for (size_t i = 0; i < 20; ++i) {
+      // Every client sends several bodies.
+      const string id = "client " + to_string(i % 5);
+      receiver.ProcessReceivedHTTPBody(Gzip(CreateCerealIdEvent(id.c_str())), AlohalyticsBaseEvent::CurrentTimestamp(),
+                                       kFirstIP, kFirstUA, kFirstURI);
+    }
+    receiver.ReopenDataFile();
+  }
+  const string manifest = FileManager::ReadFileAsString(directory + alohalytics::kShardsManifestFileName);
+  istringstream manifest_stream(manifest);
+  map<string, string> client_shards;
+  size_t files = 0;
+  for (string file; getline(manifest_stream, file); ++files) {
+    const string path = directory + file;
+    removers.emplace(removers.begin(), new ScopedRemoveFile(FileManager::GetDirectoryFromFilePath(path)));
+    FileManager::ForEachFileInDir(FileManager::GetDirectoryFromFilePath(path), [&](const string & full_path) {
+      removers.emplace(removers.begin(), new ScopedRemoveFile(full_path));
+      istringstream in_stream(FileManager::ReadFileAsString(full_path));
+      cereal::BinaryInputArchive in_ar(in_stream);
+      unique_ptr<AlohalyticsBaseEvent> ptr;
+      while (in_stream.peek() != istringstream::traits_type::eof()) {
+        in_ar(ptr);
+        const AlohalyticsIdServerEvent * id_event = dynamic_cast<const AlohalyticsIdServerEvent *>(ptr.get());
+        EXPECT_NE(nullptr, id_event);
+        // All bodies of the same client are in the same shard.
+        const auto inserted = client_shards.emplace(id_event->id, file);
+        EXPECT_EQ(file, inserted.first->second);
+      }
+      return true;
+    });
+  }
+  EXPECT_EQ(kShards, files);
+  EXPECT_EQ(5u, client_shards.size());
+}
+
+TEST(StatisticsReceiver, ShardsByThreadOfEveryReceiver) {
+  constexpr size_t kShards = 2;
+  vector<unique_ptr<ScopedRemoveFile>> removers;
+  vector<string> directories;
+  for (size_t i = 0; i < 2; ++i) {
+    directories.push_back(GenerateTemporaryFileName() + FileManager::kDirectorySeparator);
+    ASSERT_TRUE(FileManager::MakeDirectory(directories.back()));
+    removers.emplace(removers.begin(), new ScopedRemoveFile(directories.back()));
+    removers.emplace(removers.begin(),
+                     new ScopedRemoveFile(directories.back() + alohalytics::kShardsManifestFileName));
+    for (size_t shard = 0; shard < kShards; ++shard) {
+      const string shard_directory =
+          directories.back() + "shard-" + to_string(shard) + FileManager::kDirectorySeparator;
+      removers.emplace(removers.begin(), new ScopedRemoveFile(shard_directory));
+      removers.emplace(removers.begin(), new ScopedRemoveFile(shard_directory + alohalytics::kCurrentFileName));
+    }
+  }
+  {
+    StatisticsReceiver first(directories[0], kShards), second(directories[1], kShards);
+    const string body = Gzip(CreateCerealIdEvent("client"));
+    const auto store_into_both = [&]() {
+      first.ProcessReceivedHTTPBody(body, 1, kFirstIP, kFirstUA, kFirstURI);
+      second.ProcessReceivedHTTPBody(body, 1, kFirstIP, kFirstUA, kFirstURI);
+    };
+    // Thread's index in the first receiver does not affect it's index in the second one, so the second receiver
+    // uses both shards for the first and the third threads.
+    thread(store_into_both).join();
+    thread([&]() { first.ProcessReceivedHTTPBody(body, 1, kFirstIP, kFirstUA, kFirstURI); }).join();
+    thread(store_into_both).join();
+    first.ReopenDataFile();
+    second.ReopenDataFile();
+  }
+  for (const string & directory : directories) {
+    for (size_t shard = 0; shard < kShards; ++shard) {
+      const string shard_directory = directory + "shard-" + to_string(shard) + FileManager::kDirectorySeparator;
+      EXPECT_FALSE(FileManager::ReadFileAsString(shard_directory + alohalytics::kCurrentFileName).empty())
+          << shard_directory;
+    }
+  }
+}
+
+namespace {
+// Returns body by chunks of chunk_size bytes, like a network stream.
+struct ChunkedReader {
+  const string & data;
+  size_t chunk_size;
+  size_t offset = 0;
+
+  ChunkedReader(const string & data, size_t chunk_size) : data(data), chunk_size(chunk_size) {}
+  size_t operator()(char * buffer, size_t size) {
+    size = min(min(size, chunk_size), data.size() - offset);
+    memcpy(buffer, data.data() + offset, size);
+    offset += size;
+    return size;
+  }
+};
+
+string ManyEventsBody(size_t events_count) {
+  string body = CreateCerealIdEvent(kFirstEventId);
+  AlohalyticsKeyValueEvent event;
+  event.key = "key";
+  for (size_t i = 0; i < events_count; ++i) {
+    event.timestamp = i;
+    event.value = to_string(i);
+    ostringstream sstream;
+    cereal::BinaryOutputArchive(sstream) << unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event);
+    body += sstream.str();
+  }
+  return body;
+}
+}  // namespace
+
+TEST(StatisticsReceiver, StreamingIngest) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  // Events are split between inflated chunks.
+  const string body = ManyEventsBody(5000);
+  const string gzipped = Gzip(body);
+  string expected, client_id;
+  EventsScanner scanner(body.data(), body.size());
+  ASSERT_TRUE(StatisticsReceiver::RewriteEvents(scanner, 1, kFirstIP, kFirstUA, kFirstURI, expected, client_id));
+  {
+    StatisticsReceiver receiver(kTestDirectory);
+    for (size_t chunk_size : {size_t(7), size_t(1000), gzipped.size()}) {
+      EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, chunk_size),
+                                                                     gzipped.size(), 1, kFirstIP, kFirstUA, kFirstURI));
+    }
+    EXPECT_EQ(3u, receiver.IngestCounter(IngestResult::Ok));
+  }
+  EXPECT_EQ(expected + expected + expected, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+}
+
+TEST(StatisticsReceiver, StreamingIngestOfLargeEvent) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  // A single 10MB pairs event spans hundreds of inflated chunks, and is scanned only once.
+  AlohalyticsKeyPairsEvent event;
+  event.key = "key";
+  for (size_t i = 0; i < 200000; ++i) {
+    event.pairs[to_string(1000000 + i)] = to_string(i) + string(30, 'v');
+  }
+  ostringstream sstream;
+  cereal::BinaryOutputArchive(sstream) << unique_ptr<AlohalyticsBaseEvent const, NoOpDeleter>(&event);
+  const string body = CreateCerealIdEvent(kFirstEventId) + sstream.str();
+  const string gzipped = Gzip(body);
+  string expected, client_id;
+  EventsScanner scanner(body.data(), body.size());
+  ASSERT_TRUE(StatisticsReceiver::RewriteEvents(scanner, 1, kFirstIP, kFirstUA, kFirstURI, expected, client_id));
+  {
+    StatisticsReceiver receiver(kTestDirectory);
+    EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                   kFirstIP, kFirstUA, kFirstURI));
+  }
+  EXPECT_EQ(expected, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+}
+
+TEST(StatisticsReceiver, StreamingIngestLimits) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  const auto process = [&receiver](const string & gzipped) {
+    return receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 4096), gzipped.size(), 1, kFirstIP, kFirstUA,
+                                              kFirstURI);
+  };
+  // Identical events are compressed very well.
+  const string junk = Gzip(ManyEventsBody(1).substr(0, 50) + string(10 * 1024 * 1024, 'x'));
+  string identical_events;
+  while (identical_events.size() < 4 * IngestLimits::kRatioCheckMinInflatedBytes) {
+    identical_events += CreateCerealIdEvent(kFirstEventId);
+  }
+  const string gzipped_identical_events = Gzip(identical_events);
+
+  IngestLimits limits;
+  limits.max_compressed_bytes = 100;
+  receiver.SetIngestLimits(limits);
+  EXPECT_EQ(IngestResult::CompressedTooLarge, process(Gzip(ManyEventsBody(100))));
+
+  limits = IngestLimits();
+  limits.max_inflated_bytes = 10000;
+  receiver.SetIngestLimits(limits);
+  EXPECT_EQ(IngestResult::InflatedTooLarge, process(Gzip(ManyEventsBody(1000))));
+  EXPECT_EQ(IngestResult::Ok, process(Gzip(ManyEventsBody(10))));
+
+  limits = IngestLimits();
+  limits.max_inflate_ratio = 10;
+  receiver.SetIngestLimits(limits);
+  EXPECT_EQ(IngestResult::RatioTooHigh, process(gzipped_identical_events));
+  limits.max_inflate_ratio = 2000;
+  receiver.SetIngestLimits(limits);
+  EXPECT_EQ(IngestResult::Ok, process(gzipped_identical_events));
+
+  // Junk is detected in the first inflated chunk.
+  EXPECT_EQ(IngestResult::CorruptedEvents, process(junk));
+  EXPECT_EQ(IngestResult::GunzipError, process("not a gzip"));
+  const string gzipped = Gzip(ManyEventsBody(100));
+  EXPECT_EQ(IngestResult::GunzipError, process(gzipped.substr(0, gzipped.size() / 2)));
+  // Truncated event at the end.
+  const string body = ManyEventsBody(100);
+  EXPECT_EQ(IngestResult::CorruptedEvents, process(Gzip(body.substr(0, body.size() - 1))));
+  // Stream has less data than it should.
+  const string half = gzipped.substr(0, gzipped.size() / 2);
+  EXPECT_EQ(IngestResult::ReadError,
+            receiver.ProcessReceivedHTTPStream(ChunkedReader(half, 4096), gzipped.size(), 1, "", "", ""));
+
+  EXPECT_EQ(2u, receiver.IngestCounter(IngestResult::Ok));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::CompressedTooLarge));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::InflatedTooLarge));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::RatioTooHigh));
+  EXPECT_EQ(2u, receiver.IngestCounter(IngestResult::CorruptedEvents));
+  EXPECT_EQ(2u, receiver.IngestCounter(IngestResult::GunzipError));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::ReadError));
+}
+
+TEST(StatisticsReceiver, DurableWrites) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  const string body = ManyEventsBody(10);
+  string expected, client_id;
+  EventsScanner scanner(body.data(), body.size());
+  ASSERT_TRUE(StatisticsReceiver::RewriteEvents(scanner, 1, kFirstIP, kFirstUA, kFirstURI, expected, client_id));
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableDurableWrites();
+  const string gzipped = Gzip(body);
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  // Data is already in the file when the call returns.
+  EXPECT_EQ(expected, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+  receiver.ProcessReceivedHTTPBody(gzipped, 1, kFirstIP, kFirstUA, kFirstURI);
+  EXPECT_EQ(expected + expected, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+  EXPECT_EQ(2u, receiver.Metrics().sync_requests);
+  EXPECT_EQ(2u, receiver.Metrics().syncs);
+}
+
+TEST(StatisticsReceiver, SyncStoredData) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableStoredDataSync();
+  const string gzipped = Gzip(ManyEventsBody(10));
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                   kFirstIP, kFirstUA, kFirstURI));
+  }
+  // Stores do not wait for flushes, one sync covers all of them.
+  EXPECT_EQ(0u, receiver.Metrics().sync_requests);
+  EXPECT_TRUE(receiver.SyncStoredData());
+  EXPECT_EQ(1u, receiver.Metrics().sync_requests);
+  EXPECT_EQ(1u, receiver.Metrics().syncs);
+  const string stored = FileManager::ReadFileAsString(kQueueFileToCleanUp);
+  EXPECT_FALSE(stored.empty());
+  EXPECT_TRUE(receiver.SyncStoredData());
+  EXPECT_EQ(stored, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+}
+
+TEST(StatisticsReceiver, Backpressure) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableDurableWrites();
+  alohalytics::UploadHint hint;
+  hint.retry_after_seconds = 1;
+  // Disabled by default.
+  EXPECT_FALSE(receiver.CheckBackpressure(hint));
+  EXPECT_TRUE(hint.Empty());
+
+  alohalytics::BackpressureLimits limits;
+  // Any flush takes more time.
+  limits.soft_store_latency_us = 1;
+  limits.min_retry_after_seconds = 10;
+  limits.max_retry_after_seconds = 1000;
+  limits.min_sampling_percent = 5;
+  limits.update_interval = std::chrono::milliseconds(0);
+  receiver.SetBackpressureLimits(limits);
+  const string gzipped = Gzip(ManyEventsBody(10));
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  EXPECT_FALSE(receiver.CheckBackpressure(hint));
+  EXPECT_GE(hint.retry_after_seconds, 10u);
+  EXPECT_LE(hint.retry_after_seconds, 1000u);
+  EXPECT_GE(hint.sampling_percent, 5u);
+  EXPECT_LT(hint.sampling_percent, 100u);
+  // Nothing was stored since the last update.
+  EXPECT_FALSE(receiver.CheckBackpressure(hint));
+  EXPECT_TRUE(hint.Empty());
+
+  limits.hard_store_latency_us = 1;
+  receiver.SetBackpressureLimits(limits);
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  EXPECT_TRUE(receiver.CheckBackpressure(hint));
+  EXPECT_GE(hint.retry_after_seconds, 10u);
+}
+
+TEST(StatisticsReceiver, AdmissionControl) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  // Disabled by default.
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_TRUE(receiver.AdmitRequest(kFirstIP));
+  }
+  alohalytics::AdmissionConfig config;
+  config.ip_rate = 0.001;
+  config.ip_burst = 1.;
+  config.client_rate = 0.001;
+  config.client_burst = 1.;
+  receiver.SetAdmissionConfig(config);
+  // Stored data is in the file when processing returns.
+  receiver.EnableDurableWrites();
+  EXPECT_TRUE(receiver.AdmitRequest(kFirstIP));
+  EXPECT_FALSE(receiver.AdmitRequest(kFirstIP));
+  EXPECT_TRUE(receiver.AdmitRequest(kSecondIP));
+  EXPECT_EQ(1000u, receiver.RateLimitRetryAfterSeconds());
+
+  const string gzipped = Gzip(ManyEventsBody(10000));
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  const string stored = FileManager::ReadFileAsString(kQueueFileToCleanUp);
+  // The same client ID from another IP is limited too, and nothing is stored.
+  size_t read_bytes = 0;
+  ChunkedReader reader(gzipped, 1000);
+  const auto counting_reader = [&reader, &read_bytes](char * buffer, size_t size) {
+    const size_t read = reader(buffer, size);
+    read_bytes += read;
+    return read;
+  };
+  EXPECT_EQ(IngestResult::RateLimited, receiver.ProcessReceivedHTTPStream(counting_reader, gzipped.size(), 1,
+                                                                          kSecondIP, kFirstUA, kFirstURI));
+  // Body is rejected after the first inflated chunk.
+  EXPECT_LT(read_bytes, gzipped.size());
+  EXPECT_EQ(stored, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::RateLimited));
+  const alohalytics::AdmissionCounters counters = receiver.GetAdmissionCounters();
+  EXPECT_EQ(2u, counters.ip_admitted);
+  EXPECT_EQ(1u, counters.ip_rejected);
+  EXPECT_EQ(1u, counters.client_admitted);
+  EXPECT_EQ(1u, counters.client_rejected);
+}
+
+TEST(StatisticsReceiver, DuplicateDetection) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableDurableWrites();
+  receiver.EnableDuplicateDetection(1024, std::chrono::seconds(60));
+  const string gzipped = Gzip(ManyEventsBody(100));
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  const string stored = FileManager::ReadFileAsString(kQueueFileToCleanUp);
+  // Resent body is acknowledged, but not stored, regardless of the IP and other request fields.
+  EXPECT_EQ(IngestResult::Duplicate, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 100), gzipped.size(),
+                                                                        2, kSecondIP, kSecondUA, kSecondURI));
+  EXPECT_FALSE(receiver.ProcessReceivedHTTPBody(gzipped, 3, kFirstIP, kFirstUA, kFirstURI));
+  EXPECT_EQ(stored, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+  // Another body is stored.
+  const string another = Gzip(ManyEventsBody(101));
+  EXPECT_TRUE(receiver.ProcessReceivedHTTPBody(another, 3, kFirstIP, kFirstUA, kFirstURI));
+  EXPECT_NE(stored, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::Duplicate));
+  const alohalytics::DuplicateCacheCounters counters = receiver.GetDuplicateCacheCounters();
+  EXPECT_EQ(4u, counters.lookups);
+  EXPECT_EQ(2u, counters.hits);
+}
+
+TEST(StatisticsReceiver, ConcurrentDuplicates) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  const string gzipped = Gzip(ManyEventsBody(100));
+  string expected;
+  {
+    StatisticsReceiver receiver(kTestDirectory);
+    receiver.EnableDurableWrites();
+    EXPECT_TRUE(receiver.ProcessReceivedHTTPBody(gzipped, 1, kFirstIP, kFirstUA, kFirstURI));
+    expected = FileManager::ReadFileAsString(kQueueFileToCleanUp);
+  }
+  std::remove(kQueueFileToCleanUp.c_str());
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableDurableWrites();
+  receiver.EnableDuplicateDetection(1024, std::chrono::seconds(60));
+  // Copies which arrive while the original is being stored wait for it, and are not stored again.
+  const size_t kThreads = 8;
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&receiver, &gzipped]() {
+      receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 1000), gzipped.size(), 1, kFirstIP, kFirstUA,
+                                         kFirstURI);
+    });
+  }
+  for (std::thread & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::Ok));
+  EXPECT_EQ(kThreads - 1, receiver.IngestCounter(IngestResult::Duplicate));
+  EXPECT_EQ(expected, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+}
+
+TEST(StatisticsReceiver, DecodeAndStoreSeparately) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  const string first = Gzip(ManyEventsBody(100));
+  const string second = Gzip(ManyEventsBody(101));
+  string expected;
+  {
+    StatisticsReceiver receiver(kTestDirectory);
+    receiver.EnableDurableWrites();
+    EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(first, 100), first.size(), 1,
+                                                                   kFirstIP, kFirstUA, kFirstURI));
+    EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(second, 100), second.size(), 2,
+                                                                   kSecondIP, kSecondUA, kSecondURI));
+    expected = FileManager::ReadFileAsString(kQueueFileToCleanUp);
+  }
+  std::remove(kQueueFileToCleanUp.c_str());
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableDurableWrites();
+  // Bodies can be decoded in any order, and nothing is stored or counted before StoreDecoded.
+  DecodedBody decoded_first, decoded_second;
+  EXPECT_EQ(IngestResult::Ok, receiver.DecodeReceivedHTTPStream(ChunkedReader(second, 100), second.size(), 2,
+                                                                kSecondIP, kSecondUA, kSecondURI, decoded_second));
+  EXPECT_EQ(IngestResult::Ok, receiver.DecodeReceivedHTTPStream(ChunkedReader(first, 100), first.size(), 1,
+                                                                kFirstIP, kFirstUA, kFirstURI, decoded_first));
+  EXPECT_EQ(0u, receiver.IngestCounter(IngestResult::Ok));
+  EXPECT_EQ(IngestResult::Ok, receiver.StoreDecoded(decoded_first));
+  EXPECT_EQ(IngestResult::Ok, receiver.StoreDecoded(decoded_second));
+  EXPECT_EQ(expected, FileManager::ReadFileAsString(kQueueFileToCleanUp));
+  EXPECT_EQ(2u, receiver.IngestCounter(IngestResult::Ok));
+  // Rejected bodies are counted when they are decoded.
+  DecodedBody junk;
+  EXPECT_EQ(IngestResult::GunzipError,
+            receiver.DecodeReceivedHTTPStream(ChunkedReader("junk", 100), 4, 1, kFirstIP, kFirstUA, kFirstURI, junk));
+  EXPECT_EQ(1u, receiver.IngestCounter(IngestResult::GunzipError));
+}
+
+TEST(StatisticsReceiver, Metrics) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  EXPECT_EQ(nullptr, receiver.GetIngestMetrics());
+  receiver.EnableMetrics();
+  ASSERT_NE(nullptr, receiver.GetIngestMetrics());
+  const string gzipped = Gzip(ManyEventsBody(100));
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 100), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  EXPECT_EQ(IngestResult::GunzipError, receiver.ProcessReceivedHTTPStream(ChunkedReader("junk", 100), 4, 1, kFirstIP,
+                                                                          kFirstUA, kFirstURI));
+  receiver.GetIngestMetrics()->RecordReply(200, 6);
+  const string text = receiver.MetricsText();
+  const auto contains = [&text](const string & line) { return text.find(line + '\n') != string::npos; };
+  EXPECT_TRUE(contains("alohalytics_requests_total{code=\"200\"} 1")) << text;
+  EXPECT_TRUE(contains("alohalytics_received_bytes_total " + to_string(gzipped.size() + 4))) << text;
+  EXPECT_TRUE(contains("alohalytics_events_total{type=\"i\"} 1")) << text;
+  EXPECT_TRUE(contains("alohalytics_events_total{type=\"v\"} 100")) << text;
+  EXPECT_TRUE(contains("alohalytics_ingest_bodies_total{result=\"Ok\"} 1")) << text;
+  EXPECT_TRUE(contains("alohalytics_ingest_bodies_total{result=\"GunzipError\"} 1")) << text;
+  // Timings are recorded for completely processed bodies only.
+  for (const char * stage : {"gunzip", "rewrite", "store"}) {
+    EXPECT_TRUE(contains(string("alohalytics_ingest_stage_seconds_count{stage=\"") + stage + "\"} 1")) << text;
+  }
+  // Depth depends on how fast the writer thread is.
+  EXPECT_NE(string::npos, text.find("\nalohalytics_queue_depth ")) << text;
+  EXPECT_TRUE(contains("alohalytics_admission_total{key=\"ip\",decision=\"rejected\"} 0")) << text;
+  EXPECT_TRUE(contains("alohalytics_duplicate_hits_total 0")) << text;
+}
+
+TEST(StatisticsReceiver, RejectedBodyFailure) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.EnableMetrics();
+  const string body = ManyEventsBody(3000);
+  IngestFailure failure;
+  // Invalid event is found at the same offset as in the whole inflated body, whatever the chunks are.
+  const string corrupted = body + string(16, '\xff') + body;
+  EventsScanner scanner(corrupted.data(), corrupted.size());
+  EventsScanner::Event event;
+  while (scanner.Next(event)) {
+  }
+  const uint64_t error_offset = scanner.ErrorOffset();
+  EXPECT_GE(error_offset, body.size());
+  for (const size_t chunk_size : {size_t(7), size_t(1000), size_t(100000)}) {
+    const string gzipped = Gzip(corrupted);
+    EXPECT_EQ(IngestResult::CorruptedEvents,
+              receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, chunk_size), gzipped.size(), 1, kFirstIP,
+                                                 kFirstUA, kFirstURI, &failure));
+    EXPECT_NE(EventsScanner::Error::None, failure.events_error);
+    EXPECT_NE(EventsScanner::Error::Truncated, failure.events_error);
+    EXPECT_EQ(scanner.GetError(), failure.events_error);
+    EXPECT_EQ(error_offset, failure.offset) << chunk_size;
+    EXPECT_GE(failure.inflated_bytes, body.size());
+    EXPECT_GT(failure.compressed_bytes, 0u);
+  }
+  const string truncated = Gzip(body.substr(0, body.size() - 1));
+  EXPECT_EQ(IngestResult::CorruptedEvents,
+            receiver.ProcessReceivedHTTPStream(ChunkedReader(truncated, 100), truncated.size(), 1, kFirstIP, kFirstUA,
+                                               kFirstURI, &failure));
+  EXPECT_EQ(EventsScanner::Error::Truncated, failure.events_error);
+  EXPECT_LT(failure.offset, body.size());
+  EXPECT_EQ(body.size() - 1, failure.inflated_bytes);
+  EXPECT_EQ(IngestResult::GunzipError,
+            receiver.ProcessReceivedHTTPStream(ChunkedReader("junk", 100), 4, 1, kFirstIP, kFirstUA, kFirstURI,
+                                               &failure));
+  EXPECT_EQ(EventsScanner::Error::None, failure.events_error);
+  EXPECT_EQ(4u, failure.offset);
+  EXPECT_EQ("at offset 4, read 4 gzipped and 0 inflated bytes", failure.ToString());
+  // Rejected bodies cost is measured.
+  const string text = receiver.MetricsText();
+  EXPECT_NE(string::npos, text.find("alohalytics_rejected_body_seconds_count 5\n")) << text;
+  EXPECT_NE(string::npos, text.find("alohalytics_quarantined_bodies_total 0\n")) << text;
+}
+
+TEST(StatisticsReceiver, Quarantine) {
+  ScopedRemoveFile remover(kQueueFileToCleanUp), manifest_remover(kManifestFileToCleanUp);
+  QuarantineConfig config;
+  config.directory = GenerateTemporaryFileName();
+  ASSERT_TRUE(FileManager::MakeDirectory(config.directory));
+  // Files are removed before their directory.
+  vector<unique_ptr<ScopedRemoveFile>> removers;
+  removers.emplace_back(new ScopedRemoveFile(config.directory));
+  config.sample_one_of = 2;
+  StatisticsReceiver receiver(kTestDirectory);
+  receiver.SetQuarantineConfig(config);
+  const string gzipped = Gzip(ManyEventsBody(10));
+  // Sampled, but valid.
+  EXPECT_EQ(IngestResult::Ok, receiver.ProcessReceivedHTTPStream(ChunkedReader(gzipped, 100), gzipped.size(), 1,
+                                                                 kFirstIP, kFirstUA, kFirstURI));
+  // Not sampled.
+  EXPECT_EQ(IngestResult::GunzipError, receiver.ProcessReceivedHTTPStream(ChunkedReader("junk 1", 100), 6, 1, kFirstIP,
+                                                                          kFirstUA, kFirstURI));
+  EXPECT_EQ(IngestResult::GunzipError, receiver.ProcessReceivedHTTPStream(ChunkedReader("junk 2", 100), 6, 1, kFirstIP,
+                                                                          kFirstUA, kFirstURI));
+  EXPECT_EQ(1u, receiver.QuarantinedBodiesCount());
+  vector<string> files;
+  FileManager::ForEachFileInDir(config.directory, [&](const string & full_path) {
+    removers.emplace(removers.begin(), new ScopedRemoveFile(full_path));
+    files.push_back(full_path);
+    return true;
+  });
+  ASSERT_EQ(2u, files.size());
+  sort(files.begin(), files.end());
+  EXPECT_EQ("junk 2", FileManager::ReadFileAsString(files[0]));
+  const string description = FileManager::ReadFileAsString(files[1]);
+  EXPECT_EQ(0u, description.find("GunzipError at offset 6")) << description;
+  EXPECT_NE(string::npos, description.find(kFirstUA)) << description;
+  config.directory += "/missing";
+  EXPECT_THROW(receiver.SetQuarantineConfig(config), std::runtime_error);
+}
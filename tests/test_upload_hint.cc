@@ -0,0 +1,66 @@
+/*******************************************************************************
+ The MIT License (MIT)
+
+ Copyright (c) 2015 Alexander Borsuk <me@alex.bio> from Minsk, Belarus
+
+ Permission is hereby granted, free of charge, to any person obtaining a copy
+ of this software and associated documentation files (the "Software"), to deal
+ in the Software without restriction, including without limitation the rights
+ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ copies of the Software, and to permit persons to whom the Software is
+ furnished to do so, subject to the following conditions:
+
+ The above copyright notice and this permission notice shall be included in all
+ copies or substantial portions of the Software.
+
+ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ SOFTWARE.
+ *******************************************************************************/
+
+#include "gtest/gtest.h"
+
+#include "../src/upload_hint.h"
+
+#include <string>
+
+using alohalytics::UploadHint;
+
+TEST(UploadHint, OldRepliesHaveNoHint) {
+  EXPECT_TRUE(UploadHint::Parse("").Empty());
+  EXPECT_TRUE(UploadHint::Parse("Mahalo").Empty());
+  EXPECT_TRUE(UploadHint::Parse("Mahalo\n").Empty());
+  EXPECT_TRUE(UploadHint::Parse("Hohono").Empty());
+  EXPECT_EQ("", UploadHint().ToString());
+}
+
+TEST(UploadHint, RoundTrip) {
+  UploadHint hint;
+  hint.retry_after_seconds = 120;
+  EXPECT_EQ("retry_after=120", hint.ToString());
+  hint.sampling_percent = 50;
+  EXPECT_EQ("retry_after=120&sampling_percent=50", hint.ToString());
+  const UploadHint parsed = UploadHint::Parse("Mahalo\n" + hint.ToString() + "\n");
+  EXPECT_EQ(120u, parsed.retry_after_seconds);
+  EXPECT_EQ(50u, parsed.sampling_percent);
+  hint.retry_after_seconds = 0;
+  EXPECT_EQ("sampling_percent=50", hint.ToString());
+  EXPECT_EQ(50u, UploadHint::Parse("Hohono\n" + hint.ToString()).sampling_percent);
+}
+
+TEST(UploadHint, InvalidValuesAreIgnored) {
+  UploadHint hint = UploadHint::Parse("Mahalo\nfuture_key=abc&retry_after=-1&sampling_percent=0\nretry_after=5");
+  EXPECT_TRUE(hint.Empty());
+  hint = UploadHint::Parse("Mahalo\nsampling_percent=101&retry_after=&=7&retry_after");
+  EXPECT_TRUE(hint.Empty());
+  hint = UploadHint::Parse("Mahalo\nfuture_key=1&sampling_percent=1.5&retry_after=30");
+  EXPECT_EQ(30u, hint.retry_after_seconds);
+  EXPECT_EQ(100u, hint.sampling_percent);
+  // Server can't stop uploads forever.
+  hint = UploadHint::Parse("Mahalo\nretry_after=99999999999999999999999");
+  EXPECT_EQ(alohalytics::kMaxUploadRetryAfterSeconds, hint.retry_after_seconds);
+}